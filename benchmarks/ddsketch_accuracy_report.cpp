@@ -0,0 +1,294 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+/*
+ * Report, for every dataset and mapping, the ingest and query times, the
+ * number of bins, the memory footprint and the maximum relative error of the
+ * quantiles against the exact ones, as CSV or JSON.
+ *
+ * Usage:
+ *   DDSketch_Accuracy_Report [--sizes=1000000,10000000] [--format=csv|json]
+ *                            [--relative-accuracy=0.01]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../include/ddsketch/ddsketch.h"
+#include "../include/test/datasets.h"
+
+namespace ddsketch { namespace benchmarks {
+
+using test::GenericDataSet;
+
+static constexpr RealValue kDefaultRelativeAccuracy = 0.01;
+static constexpr int kNumQueryRepetitions = 100;
+
+using Clock = std::chrono::steady_clock;
+
+struct ReportOptions {
+    std::vector<int> sizes {1000000, 10000000};
+    std::string format = "csv";
+    RealValue relative_accuracy = kDefaultRelativeAccuracy;
+};
+
+struct ReportRow {
+    std::string dataset;
+    int size;
+    std::string mapping;
+    RealValue relative_accuracy;
+    RealValue ingest_ns_per_value;
+    RealValue query_ns;
+    size_t bins;
+    size_t bytes;
+    RealValue max_relative_error;
+};
+
+/* The quantiles the error is measured at: every percentile, and the tails */
+std::vector<RealValue> report_quantiles() {
+    std::vector<RealValue> quantiles {0.001, 0.999};
+
+    for (int percentile = 0; percentile <= 100; ++percentile) {
+        quantiles.push_back(percentile / 100.0);
+    }
+
+    return quantiles;
+}
+
+RealValue elapsed_ns(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<RealValue, std::nano>(end - start).count();
+}
+
+template <class Mapping>
+ReportRow measure(const std::string& mapping_name,
+                  const GenericDataSet& dataset,
+                  RealValue relative_accuracy) {
+    using Sketch = BaseDDSketch<DenseStore, Mapping>;
+
+    const auto quantiles = report_quantiles();
+    Sketch sketch {Mapping(relative_accuracy), DenseStore(), DenseStore()};
+
+    auto ingest_start = Clock::now();
+
+    for (const auto value : dataset) {
+        sketch.add(value);
+    }
+
+    auto ingest_end = Clock::now();
+
+    /* Keeps the queries from being optimized away */
+    volatile RealValue sink = 0;
+    auto query_start = Clock::now();
+
+    for (int repetition = 0; repetition < kNumQueryRepetitions; ++repetition) {
+        for (const auto quantile : quantiles) {
+            sink = sink + sketch.get_quantile_value(quantile);
+        }
+    }
+
+    auto query_end = Clock::now();
+
+    RealValue max_relative_error = 0;
+
+    for (const auto quantile : quantiles) {
+        auto expected = dataset.quantile(quantile);
+        auto actual = sketch.get_quantile_value(quantile);
+        auto error = expected == 0 ?
+                     std::abs(actual) :
+                     std::abs(actual - expected) / std::abs(expected);
+
+        max_relative_error = std::max(max_relative_error, error);
+    }
+
+    const auto& store = sketch.store();
+    const auto& negative_store = sketch.negative_store();
+    const auto bins = store.length() + negative_store.length();
+
+    ReportRow row;
+
+    row.dataset = dataset.name();
+    row.size = dataset.len();
+    row.mapping = mapping_name;
+    row.relative_accuracy = relative_accuracy;
+    row.ingest_ns_per_value =
+        elapsed_ns(ingest_start, ingest_end) / dataset.len();
+    row.query_ns = elapsed_ns(query_start, query_end) /
+                   (kNumQueryRepetitions * quantiles.size());
+    row.bins = bins;
+    /* The bins of a DenseStore are plain counters */
+    row.bytes = sizeof(Sketch) + bins * sizeof(RealValue);
+    row.max_relative_error = max_relative_error;
+
+    return row;
+}
+
+void measure_all(const GenericDataSet& dataset,
+                 RealValue relative_accuracy,
+                 std::vector<ReportRow>& rows) {
+    rows.push_back(measure<LogarithmicMapping>(
+        "Logarithmic", dataset, relative_accuracy));
+    rows.push_back(measure<TableLogarithmicMapping>(
+        "TableLogarithmic", dataset, relative_accuracy));
+    rows.push_back(measure<LinearlyInterpolatedMapping>(
+        "LinearlyInterpolated", dataset, relative_accuracy));
+    rows.push_back(measure<CubicallyInterpolatedMapping>(
+        "CubicallyInterpolated", dataset, relative_accuracy));
+}
+
+void write_csv(const std::vector<ReportRow>& rows, std::ostream& os) {
+    os << "dataset,size,mapping,relative_accuracy,ingest_ns_per_value,"
+          "query_ns,bins,bytes,max_relative_error\n";
+
+    for (const auto& row : rows) {
+        os << row.dataset << "," << row.size << "," << row.mapping << ","
+           << row.relative_accuracy << "," << row.ingest_ns_per_value << ","
+           << row.query_ns << "," << row.bins << "," << row.bytes << ","
+           << row.max_relative_error << "\n";
+    }
+}
+
+void write_json(const std::vector<ReportRow>& rows, std::ostream& os) {
+    os << "[\n";
+
+    for (size_t idx = 0; idx < rows.size(); ++idx) {
+        const auto& row = rows[idx];
+
+        os << "  {\"dataset\": \"" << row.dataset << "\", "
+           << "\"size\": " << row.size << ", "
+           << "\"mapping\": \"" << row.mapping << "\", "
+           << "\"relative_accuracy\": " << row.relative_accuracy << ", "
+           << "\"ingest_ns_per_value\": " << row.ingest_ns_per_value << ", "
+           << "\"query_ns\": " << row.query_ns << ", "
+           << "\"bins\": " << row.bins << ", "
+           << "\"bytes\": " << row.bytes << ", "
+           << "\"max_relative_error\": " << row.max_relative_error << "}"
+           << (idx + 1 < rows.size() ? ",\n" : "\n");
+    }
+
+    os << "]\n";
+}
+
+std::vector<std::unique_ptr<GenericDataSet>> create_datasets() {
+    std::vector<std::unique_ptr<GenericDataSet>> datasets;
+
+    datasets.emplace_back(std::make_unique<test::UniformForward>());
+    datasets.emplace_back(std::make_unique<test::UniformBackward>());
+    datasets.emplace_back(std::make_unique<test::NegativeUniformForward>());
+    datasets.emplace_back(std::make_unique<test::NegativeUniformBackward>());
+    datasets.emplace_back(std::make_unique<test::NumberLineForward>());
+    datasets.emplace_back(std::make_unique<test::NumberLineBackward>());
+    datasets.emplace_back(std::make_unique<test::UniformZoomIn>());
+    datasets.emplace_back(std::make_unique<test::UniformZoomOut>());
+    datasets.emplace_back(std::make_unique<test::UniformSqrt>());
+    datasets.emplace_back(std::make_unique<test::Constant>());
+    datasets.emplace_back(std::make_unique<test::Exponential>());
+    datasets.emplace_back(std::make_unique<test::Lognormal>());
+    datasets.emplace_back(std::make_unique<test::Normal>());
+    datasets.emplace_back(std::make_unique<test::Laplace>());
+    datasets.emplace_back(std::make_unique<test::Bimodal>());
+    datasets.emplace_back(std::make_unique<test::Mixed>());
+    datasets.emplace_back(std::make_unique<test::Trimodal>());
+    datasets.emplace_back(std::make_unique<test::Integers>());
+
+    return datasets;
+}
+
+bool starts_with(const std::string& str, const std::string& prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool parse_options(int argc, char **argv, ReportOptions& options) {
+    const std::string sizes_flag = "--sizes=";
+    const std::string format_flag = "--format=";
+    const std::string accuracy_flag = "--relative-accuracy=";
+
+    for (int idx = 1; idx < argc; ++idx) {
+        const std::string arg = argv[idx];
+
+        if (starts_with(arg, sizes_flag)) {
+            std::stringstream sizes(arg.substr(sizes_flag.size()));
+            std::string size;
+
+            options.sizes.clear();
+
+            while (std::getline(sizes, size, ',')) {
+                auto parsed_size = std::atoi(size.c_str());
+
+                if (parsed_size <= 0) {
+                    return false;
+                }
+
+                options.sizes.push_back(parsed_size);
+            }
+
+            if (options.sizes.empty()) {
+                return false;
+            }
+        } else if (starts_with(arg, format_flag)) {
+            options.format = arg.substr(format_flag.size());
+
+            if (options.format != "csv" && options.format != "json") {
+                return false;
+            }
+        } else if (starts_with(arg, accuracy_flag)) {
+            options.relative_accuracy =
+                std::atof(arg.substr(accuracy_flag.size()).c_str());
+
+            if (options.relative_accuracy <= 0 ||
+                options.relative_accuracy >= 1) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}  // namespace benchmarks
+}  // namespace ddsketch
+
+int main(int argc, char **argv) {
+    namespace benchmarks = ddsketch::benchmarks;
+
+    benchmarks::ReportOptions options;
+
+    if (!benchmarks::parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--sizes=1000000,10000000] [--format=csv|json]"
+                  << " [--relative-accuracy=0.01]\n";
+        return 1;
+    }
+
+    std::vector<benchmarks::ReportRow> rows;
+
+    /* One dataset at a time, so that only one is held in memory */
+    for (const auto size : options.sizes) {
+        for (auto& dataset : benchmarks::create_datasets()) {
+            dataset->populate(size);
+
+            benchmarks::measure_all(
+                *dataset, options.relative_accuracy, rows);
+
+            dataset.reset();
+        }
+    }
+
+    if (options.format == "json") {
+        benchmarks::write_json(rows, std::cout);
+    } else {
+        benchmarks::write_csv(rows, std::cout);
+    }
+
+    return 0;
+}
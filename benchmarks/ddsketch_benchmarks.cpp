@@ -0,0 +1,565 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../include/ddsketch/ddsketch.h"
+#include "../include/ddsketch/parallel_merge.h"
+#include "../include/ddsketch/windowed_ddsketch.h"
+#include "../include/test/datasets.h"
+
+#include "benchmark/benchmark.h"
+
+namespace ddsketch { namespace benchmarks {
+
+using test::GenericDataSet;
+
+static constexpr RealValue kRelativeAccuracy = 0.01;
+static constexpr Index kBinLimit = 2048;
+static constexpr int kDataSetSize = 100000;
+static constexpr size_t kNumMergedSketches = 64;
+static constexpr size_t kNumWindowSlots = 30;
+
+template <class Store>
+Store create_store();
+
+template <>
+DenseStore create_store<DenseStore>() {
+    return DenseStore();
+}
+
+template <>
+CollapsingLowestDenseStore create_store<CollapsingLowestDenseStore>() {
+    return CollapsingLowestDenseStore(kBinLimit);
+}
+
+template <>
+CollapsingHighestDenseStore create_store<CollapsingHighestDenseStore>() {
+    return CollapsingHighestDenseStore(kBinLimit);
+}
+
+template <>
+PagedDenseStore create_store<PagedDenseStore>() {
+    return PagedDenseStore();
+}
+
+template <>
+PagedCollapsingLowestDenseStore
+create_store<PagedCollapsingLowestDenseStore>() {
+    return PagedCollapsingLowestDenseStore(kBinLimit);
+}
+
+template <>
+CompactDenseStore create_store<CompactDenseStore>() {
+    return CompactDenseStore();
+}
+
+template <>
+CompactCollapsingLowestDenseStore
+create_store<CompactCollapsingLowestDenseStore>() {
+    return CompactCollapsingLowestDenseStore(kBinLimit);
+}
+
+template <>
+SparseStore create_store<SparseStore>() {
+    return SparseStore();
+}
+
+template <class Store>
+Store create_store(bool rank_index) {
+    auto store = create_store<Store>();
+    store.enable_rank_index(rank_index);
+
+    return store;
+}
+
+template <>
+SparseStore create_store<SparseStore>(bool) {
+    return SparseStore();
+}
+
+template <class Store, class Mapping>
+BaseDDSketch<Store, Mapping> create_sketch(bool rank_index = false) {
+    return BaseDDSketch<Store, Mapping>(
+        Mapping(kRelativeAccuracy),
+        create_store<Store>(rank_index),
+        create_store<Store>(rank_index));
+}
+
+template <class Store, class Mapping>
+BaseDDSketch<Store, Mapping> create_sketch(const GenericDataSet& dataset,
+                                           bool rank_index = false) {
+    auto sketch = create_sketch<Store, Mapping>(rank_index);
+
+    for (const auto value : dataset) {
+        sketch.add(value);
+    }
+
+    return sketch;
+}
+
+/* The number of bytes taken by each bin */
+template <class Bins>
+size_t bin_size(const Bins&) {
+    return sizeof(typename Bins::value_type);
+}
+
+size_t bin_size(const CompactBinList& bins) {
+    return bins.counter_size();
+}
+
+/* Report the memory footprint of the sketch: bins plus the object itself */
+template <class Sketch>
+void report_memory(benchmark::State& state, const Sketch& sketch) {
+    const auto& store = sketch.store();
+    const auto& negative_store = sketch.negative_store();
+
+    state.counters["bins"] = store.length() + negative_store.length();
+    state.counters["bytes"] =
+        sizeof(Sketch) +
+        store.length() * bin_size(store.bins()) +
+        negative_store.length() * bin_size(negative_store.bins());
+}
+
+template <class Store, class Mapping>
+void benchmark_add(benchmark::State& state, const GenericDataSet* dataset) {
+    for (auto _ : state) {
+        auto sketch = create_sketch<Store, Mapping>();
+
+        for (const auto value : *dataset) {
+            sketch.add(value);
+        }
+
+        benchmark::DoNotOptimize(sketch);
+    }
+
+    state.SetItemsProcessed(state.iterations() * dataset->len());
+    report_memory(state, create_sketch<Store, Mapping>(*dataset));
+}
+
+/* Same as above, reserving the bins for the range of the dataset first */
+template <class Store, class Mapping>
+void benchmark_add_reserved(benchmark::State& state,
+                            const GenericDataSet* dataset) {
+    const auto range = std::minmax_element(dataset->begin(), dataset->end());
+
+    for (auto _ : state) {
+        auto sketch = create_sketch<Store, Mapping>();
+        sketch.reserve(*range.first, *range.second);
+
+        for (const auto value : *dataset) {
+            sketch.add(value);
+        }
+
+        benchmark::DoNotOptimize(sketch);
+    }
+
+    state.SetItemsProcessed(state.iterations() * dataset->len());
+    report_memory(state, create_sketch<Store, Mapping>(*dataset));
+}
+
+/* Same as benchmark_add, for a dataset of positive values only */
+template <class Store, class Mapping>
+void benchmark_add_positive(benchmark::State& state,
+                            const GenericDataSet* dataset) {
+    for (auto _ : state) {
+        auto sketch = create_sketch<Store, Mapping>();
+
+        for (const auto value : *dataset) {
+            sketch.add_positive(value);
+        }
+
+        benchmark::DoNotOptimize(sketch);
+    }
+
+    state.SetItemsProcessed(state.iterations() * dataset->len());
+    report_memory(state, create_sketch<Store, Mapping>(*dataset));
+}
+
+template <class Store, class Mapping, bool RankIndex = false>
+void benchmark_get_quantile_value(benchmark::State& state,
+                                  const GenericDataSet* dataset) {
+    const auto quantiles = {0.5, 0.75, 0.9, 0.95, 0.99, 0.999};
+
+    auto sketch = create_sketch<Store, Mapping>(*dataset, RankIndex);
+
+    for (auto _ : state) {
+        for (const auto quantile : quantiles) {
+            benchmark::DoNotOptimize(sketch.get_quantile_value(quantile));
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * quantiles.size());
+    report_memory(state, sketch);
+}
+
+template <class Store, class Mapping>
+void benchmark_get_quantile_values(benchmark::State& state,
+                                   const GenericDataSet* dataset) {
+    const std::vector<RealValue> quantiles =
+        {0.5, 0.75, 0.9, 0.95, 0.99, 0.999};
+    std::vector<RealValue> values(quantiles.size());
+
+    auto sketch = create_sketch<Store, Mapping>(*dataset);
+
+    for (auto _ : state) {
+        sketch.get_quantile_values(
+            quantiles.data(), quantiles.size(), values.data());
+        benchmark::DoNotOptimize(values.data());
+    }
+
+    state.SetItemsProcessed(state.iterations() * quantiles.size());
+    report_memory(state, sketch);
+}
+
+/* The values at the quantiles of the dataset, as thresholds for get_rank */
+std::vector<RealValue> rank_thresholds(const GenericDataSet& dataset) {
+    std::vector<RealValue> thresholds;
+
+    for (const auto quantile : {0.5, 0.75, 0.9, 0.95, 0.99, 0.999}) {
+        thresholds.push_back(dataset.quantile(quantile));
+    }
+
+    return thresholds;
+}
+
+template <class Store, class Mapping, bool RankIndex = false>
+void benchmark_get_rank(benchmark::State& state,
+                        const GenericDataSet* dataset) {
+    const auto thresholds = rank_thresholds(*dataset);
+
+    auto sketch = create_sketch<Store, Mapping>(*dataset, RankIndex);
+
+    for (auto _ : state) {
+        for (const auto threshold : thresholds) {
+            benchmark::DoNotOptimize(sketch.get_rank(threshold));
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * thresholds.size());
+    report_memory(state, sketch);
+}
+
+template <class Store, class Mapping>
+void benchmark_get_ranks(benchmark::State& state,
+                         const GenericDataSet* dataset) {
+    const auto thresholds = rank_thresholds(*dataset);
+    std::vector<RealValue> ranks(thresholds.size());
+
+    auto sketch = create_sketch<Store, Mapping>(*dataset);
+
+    for (auto _ : state) {
+        sketch.get_ranks(thresholds.data(), thresholds.size(), ranks.data());
+        benchmark::DoNotOptimize(ranks.data());
+    }
+
+    state.SetItemsProcessed(state.iterations() * thresholds.size());
+    report_memory(state, sketch);
+}
+
+template <class Store, class Mapping>
+void benchmark_merge(benchmark::State& state, const GenericDataSet* dataset) {
+    auto sketch = create_sketch<Store, Mapping>(*dataset);
+    auto target = create_sketch<Store, Mapping>(*dataset);
+
+    for (auto _ : state) {
+        target.merge(sketch);
+        benchmark::DoNotOptimize(target);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    report_memory(state, sketch);
+}
+
+/* Sketches of consecutive slices of the dataset, as merged by a rollup */
+template <class Store, class Mapping>
+std::vector<BaseDDSketch<Store, Mapping>> create_sketches(
+        const GenericDataSet& dataset) {
+    std::vector<BaseDDSketch<Store, Mapping>> sketches(
+        kNumMergedSketches, create_sketch<Store, Mapping>());
+
+    size_t idx = 0;
+
+    for (const auto value : dataset) {
+        sketches[idx++ % kNumMergedSketches].add(value);
+    }
+
+    return sketches;
+}
+
+template <class Store, class Mapping>
+void benchmark_merge_each(benchmark::State& state,
+                          const GenericDataSet* dataset) {
+    const auto sketches = create_sketches<Store, Mapping>(*dataset);
+
+    for (auto _ : state) {
+        auto target = create_sketch<Store, Mapping>();
+
+        for (const auto& sketch : sketches) {
+            target.merge(sketch);
+        }
+
+        benchmark::DoNotOptimize(target);
+    }
+
+    state.SetItemsProcessed(state.iterations() * sketches.size());
+}
+
+template <class Store, class Mapping>
+void benchmark_merge_all(benchmark::State& state,
+                         const GenericDataSet* dataset) {
+    const auto sketches = create_sketches<Store, Mapping>(*dataset);
+
+    for (auto _ : state) {
+        auto target = create_sketch<Store, Mapping>();
+
+        target.merge_all(sketches.begin(), sketches.end());
+        benchmark::DoNotOptimize(target);
+    }
+
+    state.SetItemsProcessed(state.iterations() * sketches.size());
+}
+
+template <class Store, class Mapping>
+void benchmark_parallel_merge(benchmark::State& state,
+                              const GenericDataSet* dataset) {
+    const auto sketches = create_sketches<Store, Mapping>(*dataset);
+
+    for (auto _ : state) {
+        auto target = parallel_merge(sketches.begin(), sketches.end());
+        benchmark::DoNotOptimize(target);
+    }
+
+    state.SetItemsProcessed(state.iterations() * sketches.size());
+}
+
+/* Add the values of one slot, advance the window and query it */
+template <class Store, class Mapping>
+void benchmark_window(benchmark::State& state,
+                      const GenericDataSet* dataset) {
+    const auto values =
+        std::vector<RealValue>(dataset->begin(), dataset->end());
+    const auto slot_size = values.size() / kNumWindowSlots;
+
+    WindowedDDSketch<Store, Mapping> window(
+        create_sketch<Store, Mapping>(), kNumWindowSlots);
+    size_t slot = 0;
+
+    for (auto _ : state) {
+        window.add_batch(values.data() + slot * slot_size, slot_size);
+        benchmark::DoNotOptimize(window.get_quantile_value(0.99));
+
+        window.advance();
+        slot = (slot + 1) % kNumWindowSlots;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <class Store, class Mapping>
+void benchmark_copy(benchmark::State& state, const GenericDataSet* dataset) {
+    auto sketch = create_sketch<Store, Mapping>(*dataset);
+    auto target = create_sketch<Store, Mapping>();
+
+    for (auto _ : state) {
+        target.copy(sketch);
+        benchmark::DoNotOptimize(target);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    report_memory(state, sketch);
+}
+
+template <class Store, class Mapping>
+void benchmark_serialize(benchmark::State& state,
+                         const GenericDataSet* dataset) {
+    auto sketch = create_sketch<Store, Mapping>(*dataset);
+    std::vector<uint8_t> buffer(sketch.serialized_size());
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            sketch.serialize(buffer.data(), buffer.size()));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["serialized_bytes"] = buffer.size();
+}
+
+template <class Store, class Mapping>
+void benchmark_deserialize(benchmark::State& state,
+                           const GenericDataSet* dataset) {
+    const auto serialized = create_sketch<Store, Mapping>(*dataset).serialize();
+    auto target = create_sketch<Store, Mapping>();
+
+    for (auto _ : state) {
+        target.deserialize(serialized);
+        benchmark::DoNotOptimize(target);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["serialized_bytes"] = serialized.size();
+}
+
+template <class Store, class Mapping>
+void register_benchmarks(const std::string& sketch_name,
+                         const std::string& mapping_name,
+                         const GenericDataSet* dataset) {
+    auto suffix = "/" + sketch_name + "/" + mapping_name + "/" +
+                  dataset->name();
+
+    benchmark::RegisterBenchmark(
+        ("Add" + suffix).c_str(),
+        benchmark_add<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("AddReserved" + suffix).c_str(),
+        benchmark_add_reserved<Store, Mapping>,
+        dataset);
+
+    const auto min_value =
+        *std::min_element(dataset->begin(), dataset->end());
+
+    if (min_value > Mapping(kRelativeAccuracy).min_possible()) {
+        benchmark::RegisterBenchmark(
+            ("AddPositive" + suffix).c_str(),
+            benchmark_add_positive<Store, Mapping>,
+            dataset);
+    }
+
+    benchmark::RegisterBenchmark(
+        ("GetQuantileValue" + suffix).c_str(),
+        benchmark_get_quantile_value<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("GetQuantileValueRankIndex" + suffix).c_str(),
+        benchmark_get_quantile_value<Store, Mapping, true>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("GetQuantileValues" + suffix).c_str(),
+        benchmark_get_quantile_values<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("GetRank" + suffix).c_str(),
+        benchmark_get_rank<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("GetRankRankIndex" + suffix).c_str(),
+        benchmark_get_rank<Store, Mapping, true>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("GetRanks" + suffix).c_str(),
+        benchmark_get_ranks<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("Merge" + suffix).c_str(),
+        benchmark_merge<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("MergeEach" + suffix).c_str(),
+        benchmark_merge_each<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("MergeAll" + suffix).c_str(),
+        benchmark_merge_all<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("ParallelMerge" + suffix).c_str(),
+        benchmark_parallel_merge<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("Window" + suffix).c_str(),
+        benchmark_window<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("Copy" + suffix).c_str(),
+        benchmark_copy<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("Serialize" + suffix).c_str(),
+        benchmark_serialize<Store, Mapping>,
+        dataset);
+
+    benchmark::RegisterBenchmark(
+        ("Deserialize" + suffix).c_str(),
+        benchmark_deserialize<Store, Mapping>,
+        dataset);
+}
+
+template <class Mapping>
+void register_benchmarks(const std::string& mapping_name,
+                         const GenericDataSet* dataset) {
+    register_benchmarks<DenseStore, Mapping>(
+        "DDSketch", mapping_name, dataset);
+    register_benchmarks<CollapsingLowestDenseStore, Mapping>(
+        "LogCollapsingLowestDenseDDSketch", mapping_name, dataset);
+    register_benchmarks<CollapsingHighestDenseStore, Mapping>(
+        "LogCollapsingHighestDenseDDSketch", mapping_name, dataset);
+    register_benchmarks<PagedDenseStore, Mapping>(
+        "PagedDDSketch", mapping_name, dataset);
+    register_benchmarks<PagedCollapsingLowestDenseStore, Mapping>(
+        "PagedLogCollapsingLowestDenseDDSketch", mapping_name, dataset);
+    register_benchmarks<CompactDenseStore, Mapping>(
+        "CompactDDSketch", mapping_name, dataset);
+    register_benchmarks<CompactCollapsingLowestDenseStore, Mapping>(
+        "CompactLogCollapsingLowestDenseDDSketch", mapping_name, dataset);
+    register_benchmarks<SparseStore, Mapping>(
+        "SparseDDSketch", mapping_name, dataset);
+}
+
+}  // namespace benchmarks
+}  // namespace ddsketch
+
+int main(int argc, char **argv) {
+    namespace test = ddsketch::test;
+    namespace benchmarks = ddsketch::benchmarks;
+
+    std::vector<std::unique_ptr<test::GenericDataSet>> datasets;
+
+    datasets.emplace_back(std::make_unique<test::Lognormal>());
+    datasets.emplace_back(std::make_unique<test::Exponential>());
+    datasets.emplace_back(std::make_unique<test::Normal>());
+    datasets.emplace_back(std::make_unique<test::Mixed>());
+    datasets.emplace_back(std::make_unique<test::Integers>());
+
+    for (auto& dataset : datasets) {
+        dataset->populate(benchmarks::kDataSetSize);
+
+        benchmarks::register_benchmarks<ddsketch::LogarithmicMapping>(
+            "Logarithmic", dataset.get());
+        benchmarks::register_benchmarks<ddsketch::TableLogarithmicMapping>(
+            "TableLogarithmic", dataset.get());
+        benchmarks::register_benchmarks<ddsketch::LinearlyInterpolatedMapping>(
+            "LinearlyInterpolated", dataset.get());
+        benchmarks::register_benchmarks<
+            ddsketch::CubicallyInterpolatedMapping>(
+                "CubicallyInterpolated", dataset.get());
+        benchmarks::register_benchmarks<
+            ddsketch::CachedMapping<ddsketch::CubicallyInterpolatedMapping>>(
+                "CachedCubicallyInterpolated", dataset.get());
+    }
+
+    ::benchmark::Initialize(&argc, argv);
+    ::benchmark::RunSpecifiedBenchmarks();
+    ::benchmark::Shutdown();
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#ifndef INCLUDES_DDSKETCH_CONCURRENT_DDSKETCH_H_
+#define INCLUDES_DDSKETCH_CONCURRENT_DDSKETCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ddsketch.h"
+
+namespace ddsketch {
+
+/*
+ * A BaseDDSketch that can be updated and queried from several threads.
+ *
+ * The values are added to one of several shards, each one a BaseDDSketch
+ * built from the same prototype. Every thread is assigned a shard once, on
+ * its first update, so that threads do not contend with one another as long
+ * as there are at least as many shards as writing threads. Each shard keeps
+ * its own lock, which is only ever contended by readers taking a snapshot.
+ *
+ * Queries run on a snapshot, which merges all the shards. The snapshot is
+ * cached, and only rebuilt once a shard has been updated since it was taken.
+ * Merging is exact on the bins, so the snapshot keeps the relative accuracy
+ * guarantee of the prototype.
+ */
+template <typename Store, class Mapping>
+class ConcurrentDDSketch {
+ public:
+    using Sketch = BaseDDSketch<Store, Mapping>;
+
+    /* prototype is an empty sketch, which gives the parameters of the shards */
+    explicit ConcurrentDDSketch(const Sketch& prototype,
+                                size_t num_shards = default_num_shards())
+        : prototype_(prototype),
+          snapshot_(prototype),
+          snapshot_versions_(num_shards, 0) {
+        if (prototype.num_values() != 0) {
+            throw IllegalArgumentException("The prototype must be empty");
+        }
+
+        if (num_shards == 0) {
+            throw IllegalArgumentException(
+                "The number of shards must be positive");
+        }
+
+        shards_.reserve(num_shards);
+
+        for (size_t idx = 0; idx < num_shards; ++idx) {
+            shards_.emplace_back(std::make_unique<Shard>(prototype_));
+        }
+    }
+
+    ConcurrentDDSketch(const ConcurrentDDSketch& sketch) = delete;
+    ConcurrentDDSketch& operator=(const ConcurrentDDSketch& sketch) = delete;
+
+    /* One shard per hardware thread */
+    static size_t default_num_shards() {
+        auto num_threads = std::thread::hardware_concurrency();
+
+        return num_threads == 0 ? 1 : num_threads;
+    }
+
+    size_t num_shards() const {
+        return shards_.size();
+    }
+
+    /* Add a value to the shard of the calling thread */
+    void add(RealValue val, RealValue weight = 1.0) {
+        update_local_shard(
+            [val, weight](Sketch& sketch) {
+                sketch.add(val, weight);
+            });
+    }
+
+    /* Add a batch of values to the shard of the calling thread */
+    void add_batch(const RealValue* values, size_t count) {
+        update_local_shard(
+            [values, count](Sketch& sketch) {
+                sketch.add_batch(values, count);
+            });
+    }
+
+    /* Same as above, with a weight for each value */
+    void add_batch(const RealValue* values,
+                   const RealValue* weights,
+                   size_t count) {
+        update_local_shard(
+            [values, weights, count](Sketch& sketch) {
+                sketch.add_batch(values, weights, count);
+            });
+    }
+
+    /* Merge a sketch into the shard of the calling thread */
+    void merge(const Sketch& sketch) {
+        if (!mergeable(sketch)) {
+            throw UnequalSketchParametersException();
+        }
+
+        update_local_shard(
+            [&sketch](Sketch& shard_sketch) {
+                shard_sketch.merge(sketch);
+            });
+    }
+
+    /* A sketch can be merged only if its gamma is equal to the shards' one */
+    bool mergeable(const Sketch& other) const {
+        return prototype_.mergeable(other);
+    }
+
+    /* A sketch holding all the values added so far, to all the shards */
+    Sketch snapshot() const {
+        std::lock_guard<std::mutex> lock(snapshot_mutex_);
+
+        return refresh_snapshot();
+    }
+
+    RealValue num_values() const {
+        std::lock_guard<std::mutex> lock(snapshot_mutex_);
+
+        return refresh_snapshot().num_values();
+    }
+
+    /* The approximate value at the specified quantile, cf. BaseDDSketch */
+    RealValue get_quantile_value(RealValue quantile) const {
+        std::lock_guard<std::mutex> lock(snapshot_mutex_);
+
+        return refresh_snapshot().get_quantile_value(quantile);
+    }
+
+    /* The approximate values at several quantiles, cf. BaseDDSketch */
+    void get_quantile_values(const RealValue* quantiles,
+                             size_t count,
+                             RealValue* values) const {
+        std::lock_guard<std::mutex> lock(snapshot_mutex_);
+
+        refresh_snapshot().get_quantile_values(quantiles, count, values);
+    }
+
+ private:
+    static constexpr size_t kCacheLineSize = 64;
+
+    /*
+     * The shards are allocated one by one, and over-aligned allocations are
+     * only guaranteed from C++17 on. The trailing padding keeps two shards
+     * from sharing a cache line regardless of their alignment
+     */
+    struct Shard {
+        explicit Shard(const Sketch& prototype)
+            : sketch(prototype),
+              version(0) {
+        }
+
+        std::mutex mutex;
+        Sketch sketch;
+
+        /* Incremented after every update, to invalidate the snapshot */
+        std::atomic<uint64_t> version;
+
+        char padding[kCacheLineSize];
+    };
+
+    /* The slot of the calling thread, assigned on its first call */
+    static size_t thread_slot() {
+        static std::atomic<size_t> next_slot(0);
+        thread_local size_t slot = next_slot.fetch_add(1);
+
+        return slot;
+    }
+
+    template <class Update>
+    void update_local_shard(Update update) {
+        auto& shard = *shards_[thread_slot() % shards_.size()];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        update(shard.sketch);
+        shard.version.fetch_add(1, std::memory_order_release);
+    }
+
+    /*
+     * Rebuild the snapshot if any of the shards has been updated since it
+     * was taken. Must be called with snapshot_mutex_ held
+     */
+    Sketch& refresh_snapshot() const {
+        auto is_stale = false;
+
+        for (size_t idx = 0; idx < shards_.size(); ++idx) {
+            if (shards_[idx]->version.load(std::memory_order_acquire) !=
+                    snapshot_versions_[idx]) {
+                is_stale = true;
+                break;
+            }
+        }
+
+        if (!is_stale) {
+            return snapshot_;
+        }
+
+        snapshot_.copy(prototype_);
+
+        for (size_t idx = 0; idx < shards_.size(); ++idx) {
+            auto& shard = *shards_[idx];
+
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            snapshot_versions_[idx] = shard.version.load();
+            snapshot_.merge(shard.sketch);
+        }
+
+        return snapshot_;
+    }
+
+    const Sketch prototype_;  /* An empty sketch with the shards' parameters */
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    mutable std::mutex snapshot_mutex_;
+    mutable Sketch snapshot_;  /* The merged shards, as of snapshot_versions_ */
+    mutable std::vector<uint64_t> snapshot_versions_;
+};
+
+}  // namespace ddsketch
+
+#endif  // INCLUDES_DDSKETCH_CONCURRENT_DDSKETCH_H_
@@ -7,12 +7,24 @@
 #define INCLUDES_DDSKETCH_DDSKETCH_H_
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <deque>
+#include <iterator>
 #include <limits>
+#include <memory>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
 #include <numeric>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 /*
  * A quantile sketch with relative-error guarantees. This sketch computes
@@ -45,6 +57,16 @@
  *     https://github.com/DataDog/sketches-js/
  */
 
+/*
+ * Tells the compiler that a pointer does not alias the other pointers of a
+ * loop, so that the loop is vectorized without checking for an overlap
+ */
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define DDSKETCH_RESTRICT __restrict
+#else
+#define DDSKETCH_RESTRICT
+#endif
+
 namespace ddsketch {
 
 using RealValue = double;
@@ -52,54 +74,188 @@ using Index = int64_t;
 
 static constexpr Index kChunkSize = 128;
 
+/*
+ * The kernels over contiguous bins, written so that the compiler vectorizes
+ * them: the ranges do not overlap, and there are no loop-carried
+ * dependencies on a single accumulator or early exits per bin.
+ */
+
+/* Add count bins of source to the bins of destination */
+template <typename BinItem>
+void add_bin_range(BinItem* DDSKETCH_RESTRICT destination,
+                   const BinItem* DDSKETCH_RESTRICT source,
+                   size_t count) {
+    for (size_t pos = 0; pos < count; ++pos) {
+        destination[pos] += source[pos];
+    }
+}
+
+/*
+ * The sum of count bins, as a Sum. The bins are summed into independent
+ * partial sums, one per vector lane, which are added up at the end, so that
+ * the rounding of non-integer counts may differ from a sequential sum
+ */
+template <typename Sum, typename BinItem>
+Sum sum_bin_range(const BinItem* bins, size_t count) {
+    constexpr size_t kNumLanes = 4;
+
+    Sum lane_sums[kNumLanes] = {};
+    size_t pos = 0;
+
+    for (; pos + kNumLanes <= count; pos += kNumLanes) {
+        for (size_t lane = 0; lane < kNumLanes; ++lane) {
+            lane_sums[lane] += bins[pos + lane];
+        }
+    }
+
+    auto sum = (lane_sums[0] + lane_sums[1]) + (lane_sums[2] + lane_sums[3]);
+
+    for (; pos < count; ++pos) {
+        sum += bins[pos];
+    }
+
+    return sum;
+}
+
+/* Whether count bins are all zeros, checked by blocks of kBlockSize bins */
 template <typename BinItem>
+bool is_zero_bin_range(const BinItem* bins, size_t count) {
+    constexpr size_t kBlockSize = 64;
+
+    size_t pos = 0;
+
+    for (; pos + kBlockSize <= count; pos += kBlockSize) {
+        bool has_non_zero = false;
+
+        for (size_t slot = 0; slot < kBlockSize; ++slot) {
+            has_non_zero |= bins[pos + slot] != 0;
+        }
+
+        if (has_non_zero) {
+            return false;
+        }
+    }
+
+    for (; pos < count; ++pos) {
+        if (bins[pos] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The relative tolerance of the counts subtracted from a store. A count is
+ * a sum of weights, rounded in another order than the sums subtracted from
+ * it, e.g., 0.7 + 0.1 - 0.7 < 0.1, so that a count may fall slightly short
+ * of the values it holds, or keep a residue once they are all subtracted.
+ */
+static constexpr RealValue kSubtractionTolerance = 1e-9;
+
+/* Whether a count is higher than the total it is subtracted from */
+inline bool exceeds_count(RealValue count, RealValue total) {
+    return count - total > kSubtractionTolerance * std::max(count, total);
+}
+
+/* The total minus the count, with the residues of the rounding cleared */
+inline RealValue subtract_count(RealValue total, RealValue count) {
+    auto difference = total - count;
+
+    return difference <= kSubtractionTolerance * total ? 0 : difference;
+}
+
+/*
+ * A list of bins stored in a single contiguous buffer. The used bins sit in
+ * the middle of the buffer, with spare room kept at both ends, so that the
+ * list can grow or shift in either direction in amortized O(1) per bin, while
+ * scans over the bins remain cache-friendly and vectorizable.
+ *
+ * The buffer is obtained from the allocator, e.g., an arena shared by many
+ * sketches. As with the standard containers, a copy of the list gets the
+ * allocator selected by select_on_container_copy_construction, and an
+ * assignment keeps the allocator of the list assigned to, unless the
+ * allocator propagates.
+ */
+template <typename BinItem, class Allocator = std::allocator<BinItem>>
 class BinList {
  public:
-    using Container = std::deque<BinItem>;
-    using iterator = typename Container::iterator;
-    using const_iterator = typename Container::const_iterator;
+    using Container = std::vector<BinItem, Allocator>;
+    using allocator_type = Allocator;
+    using value_type = BinItem;
+    using iterator = BinItem*;
+    using const_iterator = const BinItem*;
     using reference = BinItem&;
     using const_reference = const BinItem&;
 
     iterator begin() {
-         return data_.begin();
+        return data_.data() + head_;
     }
 
     iterator end() {
-        return data_.end();
+        return begin() + size_;
     }
 
     const_iterator begin() const {
-        return data_.begin();
+        return data_.data() + head_;
     }
 
     const_iterator end() const {
-        return data_.end();
+        return begin() + size_;
+    }
+
+    BinList() : head_(0), size_(0) {
     }
 
-    BinList() = default;
+    explicit BinList(const Allocator& allocator)
+        : data_(allocator),
+          head_(0),
+          size_(0) {
+    }
 
     ~BinList() = default;
 
-    explicit BinList(size_t size) {
+    explicit BinList(size_t size, const Allocator& allocator = Allocator())
+        : BinList(allocator) {
         initialize_with_zeros(size);
     }
 
-    BinList(const BinList<BinItem>& bins)
-        : data_(bins.data_) {
+    BinList(const BinList& bins)
+        : data_(bins.begin(),
+                bins.end(),
+                std::allocator_traits<Allocator>::
+                    select_on_container_copy_construction(
+                        bins.get_allocator())),
+          head_(0),
+          size_(bins.size_) {
     }
 
-    BinList(BinList<BinItem>&& bins) noexcept
-        : data_(std::move(bins.data_)) {
+    BinList(BinList&& bins) noexcept
+        : data_(std::move(bins.data_)),
+          head_(bins.head_),
+          size_(bins.size_) {
+        bins.head_ = 0;
+        bins.size_ = 0;
     }
 
-    BinList& operator=(const BinList<BinItem>& bins) {
-        data_ =  bins.data_;
+    BinList& operator=(const BinList& bins) {
+        if (this != &bins) {
+            data_.assign(bins.begin(), bins.end());
+            head_ = 0;
+            size_ = bins.size_;
+        }
+
         return *this;
     }
 
-    BinList& operator=(BinList<BinItem>&& bins) noexcept {
+    BinList& operator=(BinList&& bins) noexcept {
         data_ = std::move(bins.data_);
+        head_ = bins.head_;
+        size_ = bins.size_;
+
+        bins.head_ = 0;
+        bins.size_ = 0;
+
         return *this;
     }
 
@@ -111,28 +267,35 @@ class BinList {
         return os;
     }
 
+    allocator_type get_allocator() const {
+        return data_.get_allocator();
+    }
+
     size_t size() const {
-        return data_.size();
+        return size_;
     }
 
     reference operator[] (int idx) {
-        return data_[idx];
+        return data_[head_ + idx];
     }
 
     const_reference operator[] (int idx) const {
-        return data_[idx];
+        return data_[head_ + idx];
     }
 
     reference first() {
-        return data_[0];
+        return data_[head_];
     }
 
     reference last() {
-        return data_[size() - 1];
+        return data_[head_ + size_ - 1];
     }
 
     void insert(BinItem elem) {
-        data_.push_back(elem);
+        reserve_room(0, 1);
+
+        data_[head_ + size_] = elem;
+        ++size_;
     }
 
     BinItem collapsed_count(int start_idx, int end_idx) const {
@@ -140,67 +303,94 @@ class BinList {
             throw std::invalid_argument("Indexes out of bounds");
         }
 
-        return std::accumulate(
-                   data_.begin() + start_idx,
-                   data_.begin() + end_idx,
-                   typename decltype(data_)::value_type(0));
+        return end_idx > start_idx ?
+                   sum_bin_range<BinItem>(
+                       begin() + start_idx, end_idx - start_idx) :
+                   BinItem(0);
     }
 
     bool has_only_zeros() const {
-        auto non_zero_item =
-            std::find_if(
-                    data_.begin(),
-                    data_.end(),
-                    [](const auto& item) {
-                        return item != 0;
-                    });
-
-        return non_zero_item == data_.end();
+        return is_zero_bin_range(begin(), size_);
     }
 
     BinItem sum() const {
-        return collapsed_count(0, data_.size());
+        return collapsed_count(0, size_);
     }
 
     void initialize_with_zeros(size_t num_zeros) {
-        auto trailing_zeros = Container(num_zeros, 0);
+        if (data_.size() < num_zeros) {
+            data_.assign(num_zeros, 0);
+        }
+
+        /* Reuse the existing buffer, keeping the spare room balanced */
+        head_ = (data_.size() - num_zeros) / 2;
+        size_ = num_zeros;
 
-        data_ = trailing_zeros;
+        std::fill(begin(), end(), 0);
     }
 
     void extend_front_with_zeros(size_t count) {
-       auto trailing_zeros = Container(count, 0);
+        reserve_room(count, 0);
 
-       data_.insert(
-           data_.begin(),
-           trailing_zeros.begin(),
-           trailing_zeros.end());
+        head_ -= count;
+        size_ += count;
+
+        std::fill(begin(), begin() + count, 0);
     }
 
     void extend_back_with_zeros(size_t count) {
-       auto trailing_zeros = Container(count, 0);
+        reserve_room(0, count);
+
+        std::fill(end(), end() + count, 0);
 
-       data_.insert(
-           data_.end(),
-           trailing_zeros.begin(),
-           trailing_zeros.end());
+        size_ += count;
     }
 
     void remove_trailing_elements(size_t count) {
-        data_.erase(data_.end() - count, data_.end());
+        size_ -= count;
     }
 
     void remove_leading_elements(size_t count) {
-        data_.erase(data_.begin(), data_.begin() + count);
+        head_ += count;
+        size_ -= count;
     }
 
     void replace_range_with_zeros(int start_idx,
                                   int end_idx,
                                   size_t num_zeros) {
-        auto zeros = Container(num_zeros, 0);
+        size_t num_removed = end_idx - start_idx;
+
+        if (num_zeros > num_removed) {
+            auto num_added = num_zeros - num_removed;
+
+            reserve_room(0, num_added);
+            std::copy_backward(
+                begin() + end_idx, end(), end() + num_added);
+            size_ += num_added;
+        } else if (num_zeros < num_removed) {
+            std::copy(
+                begin() + end_idx, end(), begin() + start_idx + num_zeros);
+            size_ -= num_removed - num_zeros;
+        }
 
-        data_.erase(data_.begin() + start_idx, data_.begin() + end_idx);
-        data_.insert(data_.begin() + start_idx, zeros.begin(), zeros.end());
+        std::fill(
+            begin() + start_idx, begin() + start_idx + num_zeros, 0);
+    }
+
+    /* Add count bins of another list, from bins_idx on, to the bins from idx */
+    void add_bins(int idx, const BinList& bins, int bins_idx, size_t count) {
+        auto destination = begin() + idx;
+
+        /* The kernel takes the bins as not aliased, e.g., by a self-merge */
+        if (&bins == this) {
+            std::vector<BinItem> source(
+                bins.begin() + bins_idx, bins.begin() + bins_idx + count);
+
+            add_bin_range(destination, source.data(), count);
+            return;
+        }
+
+        add_bin_range(destination, bins.begin() + bins_idx, count);
     }
 
  private:
@@ -208,1055 +398,6345 @@ class BinList {
         return idx > size();
     }
 
-    Container data_;
-};
+    /*
+     * Make room for `front` bins before and `back` bins after the used range.
+     * When the buffer has enough spare capacity, the used range is simply
+     * re-centered, otherwise the buffer grows by half of the required size.
+     */
+    void reserve_room(size_t front, size_t back) {
+        auto room_after = data_.size() - head_ - size_;
 
-template <typename T>
-struct CRTP {
-    T& underlying() {
-        return static_cast<T&>(*this);
-    }
+        if (head_ >= front && room_after >= back) {
+            return;
+        }
 
-    T const& underlying() const {
-        return static_cast<T const&>(*this);
+        auto required = size_ + front + back;
+
+        if (data_.size() >= required + required / 4) {
+            auto new_head = front + (data_.size() - required) / 2;
+            auto destination = data_.begin() + new_head;
+
+            if (new_head < head_) {
+                std::copy(begin(), end(), destination);
+            } else {
+                std::copy_backward(begin(), end(), destination + size_);
+            }
+
+            head_ = new_head;
+        } else {
+            Container buffer(required + required / 2, data_.get_allocator());
+            auto new_head = front + (buffer.size() - required) / 2;
+
+            std::copy(begin(), end(), buffer.begin() + new_head);
+
+            data_.swap(buffer);
+            head_ = new_head;
+        }
     }
+
+    Container data_;
+    size_t head_;   /* The position of the first used bin in the buffer */
+    size_t size_;   /* The number of used bins */
 };
 
-/* The basic specification of a store */
-template <class ConcreteStore>
-class BaseStore : CRTP<ConcreteStore> {
+/*
+ * A list of bins backed by a std::deque. Kept as an alternative to BinList for
+ * workloads where the bins are rarely scanned; BinList is the default. The
+ * blocks of the deque are obtained from the allocator, cf. BinList.
+ */
+template <typename BinItem, class Allocator = std::allocator<BinItem>>
+class DequeBinList {
  public:
-    /* Copy the input store into this one */
-    void copy(const ConcreteStore &store) {
-        this->underlying()->copy(store);
-    }
+    using Container = std::deque<BinItem, Allocator>;
+    using allocator_type = Allocator;
+    using value_type = BinItem;
+    using iterator = typename Container::iterator;
+    using const_iterator = typename Container::const_iterator;
+    using reference = BinItem&;
+    using const_reference = const BinItem&;
 
-    /* The number of bins */
-    Index length() {
-        return this->underlying()->length();
+    iterator begin() {
+         return data_.begin();
     }
 
-    bool is_empty() {
-        return this->underlying()->is_empty();
+    iterator end() {
+        return data_.end();
     }
 
-    /*
-     * Updates the counter at the specified index key,
-     * growing the number of bins if necessary.
-     */
-    void add(Index key, RealValue weight) {
-        this->underlying()->add(key, weight);
+    const_iterator begin() const {
+        return data_.begin();
     }
 
-    void add(Index key) {
-        this->underlying()->add(key, 1.0);
+    const_iterator end() const {
+        return data_.end();
     }
 
-    /*
-     * Return the key for the value at given rank
-     *
-     *  E.g., if the non-zero bins are [1, 1] for keys a, b with no offset
-     *
-     *  if (lower == true) {
-     *       key_at_rank(x) = a for x in [0, 1)
-     *       key_at_rank(x) = b for x in [1, 2)
-     *  }
-     *  if (lower == false) {
-     *       key_at_rank(x) = a for x in (-1, 0]
-     *       key_at_rank(x) = b for x in (0, 1]
-     *  }
-     */
-    Index key_at_rank(RealValue rank, bool lower = false) const {
-        return this->underlying()->key_at_rank(rank, lower);
-    }
+    DequeBinList() = default;
 
-    /*
-     * Merge another store into this one. This should be equivalent as running the
-     * add operations that have been run on the other store on this one.
-     */
-    void merge(const ConcreteStore& store) {
-        return this->underlying()->merge(store);
+    explicit DequeBinList(const Allocator& allocator) : data_(allocator) {
     }
 
- protected:
-     BaseStore() = default;
-    ~BaseStore() = default;
-
-    BaseStore(const BaseStore& store) = default;
-    BaseStore(BaseStore&& store) noexcept = default;
+    ~DequeBinList() = default;
 
-    BaseStore& operator=(const BaseStore& store) = default;
-    BaseStore& operator=(BaseStore&& store) noexcept = default;
-};
+    explicit DequeBinList(size_t size, const Allocator& allocator = Allocator())
+        : data_(allocator) {
+        initialize_with_zeros(size);
+    }
 
-/*
- * A dense store that keeps all the bins between the bin for the min_key
- * and the bin for the max_key.
- */
-template <class ConcreteStore = void>
-class BaseDenseStore : public BaseStore<BaseDenseStore<ConcreteStore>> {
- public:
-    explicit BaseDenseStore(Index chunk_size = kChunkSize)
-    : count_(0),
-      min_key_(std::numeric_limits<Index>::max()),
-      max_key_(std::numeric_limits<Index>::min()),
-      chunk_size_(chunk_size),
-      offset_(0) {
+    DequeBinList(const DequeBinList& bins)
+        : data_(bins.data_) {
     }
 
-    std::string to_string() const {
-        std::ostringstream repr;
+    DequeBinList(DequeBinList&& bins) noexcept
+        : data_(std::move(bins.data_)) {
+    }
 
-        repr <<  "{";
+    DequeBinList& operator=(const DequeBinList& bins) {
+        data_ =  bins.data_;
+        return *this;
+    }
 
-        Index i = 0;
+    DequeBinList& operator=(DequeBinList&& bins) noexcept {
+        data_ = std::move(bins.data_);
+        return *this;
+    }
 
-        for (const auto& sbin : bins_) {
-            repr << i++ + offset_ << ": " << sbin << ", ";
+    friend std::ostream& operator<<(std::ostream& os,
+                                    const DequeBinList& bins) {
+        for (const auto& elem : bins) {
+            os << elem << " ";
         }
 
-        repr << "}, ";
-
-        repr << "min_key:" << min_key_
-             << ", max_key:" << max_key_
-             << ", offset:" << offset_;
+        return os;
+    }
 
-        return repr.str();
+    allocator_type get_allocator() const {
+        return data_.get_allocator();
     }
 
-    void copy(const BaseDenseStore& store) {
-        count_ = store.count_;
-        min_key_ = store.min_key_;
-        max_key_ = store.max_key_;
-        offset_ = store.offset_;
-        bins_ = store.bins_;
+    size_t size() const {
+        return data_.size();
     }
 
-    const BinList<RealValue>& bins() const {
-        return bins_;
+    reference operator[] (int idx) {
+        return data_[idx];
     }
 
-    Index offset() const {
-        return offset_;
+    const_reference operator[] (int idx) const {
+        return data_[idx];
     }
 
-    RealValue count() const {
-        return count_;
+    reference first() {
+        return data_[0];
     }
 
-    Index length() const {
-        return bins_.size();
+    reference last() {
+        return data_[size() - 1];
     }
 
-    bool is_empty() const {
-        return length() == kEmptyStoreLength;
+    void insert(BinItem elem) {
+        data_.push_back(elem);
     }
 
-    void add(Index key, RealValue weight = 1.0) {
-        Index idx = get_index(key);
+    BinItem collapsed_count(int start_idx, int end_idx) const {
+        if (index_outside_bounds(start_idx) || index_outside_bounds(end_idx)) {
+            throw std::invalid_argument("Indexes out of bounds");
+        }
 
-        bins_[idx] += weight;
-        count_ += weight;
+        return std::accumulate(
+                   data_.begin() + start_idx,
+                   data_.begin() + end_idx,
+                   typename decltype(data_)::value_type(0));
     }
 
-    Index key_at_rank(RealValue rank, bool lower = true) const {
-        auto running_ct = 0.0;
-
-        auto idx = 0;
-        for (const auto bin_ct : bins_) {
-            running_ct += bin_ct;
-            if ((lower && running_ct > rank) ||
-                (!lower && running_ct >= rank + 1)) {
-                return idx + offset_;
-            }
-            ++idx;
-        }
+    bool has_only_zeros() const {
+        auto non_zero_item =
+            std::find_if(
+                    data_.begin(),
+                    data_.end(),
+                    [](const auto& item) {
+                        return item != 0;
+                    });
 
-        return max_key_;
+        return non_zero_item == data_.end();
     }
 
-    void merge(const BaseDenseStore& store) {
-        if (store.count_ == 0) {
-            return;
-        }
+    BinItem sum() const {
+        return collapsed_count(0, data_.size());
+    }
 
-        if (count_ == 0) {
-            copy(store);
-            return;
-        }
+    /* Reuses the blocks of the deque */
+    void initialize_with_zeros(size_t num_zeros) {
+        data_.assign(num_zeros, 0);
+    }
 
-        if (store.min_key_ < min_key_ || store.max_key_ > max_key_) {
-            extend_range(store.min_key_, store.max_key_);
-        }
+    void extend_front_with_zeros(size_t count) {
+        data_.insert(data_.begin(), count, BinItem(0));
+    }
 
-        for (auto key = store.min_key_; key <= store.max_key_ ; ++key) {
-            bins_[key - offset_] += store.bins_[key - store.offset_];
-        }
+    void extend_back_with_zeros(size_t count) {
+        data_.insert(data_.end(), count, BinItem(0));
+    }
 
-        count_ += store.count_;
+    void remove_trailing_elements(size_t count) {
+        data_.erase(data_.end() - count, data_.end());
     }
 
- protected:
-    virtual Index get_new_length(Index new_min_key, Index new_max_key) {
-        auto desired_length = new_max_key - new_min_key + 1;
-        auto num_chunks = std::ceil((1.0 * desired_length) / chunk_size_);
+    void remove_leading_elements(size_t count) {
+        data_.erase(data_.begin(), data_.begin() + count);
+    }
 
-        return chunk_size_ * num_chunks;
+    void replace_range_with_zeros(int start_idx,
+                                  int end_idx,
+                                  size_t num_zeros) {
+        data_.erase(data_.begin() + start_idx, data_.begin() + end_idx);
+        data_.insert(data_.begin() + start_idx, num_zeros, BinItem(0));
     }
 
-    /*
-     * Adjust the bins, the offset, the min_key, and max_key, without resizing
-     * the bins, in order to try making it fit the specified range
-     */
-    virtual void adjust(Index new_min_key, Index new_max_key) {
-        center_bins(new_min_key, new_max_key);
+    /* Add count bins of another list, from bins_idx on, to the bins from idx */
+    void add_bins(int idx,
+                  const DequeBinList& bins,
+                  int bins_idx,
+                  size_t count) {
+        std::transform(
+            bins.data_.begin() + bins_idx,
+            bins.data_.begin() + bins_idx + count,
+            data_.begin() + idx,
+            data_.begin() + idx,
+            [](BinItem bin_ct, BinItem bin) {
+                return bin + bin_ct;
+            });
+    }
 
-        min_key_ = new_min_key;
-        max_key_ = new_max_key;
+ private:
+    bool index_outside_bounds(size_t idx) const {
+        return idx > size();
     }
 
-    /* Shift the bins; this changes the offset */
-    void shift_bins(Index shift) {
-        if (shift > 0) {
-            bins_.remove_trailing_elements(shift);
-            bins_.extend_front_with_zeros(shift);
-        } else {
-            auto abs_shift = std::abs(shift);
+    Container data_;
+};
 
-            bins_.remove_leading_elements(abs_shift);
-            bins_.extend_back_with_zeros(abs_shift);
+/*
+ * A thread-local pool of fixed-size bin pages, shared by all the
+ * PagedBinLists with the same bin type and page size. Released pages are kept
+ * for reuse, up to kMaxPooledPages per thread, instead of going back to the
+ * allocator. A page can be released by another thread than the one which
+ * acquired it; it then joins the pool of the releasing thread.
+ */
+template <typename BinItem, size_t PageSize>
+class BinPagePool {
+ public:
+    union Page {
+        BinItem bins[PageSize];
+        Page* next;  /* The next pooled page, while the page is pooled */
+    };
+
+    static constexpr size_t kMaxPooledPages = 1024;
+
+    /* A page with all its bins set to zero */
+    static Page* acquire() {
+        auto& free_list = thread_free_list();
+
+        if (free_list.head == nullptr) {
+            return new Page();
         }
 
-        offset_ -= shift;
-    }
+        auto page = free_list.head;
 
-    /* Center the bins; this changes the offset */
-    void center_bins(Index new_min_key, Index new_max_key) {
-        auto middle_key = new_min_key + (new_max_key - new_min_key + 1) / 2;
+        free_list.head = page->next;
+        --free_list.size;
 
-        shift_bins(offset_ + length() / 2 - middle_key);
+        std::fill(page->bins, page->bins + PageSize, BinItem(0));
+
+        return page;
     }
 
-    /* Grow the bins as necessary and call _adjust */
-    void extend_range(Index key, Index second_key) {
-        auto new_min_key = std::min({key, second_key, min_key_});
-        auto new_max_key = std::max({key, second_key, max_key_});
+    static void release(Page* page) {
+        auto& free_list = thread_free_list();
 
-        if (is_empty()) {
-            /* Initialize bins */
-            auto new_length = get_new_length(new_min_key, new_max_key);
-            bins_.initialize_with_zeros(new_length);
-            offset_ = new_min_key;
-            adjust(new_min_key, new_max_key);
-        } else if (new_min_key >= min_key_ &&
-                   new_max_key < offset_ + length()) {
-            /* No need to change the range; just update min/max keys */
-            min_key_ = new_min_key;
-            max_key_ = new_max_key;
-        } else {
-            /* Grow the bins */
-            Index new_length = get_new_length(new_min_key, new_max_key);
+        if (free_list.is_closed || free_list.size >= kMaxPooledPages) {
+            delete page;
+            return;
+        }
 
-            if (new_length > length()) {
-                bins_.extend_back_with_zeros(new_length - length());
-            }
+        drain_at_thread_exit();
 
-            adjust(new_min_key, new_max_key);
-        }
+        page->next = free_list.head;
+        free_list.head = page;
+        ++free_list.size;
     }
 
-    void extend_range(Index key) {
-        extend_range(key, key);
+    /* The number of pages pooled by the calling thread */
+    static size_t size() {
+        return thread_free_list().size;
     }
 
-    /* Calculate the bin index for the key, extending the range if necessary */
-    virtual Index get_index(Index key) {
-        if (key < min_key_ || key > max_key_) {
-            extend_range(key);
-        }
+ private:
+    /*
+     * Trivially destructible, so that it remains usable while the other
+     * thread-local objects, which may own pages, are being destroyed
+     */
+    struct FreeList {
+        Page* head;
+        size_t size;
+        bool is_closed;  /* Set once the pooled pages have been freed */
+    };
 
-        return key - offset_;
-    }
+    /* Frees the pooled pages when the thread exits */
+    struct Drain {
+        ~Drain() {
+            auto& free_list = thread_free_list();
 
- public:
-    RealValue count_; /* The sum of the counts for the bins */
-    Index min_key_;   /* The minimum key bin */
-    Index max_key_;   /* The maximum key bin */
+            free_list.is_closed = true;
 
-    /* The number of bins to grow by */
-    Index chunk_size_;
+            while (free_list.head != nullptr) {
+                auto page = free_list.head;
 
-    /* The difference btw the keys and the index in which they are stored */
-    Index offset_;
-    BinList<RealValue> bins_;
+                free_list.head = page->next;
+                delete page;
+            }
 
- private:
-    static constexpr size_t kEmptyStoreLength = 0;
-};
+            free_list.size = 0;
+        }
+    };
 
-using DenseStore = BaseDenseStore<>;
+    static FreeList& thread_free_list() {
+        static thread_local FreeList free_list = {nullptr, 0, false};
+
+        return free_list;
+    }
+
+    static void drain_at_thread_exit() {
+        static thread_local Drain drain;
+
+        (void) drain;
+    }
+};
 
 /*
- * A dense store that keeps all the bins between the bin for the min_key and the
- * bin for the max_key, but collapsing the left-most bins if the number of bins
- * exceeds the bin_limit
+ * A list of bins stored in fixed-size pages, which are taken from a
+ * BinPagePool. The list itself only holds a small directory of pages, in
+ * which a null page stands for a page of zeros, only allocated once one of
+ * its bins is written to.
+ *
+ * Growing the list only adds pages to the directory, and removing bins from
+ * either end drops the pages that no longer hold any bin, so that shifting
+ * the bins, as done by the dense stores, never moves the bins themselves.
+ * Pages whose bins are all replaced with zeros go back to the pool.
+ *
+ * The iterators are read-only, and yield the bins by value. The pages always
+ * come from the pool, so the allocator taken by the constructors, for the
+ * same interface as BinList, is not used.
  */
-class CollapsingLowestDenseStore
-    : public BaseDenseStore<CollapsingLowestDenseStore> {
+template <typename BinItem, size_t PageSize = kChunkSize>
+class PagedBinList {
  public:
-    explicit CollapsingLowestDenseStore(Index bin_limit,
-                                        Index chunk_size = kChunkSize)
-    : BaseDenseStore(chunk_size),
-      bin_limit_(bin_limit),
-      is_collapsed_(false) {
-    }
+    using Pool = BinPagePool<BinItem, PageSize>;
+    using Page = typename Pool::Page;
+    using allocator_type = std::allocator<BinItem>;
+    using value_type = BinItem;
+    using reference = BinItem&;
+    using const_reference = const BinItem&;
 
-    Index bin_limit() const {
-        return bin_limit_;
-    }
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = BinItem;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const BinItem*;
+        using reference = BinItem;
+
+        const_iterator(const Page* const* page, size_t slot)
+            : page_(page),
+              slot_(slot) {
+        }
 
-    void copy(const CollapsingLowestDenseStore& store) {
-        count_ = store.count_;
-        min_key_ = store.min_key_;
-        max_key_ = store.max_key_;
-        offset_ = store.offset_;
-        bins_ = store.bins_;
+        BinItem operator*() const {
+            return *page_ == nullptr ? BinItem(0) : (*page_)->bins[slot_];
+        }
 
-        bin_limit_ = store.bin_limit_;
-        is_collapsed_ = store.is_collapsed_;
-    }
+        const_iterator& operator++() {
+            if (++slot_ == PageSize) {
+                slot_ = 0;
+                ++page_;
+            }
 
-    void merge(const CollapsingLowestDenseStore& store) {
-        if (store.count_ == 0) {
-            return;
+            return *this;
         }
 
-        if (count_ == 0) {
-            copy(store);
-            return;
+        const_iterator operator++(int) {
+            auto iterator = *this;
+            ++*this;
+
+            return iterator;
         }
 
-        if (store.min_key_ < min_key_ || store.max_key_ > max_key_) {
-            extend_range(store.min_key_, store.max_key_);
+        bool operator==(const const_iterator& other) const {
+            return page_ == other.page_ && slot_ == other.slot_;
         }
 
-        auto collapse_start_idx = store.min_key_ - store.offset_;
+        bool operator!=(const const_iterator& other) const {
+            return !(*this == other);
+        }
 
-        auto collapse_end_idx =
-                std::min(min_key_, store.max_key_ + 1) - store.offset_;
+     private:
+        const Page* const* page_;
+        size_t slot_;  /* The position of the bin in its page */
+    };
 
-        if (collapse_end_idx > collapse_start_idx) {
-            auto collapsed_count =
-                bins_.collapsed_count(
-                    collapse_start_idx, collapse_end_idx);
+    using iterator = const_iterator;
 
-            bins_.first() += collapsed_count;
-        } else {
-            collapse_end_idx = collapse_start_idx;
-        }
+    const_iterator begin() const {
+        return iterator_at(head_);
+    }
 
-        for (auto key = collapse_end_idx + store.offset_;
-                  key <= store.max_key_; ++key) {
-            bins_[key - offset_] += store.bins_[key - store.offset_];
-        }
+    const_iterator end() const {
+        return iterator_at(head_ + size_);
+    }
 
-        count_ += store.count_;
+    PagedBinList() : head_(0), size_(0) {
     }
 
- private:
-    Index get_new_length(Index new_min_key, Index new_max_key) override {
-        auto desired_length = new_max_key - new_min_key + 1;
-        Index num_chunks = std::ceil((1.0 * desired_length) / chunk_size_);
+    ~PagedBinList() {
+        release_pages(0, pages_.size());
+    }
 
-        return std::min(chunk_size_ * num_chunks, bin_limit_);
+    explicit PagedBinList(const allocator_type& /* allocator */)
+        : PagedBinList() {
     }
 
-    /* Calculate the bin index for the key, extending the range if necessary */
-    Index get_index(Index key) override {
-        if (key < min_key_) {
-            if (is_collapsed_) {
-                return 0;
-            }
+    explicit PagedBinList(size_t size,
+                          const allocator_type& /* allocator */ =
+                              allocator_type())
+        : PagedBinList() {
+        initialize_with_zeros(size);
+    }
 
-            extend_range(key);
+    allocator_type get_allocator() const {
+        return allocator_type();
+    }
 
-            if (is_collapsed_) {
-                return 0;
-            }
-        } else if (key > max_key_) {
-            extend_range(key);
+    PagedBinList(const PagedBinList& bins)
+        : head_(bins.head_),
+          size_(bins.size_) {
+        copy_pages(bins);
+    }
+
+    PagedBinList(PagedBinList&& bins) noexcept
+        : pages_(std::move(bins.pages_)),
+          head_(bins.head_),
+          size_(bins.size_) {
+        bins.pages_.clear();
+        bins.head_ = 0;
+        bins.size_ = 0;
+    }
+
+    PagedBinList& operator=(const PagedBinList& bins) {
+        if (this != &bins) {
+            clear();
+            copy_pages(bins);
+
+            head_ = bins.head_;
+            size_ = bins.size_;
         }
 
-        return key - offset_;
+        return *this;
     }
 
-    /*
-     * Override. Adjust the bins, the offset, the min_key, and max_key,
-     * without resizing the bins, in order to try making it fit the specified
-     * range. Collapse to the left if necessary
-     */
-    void adjust(Index new_min_key, Index new_max_key) override {
-        if (new_max_key - new_min_key + 1 > length()) {
-            /*
-             * The range of keys is too wide.
-             * The lowest bins need to be collapsed
-             */
-            new_min_key = new_max_key - length() + 1;
+    PagedBinList& operator=(PagedBinList&& bins) noexcept {
+        if (this != &bins) {
+            clear();
 
-            if (new_min_key >= max_key_) {
-                /* Put everything in the first bin */
-                offset_ = new_min_key;
-                min_key_ = new_min_key;
+            pages_ = std::move(bins.pages_);
+            head_ = bins.head_;
+            size_ = bins.size_;
 
-                bins_.initialize_with_zeros(length());
-                bins_.first() = count_;
-            } else {
-                auto shift = offset_ - new_min_key;
+            bins.pages_.clear();
+            bins.head_ = 0;
+            bins.size_ = 0;
+        }
 
-                if (shift < 0) {
-                    auto collapse_start_index = min_key_ - offset_;
-                    auto collapse_end_index = new_min_key - offset_;
+        return *this;
+    }
 
-                    auto collapsed_count =
-                        bins_.collapsed_count(
-                            collapse_start_index,
-                            collapse_end_index);
+    friend std::ostream& operator<<(std::ostream& os,
+                                    const PagedBinList& bins) {
+        for (const auto elem : bins) {
+            os << elem << " ";
+        }
 
-                    bins_.replace_range_with_zeros(
-                        collapse_start_index,
-                        collapse_end_index,
-                        new_min_key - min_key_);
+        return os;
+    }
 
-                    bins_[collapse_end_index] += collapsed_count;
+    size_t size() const {
+        return size_;
+    }
 
-                    min_key_ = new_min_key;
+    /* The number of pages holding bins, i.e. not taken as zeros */
+    size_t num_allocated_pages() const {
+        return std::count_if(
+                   pages_.begin(),
+                   pages_.end(),
+                   [](const Page* page) {
+                       return page != nullptr;
+                   });
+    }
 
-                    /* Shift the buckets to make room for new_max_key */
-                    shift_bins(shift);
-                } else {
-                    min_key_ = new_min_key;
+    /* Allocates the page of the bin, if it is still made of zeros */
+    reference operator[] (int idx) {
+        auto position = head_ + idx;
+        auto& page = pages_[position / PageSize];
 
-                    /* Shift the buckets to make room for new_min_key */
-                    shift_bins(shift);
-                }
-              }
-
-            max_key_ = new_max_key;
-            is_collapsed_ = true;
-        } else {
-            center_bins(new_min_key, new_max_key);
-
-            min_key_ = new_min_key;
-            max_key_ = new_max_key;
+        if (page == nullptr) {
+            page = Pool::acquire();
         }
+
+        return page->bins[position % PageSize];
     }
 
-    Index bin_limit_;  /* The maximum number of bins */
-    bool is_collapsed_;
-};
+    const_reference operator[] (int idx) const {
+        static const BinItem kZero = 0;
 
-/*
- * A dense store that keeps all the bins between the bin for the min_key and the
- * bin for the max_key, but collapsing the right-most bins if the number of bins
- * exceeds the bin_limit
- */
-class CollapsingHighestDenseStore
-    : public BaseDenseStore<CollapsingHighestDenseStore> {
- public:
-    explicit CollapsingHighestDenseStore(Index bin_limit,
-                                         Index chunk_size = kChunkSize)
-    : BaseDenseStore(chunk_size),
-      bin_limit_(bin_limit),
-      is_collapsed_(false) {
-    }
+        auto position = head_ + idx;
+        const auto page = pages_[position / PageSize];
 
-    Index bin_limit() const {
-        return bin_limit_;
+        return page == nullptr ? kZero : page->bins[position % PageSize];
     }
 
-    void copy(const CollapsingHighestDenseStore& store) {
-        count_ = store.count_;
-        min_key_ = store.min_key_;
-        max_key_ = store.max_key_;
-        offset_ = store.offset_;
-        bins_ = store.bins_;
+    reference first() {
+        return (*this)[0];
+    }
 
-        bin_limit_ = store.bin_limit_;
-        is_collapsed_ = store.is_collapsed_;
+    reference last() {
+        return (*this)[size_ - 1];
     }
 
-    void merge(const CollapsingHighestDenseStore& store) {
-        if (store.count_ == 0) {
-            return;
-        }
+    void insert(BinItem elem) {
+        extend_back_with_zeros(1);
 
-        if (count_ == 0) {
-            copy(store);
-            return;
+        if (elem != 0) {
+            last() = elem;
         }
+    }
 
-        if (store.min_key_ < min_key_ || store.max_key_ > max_key_) {
-            extend_range(store.min_key_, store.max_key_);
+    BinItem collapsed_count(int start_idx, int end_idx) const {
+        if (index_outside_bounds(start_idx) || index_outside_bounds(end_idx)) {
+            throw std::invalid_argument("Indexes out of bounds");
         }
 
-        auto collapse_end_idx = store.max_key_ - store.offset_ + 1;
-        auto collapse_start_idx =
-            std::max(max_key_ + 1, store.min_key_) - store.offset_;
+        auto count = BinItem(0);
 
-        if (collapse_end_idx > collapse_start_idx) {
-             auto collapsed_count =
-                    bins_.collapsed_count(
-                        collapse_start_idx, collapse_end_idx);
-            bins_.last() += collapsed_count;
-        } else {
-            collapse_start_idx = collapse_end_idx;
-        }
+        for_each_page(
+            head_ + start_idx,
+            head_ + end_idx,
+            [this, &count](size_t page_idx, size_t start, size_t end) {
+                const auto page = pages_[page_idx];
 
-        for (auto key = store.min_key_;
-                 key < collapse_start_idx + store.offset_; ++key) {
-            bins_[key - offset_] += store.bins_[key - store.offset_];
-        }
+                if (page != nullptr) {
+                    count += sum_bin_range<BinItem>(
+                                 page->bins + start, end - start);
+                }
+            });
 
-        count_ += store.count_;
+        return count;
     }
 
- private:
-    Index get_new_length(Index new_min_key, Index new_max_key) override {
-        auto desired_length = new_max_key - new_min_key + 1;
-        Index num_chunks = std::ceil((1.0 * desired_length) / chunk_size_);
+    bool has_only_zeros() const {
+        for (size_t page_idx = 0; page_idx < pages_.size(); ++page_idx) {
+            if (!page_has_only_zeros(page_idx)) {
+                return false;
+            }
+        }
 
-        return std::min(chunk_size_ * num_chunks, bin_limit_);
+        return true;
     }
 
-    /* Calculate the bin index for the key, extending the range if necessary */
-    Index get_index(Index key) override {
-        if (key > max_key_) {
-            if (is_collapsed_) {
-                return length() - 1;
-            }
+    BinItem sum() const {
+        return collapsed_count(0, size_);
+    }
 
-            extend_range(key);
+    void initialize_with_zeros(size_t num_zeros) {
+        clear();
 
-            if (is_collapsed_) {
-                return length() - 1;
-            }
-        } else if (key < min_key_) {
-            extend_range(key);
+        pages_.assign(num_pages(num_zeros), nullptr);
+        size_ = num_zeros;
+    }
+
+    void extend_front_with_zeros(size_t count) {
+        if (count <= head_) {
+            clear_unused_bins(head_ - count, head_);
+            head_ -= count;
+        } else {
+            auto num_new_pages = num_pages(count - head_);
+
+            clear_unused_bins(0, head_);
+            pages_.insert(pages_.begin(), num_new_pages, nullptr);
+            head_ += num_new_pages * PageSize - count;
         }
 
-        return key - offset_;
+        size_ += count;
     }
 
-    /*
-     * Override. Adjust the bins, the offset, the min_key, and max_key, without
-     * resizing the bins, in order to try making it fit the specified range.
-     * Collapse to the left if necessary.
-     */
-    void adjust(Index new_min_key, Index new_max_key) override {
-        if (new_max_key - new_min_key + 1 > length()) {
-            /*
-             * The range of keys is too wide.
-             * The lowest bins need to be collapsed
-             */
-            new_max_key = new_min_key + length() - 1;
+    void extend_back_with_zeros(size_t count) {
+        clear_unused_bins(head_ + size_, head_ + size_ + count);
 
-            if (new_max_key <= min_key_) {
-                /* Put everything in the last bin */
-                offset_ = new_min_key;
-                max_key_ = new_max_key;
+        size_ += count;
+        pages_.resize(num_pages(head_ + size_), nullptr);
+    }
 
-                bins_ = BinList<RealValue>(length());
-                bins_.last() = count_;
-            } else {
-                auto shift = offset_ - new_min_key;
+    void remove_trailing_elements(size_t count) {
+        size_ -= count;
 
-                if (shift > 0) {
-                    auto collapse_start_index = new_max_key - offset_ + 1;
-                    auto collapse_end_index = max_key_ - offset_ + 1;
+        if (size_ == 0) {
+            clear();
+            return;
+        }
 
-                    auto collapsed_count =
-                        bins_.collapsed_count(
-                            collapse_start_index, collapse_end_index);
+        auto num_used_pages = num_pages(head_ + size_);
 
-                    bins_.replace_range_with_zeros(
-                        collapse_start_index,
-                        collapse_end_index,
-                        max_key_ - new_max_key);
+        release_pages(num_used_pages, pages_.size());
+        pages_.resize(num_used_pages);
+    }
 
-                    bins_[collapse_start_index - 1] += collapsed_count;
+    void remove_leading_elements(size_t count) {
+        size_ -= count;
 
-                    max_key_ = new_max_key;
+        if (size_ == 0) {
+            clear();
+            return;
+        }
 
-                    /* Shift the buckets to make room for new_max_key */
-                    shift_bins(shift);
-                } else {
-                    max_key_ = new_max_key;
+        auto num_unused_pages = (head_ + count) / PageSize;
 
-                    /* Shift the buckets to make room for new_min_key */
-                    shift_bins(shift);
-                }
-            }
+        release_pages(0, num_unused_pages);
+        pages_.erase(pages_.begin(), pages_.begin() + num_unused_pages);
+        head_ = (head_ + count) % PageSize;
+    }
 
-            min_key_ = new_min_key;
-            is_collapsed_ = true;
-        } else {
-            center_bins(new_min_key, new_max_key);
+    void replace_range_with_zeros(int start_idx,
+                                  int end_idx,
+                                  size_t num_zeros) {
+        size_t num_removed = end_idx - start_idx;
 
-            min_key_ = new_min_key;
-            max_key_ = new_max_key;
+        if (num_zeros > num_removed) {
+            auto num_added = num_zeros - num_removed;
+            auto num_moved = size_ - end_idx;
+
+            extend_back_with_zeros(num_added);
+            move_bins(end_idx, end_idx + num_added, num_moved);
+        } else if (num_zeros < num_removed) {
+            move_bins(end_idx, start_idx + num_zeros, size_ - end_idx);
+            remove_trailing_elements(num_removed - num_zeros);
         }
+
+        clear_bins(start_idx, start_idx + num_zeros);
     }
 
-    Index bin_limit_;    /* The maximum number of bins */
-    bool is_collapsed_;
-};
+    /*
+     * Add count bins of another list, from bins_idx on, to the bins from idx.
+     * The zero pages of the other list are skipped
+     */
+    void add_bins(int idx,
+                  const PagedBinList& bins,
+                  int bins_idx,
+                  size_t count) {
+        /* The kernel takes the bins as not aliased, e.g., by a self-merge */
+        if (&bins == this) {
+            add_bins(idx, PagedBinList(bins), bins_idx, count);
+            return;
+        }
 
-/*
- * Thrown when an argument is misspecified
- */
-class IllegalArgumentException : public std::exception {
- public:
-    const char* what() const noexcept override {
-        return message_.c_str();
-    }
+        auto bins_start = bins.head_ + bins_idx;
 
-    explicit IllegalArgumentException(const std::string& message)
-        : message_(message) {
-    }
+        bins.for_each_page(
+            bins_start,
+            bins_start + count,
+            [this, idx, &bins, bins_start](size_t page_idx,
+                                           size_t start,
+                                           size_t end) {
+                const auto page = bins.pages_[page_idx];
 
- private:
-    std::string message_;
-};
+                if (page == nullptr) {
+                    return;
+                }
 
-/*
- * Thrown when trying to merge two sketches with different
- * relative_accuracy parameters
- */
-class UnequalSketchParametersException : public std::exception {
- public:
-    const char* what() const noexcept override {
-        return "Cannot merge two DDSketches with different parameters";
+                auto first_idx = idx + page_idx * PageSize + start - bins_start;
+
+                add_page_bins(first_idx, page->bins + start, end - start);
+            });
     }
-};
 
-/*
- * A mapping between values and integer indices that imposes relative accuracy
- * guarantees. Specifically, for any value `minIndexableValue() < value <
- * maxIndexableValue` implementations of `KeyMapping` must be such that
- * `value(key(v))` is close to `v` with a relative error that is less than
- * `relative_accuracy`.
- *
- * In implementations of KeyMapping, there is generally a trade-off between the
- * cost of computing the key and the number of keys that are required to cover a
- * given range of values (memory optimality). The most memory-optimal mapping is
- * the LogarithmicMapping, but it requires the costly evaluation of the logarithm
- * when computing the index. Other mappings can approximate the logarithmic
- *mapping, while being less computationally costly.
- */
-class KeyMapping {
- public:
-    /*
-     * Args:
-     *       value
-     * Returns:
-     *       The key specifying the bucket for value
-     */
-    Index key(RealValue value) {
-        return static_cast<Index>(std::ceil(log_gamma(value)) + offset_);
+    /* Return the pages whose bins are all zeros to the pool */
+    void release_zero_pages() {
+        release_zero_pages(0, pages_.size());
     }
 
+ private:
     /*
-     * Args:
-     *       key
-     * Returns:
-     *       The value represented by the bucket specified by the key
+     * The bins are addressed by their position in the pages: the position of
+     * the first bin is head_, which is always within the first page
      */
-    RealValue value(Index key) {
-        return pow_gamma(key - offset_) * (2.0 / (1 + gamma_));
+    static size_t num_pages(size_t num_positions) {
+        return (num_positions + PageSize - 1) / PageSize;
     }
 
-    RealValue relative_accuracy() const {
-        return relative_accuracy_;
+    bool index_outside_bounds(size_t idx) const {
+        return idx > size();
     }
 
-    RealValue gamma() const {
-        return gamma_;
+    const_iterator iterator_at(size_t position) const {
+        return const_iterator(
+                   pages_.data() + position / PageSize, position % PageSize);
     }
 
-    RealValue min_possible() const {
-        return min_possible_;
+    /*
+     * Call visit(page_idx, start, end) for each page holding some of the
+     * positions in [start_position, end_position), with the range of the
+     * matching positions within the page
+     */
+    template <class Visit>
+    void for_each_page(size_t start_position,
+                       size_t end_position,
+                       Visit visit) const {
+        while (start_position < end_position) {
+            auto page_idx = start_position / PageSize;
+            auto start = start_position % PageSize;
+            auto end =
+                std::min(PageSize, start + end_position - start_position);
+
+            visit(page_idx, start, end);
+            start_position += end - start;
+        }
     }
 
-    RealValue max_possible() const {
-        return max_possible_;
-    }
+    /*
+     * Add count bins, from a single page of another list, to the bins from
+     * idx on, which may span two pages of this list
+     */
+    void add_page_bins(size_t idx, const BinItem* source, size_t count) {
+        while (count > 0) {
+            auto position = head_ + idx;
+            auto& page = pages_[position / PageSize];
+            auto slot = position % PageSize;
+            auto num_bins = std::min(count, PageSize - slot);
+
+            if (page == nullptr) {
+                page = Pool::acquire();
+            }
 
-    RealValue multiplier() const {
-        return multiplier_;
-    }
+            add_bin_range(page->bins + slot, source, num_bins);
 
-    RealValue& multiplier() {
-        return multiplier_;
+            idx += num_bins;
+            source += num_bins;
+            count -= num_bins;
+        }
     }
 
- protected:
-    explicit KeyMapping(RealValue relative_accuracy,
-                        RealValue offset = 0.0) {
-        if (relative_accuracy <= 0.0 || relative_accuracy >= 1.0) {
-            throw IllegalArgumentException(
-                "Relative accuracy must be between 0 and 1");
+    bool page_has_only_zeros(size_t page_idx) const {
+        const auto page = pages_[page_idx];
+
+        if (page == nullptr) {
+            return true;
         }
 
-        relative_accuracy_ = relative_accuracy;
-        offset_ = offset;
+        auto start = page_idx == 0 ? head_ : 0;
+        auto end = std::min(PageSize, head_ + size_ - page_idx * PageSize);
 
-        auto gamma_mantissa = 2 * relative_accuracy / (1 - relative_accuracy);
+        return is_zero_bin_range(page->bins + start, end - start);
+    }
 
-        gamma_ = 1.0 + gamma_mantissa;
-        multiplier_ = 1.0 / std::log1p(gamma_mantissa);
+    /* Zero the unused positions about to hold bins, in the allocated pages */
+    void clear_unused_bins(size_t start_position, size_t end_position) {
+        end_position = std::min(end_position, pages_.size() * PageSize);
 
-        min_possible_ = std::numeric_limits<RealValue>::min() * gamma_;
-        max_possible_ = std::numeric_limits<RealValue>::max() / gamma_;
+        for_each_page(
+            start_position,
+            end_position,
+            [this](size_t page_idx, size_t start, size_t end) {
+                auto page = pages_[page_idx];
+
+                if (page != nullptr) {
+                    std::fill(page->bins + start, page->bins + end, BinItem(0));
+                }
+            });
     }
 
-    /* Return (an approximation of) the logarithm of the value base gamma */
-    virtual RealValue log_gamma(RealValue value) = 0;
+    /* Zero the bins in [start_idx, end_idx), releasing the emptied pages */
+    void clear_bins(size_t start_idx, size_t end_idx) {
+        for_each_page(
+            head_ + start_idx,
+            head_ + end_idx,
+            [this](size_t page_idx, size_t start, size_t end) {
+                auto page = pages_[page_idx];
 
-    /* Return (an approximation of) gamma to the power value */
-    virtual RealValue pow_gamma(RealValue value) = 0;
+                if (page != nullptr) {
+                    std::fill(page->bins + start, page->bins + end, BinItem(0));
+                }
+            });
 
- private:
-    static RealValue adjust_accuracy(RealValue relative_accuracy) {
-        if (relative_accuracy <= 0.0 || relative_accuracy >= 1.0) {
-            return kDefaultRelativeAccuracy;
+        if (start_idx < end_idx) {
+            release_zero_pages(
+                (head_ + start_idx) / PageSize,
+                num_pages(head_ + end_idx));
         }
-
-        return relative_accuracy;
     }
 
-    /*
-     * The accuracy guarantee.
-     * Referred to as alpha in the paper. (0. < alpha < 1.)
-     */
-    static constexpr auto kDefaultRelativeAccuracy = 0.01;
-    /*
-     * The accuracy guarantee.
-     * referred to as alpha in the paper (0. < alpha < 1.)
-     */
-    RealValue relative_accuracy_;
+    void release_zero_pages(size_t start_page_idx, size_t end_page_idx) {
+        for (auto page_idx = start_page_idx; page_idx < end_page_idx;
+                  ++page_idx) {
+            if (page_has_only_zeros(page_idx)) {
+                release_pages(page_idx, page_idx + 1);
+            }
+        }
+    }
 
-    /* An offset that can be used to shift all bin keys */
-    RealValue offset_;
+    /* Move count bins from from_idx to to_idx; the ranges may overlap */
+    void move_bins(size_t from_idx, size_t to_idx, size_t count) {
+        auto move_bin = [this](size_t from, size_t to) {
+            const auto& bins = *this;
+
+            if (bins[from] != 0 || pages_[(head_ + to) / PageSize] != nullptr) {
+                (*this)[to] = bins[from];
+            }
+        };
+
+        if (to_idx > from_idx) {
+            for (auto idx = count; idx > 0; --idx) {
+                move_bin(from_idx + idx - 1, to_idx + idx - 1);
+            }
+        } else {
+            for (size_t idx = 0; idx < count; ++idx) {
+                move_bin(from_idx + idx, to_idx + idx);
+            }
+        }
+    }
+
+    void copy_pages(const PagedBinList& bins) {
+        pages_.assign(bins.pages_.size(), nullptr);
+
+        try {
+            for (size_t page_idx = 0; page_idx < pages_.size(); ++page_idx) {
+                const auto page = bins.pages_[page_idx];
+
+                if (page != nullptr) {
+                    pages_[page_idx] = Pool::acquire();
+                    std::copy(page->bins,
+                              page->bins + PageSize,
+                              pages_[page_idx]->bins);
+                }
+            }
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    void release_pages(size_t start_page_idx, size_t end_page_idx) {
+        for (auto page_idx = start_page_idx; page_idx < end_page_idx;
+                  ++page_idx) {
+            if (pages_[page_idx] != nullptr) {
+                Pool::release(pages_[page_idx]);
+                pages_[page_idx] = nullptr;
+            }
+        }
+    }
+
+    void clear() {
+        release_pages(0, pages_.size());
+
+        pages_.clear();
+        head_ = 0;
+        size_ = 0;
+    }
+
+    std::vector<Page*> pages_;  /* The directory; nullptr for zero pages */
+    size_t head_;   /* The position of the first bin in the first page */
+    size_t size_;   /* The number of bins */
+};
+
+/*
+ * A list of bins with integer counters as narrow as the counts allow. The
+ * counters start as 16-bit integers, and the whole list is widened to 32-bit
+ * integers, then to doubles, the first time a bin is set to a count which
+ * does not fit, either because it is too large or not an integer. Widening
+ * is exact, so the counts are the same as with BinList<RealValue>.
+ *
+ * The counters are read and written through RealValue: operator[] returns
+ * a proxy on the bin, and the iterators are read-only and yield the bins by
+ * value.
+ *
+ * The counters of every width are obtained from the allocator, rebound to
+ * the type of the counters, cf. BinList.
+ */
+template <class Allocator = std::allocator<RealValue>>
+class BaseCompactBinList {
+    template <typename Counter>
+    using CounterBins = BinList<
+        Counter,
+        typename std::allocator_traits<Allocator>::template rebind_alloc<
+            Counter>>;
+
+ public:
+    /* The type of the counters, from the narrowest to the widest */
+    enum class Width : uint8_t {
+        kUInt16,
+        kUInt32,
+        kReal
+    };
+
+    using allocator_type = Allocator;
+    using value_type = RealValue;
+    using const_reference = RealValue;
+
+    class reference {
+     public:
+        reference(BaseCompactBinList* bins, size_t idx)
+            : bins_(bins),
+              idx_(idx) {
+        }
+
+        operator RealValue() const {
+            return bins_->get(idx_);
+        }
+
+        reference& operator=(RealValue count) {
+            bins_->set(idx_, count);
+            return *this;
+        }
+
+        reference& operator=(const reference& bin) {
+            return *this = RealValue(bin);
+        }
+
+        reference& operator+=(RealValue count) {
+            bins_->add(idx_, count);
+            return *this;
+        }
+
+     private:
+        BaseCompactBinList* bins_;
+        size_t idx_;
+    };
+
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = RealValue;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const RealValue*;
+        using reference = RealValue;
+
+        const_iterator(const BaseCompactBinList* bins, size_t idx)
+            : bins_(bins),
+              idx_(idx) {
+        }
+
+        RealValue operator*() const {
+            return bins_->get(idx_);
+        }
+
+        const_iterator& operator++() {
+            ++idx_;
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            auto iterator = *this;
+            ++idx_;
+
+            return iterator;
+        }
+
+        bool operator==(const const_iterator& other) const {
+            return idx_ == other.idx_;
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return idx_ != other.idx_;
+        }
+
+     private:
+        const BaseCompactBinList* bins_;
+        size_t idx_;
+    };
+
+    using iterator = const_iterator;
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, size());
+    }
+
+    BaseCompactBinList() : width_(Width::kUInt16) {
+    }
+
+    explicit BaseCompactBinList(const Allocator& allocator)
+        : uint16_bins_(allocator),
+          uint32_bins_(allocator),
+          real_bins_(allocator),
+          width_(Width::kUInt16) {
+    }
+
+    explicit BaseCompactBinList(size_t size,
+                                const Allocator& allocator = Allocator())
+        : BaseCompactBinList(allocator) {
+        initialize_with_zeros(size);
+    }
+
+    allocator_type get_allocator() const {
+        return real_bins_.get_allocator();
+    }
+
+    friend std::ostream& operator<<(std::ostream& os,
+                                    const BaseCompactBinList& bins) {
+        for (const auto elem : bins) {
+            os << elem << " ";
+        }
+
+        return os;
+    }
+
+    Width width() const {
+        return width_;
+    }
+
+    /* The number of bytes taken by each counter */
+    size_t counter_size() const {
+        return with_bins(
+                   [](const auto& bins) {
+                       return sizeof(typename std::decay_t<
+                                         decltype(bins)>::value_type);
+                   });
+    }
+
+    size_t size() const {
+        return with_bins(
+                   [](const auto& bins) {
+                       return bins.size();
+                   });
+    }
+
+    reference operator[] (int idx) {
+        return reference(this, idx);
+    }
+
+    const_reference operator[] (int idx) const {
+        return get(idx);
+    }
+
+    reference first() {
+        return reference(this, 0);
+    }
+
+    reference last() {
+        return reference(this, size() - 1);
+    }
+
+    void insert(RealValue elem) {
+        extend_back_with_zeros(1);
+        last() = elem;
+    }
+
+    RealValue collapsed_count(int start_idx, int end_idx) const {
+        if (index_outside_bounds(start_idx) || index_outside_bounds(end_idx)) {
+            throw std::invalid_argument("Indexes out of bounds");
+        }
+
+        /* Summed as doubles, since the sum may not fit in the counters */
+        return with_bins(
+                   [start_idx, end_idx](const auto& bins) {
+                       return end_idx > start_idx ?
+                                  sum_bin_range<RealValue>(
+                                      bins.begin() + start_idx,
+                                      end_idx - start_idx) :
+                                  RealValue(0);
+                   });
+    }
+
+    bool has_only_zeros() const {
+        return with_bins(
+                   [](const auto& bins) {
+                       return bins.has_only_zeros();
+                   });
+    }
+
+    RealValue sum() const {
+        return collapsed_count(0, size());
+    }
+
+    /* Also resets the counters to the narrowest width */
+    void initialize_with_zeros(size_t num_zeros) {
+        if (width_ != Width::kUInt16) {
+            uint32_bins_ = CounterBins<uint32_t>(get_allocator());
+            real_bins_ = CounterBins<RealValue>(get_allocator());
+            width_ = Width::kUInt16;
+        }
+
+        uint16_bins_.initialize_with_zeros(num_zeros);
+    }
+
+    void extend_front_with_zeros(size_t count) {
+        update_bins(
+            [count](auto& bins) {
+                bins.extend_front_with_zeros(count);
+            });
+    }
+
+    void extend_back_with_zeros(size_t count) {
+        update_bins(
+            [count](auto& bins) {
+                bins.extend_back_with_zeros(count);
+            });
+    }
+
+    void remove_trailing_elements(size_t count) {
+        update_bins(
+            [count](auto& bins) {
+                bins.remove_trailing_elements(count);
+            });
+    }
+
+    void remove_leading_elements(size_t count) {
+        update_bins(
+            [count](auto& bins) {
+                bins.remove_leading_elements(count);
+            });
+    }
+
+    void replace_range_with_zeros(int start_idx,
+                                  int end_idx,
+                                  size_t num_zeros) {
+        update_bins(
+            [start_idx, end_idx, num_zeros](auto& bins) {
+                bins.replace_range_with_zeros(start_idx, end_idx, num_zeros);
+            });
+    }
 
     /*
-     * The base for the exponential buckets.
-     * gamma = (1 + alpha) / (1 - alpha)
+     * Add count bins of another list, from bins_idx on, to the bins from idx.
+     * The bins are added with the kernel when both lists have the same width
+     * and the sums fit in it; otherwise, one by one, widening the counters
+     * as needed
      */
-    RealValue gamma_;
+    void add_bins(int idx,
+                  const BaseCompactBinList& bins,
+                  int bins_idx,
+                  size_t count) {
+        if (count == 0) {
+            return;
+        }
 
-    /* The smallest value the sketch can distinguish from 0 */
-    RealValue min_possible_;
+        if (bins.width_ == width_) {
+            auto added = update_bins(
+                [this, idx, &bins, bins_idx, count](auto& counter_bins) {
+                    const auto& other_bins =
+                        bins.same_width_bins(counter_bins);
 
-    /* The largest value the sketch can handle */
-    RealValue max_possible_;
+                    if (!sums_fit(counter_bins.begin() + idx,
+                                  other_bins.begin() + bins_idx, count)) {
+                        return false;
+                    }
+
+                    counter_bins.add_bins(idx, other_bins, bins_idx, count);
+                    return true;
+                });
+
+            if (added) {
+                return;
+            }
+        }
+
+        for (size_t pos = 0; pos < count; ++pos) {
+            auto bin_ct = bins.get(bins_idx + pos);
+
+            if (bin_ct != 0) {
+                add(idx + pos, bin_ct);
+            }
+        }
+    }
+
+ private:
+    /* Call visit on the bins of the current width */
+    template <class Visit>
+    auto with_bins(Visit visit) const
+        -> decltype(visit(std::declval<const CounterBins<uint16_t>&>())) {
+        switch (width_) {
+        case Width::kUInt16:
+            return visit(uint16_bins_);
+        case Width::kUInt32:
+            return visit(uint32_bins_);
+        default:
+            return visit(real_bins_);
+        }
+    }
+
+    /* Same as above, for updating the bins */
+    template <class Visit>
+    auto update_bins(Visit visit)
+        -> decltype(visit(std::declval<CounterBins<uint16_t>&>())) {
+        switch (width_) {
+        case Width::kUInt16:
+            return visit(uint16_bins_);
+        case Width::kUInt32:
+            return visit(uint32_bins_);
+        default:
+            return visit(real_bins_);
+        }
+    }
+
+    /* The bins of this list with the type of the counters of bins */
+    template <typename Counter>
+    const CounterBins<Counter>& same_width_bins(
+            const CounterBins<Counter>& /* bins */) const {
+        return bins_of(Counter());
+    }
+
+    const CounterBins<uint16_t>& bins_of(uint16_t) const {
+        return uint16_bins_;
+    }
+
+    const CounterBins<uint32_t>& bins_of(uint32_t) const {
+        return uint32_bins_;
+    }
+
+    const CounterBins<RealValue>& bins_of(RealValue) const {
+        return real_bins_;
+    }
 
     /*
-     * Used for calculating log_gamma(value).
-     * Initially multiplier = 1 / log(gamma)
+     * Whether count bins can be added to as many integer counters without
+     * overflowing them, from their highest values
      */
-    RealValue multiplier_;
+    template <typename Counter>
+    static bool sums_fit(const Counter* bins,
+                         const Counter* other_bins,
+                         size_t count) {
+        return std::is_floating_point<Counter>::value ||
+               static_cast<uint64_t>(*std::max_element(bins, bins + count)) +
+                       static_cast<uint64_t>(*std::max_element(
+                           other_bins, other_bins + count)) <=
+                   std::numeric_limits<Counter>::max();
+    }
+
+    /* The narrowest width which holds the count exactly */
+    static Width width_of(RealValue count) {
+        if (count >= 0 && count == std::floor(count)) {
+            if (count <= std::numeric_limits<uint16_t>::max()) {
+                return Width::kUInt16;
+            }
+
+            if (count <= std::numeric_limits<uint32_t>::max()) {
+                return Width::kUInt32;
+            }
+        }
+
+        return Width::kReal;
+    }
+
+    bool index_outside_bounds(size_t idx) const {
+        return idx > size();
+    }
+
+    RealValue get(size_t idx) const {
+        return with_bins(
+                   [idx](const auto& bins) {
+                       return RealValue(bins[idx]);
+                   });
+    }
+
+    void add(size_t idx, RealValue count) {
+        switch (width_) {
+        case Width::kUInt16:
+            if (add_in_place(uint16_bins_[idx], count)) {
+                return;
+            }
+            break;
+        case Width::kUInt32:
+            if (add_in_place(uint32_bins_[idx], count)) {
+                return;
+            }
+            break;
+        default:
+            real_bins_[idx] += count;
+            return;
+        }
+
+        /* The sum does not fit in the counter */
+        set(idx, get(idx) + count);
+    }
+
+    /* Add the count to the counter, if the sum still fits in it exactly */
+    template <typename Counter>
+    static bool add_in_place(Counter& counter, RealValue count) {
+        auto sum = counter + count;
+
+        if (sum < 0 || sum > std::numeric_limits<Counter>::max()) {
+            return false;
+        }
+
+        auto integer_sum = static_cast<Counter>(sum);
+
+        if (integer_sum != sum) {
+            return false;
+        }
+
+        counter = integer_sum;
+
+        return true;
+    }
+
+    void set(size_t idx, RealValue count) {
+        auto count_width = width_of(count);
+
+        if (count_width > width_) {
+            widen(count_width);
+        }
+
+        update_bins(
+            [idx, count](auto& bins) {
+                using Counter =
+                    typename std::decay_t<decltype(bins)>::value_type;
+
+                bins[idx] = static_cast<Counter>(count);
+            });
+    }
+
+    void widen(Width width) {
+        if (width == Width::kUInt32) {
+            uint32_bins_ = widened<uint32_t>(uint16_bins_);
+            uint16_bins_ = CounterBins<uint16_t>(get_allocator());
+        } else if (width_ == Width::kUInt16) {
+            real_bins_ = widened<RealValue>(uint16_bins_);
+            uint16_bins_ = CounterBins<uint16_t>(get_allocator());
+        } else {
+            real_bins_ = widened<RealValue>(uint32_bins_);
+            uint32_bins_ = CounterBins<uint32_t>(get_allocator());
+        }
+
+        width_ = width;
+    }
+
+    template <typename Counter, typename Bins>
+    CounterBins<Counter> widened(const Bins& bins) const {
+        CounterBins<Counter> widened_bins(bins.size(), get_allocator());
+
+        std::copy(bins.begin(), bins.end(), widened_bins.begin());
+
+        return widened_bins;
+    }
+
+    /* Only the bins of the current width are used; the others are empty */
+    CounterBins<uint16_t> uint16_bins_;
+    CounterBins<uint32_t> uint32_bins_;
+    CounterBins<RealValue> real_bins_;
+    Width width_;
 };
 
+using CompactBinList = BaseCompactBinList<>;
+
 /*
- * A memory-optimal KeyMapping, i.e, given a targeted relative accuracy,
- * it requires the least number of keys to cover a given range of values.
- * This is done by logarithmically mapping floating-point values to integers.
+ * Thrown when a sketch cannot be serialized into a buffer, or deserialized
+ * from one
  */
-class LogarithmicMapping : public KeyMapping {
+class SerializationException : public std::exception {
  public:
-    explicit LogarithmicMapping(RealValue relative_accuracy,
-                                RealValue offset = 0.0) :
-        KeyMapping(relative_accuracy, offset) {
-        multiplier() *= std::log(2.0);
+    const char* what() const noexcept override {
+        return message_.c_str();
+    }
+
+    explicit SerializationException(const std::string& message)
+        : message_(message) {
     }
 
  private:
-    RealValue log_gamma(RealValue value) override {
-        return std::log2(value) * multiplier();
+    std::string message_;
+};
+
+/* The wire types of the protocol buffers encoding */
+enum class WireType : uint8_t {
+    kVarint = 0,
+    kFixed64 = 1,
+    kLengthDelimited = 2,
+    kFixed32 = 5
+};
+
+/*
+ * Writes fields in the protocol buffers wire format into a buffer owned by
+ * the caller, without allocating. The buffer is expected to be large enough
+ * for the fields, which the serialized_size methods give
+ */
+class ProtoWriter {
+ public:
+    ProtoWriter(uint8_t* buffer, size_t size)
+        : begin_(buffer),
+          position_(buffer),
+          end_(buffer + size) {
     }
 
-    RealValue pow_gamma(RealValue value) override {
-        return std::exp2(value / multiplier());
+    /* The number of bytes written so far */
+    size_t size() const {
+        return position_ - begin_;
+    }
+
+    void write_tag(int field, WireType wire_type) {
+        write_varint((field << kWireTypeBits) |
+                     static_cast<uint64_t>(wire_type));
+    }
+
+    void write_varint(uint64_t value) {
+        reserve(varint_size(value));
+
+        while (value >= kVarintContinuation) {
+            *position_++ =
+                static_cast<uint8_t>(value | kVarintContinuation);
+            value >>= kVarintPayloadBits;
+        }
+
+        *position_++ = static_cast<uint8_t>(value);
+    }
+
+    void write_sint32(Index value) {
+        write_varint(zigzag(value));
+    }
+
+    /* A double, as a little-endian fixed64 */
+    void write_double(RealValue value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+
+        reserve(sizeof(bits));
+
+        for (size_t byte = 0; byte < sizeof(bits); ++byte) {
+            *position_++ = static_cast<uint8_t>(bits >> (8 * byte));
+        }
+    }
+
+    static size_t varint_size(uint64_t value) {
+        size_t size = 1;
+
+        while (value >= kVarintContinuation) {
+            value >>= kVarintPayloadBits;
+            ++size;
+        }
+
+        return size;
+    }
+
+    static size_t sint32_size(Index value) {
+        return varint_size(zigzag(value));
+    }
+
+    /* The size of a tag, for the field numbers used by the sketches */
+    static constexpr size_t kTagSize = 1;
+
+ private:
+    /* The zigzag encoding of a sint32, which keys must fit in */
+    static uint64_t zigzag(Index value) {
+        if (value < std::numeric_limits<int32_t>::min() ||
+            value > std::numeric_limits<int32_t>::max()) {
+            throw SerializationException(
+                "Key out of the range of the wire format");
+        }
+
+        auto value32 = static_cast<int32_t>(value);
+
+        return (static_cast<uint32_t>(value32) << 1) ^
+               static_cast<uint32_t>(value32 >> 31);
+    }
+
+    void reserve(size_t size) {
+        if (static_cast<size_t>(end_ - position_) < size) {
+            throw SerializationException("The buffer is too small");
+        }
+    }
+
+    static constexpr int kWireTypeBits = 3;
+    static constexpr int kVarintPayloadBits = 7;
+    static constexpr uint64_t kVarintContinuation = 0x80;
+
+    uint8_t* begin_;
+    uint8_t* position_;
+    uint8_t* end_;
+};
+
+/*
+ * Reads fields in the protocol buffers wire format from a buffer owned by
+ * the caller, without copying it. Nested messages are read by sub-readers
+ * over their part of the buffer
+ */
+class ProtoReader {
+ public:
+    ProtoReader(const uint8_t* buffer, size_t size)
+        : position_(buffer),
+          end_(buffer + size) {
+    }
+
+    bool at_end() const {
+        return position_ == end_;
+    }
+
+    /* Read the tag of the next field */
+    void read_tag(int& field, WireType& wire_type) {
+        auto tag = read_varint();
+
+        field = static_cast<int>(tag >> kWireTypeBits);
+        wire_type = static_cast<WireType>(tag & kWireTypeMask);
+
+        if (field == 0) {
+            throw SerializationException("Invalid field number");
+        }
+    }
+
+    uint64_t read_varint() {
+        uint64_t value = 0;
+
+        for (int shift = 0; shift < kMaxVarintBits;
+                 shift += kVarintPayloadBits) {
+            require(1);
+
+            auto byte = *position_++;
+            value |= static_cast<uint64_t>(byte & kVarintPayloadMask) << shift;
+
+            if (!(byte & kVarintContinuation)) {
+                return value;
+            }
+        }
+
+        throw SerializationException("Invalid varint");
+    }
+
+    Index read_sint32() {
+        auto value = static_cast<uint32_t>(read_varint());
+
+        return static_cast<int32_t>((value >> 1) ^ (0u - (value & 1)));
+    }
+
+    /* A double, from a little-endian fixed64 */
+    RealValue read_double() {
+        require(sizeof(uint64_t));
+
+        uint64_t bits = 0;
+
+        for (size_t byte = 0; byte < sizeof(bits); ++byte) {
+            bits |= static_cast<uint64_t>(*position_++) << (8 * byte);
+        }
+
+        RealValue value;
+        std::memcpy(&value, &bits, sizeof(value));
+
+        return value;
+    }
+
+    /* A reader over the next length-delimited field */
+    ProtoReader read_message() {
+        auto size = read_varint();
+
+        require(size);
+
+        auto message = ProtoReader(position_, size);
+        position_ += size;
+
+        return message;
+    }
+
+    /* Skip the value of a field that is not read */
+    void skip(WireType wire_type) {
+        switch (wire_type) {
+            case WireType::kVarint:
+                read_varint();
+                break;
+            case WireType::kFixed64:
+                require(sizeof(uint64_t));
+                position_ += sizeof(uint64_t);
+                break;
+            case WireType::kLengthDelimited:
+                read_message();
+                break;
+            case WireType::kFixed32:
+                require(sizeof(uint32_t));
+                position_ += sizeof(uint32_t);
+                break;
+            default:
+                throw SerializationException("Unsupported wire type");
+        }
+    }
+
+    /* Check the wire type of a known field */
+    static void expect(WireType wire_type, WireType expected_wire_type) {
+        if (wire_type != expected_wire_type) {
+            throw SerializationException("Unexpected wire type");
+        }
+    }
+
+ private:
+    void require(uint64_t size) const {
+        if (static_cast<uint64_t>(end_ - position_) < size) {
+            throw SerializationException("The buffer is truncated");
+        }
+    }
+
+    static constexpr int kWireTypeBits = 3;
+    static constexpr uint64_t kWireTypeMask = 0x07;
+    static constexpr int kVarintPayloadBits = 7;
+    static constexpr int kMaxVarintBits = 64;
+    static constexpr uint8_t kVarintPayloadMask = 0x7f;
+    static constexpr uint8_t kVarintContinuation = 0x80;
+
+    const uint8_t* position_;
+    const uint8_t* end_;
+};
+
+/*
+ * The Store message of the DDSketch protobuf format, which holds bin counts
+ * as a map from keys to counts and/or as contiguous counts with the key of
+ * the first one
+ */
+class StoreProto {
+ public:
+    /* The field numbers of the Store message */
+    static constexpr int kBinCountsField = 1;
+    static constexpr int kContiguousBinCountsField = 2;
+    static constexpr int kContiguousBinIndexOffsetField = 3;
+
+    /* The field numbers of the entries of the binCounts map */
+    static constexpr int kBinCountsKeyField = 1;
+    static constexpr int kBinCountsValueField = 2;
+
+    /* The size of an entry of the binCounts map, including its tag */
+    static size_t bin_count_size(Index key) {
+        auto entry_size = entry_content_size(key);
+
+        return ProtoWriter::kTagSize +
+               ProtoWriter::varint_size(entry_size) +
+               entry_size;
+    }
+
+    /* Write an entry of the binCounts map */
+    static void write_bin_count(ProtoWriter& writer,
+                                Index key,
+                                RealValue bin_ct) {
+        writer.write_tag(kBinCountsField, WireType::kLengthDelimited);
+        writer.write_varint(entry_content_size(key));
+        writer.write_tag(kBinCountsKeyField, WireType::kVarint);
+        writer.write_sint32(key);
+        writer.write_tag(kBinCountsValueField, WireType::kFixed64);
+        writer.write_double(bin_ct);
+    }
+
+    /*
+     * Call visit(key, count) for each non-empty bin of a Store message,
+     * whether in the binCounts map or in the contiguous counts, packed or
+     * not. Throws SerializationException on invalid counts
+     */
+    template <class Visit>
+    static void for_each_bin(const ProtoReader& reader, Visit visit) {
+        auto visit_bin = [&visit](Index key, RealValue bin_ct) {
+            if (!(bin_ct >= 0) || std::isinf(bin_ct)) {
+                throw SerializationException("Invalid bin count");
+            }
+
+            if (bin_ct != 0) {
+                visit(key, bin_ct);
+            }
+        };
+
+        auto contiguous_key = contiguous_bin_index_offset(reader);
+
+        for_each_field(
+            reader,
+            [&visit_bin, &contiguous_key](int field,
+                                          WireType wire_type,
+                                          ProtoReader& field_reader) {
+                if (field == kBinCountsField) {
+                    ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+                    read_bin_count(field_reader.read_message(), visit_bin);
+                } else if (field == kContiguousBinCountsField) {
+                    /* The counts may be packed or not */
+                    if (wire_type == WireType::kFixed64) {
+                        visit_bin(contiguous_key++, field_reader.read_double());
+                        return true;
+                    }
+
+                    ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+
+                    auto counts_reader = field_reader.read_message();
+
+                    while (!counts_reader.at_end()) {
+                        visit_bin(contiguous_key++,
+                                  counts_reader.read_double());
+                    }
+                } else {
+                    return false;
+                }
+
+                return true;
+            });
+    }
+
+ private:
+    static size_t entry_content_size(Index key) {
+        return ProtoWriter::kTagSize + ProtoWriter::sint32_size(key) +
+               ProtoWriter::kTagSize + sizeof(RealValue);
+    }
+
+    /*
+     * Call visit(field, wire_type, reader) for each field of the message;
+     * the fields for which visit returns false are skipped
+     */
+    template <class Visit>
+    static void for_each_field(ProtoReader reader, Visit visit) {
+        while (!reader.at_end()) {
+            int field;
+            WireType wire_type;
+
+            reader.read_tag(field, wire_type);
+
+            if (!visit(field, wire_type, reader)) {
+                reader.skip(wire_type);
+            }
+        }
+    }
+
+    /* The offset may follow the contiguous counts it applies to */
+    static Index contiguous_bin_index_offset(const ProtoReader& reader) {
+        Index offset = 0;
+
+        for_each_field(
+            reader,
+            [&offset](int field,
+                      WireType wire_type,
+                      ProtoReader& field_reader) {
+                if (field != kContiguousBinIndexOffsetField) {
+                    return false;
+                }
+
+                ProtoReader::expect(wire_type, WireType::kVarint);
+                offset = field_reader.read_sint32();
+
+                return true;
+            });
+
+        return offset;
+    }
+
+    template <class Visit>
+    static void read_bin_count(ProtoReader reader, Visit visit) {
+        Index key = 0;
+        RealValue bin_ct = 0;
+
+        for_each_field(
+            reader,
+            [&key, &bin_ct](int field,
+                            WireType wire_type,
+                            ProtoReader& entry_reader) {
+                if (field == kBinCountsKeyField) {
+                    ProtoReader::expect(wire_type, WireType::kVarint);
+                    key = entry_reader.read_sint32();
+                } else if (field == kBinCountsValueField) {
+                    ProtoReader::expect(wire_type, WireType::kFixed64);
+                    bin_ct = entry_reader.read_double();
+                } else {
+                    return false;
+                }
+
+                return true;
+            });
+
+        visit(key, bin_ct);
+    }
+};
+
+template <typename T>
+struct CRTP {
+    T& underlying() {
+        return static_cast<T&>(*this);
+    }
+
+    T const& underlying() const {
+        return static_cast<T const&>(*this);
+    }
+};
+
+/* The basic specification of a store */
+template <class ConcreteStore>
+class BaseStore : CRTP<ConcreteStore> {
+    friend struct CRTP<ConcreteStore>;
+
+ public:
+    /* Copy the input store into this one */
+    void copy(const ConcreteStore &store) {
+        this->underlying().copy(store);
+    }
+
+    /* The number of bins */
+    Index length() {
+        return this->underlying().length();
+    }
+
+    bool is_empty() {
+        return this->underlying().is_empty();
+    }
+
+    /*
+     * Updates the counter at the specified index key,
+     * growing the number of bins if necessary.
+     */
+    void add(Index key, RealValue weight) {
+        this->underlying().add(key, weight);
+    }
+
+    void add(Index key) {
+        this->underlying().add(key, 1.0);
+    }
+
+    /*
+     * Return the key for the value at given rank
+     *
+     *  E.g., if the non-zero bins are [1, 1] for keys a, b with no offset
+     *
+     *  if (lower == true) {
+     *       key_at_rank(x) = a for x in [0, 1)
+     *       key_at_rank(x) = b for x in [1, 2)
+     *  }
+     *  if (lower == false) {
+     *       key_at_rank(x) = a for x in (-1, 0]
+     *       key_at_rank(x) = b for x in (0, 1]
+     *  }
+     */
+    Index key_at_rank(RealValue rank, bool lower = false) const {
+        return this->underlying().key_at_rank(rank, lower);
+    }
+
+    /* The sum of the counts of the bins up to the key, included */
+    RealValue count_up_to(Index key) const {
+        return this->underlying().count_up_to(key);
+    }
+
+    /*
+     * Merge another store into this one. This should be equivalent as running the
+     * add operations that have been run on the other store on this one.
+     */
+    void merge(const ConcreteStore& store) {
+        return this->underlying().merge(store);
+    }
+
+    /* Merge several stores into this one, cf. merge */
+    void merge_all(const ConcreteStore* const* stores, size_t num_stores) {
+        return this->underlying().merge_all(stores, num_stores);
+    }
+
+    /*
+     * Subtract another store from this one. This should be equivalent as
+     * undoing, on this store, the add operations that have been run on the
+     * other store, which must all have been run on this one as well.
+     */
+    void subtract(const ConcreteStore& store) {
+        return this->underlying().subtract(store);
+    }
+
+    /* Whether subtract would accept the other store */
+    bool holds(const ConcreteStore& store) const {
+        return this->underlying().holds(store);
+    }
+
+    /*
+     * Allocate the bins for the keys in [min_key, max_key] ahead of the
+     * values, so that adding them does not grow the store
+     */
+    void reserve(Index min_key, Index max_key) {
+        this->underlying().reserve(min_key, max_key);
+    }
+
+    /* Release the memory that the bins do not use */
+    void shrink_to_fit() {
+        this->underlying().shrink_to_fit();
+    }
+
+ protected:
+     BaseStore() = default;
+    ~BaseStore() = default;
+
+    BaseStore(const BaseStore& store) = default;
+    BaseStore(BaseStore&& store) noexcept = default;
+
+    BaseStore& operator=(const BaseStore& store) = default;
+    BaseStore& operator=(BaseStore&& store) noexcept = default;
+};
+
+/* The keys from min_key to max_key, included */
+struct KeyRange {
+    Index min_key;
+    Index max_key;
+};
+
+/*
+ * The stats policy of the dense stores which keep no stats. Its hooks are
+ * empty, so that the compiler removes them along with their arguments.
+ *
+ * A stats policy is called by the store it is a base of:
+ *   - record_add, for each key added, with the key of the bin it went to,
+ *     which differs from the key when the key was collapsed
+ *   - record_range_extension, each time the range of keys is extended
+ *   - record_shift, each time the bins are shifted, by a number of bins
+ *   - record_allocation, each time the bins are grown, by a number of bytes
+ *   - record_collapse, each time the range of keys is narrowed by a
+ *     collapse, or the bins of a merged store are collapsed, with the
+ *     weight moved to the boundary bin
+ *
+ * Passing CountingStoreStats instead, e.g., as InstrumentedDenseStore does,
+ * counts these events, as read through stats().
+ */
+class NoStoreStats {
+ public:
+    void record_add(Index /* key */,
+                    Index /* bin_key */,
+                    RealValue /* weight */) {
+    }
+
+    void record_range_extension() {
+    }
+
+    void record_shift(Index /* num_bins */) {
+    }
+
+    void record_allocation(size_t /* num_bytes */) {
+    }
+
+    void record_collapse(RealValue /* weight */) {
+    }
+};
+
+/*
+ * A stats policy which counts the events of a dense store, e.g., to size
+ * its bin_limit and its chunk_size from the data. The counts are those of
+ * the store object, and are neither copied nor merged along with its bins
+ */
+class CountingStoreStats {
+ public:
+    /* The number of keys added */
+    uint64_t num_adds() const {
+        return num_adds_;
+    }
+
+    uint64_t num_range_extensions() const {
+        return num_range_extensions_;
+    }
+
+    /* The number of times the bins were shifted, and the bins shifted */
+    uint64_t num_shifts() const {
+        return num_shifts_;
+    }
+
+    uint64_t num_bins_shifted() const {
+        return num_bins_shifted_;
+    }
+
+    /* The bytes that the bins were grown by, not counting copies */
+    uint64_t num_bytes_allocated() const {
+        return num_bytes_allocated_;
+    }
+
+    /* The number of collapses of the range, or of a merged store */
+    uint64_t num_collapses() const {
+        return num_collapses_;
+    }
+
+    /* The weight added to another bin than the one of its key */
+    RealValue collapsed_weight() const {
+        return collapsed_weight_;
+    }
+
+    void record_add(Index key, Index bin_key, RealValue weight) {
+        ++num_adds_;
+
+        if (bin_key != key) {
+            collapsed_weight_ += weight;
+        }
+    }
+
+    void record_range_extension() {
+        ++num_range_extensions_;
+    }
+
+    void record_shift(Index num_bins) {
+        if (num_bins != 0) {
+            ++num_shifts_;
+            num_bins_shifted_ += static_cast<uint64_t>(std::abs(num_bins));
+        }
+    }
+
+    void record_allocation(size_t num_bytes) {
+        num_bytes_allocated_ += num_bytes;
+    }
+
+    void record_collapse(RealValue weight) {
+        ++num_collapses_;
+        collapsed_weight_ += weight;
+    }
+
+ private:
+    uint64_t num_adds_ = 0;
+    uint64_t num_range_extensions_ = 0;
+    uint64_t num_shifts_ = 0;
+    uint64_t num_bins_shifted_ = 0;
+    uint64_t num_bytes_allocated_ = 0;
+    uint64_t num_collapses_ = 0;
+    RealValue collapsed_weight_ = 0.0;
+};
+
+/*
+ * A dense store that keeps all the bins between the bin for the min_key
+ * and the bin for the max_key.
+ *
+ * The bins are held in a BinList of doubles by default. When all the weights
+ * are integers, CompactBinList, or a BinList of integer counters, holds
+ * them in less memory; count() remains a double in every case.
+ */
+template <class ConcreteStore = void,
+          class Bins = BinList<RealValue>,
+          class Stats = NoStoreStats>
+class BaseDenseStore
+    : public BaseStore<
+          std::conditional_t<std::is_void<ConcreteStore>::value,
+                             BaseDenseStore<ConcreteStore, Bins, Stats>,
+                             ConcreteStore>>,
+      private Stats {
+    /*
+     * The most derived store. The hooks get_index, adjust and get_new_length
+     * are resolved on it at compile time, so that they can be inlined
+     */
+    using DerivedStore =
+        std::conditional_t<std::is_void<ConcreteStore>::value,
+                           BaseDenseStore,
+                           ConcreteStore>;
+
+ public:
+    using allocator_type = typename Bins::allocator_type;
+
+    explicit BaseDenseStore(Index chunk_size = kChunkSize)
+    : BaseDenseStore(allocator_type(), chunk_size) {
+    }
+
+    /* A store whose bins are obtained from the allocator, e.g., an arena */
+    explicit BaseDenseStore(const allocator_type& allocator,
+                            Index chunk_size = kChunkSize)
+    : count_(0),
+      min_key_(std::numeric_limits<Index>::max()),
+      max_key_(std::numeric_limits<Index>::min()),
+      chunk_size_(chunk_size),
+      offset_(0),
+      bins_(allocator),
+      rank_index_enabled_(false),
+      rank_index_dirty_(true) {
+    }
+
+    allocator_type get_allocator() const {
+        return bins_.get_allocator();
+    }
+
+    /* A store whose bins are allocated for the expected keys, cf. reserve */
+    explicit BaseDenseStore(const KeyRange& expected_keys,
+                            Index chunk_size = kChunkSize)
+    : BaseDenseStore(chunk_size) {
+        reserve(expected_keys.min_key, expected_keys.max_key);
+    }
+
+    std::string to_string() const {
+        std::ostringstream repr;
+
+        repr <<  "{";
+
+        Index i = 0;
+
+        for (const auto& sbin : bins_) {
+            repr << i++ + offset_ << ": " << sbin << ", ";
+        }
+
+        repr << "}, ";
+
+        repr << "min_key:" << min_key_
+             << ", max_key:" << max_key_
+             << ", offset:" << offset_;
+
+        return repr.str();
+    }
+
+    void copy(const BaseDenseStore& store) {
+        count_ = store.count_;
+        min_key_ = store.min_key_;
+        max_key_ = store.max_key_;
+        offset_ = store.offset_;
+        bins_ = store.bins_;
+
+        invalidate_rank_index();
+    }
+
+    const Bins& bins() const {
+        return bins_;
+    }
+
+    /* The stats recorded by the Stats policy, empty for NoStoreStats */
+    const Stats& stats() const {
+        return *this;
+    }
+
+    Index offset() const {
+        return offset_;
+    }
+
+    RealValue count() const {
+        return count_;
+    }
+
+    Index length() const {
+        return bins_.size();
+    }
+
+    /* Whether the store holds no values, though it may hold zero bins */
+    bool is_empty() const {
+        return count_ == 0;
+    }
+
+    /*
+     * Opt in to the cumulative count index used by key_at_rank and
+     * key_at_ranks. The index is rebuilt lazily, by the first query following
+     * an update, after which each rank is found by a binary search over the
+     * bins instead of a linear scan. This pays off when the store is queried
+     * much more often than it is updated. Queries update the index, so
+     * concurrent queries on the same store need external synchronization
+     */
+    void enable_rank_index(bool enabled = true) {
+        rank_index_enabled_ = enabled;
+
+        if (!enabled) {
+            rank_index_.clear();
+            rank_index_.shrink_to_fit();
+        }
+
+        invalidate_rank_index();
+    }
+
+    bool has_rank_index() const {
+        return rank_index_enabled_;
+    }
+
+    void add(Index key, RealValue weight = 1.0) {
+        Index idx = derived().get_index(key);
+
+        bins_[idx] += weight;
+        count_ += weight;
+
+        recorded_stats().record_add(key, idx + offset_, weight);
+
+        invalidate_rank_index();
+    }
+
+    /*
+     * Updates the counters for a batch of keys, with unit weights.
+     * The range is extended at most once, to cover the smallest and the
+     * largest key of the batch, after which the keys are added without
+     * any further range check.
+     */
+    void add_batch(const Index* keys, size_t count) {
+        if (count == 0) {
+            return;
+        }
+
+        extend_range_for_batch(keys, count);
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            auto bin_idx = derived().get_clamped_index(keys[idx]);
+
+            bins_[bin_idx] += 1.0;
+            recorded_stats().record_add(keys[idx], bin_idx + offset_, 1.0);
+        }
+
+        count_ += count;
+
+        invalidate_rank_index();
+    }
+
+    /* Same as above, with a weight for each key */
+    void add_batch(const Index* keys, const RealValue* weights, size_t count) {
+        if (count == 0) {
+            return;
+        }
+
+        extend_range_for_batch(keys, count);
+
+        auto total_weight = 0.0;
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            auto bin_idx = derived().get_clamped_index(keys[idx]);
+
+            bins_[bin_idx] += weights[idx];
+            total_weight += weights[idx];
+
+            recorded_stats().record_add(
+                keys[idx], bin_idx + offset_, weights[idx]);
+        }
+
+        count_ += total_weight;
+
+        invalidate_rank_index();
+    }
+
+    Index key_at_rank(RealValue rank, bool lower = true) const {
+        if (rank_index_enabled_) {
+            const auto& cumulative_counts = rank_index();
+
+            return indexed_key_at_rank(
+                cumulative_counts.begin(), cumulative_counts, rank, lower);
+        }
+
+        auto running_ct = 0.0;
+
+        auto idx = 0;
+        for (const auto bin_ct : bins_) {
+            running_ct += bin_ct;
+            if ((lower && running_ct > rank) ||
+                (!lower && running_ct >= rank + 1)) {
+                return idx + offset_;
+            }
+            ++idx;
+        }
+
+        return max_key_;
+    }
+
+    /*
+     * Same as key_at_rank, for several ranks sorted in increasing order,
+     * which are all resolved during a single pass over the bins
+     */
+    void key_at_ranks(const RealValue* ranks,
+                      size_t count,
+                      Index* keys,
+                      bool lower = true) const {
+        if (rank_index_enabled_) {
+            const auto& cumulative_counts = rank_index();
+            auto first = cumulative_counts.begin();
+
+            /* The ranks are sorted, so each search resumes at the last bin */
+            for (size_t rank_idx = 0; rank_idx < count; ++rank_idx) {
+                keys[rank_idx] = indexed_key_at_rank(
+                    first, cumulative_counts, ranks[rank_idx], lower);
+
+                if (keys[rank_idx] != max_key_) {
+                    first = cumulative_counts.begin() +
+                            (keys[rank_idx] - offset_);
+                }
+            }
+
+            return;
+        }
+
+        auto running_ct = 0.0;
+        size_t rank_idx = 0;
+
+        auto idx = 0;
+        for (const auto bin_ct : bins_) {
+            running_ct += bin_ct;
+
+            while (rank_idx < count &&
+                   ((lower && running_ct > ranks[rank_idx]) ||
+                    (!lower && running_ct >= ranks[rank_idx] + 1))) {
+                keys[rank_idx++] = idx + offset_;
+            }
+
+            if (rank_idx == count) {
+                return;
+            }
+            ++idx;
+        }
+
+        std::fill(keys + rank_idx, keys + count, max_key_);
+    }
+
+    /* The sum of the counts of the bins up to the key, included */
+    RealValue count_up_to(Index key) const {
+        RealValue count;
+        counts_up_to(&key, 1, &count);
+
+        return count;
+    }
+
+    /*
+     * Same as count_up_to, for several keys sorted in increasing order, which
+     * are all resolved during a single pass over the bins, or looked up in
+     * the rank index if it is enabled
+     */
+    void counts_up_to(const Index* keys,
+                      size_t count,
+                      RealValue* counts) const {
+        if (rank_index_enabled_) {
+            const auto& cumulative_counts = rank_index();
+            auto num_bins = static_cast<Index>(cumulative_counts.size());
+
+            for (size_t key_idx = 0; key_idx < count; ++key_idx) {
+                auto idx = keys[key_idx] - offset_;
+
+                if (idx < 0 || num_bins == 0) {
+                    counts[key_idx] = 0.0;
+                } else {
+                    counts[key_idx] =
+                        cumulative_counts[std::min(idx, num_bins - 1)];
+                }
+            }
+
+            return;
+        }
+
+        auto running_ct = 0.0;
+        size_t key_idx = 0;
+
+        auto key = offset_;
+        for (const auto bin_ct : bins_) {
+            while (key_idx < count && keys[key_idx] < key) {
+                counts[key_idx++] = running_ct;
+            }
+
+            if (key_idx == count) {
+                return;
+            }
+
+            running_ct += bin_ct;
+            ++key;
+        }
+
+        std::fill(counts + key_idx, counts + count, running_ct);
+    }
+
+    void merge(const BaseDenseStore& store) {
+        if (store.count_ == 0) {
+            return;
+        }
+
+        if (count_ == 0) {
+            copy(store);
+            return;
+        }
+
+        if (store.min_key_ < min_key_ || store.max_key_ > max_key_) {
+            extend_range(store.min_key_, store.max_key_);
+        }
+
+        merge_bins(store);
+
+        invalidate_rank_index();
+    }
+
+    /*
+     * Same as above, but the bins of the other store are taken, rather than
+     * copied, when this store is empty, or when the bins of the other store
+     * already cover the range of this one. The other store is left empty
+     */
+    void merge(BaseDenseStore&& store) {
+        if (&store == this) {
+            merge(static_cast<const BaseDenseStore&>(store));
+            return;
+        }
+
+        if (store.count_ == 0) {
+            return;
+        }
+
+        if (count_ == 0) {
+            take(store);
+            return;
+        }
+
+        if (!covers(store.min_key_, store.max_key_) &&
+                store.covers(min_key_, max_key_)) {
+            swap_bins(store);
+        }
+
+        merge(static_cast<const BaseDenseStore&>(store));
+        store.derived().clear();
+    }
+
+    /*
+     * Merge several stores into this one. The range is extended once, to
+     * cover the keys of all the stores, before their bins are added
+     */
+    void merge_all(const DerivedStore* const* stores, size_t num_stores) {
+        auto new_min_key = min_key_;
+        auto new_max_key = max_key_;
+
+        for (size_t idx = 0; idx < num_stores; ++idx) {
+            if (stores[idx]->count_ != 0) {
+                new_min_key = std::min(new_min_key, stores[idx]->min_key_);
+                new_max_key = std::max(new_max_key, stores[idx]->max_key_);
+            }
+        }
+
+        if (new_min_key < min_key_ || new_max_key > max_key_) {
+            extend_range(new_min_key, new_max_key);
+        }
+
+        for (size_t idx = 0; idx < num_stores; ++idx) {
+            if (stores[idx]->count_ != 0) {
+                derived().merge_bins(*stores[idx]);
+            }
+        }
+
+        invalidate_rank_index();
+    }
+
+    /*
+     * Whether the other store can be subtracted from this one, cf. subtract:
+     * its keys are within the range, and its counts are at most the ones of
+     * the bins they are subtracted from
+     */
+    bool holds(const BaseDenseStore& store) const {
+        return store.count_ == 0 ||
+               (covers_keys_of(store) && holds_counts_of(store));
+    }
+
+    /*
+     * Subtract the bins of a store whose values have all been added to, or
+     * merged into, this one. The keys are mapped to the bins as they are
+     * when adding, so that the keys collapsed by this store are subtracted
+     * from the collapsed bin. The range is then trimmed to the bins which
+     * remain non-empty, and the store is cleared once its count drops to
+     * zero. Throws std::invalid_argument, leaving the store unchanged, if
+     * the other store holds keys outside of the range of this one, or
+     * counts which would make a bin negative
+     */
+    void subtract(const BaseDenseStore& store) {
+        if (store.count_ == 0) {
+            return;
+        }
+
+        if (!covers_keys_of(store)) {
+            throw std::invalid_argument(
+                "The keys to subtract are outside of the range");
+        }
+
+        if (!holds_counts_of(store)) {
+            throw std::invalid_argument(
+                "The counts to subtract are higher than the ones of the store");
+        }
+
+        for (auto key = store.min_key_; key <= store.max_key_; ++key) {
+            auto bin_ct = store.bins_[key - store.offset_];
+
+            if (bin_ct != 0) {
+                auto index = derived().get_clamped_index(key);
+
+                bins_[index] = subtract_count(bins_[index], bin_ct);
+            }
+        }
+
+        count_ = subtract_count(count_, store.count_);
+
+        if (count_ <= 0) {
+            derived().clear();
+            return;
+        }
+
+        derived().trim_range();
+        invalidate_rank_index();
+    }
+
+    /* Call visit(key, count) for each non-empty bin, by increasing key */
+    template <class Visit>
+    void for_each_bin(Visit visit) const {
+        if (count_ == 0) {
+            return;
+        }
+
+        for (auto key = min_key_; key <= max_key_; ++key) {
+            auto bin_ct = bins_[key - offset_];
+
+            if (bin_ct != 0) {
+                visit(key, bin_ct);
+            }
+        }
+    }
+
+    /*
+     * Remove all the values from the store. The bins are set to zero but
+     * kept, along with their range, as if reserved, so that the values added
+     * next within that range neither grow nor shift them. shrink_to_fit
+     * releases them
+     */
+    void clear() {
+        count_ = 0;
+        min_key_ = std::numeric_limits<Index>::max();
+        max_key_ = std::numeric_limits<Index>::min();
+        bins_.initialize_with_zeros(bins_.size());
+
+        invalidate_rank_index();
+    }
+
+    /*
+     * Allocate the bins for the keys in [min_key, max_key], as well as the
+     * keys of the store, in chunks of chunk_size bins and up to the limit
+     * of the store, without changing the values. The keys which are then
+     * added within these bins neither grow nor shift them
+     */
+    void reserve(Index min_key, Index max_key) {
+        if (min_key > max_key) {
+            return;
+        }
+
+        if (count_ != 0) {
+            min_key = std::min(min_key, min_key_);
+            max_key = std::max(max_key, max_key_);
+        }
+
+        if (covers(min_key, max_key)) {
+            return;
+        }
+
+        auto new_length = derived().get_new_length(min_key, max_key);
+
+        if (count_ == 0) {
+            bins_.initialize_with_zeros(new_length);
+            recorded_stats().record_allocation(bins_size(new_length));
+
+            offset_ = min_key;
+        } else {
+            if (new_length > length()) {
+                recorded_stats().record_allocation(
+                    bins_size(new_length - length()));
+                bins_.extend_back_with_zeros(new_length - length());
+            }
+
+            /*
+             * Keep the keys of the store within the bins, when the bin
+             * limit does not let them cover min_key as well
+             */
+            shift_bins(offset_ - std::max(min_key, max_key_ - length() + 1));
+        }
+
+        invalidate_rank_index();
+    }
+
+    /*
+     * Reallocate the bins to the chunks which cover the keys of the store,
+     * releasing the rest of the memory, e.g., once a long-lived store no
+     * longer grows
+     */
+    void shrink_to_fit() {
+        if (count_ == 0) {
+            derived().clear();
+            bins_ = Bins(bins_.get_allocator());
+            offset_ = 0;
+        } else {
+            auto new_length = derived().get_new_length(min_key_, max_key_);
+            auto bins = Bins(new_length, bins_.get_allocator());
+
+            bins.add_bins(
+                0, bins_, min_key_ - offset_, max_key_ - min_key_ + 1);
+
+            bins_ = std::move(bins);
+            offset_ = min_key_;
+        }
+
+        rank_index_.clear();
+        rank_index_.shrink_to_fit();
+        invalidate_rank_index();
+    }
+
+    /*
+     * The size of the Store message of the DDSketch protobuf format
+     * (cf. DDSketch.proto in sketches-go, sketches-java or sketches-py)
+     * that serialize writes
+     */
+    size_t serialized_size() const {
+        if (count_ == 0) {
+            return 0;
+        }
+
+        auto counts_size = contiguous_bin_counts_size();
+        auto size = ProtoWriter::kTagSize +
+                    ProtoWriter::varint_size(counts_size) +
+                    counts_size;
+
+        if (min_key_ != 0) {
+            size += ProtoWriter::kTagSize + ProtoWriter::sint32_size(min_key_);
+        }
+
+        return size;
+    }
+
+    /*
+     * Encode the store as a Store message, into a buffer of at least
+     * serialized_size() bytes. The bins between min_key and max_key are
+     * written as contiguous bin counts. Returns the number of bytes written
+     */
+    size_t serialize(uint8_t* buffer, size_t size) const {
+        auto writer = ProtoWriter(buffer, size);
+        encode(writer);
+
+        return writer.size();
+    }
+
+    void encode(ProtoWriter& writer) const {
+        if (count_ == 0) {
+            return;
+        }
+
+        writer.write_tag(StoreProto::kContiguousBinCountsField,
+                         WireType::kLengthDelimited);
+        writer.write_varint(contiguous_bin_counts_size());
+
+        for (auto key = min_key_; key <= max_key_; ++key) {
+            writer.write_double(bins_[key - offset_]);
+        }
+
+        if (min_key_ != 0) {
+            writer.write_tag(StoreProto::kContiguousBinIndexOffsetField,
+                             WireType::kVarint);
+            writer.write_sint32(min_key_);
+        }
+    }
+
+    /*
+     * Replace the content of the store with a Store message, which may hold
+     * both sparse and contiguous bin counts. The range is extended once,
+     * to cover all the keys, before the counts are written straight into
+     * the bins. Throws SerializationException, and leaves the store empty,
+     * if the message is malformed
+     */
+    void deserialize(const uint8_t* buffer, size_t size) {
+        decode(ProtoReader(buffer, size));
+    }
+
+    void decode(ProtoReader reader) {
+        derived().clear();
+
+        try {
+            decode_bins(reader);
+        } catch (...) {
+            derived().clear();
+            throw;
+        }
+    }
+
+ protected:
+    DerivedStore& derived() {
+        return static_cast<DerivedStore&>(*this);
+    }
+
+    const DerivedStore& derived() const {
+        return static_cast<const DerivedStore&>(*this);
+    }
+
+    Stats& recorded_stats() {
+        return *this;
+    }
+
+    /* The number of bytes taken by num_bins bins */
+    static size_t bins_size(Index num_bins) {
+        return static_cast<size_t>(num_bins) *
+               sizeof(typename Bins::value_type);
+    }
+
+    /* To be called whenever the bins or the offset change */
+    void invalidate_rank_index() {
+        rank_index_dirty_ = true;
+    }
+
+    /* Add the bins of a store whose keys are all within the range */
+    void merge_bins(const BaseDenseStore& store) {
+        bins_.add_bins(
+            store.min_key_ - offset_,
+            store.bins_,
+            store.min_key_ - store.offset_,
+            store.max_key_ - store.min_key_ + 1);
+
+        count_ += store.count_;
+    }
+
+    /* Whether the keys of the other store are mapped within the range */
+    bool covers_keys_of(const BaseDenseStore& store) const {
+        return count_ != 0 &&
+               derived().get_clamped_index(store.min_key_) >=
+                   min_key_ - offset_ &&
+               derived().get_clamped_index(store.max_key_) <=
+                   max_key_ - offset_;
+    }
+
+    /*
+     * Whether each bin of this store is at least the sum of the counts of the
+     * keys of the other store which it holds, with the keys collapsed as
+     * when adding them, up to the rounding of the counts. The keys of the
+     * other store must be within the range
+     */
+    bool holds_counts_of(const BaseDenseStore& store) const {
+        auto key = store.min_key_;
+
+        /* The keys mapped to the same bin are contiguous */
+        while (key <= store.max_key_) {
+            auto index = derived().get_clamped_index(key);
+            auto subtracted_ct = 0.0;
+
+            for (; key <= store.max_key_ &&
+                       derived().get_clamped_index(key) == index;
+                   ++key) {
+                subtracted_ct += store.bins_[key - store.offset_];
+            }
+
+            if (exceeds_count(subtracted_ct, bins_[index])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /* Narrow min_key and max_key down to the non-empty bins */
+    void trim_range() {
+        while (min_key_ < max_key_ && bins_[min_key_ - offset_] == 0) {
+            ++min_key_;
+        }
+
+        while (max_key_ > min_key_ && bins_[max_key_ - offset_] == 0) {
+            --max_key_;
+        }
+    }
+
+    /* Take the bins of another store, leaving it empty */
+    void take(BaseDenseStore& store) {
+        count_ = store.count_;
+        min_key_ = store.min_key_;
+        max_key_ = store.max_key_;
+        offset_ = store.offset_;
+        bins_ = std::move(store.bins_);
+        store.bins_ = Bins(store.bins_.get_allocator());
+
+        store.derived().clear();
+        invalidate_rank_index();
+    }
+
+    /* Whether the keys fit in the bins, without extending the range */
+    bool covers(Index min_key, Index max_key) const {
+        return min_key >= offset_ && max_key < offset_ + length();
+    }
+
+    /* Exchange the values of two stores */
+    void swap_bins(BaseDenseStore& store) {
+        std::swap(count_, store.count_);
+        std::swap(min_key_, store.min_key_);
+        std::swap(max_key_, store.max_key_);
+        std::swap(offset_, store.offset_);
+        std::swap(bins_, store.bins_);
+
+        invalidate_rank_index();
+        store.invalidate_rank_index();
+    }
+
+    Index get_new_length(Index new_min_key, Index new_max_key) {
+        auto desired_length = new_max_key - new_min_key + 1;
+        auto num_chunks = std::ceil((1.0 * desired_length) / chunk_size_);
+
+        return chunk_size_ * num_chunks;
+    }
+
+    /*
+     * Adjust the bins, the offset, the min_key, and max_key, without resizing
+     * the bins, in order to try making it fit the specified range
+     */
+    void adjust(Index new_min_key, Index new_max_key) {
+        center_bins(new_min_key, new_max_key);
+
+        min_key_ = new_min_key;
+        max_key_ = new_max_key;
+    }
+
+    /* Shift the bins; this changes the offset */
+    void shift_bins(Index shift) {
+        recorded_stats().record_shift(shift);
+
+        if (shift > 0) {
+            bins_.remove_trailing_elements(shift);
+            bins_.extend_front_with_zeros(shift);
+        } else {
+            auto abs_shift = std::abs(shift);
+
+            bins_.remove_leading_elements(abs_shift);
+            bins_.extend_back_with_zeros(abs_shift);
+        }
+
+        offset_ -= shift;
+    }
+
+    /* Center the bins; this changes the offset */
+    void center_bins(Index new_min_key, Index new_max_key) {
+        auto middle_key = new_min_key + (new_max_key - new_min_key + 1) / 2;
+
+        shift_bins(offset_ + length() / 2 - middle_key);
+    }
+
+    /* Grow the bins as necessary and call _adjust */
+    void extend_range(Index key, Index second_key) {
+        auto new_min_key = std::min({key, second_key, min_key_});
+        auto new_max_key = std::max({key, second_key, max_key_});
+
+        recorded_stats().record_range_extension();
+
+        if (covers(new_min_key, new_max_key)) {
+            /*
+             * No need to change the range; just update min/max keys. The
+             * bins out of the range, e.g., the reserved ones, are all zero
+             */
+            min_key_ = new_min_key;
+            max_key_ = new_max_key;
+        } else if (count_ == 0) {
+            /* Initialize bins, unless the reserved ones cover the keys */
+            auto new_length =
+                derived().get_new_length(new_min_key, new_max_key);
+            bins_.initialize_with_zeros(new_length);
+            recorded_stats().record_allocation(bins_size(new_length));
+
+            offset_ = new_min_key;
+            derived().adjust(new_min_key, new_max_key);
+        } else {
+            /* Grow the bins */
+            Index new_length =
+                derived().get_new_length(new_min_key, new_max_key);
+
+            if (new_length > length()) {
+                recorded_stats().record_allocation(
+                    bins_size(new_length - length()));
+                bins_.extend_back_with_zeros(new_length - length());
+            }
+
+            derived().adjust(new_min_key, new_max_key);
+        }
+
+        invalidate_rank_index();
+    }
+
+    void extend_range(Index key) {
+        extend_range(key, key);
+    }
+
+    /* Calculate the bin index for the key, extending the range if necessary */
+    Index get_index(Index key) {
+        if (key < min_key_ || key > max_key_) {
+            extend_range(key);
+        }
+
+        return key - offset_;
+    }
+
+    /*
+     * Calculate the bin index for a key, once the range has been extended
+     * to cover the keys of a batch
+     */
+    Index get_clamped_index(Index key) const {
+        return key - offset_;
+    }
+
+    void extend_range_for_batch(const Index* keys, size_t count) {
+        auto key_range = std::minmax_element(keys, keys + count);
+
+        if (*key_range.first < min_key_ || *key_range.second > max_key_) {
+            extend_range(*key_range.first, *key_range.second);
+        }
+    }
+
+ public:
+    RealValue count_; /* The sum of the counts for the bins */
+    Index min_key_;   /* The minimum key bin */
+    Index max_key_;   /* The maximum key bin */
+
+    /* The number of bins to grow by */
+    Index chunk_size_;
+
+    /* The difference btw the keys and the index in which they are stored */
+    Index offset_;
+    Bins bins_;
+
+ private:
+    size_t contiguous_bin_counts_size() const {
+        return (max_key_ - min_key_ + 1) * sizeof(RealValue);
+    }
+
+    void decode_bins(const ProtoReader& reader) {
+        auto min_key = std::numeric_limits<Index>::max();
+        auto max_key = std::numeric_limits<Index>::min();
+        auto total_count = 0.0;
+
+        StoreProto::for_each_bin(
+            reader,
+            [&min_key, &max_key, &total_count](Index key, RealValue bin_ct) {
+                min_key = std::min(min_key, key);
+                max_key = std::max(max_key, key);
+                total_count += bin_ct;
+            });
+
+        if (total_count == 0) {
+            return;
+        }
+
+        extend_range(min_key, max_key);
+
+        StoreProto::for_each_bin(
+            reader,
+            [this](Index key, RealValue bin_ct) {
+                bins_[derived().get_clamped_index(key)] += bin_ct;
+            });
+
+        count_ = total_count;
+
+        invalidate_rank_index();
+    }
+
+    using CumulativeCounts = std::vector<RealValue>;
+
+    /*
+     * Return the cumulative counts of the bins, rebuilding them if the store
+     * has been updated since the last query. They are accumulated in the
+     * same order as in the linear scan, so both give the same keys
+     */
+    const CumulativeCounts& rank_index() const {
+        if (rank_index_dirty_) {
+            rank_index_.resize(bins_.size());
+
+            auto running_ct = 0.0;
+            auto idx = 0;
+
+            for (const auto bin_ct : bins_) {
+                running_ct += bin_ct;
+                rank_index_[idx++] = running_ct;
+            }
+
+            rank_index_dirty_ = false;
+        }
+
+        return rank_index_;
+    }
+
+    /*
+     * The first bin whose cumulative count exceeds the rank (when lower is
+     * set) or reaches rank + 1 (otherwise), searched from the first iterator
+     */
+    Index indexed_key_at_rank(CumulativeCounts::const_iterator first,
+                              const CumulativeCounts& cumulative_counts,
+                              RealValue rank,
+                              bool lower) const {
+        auto bin = lower ?
+            std::upper_bound(first, cumulative_counts.end(), rank) :
+            std::lower_bound(first, cumulative_counts.end(), rank + 1);
+
+        if (bin == cumulative_counts.end()) {
+            return max_key_;
+        }
+
+        return (bin - cumulative_counts.begin()) + offset_;
+    }
+
+    bool rank_index_enabled_;
+    mutable bool rank_index_dirty_;
+    mutable CumulativeCounts rank_index_;
+};
+
+using DenseStore = BaseDenseStore<>;
+using DequeDenseStore = BaseDenseStore<void, DequeBinList<RealValue>>;
+using PagedDenseStore = BaseDenseStore<void, PagedBinList<RealValue>>;
+using CompactDenseStore = BaseDenseStore<void, CompactBinList>;
+using InstrumentedDenseStore =
+    BaseDenseStore<void, BinList<RealValue>, CountingStoreStats>;
+
+/*
+ * A dense store that keeps all the bins between the bin for the min_key and the
+ * bin for the max_key, but collapsing the left-most bins if the number of bins
+ * exceeds the bin_limit
+ */
+template <class Bins = BinList<RealValue>, class Stats = NoStoreStats>
+class BaseCollapsingLowestDenseStore
+    : public BaseDenseStore<
+          BaseCollapsingLowestDenseStore<Bins, Stats>, Bins, Stats> {
+    using Base = BaseDenseStore<
+        BaseCollapsingLowestDenseStore<Bins, Stats>, Bins, Stats>;
+
+ public:
+    using Base::count_;
+    using Base::min_key_;
+    using Base::max_key_;
+    using Base::chunk_size_;
+    using Base::offset_;
+    using Base::bins_;
+    using Base::length;
+
+    using allocator_type = typename Base::allocator_type;
+
+    explicit BaseCollapsingLowestDenseStore(Index bin_limit,
+                                            Index chunk_size = kChunkSize)
+    : Base(chunk_size),
+      bin_limit_(bin_limit),
+      is_collapsed_(false) {
+    }
+
+    /* A store whose bins are obtained from the allocator, cf. BaseDenseStore */
+    BaseCollapsingLowestDenseStore(Index bin_limit,
+                                   const allocator_type& allocator,
+                                   Index chunk_size = kChunkSize)
+    : Base(allocator, chunk_size),
+      bin_limit_(bin_limit),
+      is_collapsed_(false) {
+    }
+
+    /* A store whose bins are allocated for the expected keys, cf. reserve */
+    BaseCollapsingLowestDenseStore(Index bin_limit,
+                                   const KeyRange& expected_keys,
+                                   Index chunk_size = kChunkSize)
+    : BaseCollapsingLowestDenseStore(bin_limit, chunk_size) {
+        reserve(expected_keys.min_key, expected_keys.max_key);
+    }
+
+    Index bin_limit() const {
+        return bin_limit_;
+    }
+
+    /* Once collapsed, the bins up to the limit are all in use */
+    void reserve(Index min_key, Index max_key) {
+        if (!is_collapsed_) {
+            Base::reserve(min_key, max_key);
+        }
+    }
+
+    void shrink_to_fit() {
+        if (!is_collapsed_ || count_ == 0) {
+            Base::shrink_to_fit();
+        }
+    }
+
+    void copy(const BaseCollapsingLowestDenseStore& store) {
+        count_ = store.count_;
+        min_key_ = store.min_key_;
+        max_key_ = store.max_key_;
+        offset_ = store.offset_;
+        bins_ = store.bins_;
+
+        bin_limit_ = store.bin_limit_;
+        is_collapsed_ = store.is_collapsed_;
+
+        this->invalidate_rank_index();
+    }
+
+    void clear() {
+        Base::clear();
+        is_collapsed_ = false;
+    }
+
+    void merge(const BaseCollapsingLowestDenseStore& store) {
+        if (store.count_ == 0) {
+            return;
+        }
+
+        if (count_ == 0) {
+            copy(store);
+            return;
+        }
+
+        if (store.min_key_ < min_key_ || store.max_key_ > max_key_) {
+            extend_range(store.min_key_, store.max_key_);
+        }
+
+        merge_bins(store);
+
+        this->invalidate_rank_index();
+    }
+
+    /* Same as above, taking the bins of the other store if this one is empty */
+    void merge(BaseCollapsingLowestDenseStore&& store) {
+        if (&store == this) {
+            merge(static_cast<const BaseCollapsingLowestDenseStore&>(store));
+            return;
+        }
+
+        if (count_ == 0 && store.count_ != 0) {
+            bin_limit_ = store.bin_limit_;
+            is_collapsed_ = store.is_collapsed_;
+            this->take(store);
+            return;
+        }
+
+        merge(static_cast<const BaseCollapsingLowestDenseStore&>(store));
+        store.clear();
+    }
+
+ private:
+    friend Base;
+
+    /*
+     * Add the bins of a store whose keys are within the range, once the
+     * range has been extended. The keys below min_key are collapsed into
+     * the first bin
+     */
+    void merge_bins(const BaseCollapsingLowestDenseStore& store) {
+        auto collapse_start_idx = store.min_key_ - store.offset_;
+
+        auto collapse_end_idx =
+                std::min(min_key_, store.max_key_ + 1) - store.offset_;
+
+        if (collapse_end_idx > collapse_start_idx) {
+            auto collapsed_count =
+                store.bins_.collapsed_count(
+                    collapse_start_idx, collapse_end_idx);
+
+            bins_.first() += collapsed_count;
+            this->recorded_stats().record_collapse(collapsed_count);
+        } else {
+            collapse_end_idx = collapse_start_idx;
+        }
+
+        auto start_key = collapse_end_idx + store.offset_;
+
+        if (start_key <= store.max_key_) {
+            bins_.add_bins(
+                start_key - offset_,
+                store.bins_,
+                collapse_end_idx,
+                store.max_key_ - start_key + 1);
+        }
+
+        count_ += store.count_;
+    }
+
+    /*
+     * Once the first bin has been trimmed, the collapsed values have all
+     * been subtracted, and the lower keys can be added as they are again
+     */
+    void trim_range() {
+        auto min_key = min_key_;
+
+        Base::trim_range();
+
+        if (min_key_ != min_key) {
+            is_collapsed_ = false;
+        }
+    }
+
+    using Base::extend_range;
+    using Base::shift_bins;
+    using Base::center_bins;
+
+    Index get_new_length(Index new_min_key, Index new_max_key) {
+        auto desired_length = new_max_key - new_min_key + 1;
+        Index num_chunks = std::ceil((1.0 * desired_length) / chunk_size_);
+
+        return std::min(chunk_size_ * num_chunks, bin_limit_);
+    }
+
+    /* Calculate the bin index for the key, extending the range if necessary */
+    Index get_index(Index key) {
+        if (key < min_key_) {
+            if (is_collapsed_) {
+                return 0;
+            }
+
+            extend_range(key);
+
+            if (is_collapsed_) {
+                return 0;
+            }
+        } else if (key > max_key_) {
+            extend_range(key);
+        }
+
+        return key - offset_;
+    }
+
+    /* The keys below min_key can only remain after a collapse */
+    Index get_clamped_index(Index key) const {
+        return std::max(key, min_key_) - offset_;
+    }
+
+    /*
+     * Override. Adjust the bins, the offset, the min_key, and max_key,
+     * without resizing the bins, in order to try making it fit the specified
+     * range. Collapse to the left if necessary
+     */
+    void adjust(Index new_min_key, Index new_max_key) {
+        if (new_max_key - new_min_key + 1 > length()) {
+            /*
+             * The range of keys is too wide.
+             * The lowest bins need to be collapsed
+             */
+            new_min_key = new_max_key - length() + 1;
+
+            if (new_min_key >= max_key_) {
+                /* Put everything in the first bin */
+                this->recorded_stats().record_collapse(
+                    count_ - (new_min_key == max_key_ ?
+                                  bins_[max_key_ - offset_] : 0.0));
+
+                offset_ = new_min_key;
+                min_key_ = new_min_key;
+
+                bins_.initialize_with_zeros(length());
+                bins_.first() = count_;
+            } else {
+                auto shift = offset_ - new_min_key;
+
+                if (shift < 0) {
+                    auto collapse_start_index = min_key_ - offset_;
+                    auto collapse_end_index = new_min_key - offset_;
+
+                    auto collapsed_count =
+                        bins_.collapsed_count(
+                            collapse_start_index,
+                            collapse_end_index);
+
+                    bins_.replace_range_with_zeros(
+                        collapse_start_index,
+                        collapse_end_index,
+                        new_min_key - min_key_);
+
+                    bins_[collapse_end_index] += collapsed_count;
+                    this->recorded_stats().record_collapse(collapsed_count);
+
+                    min_key_ = new_min_key;
+
+                    /* Shift the buckets to make room for new_max_key */
+                    shift_bins(shift);
+                } else {
+                    min_key_ = new_min_key;
+                    this->recorded_stats().record_collapse(0.0);
+
+                    /* Shift the buckets to make room for new_min_key */
+                    shift_bins(shift);
+                }
+              }
+
+            max_key_ = new_max_key;
+            is_collapsed_ = true;
+        } else {
+            center_bins(new_min_key, new_max_key);
+
+            min_key_ = new_min_key;
+            max_key_ = new_max_key;
+        }
+    }
+
+    Index bin_limit_;  /* The maximum number of bins */
+    bool is_collapsed_;
+};
+
+using CollapsingLowestDenseStore = BaseCollapsingLowestDenseStore<>;
+using PagedCollapsingLowestDenseStore =
+    BaseCollapsingLowestDenseStore<PagedBinList<RealValue>>;
+using CompactCollapsingLowestDenseStore =
+    BaseCollapsingLowestDenseStore<CompactBinList>;
+using InstrumentedCollapsingLowestDenseStore =
+    BaseCollapsingLowestDenseStore<BinList<RealValue>, CountingStoreStats>;
+
+/*
+ * A dense store that keeps all the bins between the bin for the min_key and the
+ * bin for the max_key, but collapsing the right-most bins if the number of bins
+ * exceeds the bin_limit
+ */
+template <class Bins = BinList<RealValue>, class Stats = NoStoreStats>
+class BaseCollapsingHighestDenseStore
+    : public BaseDenseStore<
+          BaseCollapsingHighestDenseStore<Bins, Stats>, Bins, Stats> {
+    using Base = BaseDenseStore<
+        BaseCollapsingHighestDenseStore<Bins, Stats>, Bins, Stats>;
+
+ public:
+    using Base::count_;
+    using Base::min_key_;
+    using Base::max_key_;
+    using Base::chunk_size_;
+    using Base::offset_;
+    using Base::bins_;
+    using Base::length;
+
+    using allocator_type = typename Base::allocator_type;
+
+    explicit BaseCollapsingHighestDenseStore(Index bin_limit,
+                                             Index chunk_size = kChunkSize)
+    : Base(chunk_size),
+      bin_limit_(bin_limit),
+      is_collapsed_(false) {
+    }
+
+    /* A store whose bins are obtained from the allocator, cf. BaseDenseStore */
+    BaseCollapsingHighestDenseStore(Index bin_limit,
+                                    const allocator_type& allocator,
+                                    Index chunk_size = kChunkSize)
+    : Base(allocator, chunk_size),
+      bin_limit_(bin_limit),
+      is_collapsed_(false) {
+    }
+
+    /* A store whose bins are allocated for the expected keys, cf. reserve */
+    BaseCollapsingHighestDenseStore(Index bin_limit,
+                                    const KeyRange& expected_keys,
+                                    Index chunk_size = kChunkSize)
+    : BaseCollapsingHighestDenseStore(bin_limit, chunk_size) {
+        reserve(expected_keys.min_key, expected_keys.max_key);
+    }
+
+    Index bin_limit() const {
+        return bin_limit_;
+    }
+
+    /* Once collapsed, the bins up to the limit are all in use */
+    void reserve(Index min_key, Index max_key) {
+        if (!is_collapsed_) {
+            Base::reserve(min_key, max_key);
+        }
+    }
+
+    void shrink_to_fit() {
+        if (!is_collapsed_ || count_ == 0) {
+            Base::shrink_to_fit();
+        }
+    }
+
+    void copy(const BaseCollapsingHighestDenseStore& store) {
+        count_ = store.count_;
+        min_key_ = store.min_key_;
+        max_key_ = store.max_key_;
+        offset_ = store.offset_;
+        bins_ = store.bins_;
+
+        bin_limit_ = store.bin_limit_;
+        is_collapsed_ = store.is_collapsed_;
+
+        this->invalidate_rank_index();
+    }
+
+    void clear() {
+        Base::clear();
+        is_collapsed_ = false;
+    }
+
+    void merge(const BaseCollapsingHighestDenseStore& store) {
+        if (store.count_ == 0) {
+            return;
+        }
+
+        if (count_ == 0) {
+            copy(store);
+            return;
+        }
+
+        if (store.min_key_ < min_key_ || store.max_key_ > max_key_) {
+            extend_range(store.min_key_, store.max_key_);
+        }
+
+        merge_bins(store);
+
+        this->invalidate_rank_index();
+    }
+
+    /* Same as above, taking the bins of the other store if this one is empty */
+    void merge(BaseCollapsingHighestDenseStore&& store) {
+        if (&store == this) {
+            merge(static_cast<const BaseCollapsingHighestDenseStore&>(store));
+            return;
+        }
+
+        if (count_ == 0 && store.count_ != 0) {
+            bin_limit_ = store.bin_limit_;
+            is_collapsed_ = store.is_collapsed_;
+            this->take(store);
+            return;
+        }
+
+        merge(static_cast<const BaseCollapsingHighestDenseStore&>(store));
+        store.clear();
+    }
+
+ private:
+    friend Base;
+
+    /*
+     * Add the bins of a store whose keys are within the range, once the
+     * range has been extended. The keys above max_key are collapsed into
+     * the last bin
+     */
+    void merge_bins(const BaseCollapsingHighestDenseStore& store) {
+        auto collapse_end_idx = store.max_key_ - store.offset_ + 1;
+        auto collapse_start_idx =
+            std::max(max_key_ + 1, store.min_key_) - store.offset_;
+
+        if (collapse_end_idx > collapse_start_idx) {
+             auto collapsed_count =
+                    store.bins_.collapsed_count(
+                        collapse_start_idx, collapse_end_idx);
+            bins_.last() += collapsed_count;
+            this->recorded_stats().record_collapse(collapsed_count);
+        } else {
+            collapse_start_idx = collapse_end_idx;
+        }
+
+        auto end_key = collapse_start_idx + store.offset_;
+
+        if (store.min_key_ < end_key) {
+            bins_.add_bins(
+                store.min_key_ - offset_,
+                store.bins_,
+                store.min_key_ - store.offset_,
+                end_key - store.min_key_);
+        }
+
+        count_ += store.count_;
+    }
+
+    /*
+     * Once the last bin has been trimmed, the collapsed values have all
+     * been subtracted, and the higher keys can be added as they are again
+     */
+    void trim_range() {
+        auto max_key = max_key_;
+
+        Base::trim_range();
+
+        if (max_key_ != max_key) {
+            is_collapsed_ = false;
+        }
+    }
+
+    using Base::extend_range;
+    using Base::shift_bins;
+    using Base::center_bins;
+
+    Index get_new_length(Index new_min_key, Index new_max_key) {
+        auto desired_length = new_max_key - new_min_key + 1;
+        Index num_chunks = std::ceil((1.0 * desired_length) / chunk_size_);
+
+        return std::min(chunk_size_ * num_chunks, bin_limit_);
+    }
+
+    /* Calculate the bin index for the key, extending the range if necessary */
+    Index get_index(Index key) {
+        if (key > max_key_) {
+            if (is_collapsed_) {
+                return length() - 1;
+            }
+
+            extend_range(key);
+
+            if (is_collapsed_) {
+                return length() - 1;
+            }
+        } else if (key < min_key_) {
+            extend_range(key);
+        }
+
+        return key - offset_;
+    }
+
+    /* The keys above max_key can only remain after a collapse */
+    Index get_clamped_index(Index key) const {
+        return std::min(key, max_key_) - offset_;
+    }
+
+    /*
+     * Override. Adjust the bins, the offset, the min_key, and max_key, without
+     * resizing the bins, in order to try making it fit the specified range.
+     * Collapse to the left if necessary.
+     */
+    void adjust(Index new_min_key, Index new_max_key) {
+        if (new_max_key - new_min_key + 1 > length()) {
+            /*
+             * The range of keys is too wide.
+             * The lowest bins need to be collapsed
+             */
+            new_max_key = new_min_key + length() - 1;
+
+            if (new_max_key <= min_key_) {
+                /* Put everything in the last bin */
+                this->recorded_stats().record_collapse(
+                    count_ - (new_max_key == min_key_ ?
+                                  bins_[min_key_ - offset_] : 0.0));
+                this->recorded_stats().record_allocation(
+                    Base::bins_size(length()));
+
+                offset_ = new_min_key;
+                max_key_ = new_max_key;
+
+                bins_ = Bins(length(), bins_.get_allocator());
+                bins_.last() = count_;
+            } else {
+                auto shift = offset_ - new_min_key;
+
+                if (shift > 0) {
+                    auto collapse_start_index = new_max_key - offset_ + 1;
+                    auto collapse_end_index = max_key_ - offset_ + 1;
+
+                    auto collapsed_count =
+                        bins_.collapsed_count(
+                            collapse_start_index, collapse_end_index);
+
+                    bins_.replace_range_with_zeros(
+                        collapse_start_index,
+                        collapse_end_index,
+                        max_key_ - new_max_key);
+
+                    bins_[collapse_start_index - 1] += collapsed_count;
+                    this->recorded_stats().record_collapse(collapsed_count);
+
+                    max_key_ = new_max_key;
+
+                    /* Shift the buckets to make room for new_max_key */
+                    shift_bins(shift);
+                } else {
+                    max_key_ = new_max_key;
+                    this->recorded_stats().record_collapse(0.0);
+
+                    /* Shift the buckets to make room for new_min_key */
+                    shift_bins(shift);
+                }
+            }
+
+            min_key_ = new_min_key;
+            is_collapsed_ = true;
+        } else {
+            center_bins(new_min_key, new_max_key);
+
+            min_key_ = new_min_key;
+            max_key_ = new_max_key;
+        }
+    }
+
+    Index bin_limit_;    /* The maximum number of bins */
+    bool is_collapsed_;
+};
+
+using CollapsingHighestDenseStore = BaseCollapsingHighestDenseStore<>;
+using PagedCollapsingHighestDenseStore =
+    BaseCollapsingHighestDenseStore<PagedBinList<RealValue>>;
+using CompactCollapsingHighestDenseStore =
+    BaseCollapsingHighestDenseStore<CompactBinList>;
+using InstrumentedCollapsingHighestDenseStore =
+    BaseCollapsingHighestDenseStore<BinList<RealValue>, CountingStoreStats>;
+
+#if __cplusplus >= 201703L
+/*
+ * The dense stores whose bins are obtained from a std::pmr::memory_resource,
+ * e.g., a std::pmr::monotonic_buffer_resource which releases the bins of
+ * many sketches at once:
+ *
+ *     ddsketch::pmr::DenseStore store(&resource);
+ */
+namespace pmr {
+
+template <typename BinItem>
+using BinList =
+    ddsketch::BinList<BinItem, std::pmr::polymorphic_allocator<BinItem>>;
+
+using CompactBinList =
+    BaseCompactBinList<std::pmr::polymorphic_allocator<RealValue>>;
+
+using DenseStore = BaseDenseStore<void, BinList<RealValue>>;
+using CollapsingLowestDenseStore =
+    BaseCollapsingLowestDenseStore<BinList<RealValue>>;
+using CollapsingHighestDenseStore =
+    BaseCollapsingHighestDenseStore<BinList<RealValue>>;
+
+using CompactDenseStore = BaseDenseStore<void, CompactBinList>;
+using CompactCollapsingLowestDenseStore =
+    BaseCollapsingLowestDenseStore<CompactBinList>;
+using CompactCollapsingHighestDenseStore =
+    BaseCollapsingHighestDenseStore<CompactBinList>;
+
+}  // namespace pmr
+#endif
+
+/*
+ * A store covering a fixed range of keys, known in advance, which can be
+ * updated from several threads at once without locking. The bins are
+ * preallocated atomic counters, so adding a key never allocates memory.
+ * The keys below the range are collapsed into the first bin, and the keys
+ * above it into the last bin, so the relative accuracy is lost on the
+ * quantiles that fall outside of the range.
+ *
+ * add, add_batch and merge can run concurrently with one another and with
+ * the queries. The queries load each bin once, with relaxed ordering, and
+ * do not see a snapshot of the whole store taken at a single point in time.
+ * copy is not thread-safe.
+ */
+class FixedRangeAtomicStore : public BaseStore<FixedRangeAtomicStore> {
+    using Bin = std::atomic<RealValue>;
+
+ public:
+    FixedRangeAtomicStore(Index min_key, Index max_key)
+    : min_key_(min_key),
+      max_key_(max_key),
+      bins_(allocate_bins(min_key, max_key)) {
+    }
+
+    /* A store covering the keys of the values in [min_value, max_value] */
+    template <class Mapping>
+    static FixedRangeAtomicStore for_values(Mapping mapping,
+                                            RealValue min_value,
+                                            RealValue max_value) {
+        return FixedRangeAtomicStore(
+            mapping.key(min_value), mapping.key(max_value));
+    }
+
+    FixedRangeAtomicStore(const FixedRangeAtomicStore& store)
+    : min_key_(store.min_key_),
+      max_key_(store.max_key_),
+      bins_(copied_bins(store)) {
+        copy_bins(store);
+    }
+
+    /*
+     * The other store is left without any bins, over an empty range of keys
+     * whose length is 0, until another store is assigned to it
+     */
+    FixedRangeAtomicStore(FixedRangeAtomicStore&& store) noexcept
+    : min_key_(store.min_key_),
+      max_key_(store.max_key_),
+      bins_(std::move(store.bins_)) {
+        store.release_bins();
+    }
+
+    FixedRangeAtomicStore& operator=(const FixedRangeAtomicStore& store) {
+        copy(store);
+        return *this;
+    }
+
+    /* Same as the move constructor */
+    FixedRangeAtomicStore& operator=(FixedRangeAtomicStore&& store) noexcept {
+        if (this != &store) {
+            min_key_ = store.min_key_;
+            max_key_ = store.max_key_;
+            bins_ = std::move(store.bins_);
+            store.release_bins();
+        }
+
+        return *this;
+    }
+
+    void copy(const FixedRangeAtomicStore& store) {
+        if (this == &store) {
+            return;
+        }
+
+        if (store.length() != length() || !bins_) {
+            bins_ = copied_bins(store);
+        }
+
+        min_key_ = store.min_key_;
+        max_key_ = store.max_key_;
+        copy_bins(store);
+    }
+
+    Index min_key() const {
+        return min_key_;
+    }
+
+    Index max_key() const {
+        return max_key_;
+    }
+
+    Index length() const {
+        return max_key_ - min_key_ + 1;
+    }
+
+    bool is_empty() const {
+        return count() == 0;
+    }
+
+    /* The current count of each bin, from min_key to max_key */
+    std::vector<RealValue> bins() const {
+        std::vector<RealValue> counts(length());
+
+        for (Index idx = 0; idx < length(); ++idx) {
+            counts[idx] = bins_[idx].load(std::memory_order_relaxed);
+        }
+
+        return counts;
+    }
+
+    /* The sum of the counts for the bins */
+    RealValue count() const {
+        auto total_count = 0.0;
+
+        for (Index idx = 0; idx < length(); ++idx) {
+            total_count += bins_[idx].load(std::memory_order_relaxed);
+        }
+
+        return total_count;
+    }
+
+    void add(Index key, RealValue weight = 1.0) {
+        atomic_add(bins_[get_index(key)], weight);
+    }
+
+    /* Updates the counters for a batch of keys, with unit weights */
+    void add_batch(const Index* keys, size_t count) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            atomic_add(bins_[get_index(keys[idx])], 1.0);
+        }
+    }
+
+    /* Same as above, with a weight for each key */
+    void add_batch(const Index* keys, const RealValue* weights, size_t count) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            atomic_add(bins_[get_index(keys[idx])], weights[idx]);
+        }
+    }
+
+    Index key_at_rank(RealValue rank, bool lower = true) const {
+        Index key;
+        key_at_ranks(&rank, 1, &key, lower);
+
+        return key;
+    }
+
+    /*
+     * Same as key_at_rank, for several ranks sorted in increasing order,
+     * which are all resolved during a single pass over the bins
+     */
+    void key_at_ranks(const RealValue* ranks,
+                      size_t count,
+                      Index* keys,
+                      bool lower = true) const {
+        auto running_ct = 0.0;
+        size_t rank_idx = 0;
+
+        /* The highest key seen, for the ranks beyond the total count */
+        auto max_key = max_key_;
+
+        for (Index idx = 0; idx < length() && rank_idx < count; ++idx) {
+            auto bin_ct = bins_[idx].load(std::memory_order_relaxed);
+
+            if (bin_ct == 0) {
+                continue;
+            }
+
+            running_ct += bin_ct;
+            max_key = idx + min_key_;
+
+            while (rank_idx < count &&
+                   ((lower && running_ct > ranks[rank_idx]) ||
+                    (!lower && running_ct >= ranks[rank_idx] + 1))) {
+                keys[rank_idx++] = max_key;
+            }
+        }
+
+        std::fill(keys + rank_idx, keys + count, max_key);
+    }
+
+    /* The sum of the counts of the bins up to the key, included */
+    RealValue count_up_to(Index key) const {
+        RealValue count;
+        counts_up_to(&key, 1, &count);
+
+        return count;
+    }
+
+    /*
+     * Same as count_up_to, for several keys sorted in increasing order, which
+     * are all resolved during a single pass over the bins
+     */
+    void counts_up_to(const Index* keys,
+                      size_t count,
+                      RealValue* counts) const {
+        auto running_ct = 0.0;
+        size_t key_idx = 0;
+
+        for (Index idx = 0; idx < length(); ++idx) {
+            while (key_idx < count && keys[key_idx] < idx + min_key_) {
+                counts[key_idx++] = running_ct;
+            }
+
+            if (key_idx == count) {
+                return;
+            }
+
+            running_ct += bins_[idx].load(std::memory_order_relaxed);
+        }
+
+        std::fill(counts + key_idx, counts + count, running_ct);
+    }
+
+    /* Merge another store, whose keys are clamped to the range of this one */
+    void merge(const FixedRangeAtomicStore& store) {
+        for (Index idx = 0; idx < store.length(); ++idx) {
+            auto bin_ct = store.bins_[idx].load(std::memory_order_relaxed);
+
+            if (bin_ct != 0) {
+                add(idx + store.min_key_, bin_ct);
+            }
+        }
+    }
+
+    void merge_all(const FixedRangeAtomicStore* const* stores,
+                   size_t num_stores) {
+        for (size_t idx = 0; idx < num_stores; ++idx) {
+            merge(*stores[idx]);
+        }
+    }
+
+    /* Subtract another store, clamping its keys to the range of this one */
+    void subtract(const FixedRangeAtomicStore& store) {
+        for (Index idx = 0; idx < store.length(); ++idx) {
+            auto bin_ct = store.bins_[idx].load(std::memory_order_relaxed);
+
+            if (bin_ct != 0) {
+                add(idx + store.min_key_, -bin_ct);
+            }
+        }
+    }
+
+    /*
+     * Whether each bin is at least the sum of the counts of the keys of the
+     * other store which it holds, once clamped to the range of this one, up
+     * to the rounding of the counts
+     */
+    bool holds(const FixedRangeAtomicStore& store) const {
+        Index idx = 0;
+
+        /* The keys clamped to the same bin are contiguous */
+        while (idx < store.length()) {
+            auto index = get_index(idx + store.min_key_);
+            auto subtracted_ct = 0.0;
+
+            for (; idx < store.length() &&
+                       get_index(idx + store.min_key_) == index;
+                   ++idx) {
+                subtracted_ct +=
+                    store.bins_[idx].load(std::memory_order_relaxed);
+            }
+
+            if (exceeds_count(subtracted_ct,
+                              bins_[index].load(std::memory_order_relaxed))) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /* The bins of the whole range are allocated by the constructor */
+    void reserve(Index /* min_key */, Index /* max_key */) {
+    }
+
+    void shrink_to_fit() {
+    }
+
+ private:
+    static std::unique_ptr<Bin[]> allocate_bins(Index min_key,
+                                                Index max_key) {
+        if (max_key < min_key) {
+            throw std::invalid_argument("The range of keys is empty");
+        }
+
+        auto bins = std::make_unique<Bin[]>(max_key - min_key + 1);
+
+        for (Index idx = 0; idx <= max_key - min_key; ++idx) {
+            bins[idx].store(0.0, std::memory_order_relaxed);
+        }
+
+        return bins;
+    }
+
+    /* The bins for a copy of the store, which has none once moved from */
+    static std::unique_ptr<Bin[]> copied_bins(
+            const FixedRangeAtomicStore& store) {
+        return store.bins_ ? allocate_bins(store.min_key_, store.max_key_) :
+                             nullptr;
+    }
+
+    /* Leave the store without bins, over the empty range of keys [0, -1] */
+    void release_bins() {
+        bins_.reset();
+        min_key_ = 0;
+        max_key_ = -1;
+    }
+
+    /* std::atomic<double>::fetch_add is only available from C++20 on */
+    static void atomic_add(Bin& bin, RealValue weight) {
+        auto bin_ct = bin.load(std::memory_order_relaxed);
+
+        while (!bin.compare_exchange_weak(
+                    bin_ct, bin_ct + weight, std::memory_order_relaxed)) {
+        }
+    }
+
+    /* Calculate the bin index for the key, collapsing it into the range */
+    Index get_index(Index key) const {
+        return std::min(std::max(key, min_key_), max_key_) - min_key_;
+    }
+
+    void copy_bins(const FixedRangeAtomicStore& store) {
+        for (Index idx = 0; idx < length(); ++idx) {
+            bins_[idx].store(
+                store.bins_[idx].load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+        }
+    }
+
+    Index min_key_;  /* The key of the first bin */
+    Index max_key_;  /* The key of the last bin */
+    std::unique_ptr<Bin[]> bins_;
+};
+
+/*
+ * A store that only keeps the non-empty bins, as (key, count) pairs sorted by
+ * key in a flat vector. Its memory footprint depends on the number of
+ * distinct keys rather than on their range, so that a few values far apart
+ * from the others (e.g., sentinels) do not allocate all the bins in between,
+ * and an idle store holds no bins at all. Adding a new key costs a binary
+ * search and an insertion, so the dense stores are faster to update when
+ * the keys are close to one another.
+ */
+class SparseStore : public BaseStore<SparseStore> {
+ public:
+    using Bin = std::pair<Index, RealValue>;
+    using Bins = std::vector<Bin>;
+
+    SparseStore() : count_(0) {
+    }
+
+    std::string to_string() const {
+        std::ostringstream repr;
+
+        repr <<  "{";
+
+        for (const auto& bin : bins_) {
+            repr << bin.first << ": " << bin.second << ", ";
+        }
+
+        repr << "}";
+
+        return repr.str();
+    }
+
+    void copy(const SparseStore& store) {
+        count_ = store.count_;
+        bins_ = store.bins_;
+    }
+
+    /* The non-empty bins, sorted by key */
+    const Bins& bins() const {
+        return bins_;
+    }
+
+    RealValue count() const {
+        return count_;
+    }
+
+    /* The number of non-empty bins */
+    Index length() const {
+        return bins_.size();
+    }
+
+    bool is_empty() const {
+        return bins_.empty();
+    }
+
+    /* Remove all the values from the store */
+    void clear() {
+        count_ = 0;
+        bins_.clear();
+    }
+
+    /* The bins are only allocated for the keys which are added */
+    void reserve(Index /* min_key */, Index /* max_key */) {
+    }
+
+    void shrink_to_fit() {
+        bins_.shrink_to_fit();
+    }
+
+    /* Call visit(key, count) for each non-empty bin, by increasing key */
+    template <class Visit>
+    void for_each_bin(Visit visit) const {
+        for (const auto& bin : bins_) {
+            visit(bin.first, bin.second);
+        }
+    }
+
+    void add(Index key, RealValue weight = 1.0) {
+        auto bin = find_bin(key);
+
+        if (bin != bins_.end() && bin->first == key) {
+            bin->second += weight;
+        } else {
+            bins_.emplace(bin, key, weight);
+        }
+
+        count_ += weight;
+    }
+
+    /*
+     * Updates the counters for a batch of keys, with unit weights.
+     * The keys are sorted and merged with the bins in a single pass
+     */
+    void add_batch(const Index* keys, size_t count) {
+        if (count == 0) {
+            return;
+        }
+
+        Bins batch;
+        batch.reserve(count);
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            batch.emplace_back(keys[idx], 1.0);
+        }
+
+        add_unsorted_bins(batch);
+    }
+
+    /* Same as above, with a weight for each key */
+    void add_batch(const Index* keys, const RealValue* weights, size_t count) {
+        if (count == 0) {
+            return;
+        }
+
+        Bins batch;
+        batch.reserve(count);
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            batch.emplace_back(keys[idx], weights[idx]);
+        }
+
+        add_unsorted_bins(batch);
+    }
+
+    Index key_at_rank(RealValue rank, bool lower = true) const {
+        Index key;
+        key_at_ranks(&rank, 1, &key, lower);
+
+        return key;
+    }
+
+    /*
+     * Same as key_at_rank, for several ranks sorted in increasing order,
+     * which are all resolved during a single pass over the bins
+     */
+    void key_at_ranks(const RealValue* ranks,
+                      size_t count,
+                      Index* keys,
+                      bool lower = true) const {
+        auto running_ct = 0.0;
+        size_t rank_idx = 0;
+
+        for (const auto& bin : bins_) {
+            running_ct += bin.second;
+
+            while (rank_idx < count &&
+                   ((lower && running_ct > ranks[rank_idx]) ||
+                    (!lower && running_ct >= ranks[rank_idx] + 1))) {
+                keys[rank_idx++] = bin.first;
+            }
+
+            if (rank_idx == count) {
+                return;
+            }
+        }
+
+        std::fill(keys + rank_idx, keys + count, max_key());
+    }
+
+    /* The sum of the counts of the bins up to the key, included */
+    RealValue count_up_to(Index key) const {
+        RealValue count;
+        counts_up_to(&key, 1, &count);
+
+        return count;
+    }
+
+    /*
+     * Same as count_up_to, for several keys sorted in increasing order, which
+     * are all resolved during a single pass over the bins
+     */
+    void counts_up_to(const Index* keys,
+                      size_t count,
+                      RealValue* counts) const {
+        auto running_ct = 0.0;
+        size_t key_idx = 0;
+
+        for (const auto& bin : bins_) {
+            while (key_idx < count && keys[key_idx] < bin.first) {
+                counts[key_idx++] = running_ct;
+            }
+
+            if (key_idx == count) {
+                return;
+            }
+
+            running_ct += bin.second;
+        }
+
+        std::fill(counts + key_idx, counts + count, running_ct);
+    }
+
+    /* Merge the bins of the two stores, in a single pass over both */
+    void merge(const SparseStore& store) {
+        if (store.count_ == 0) {
+            return;
+        }
+
+        if (count_ == 0) {
+            copy(store);
+            return;
+        }
+
+        merge_sorted_bins(store.bins_);
+    }
+
+    /* Same as above, taking the bins of the other store if this one is empty */
+    void merge(SparseStore&& store) {
+        if (&store == this) {
+            merge(static_cast<const SparseStore&>(store));
+            return;
+        }
+
+        if (count_ == 0) {
+            count_ = store.count_;
+            bins_.swap(store.bins_);
+        } else {
+            merge(static_cast<const SparseStore&>(store));
+        }
+
+        store.clear();
+    }
+
+    /*
+     * Merge several stores. The bins are already sorted, so merging them one
+     * store at a time beats sorting the bins of all the stores at once
+     */
+    void merge_all(const SparseStore* const* stores, size_t num_stores) {
+        for (size_t idx = 0; idx < num_stores; ++idx) {
+            merge(*stores[idx]);
+        }
+    }
+
+    /*
+     * Subtract the bins of a store whose values have all been added to, or
+     * merged into, this one, in a single pass over both. The bins which
+     * become empty are removed. Throws std::invalid_argument, leaving the
+     * store unchanged, if the other store holds keys which this one does
+     * not, or higher counts for them
+     */
+    void subtract(const SparseStore& store) {
+        if (store.count_ == 0) {
+            return;
+        }
+
+        if (!holds(store)) {
+            throw std::invalid_argument(
+                "The bins to subtract are not in the store");
+        }
+
+        auto last = bins_.begin();
+        auto other_bin = store.bins_.cbegin();
+
+        for (auto bin = bins_.begin(); bin != bins_.end(); ++bin) {
+            if (other_bin != store.bins_.cend() &&
+                    other_bin->first == bin->first) {
+                bin->second =
+                    subtract_count(bin->second, (other_bin++)->second);
+
+                if (bin->second <= 0) {
+                    continue;
+                }
+            }
+
+            *last++ = *bin;
+        }
+
+        bins_.erase(last, bins_.end());
+        count_ = bins_.empty() ? 0 : subtract_count(count_, store.count_);
+    }
+
+    /*
+     * Whether each bin of the other store is in this one, with a count at
+     * least as high up to the rounding of the counts, i.e., whether the
+     * other store can be subtracted
+     */
+    bool holds(const SparseStore& store) const {
+        auto bin = bins_.cbegin();
+
+        for (const auto& other_bin : store.bins_) {
+            while (bin != bins_.cend() && bin->first < other_bin.first) {
+                ++bin;
+            }
+
+            if (bin == bins_.cend() || bin->first != other_bin.first ||
+                    exceeds_count(other_bin.second, bin->second)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /*
+     * The size of the Store message of the DDSketch protobuf format
+     * that serialize writes
+     */
+    size_t serialized_size() const {
+        size_t size = 0;
+
+        for (const auto& bin : bins_) {
+            size += StoreProto::bin_count_size(bin.first);
+        }
+
+        return size;
+    }
+
+    /*
+     * Encode the store as a Store message, into a buffer of at least
+     * serialized_size() bytes. The bins are written as binCounts entries.
+     * Returns the number of bytes written
+     */
+    size_t serialize(uint8_t* buffer, size_t size) const {
+        auto writer = ProtoWriter(buffer, size);
+        encode(writer);
+
+        return writer.size();
+    }
+
+    void encode(ProtoWriter& writer) const {
+        for (const auto& bin : bins_) {
+            StoreProto::write_bin_count(writer, bin.first, bin.second);
+        }
+    }
+
+    /*
+     * Replace the content of the store with a Store message. Throws
+     * SerializationException, and leaves the store empty, if the message
+     * is malformed
+     */
+    void deserialize(const uint8_t* buffer, size_t size) {
+        decode(ProtoReader(buffer, size));
+    }
+
+    void decode(ProtoReader reader) {
+        clear();
+
+        Bins decoded_bins;
+
+        StoreProto::for_each_bin(
+            reader,
+            [&decoded_bins](Index key, RealValue bin_ct) {
+                decoded_bins.emplace_back(key, bin_ct);
+            });
+
+        add_unsorted_bins(decoded_bins);
+    }
+
+ private:
+    Index max_key() const {
+        return bins_.empty() ? std::numeric_limits<Index>::min()
+                             : bins_.back().first;
+    }
+
+    Bins::iterator find_bin(Index key) {
+        return std::lower_bound(
+            bins_.begin(),
+            bins_.end(),
+            key,
+            [](const Bin& bin, Index bin_key) {
+                return bin.first < bin_key;
+            });
+    }
+
+    /* Sort the bins by key, summing the counts of equal keys, and add them */
+    void add_unsorted_bins(Bins& bins) {
+        if (bins.empty()) {
+            return;
+        }
+
+        std::sort(
+            bins.begin(),
+            bins.end(),
+            [](const Bin& bin, const Bin& other_bin) {
+                return bin.first < other_bin.first;
+            });
+
+        auto last = bins.begin();
+
+        for (auto bin = bins.begin() + 1; bin != bins.end(); ++bin) {
+            if (bin->first == last->first) {
+                last->second += bin->second;
+            } else {
+                *++last = *bin;
+            }
+        }
+
+        bins.erase(last + 1, bins.end());
+
+        if (bins_.empty()) {
+            count_ = 0;
+
+            for (const auto& bin : bins) {
+                count_ += bin.second;
+            }
+
+            bins_.swap(bins);
+            return;
+        }
+
+        merge_sorted_bins(bins);
+    }
+
+    /* Merge bins sorted by key, with distinct keys, into this store */
+    void merge_sorted_bins(const Bins& bins) {
+        Bins merged_bins;
+        merged_bins.reserve(bins_.size() + bins.size());
+
+        auto bin = bins_.cbegin();
+        auto other_bin = bins.cbegin();
+
+        while (bin != bins_.cend() && other_bin != bins.cend()) {
+            if (bin->first < other_bin->first) {
+                merged_bins.push_back(*bin++);
+            } else if (other_bin->first < bin->first) {
+                count_ += other_bin->second;
+                merged_bins.push_back(*other_bin++);
+            } else {
+                count_ += other_bin->second;
+                merged_bins.emplace_back(
+                    bin->first, bin->second + other_bin->second);
+                ++bin;
+                ++other_bin;
+            }
+        }
+
+        merged_bins.insert(merged_bins.end(), bin, bins_.cend());
+
+        for (; other_bin != bins.cend(); ++other_bin) {
+            count_ += other_bin->second;
+            merged_bins.push_back(*other_bin);
+        }
+
+        bins_.swap(merged_bins);
+    }
+
+    RealValue count_;  /* The sum of the counts for the bins */
+    Bins bins_;        /* The non-empty bins, sorted by key */
+};
+
+/*
+ * Thrown when an argument is misspecified
+ */
+class IllegalArgumentException : public std::exception {
+ public:
+    const char* what() const noexcept override {
+        return message_.c_str();
+    }
+
+    explicit IllegalArgumentException(const std::string& message)
+        : message_(message) {
+    }
+
+ private:
+    std::string message_;
+};
+
+/*
+ * Thrown when trying to merge two sketches with different
+ * relative_accuracy parameters
+ */
+class UnequalSketchParametersException : public std::exception {
+ public:
+    const char* what() const noexcept override {
+        return "Cannot merge two DDSketches with different parameters";
+    }
+};
+
+/*
+ * How a mapping approximates the logarithm, as encoded in the IndexMapping
+ * message of the DDSketch protobuf format
+ */
+enum class Interpolation : uint8_t {
+    kNone = 0,
+    kLinear = 1,
+    kQuadratic = 2,
+    kCubic = 3
+};
+
+/*
+ * A mapping between values and integer indices that imposes relative accuracy
+ * guarantees. Specifically, for any value `minIndexableValue() < value <
+ * maxIndexableValue` implementations of `KeyMapping` must be such that
+ * `value(key(v))` is close to `v` with a relative error that is less than
+ * `relative_accuracy`.
+ *
+ * In implementations of KeyMapping, there is generally a trade-off between the
+ * cost of computing the key and the number of keys that are required to cover a
+ * given range of values (memory optimality). The most memory-optimal mapping is
+ * the LogarithmicMapping, but it requires the costly evaluation of the logarithm
+ * when computing the index. Other mappings can approximate the logarithmic
+ *mapping, while being less computationally costly.
+ *
+ * Concrete mappings derive from KeyMapping<ConcreteMapping> and provide
+ * log_gamma and pow_gamma, which are resolved at compile time.
+ */
+template <class ConcreteMapping>
+class KeyMapping : CRTP<ConcreteMapping> {
+    friend struct CRTP<ConcreteMapping>;
+
+ public:
+    /*
+     * Args:
+     *       value
+     * Returns:
+     *       The key specifying the bucket for value
+     */
+    Index key(RealValue value) {
+        return static_cast<Index>(
+            std::ceil(this->underlying().log_gamma(value)) + offset_);
+    }
+
+    /*
+     * Compute the keys for a batch of values, see key().
+     * The loop has no dependency between iterations, so that it can be
+     * vectorized whenever log_gamma can.
+     */
+    void key_batch(const RealValue* values, size_t count, Index* keys) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            keys[idx] = this->underlying().key(values[idx]);
+        }
+    }
+
+    /*
+     * Args:
+     *       key
+     * Returns:
+     *       The value represented by the bucket specified by the key
+     */
+    RealValue value(Index key) const {
+        return this->underlying().pow_gamma(key - offset_) *
+               (2.0 / (1 + gamma_));
+    }
+
+    /* The lowest value, exclusive, of the bucket specified by the key */
+    RealValue lower_bound(Index key) const {
+        return this->underlying().pow_gamma(key - 1 - offset_);
+    }
+
+    /* The highest value, inclusive, of the bucket specified by the key */
+    RealValue upper_bound(Index key) const {
+        return this->underlying().pow_gamma(key - offset_);
+    }
+
+    RealValue relative_accuracy() const {
+        return relative_accuracy_;
+    }
+
+    RealValue gamma() const {
+        return gamma_;
+    }
+
+    RealValue min_possible() const {
+        return min_possible_;
+    }
+
+    RealValue max_possible() const {
+        return max_possible_;
+    }
+
+    RealValue multiplier() const {
+        return multiplier_;
+    }
+
+    RealValue& multiplier() {
+        return multiplier_;
+    }
+
+    RealValue offset() const {
+        return offset_;
+    }
+
+    /* The size of the IndexMapping message that encode writes */
+    size_t serialized_size() const {
+        auto size = ProtoWriter::kTagSize + sizeof(RealValue);
+
+        if (offset_ != 0) {
+            size += ProtoWriter::kTagSize + sizeof(RealValue);
+        }
+
+        if (ConcreteMapping::kInterpolation != Interpolation::kNone) {
+            size += ProtoWriter::kTagSize + ProtoWriter::varint_size(
+                static_cast<uint64_t>(ConcreteMapping::kInterpolation));
+        }
+
+        return size;
+    }
+
+    /* Encode the gamma, the offset and the interpolation of the mapping */
+    void encode(ProtoWriter& writer) const {
+        writer.write_tag(kGammaField, WireType::kFixed64);
+        writer.write_double(gamma_);
+
+        if (offset_ != 0) {
+            writer.write_tag(kIndexOffsetField, WireType::kFixed64);
+            writer.write_double(offset_);
+        }
+
+        if (ConcreteMapping::kInterpolation != Interpolation::kNone) {
+            writer.write_tag(kInterpolationField, WireType::kVarint);
+            writer.write_varint(
+                static_cast<uint64_t>(ConcreteMapping::kInterpolation));
+        }
+    }
+
+    /*
+     * Check that an IndexMapping message describes this mapping, so that
+     * the keys it was used for can be read as keys of this mapping.
+     * The gammas may differ by a rounding error, as they can be computed
+     * differently by the other implementations
+     */
+    void check_encoded(ProtoReader reader) const {
+        auto gamma = 0.0;
+        auto offset = 0.0;
+        uint64_t interpolation = 0;
+
+        while (!reader.at_end()) {
+            int field;
+            WireType wire_type;
+
+            reader.read_tag(field, wire_type);
+
+            if (field == kGammaField) {
+                ProtoReader::expect(wire_type, WireType::kFixed64);
+                gamma = reader.read_double();
+            } else if (field == kIndexOffsetField) {
+                ProtoReader::expect(wire_type, WireType::kFixed64);
+                offset = reader.read_double();
+            } else if (field == kInterpolationField) {
+                ProtoReader::expect(wire_type, WireType::kVarint);
+                interpolation = reader.read_varint();
+            } else {
+                reader.skip(wire_type);
+            }
+        }
+
+        if (!(std::abs(gamma - gamma_) <= kGammaTolerance * gamma_) ||
+            offset != offset_ ||
+            interpolation !=
+                static_cast<uint64_t>(ConcreteMapping::kInterpolation)) {
+            throw SerializationException(
+                "The index mapping differs from the one of the sketch");
+        }
+    }
+
+ protected:
+    explicit KeyMapping(RealValue relative_accuracy,
+                        RealValue offset = 0.0) {
+        if (relative_accuracy <= 0.0 || relative_accuracy >= 1.0) {
+            throw IllegalArgumentException(
+                "Relative accuracy must be between 0 and 1");
+        }
+
+        relative_accuracy_ = relative_accuracy;
+        offset_ = offset;
+
+        auto gamma_mantissa = 2 * relative_accuracy / (1 - relative_accuracy);
+
+        gamma_ = 1.0 + gamma_mantissa;
+        multiplier_ = 1.0 / std::log1p(gamma_mantissa);
+
+        min_possible_ = std::numeric_limits<RealValue>::min() * gamma_;
+        max_possible_ = std::numeric_limits<RealValue>::max() / gamma_;
+    }
+
+    /*
+     * Concrete mappings implement:
+     *
+     *   Return (an approximation of) the logarithm of the value base gamma
+     *   RealValue log_gamma(RealValue value) const;
+     *
+     *   Return (an approximation of) gamma to the power value
+     *   RealValue pow_gamma(RealValue value) const;
+     */
+
+ private:
+    static RealValue adjust_accuracy(RealValue relative_accuracy) {
+        if (relative_accuracy <= 0.0 || relative_accuracy >= 1.0) {
+            return kDefaultRelativeAccuracy;
+        }
+
+        return relative_accuracy;
+    }
+
+    /*
+     * The accuracy guarantee.
+     * Referred to as alpha in the paper. (0. < alpha < 1.)
+     */
+    static constexpr auto kDefaultRelativeAccuracy = 0.01;
+
+    /* The field numbers of the IndexMapping message */
+    static constexpr int kGammaField = 1;
+    static constexpr int kIndexOffsetField = 2;
+    static constexpr int kInterpolationField = 3;
+
+    static constexpr RealValue kGammaTolerance = 1e-12;
+    /*
+     * The accuracy guarantee.
+     * referred to as alpha in the paper (0. < alpha < 1.)
+     */
+    RealValue relative_accuracy_;
+
+    /* An offset that can be used to shift all bin keys */
+    RealValue offset_;
+
+    /*
+     * The base for the exponential buckets.
+     * gamma = (1 + alpha) / (1 - alpha)
+     */
+    RealValue gamma_;
+
+    /* The smallest value the sketch can distinguish from 0 */
+    RealValue min_possible_;
+
+    /* The largest value the sketch can handle */
+    RealValue max_possible_;
+
+    /*
+     * Used for calculating log_gamma(value).
+     * Initially multiplier = 1 / log(gamma)
+     */
+    RealValue multiplier_;
+};
+
+/*
+ * A memory-optimal KeyMapping, i.e, given a targeted relative accuracy,
+ * it requires the least number of keys to cover a given range of values.
+ * This is done by logarithmically mapping floating-point values to integers.
+ */
+class LogarithmicMapping : public KeyMapping<LogarithmicMapping> {
+ public:
+    static constexpr Interpolation kInterpolation = Interpolation::kNone;
+
+    explicit LogarithmicMapping(RealValue relative_accuracy,
+                                RealValue offset = 0.0) :
+        KeyMapping(relative_accuracy, offset) {
+        multiplier() *= std::log(2.0);
+    }
+
+ private:
+    friend class KeyMapping<LogarithmicMapping>;
+
+    RealValue log_gamma(RealValue value) const {
+        return std::log2(value) * multiplier();
+    }
+
+    RealValue pow_gamma(RealValue value) const {
+        return std::exp2(value / multiplier());
+    }
+};
+
+/*
+ * Reads and builds IEEE-754 doubles straight from their binary representation,
+ * as an inlineable, branch-free alternative to std::frexp and std::ldexp.
+ * Only valid for positive normal values (i.e., not zero, subnormal, infinite
+ * or NaN), which are the only ones the interpolated mappings deal with.
+ */
+class DoubleBitOperationHelper {
+ public:
+    /* The exponent e, s.t. value = m * 2 ** e, with m in [1, 2) */
+    static int64_t get_exponent(RealValue value) {
+        auto biased_exponent =
+            (to_bits(value) & kExponentMask) >> kSignificandWidth;
+
+        return static_cast<int64_t>(biased_exponent) - kExponentBias;
+    }
+
+    /* The m, s.t. value = m * 2 ** e, with m in [1, 2) */
+    static RealValue get_significand_plus_one(RealValue value) {
+        return from_bits((to_bits(value) & kSignificandMask) | kOneBits);
+    }
+
+    /* The bits of the significand, without the implicit leading one */
+    static uint64_t get_significand_bits(RealValue value) {
+        return to_bits(value) & kSignificandMask;
+    }
+
+    /*
+     * Return significand_plus_one * 2 ** exponent, for exponents of normal
+     * values. As with std::ldexp, the scaling by a power of 2 is exact.
+     */
+    static RealValue build_double(int64_t exponent,
+                                  RealValue significand_plus_one) {
+        auto power_of_two = from_bits(
+            static_cast<uint64_t>(exponent + kExponentBias)
+                << kSignificandWidth);
+
+        return significand_plus_one * power_of_two;
+    }
+
+    static constexpr int kSignificandWidth = 52;
+
+ private:
+    static uint64_t to_bits(RealValue value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+
+        return bits;
+    }
+
+    static RealValue from_bits(uint64_t bits) {
+        RealValue value;
+        std::memcpy(&value, &bits, sizeof(value));
+
+        return value;
+    }
+
+    static constexpr int64_t kExponentBias = 1023;
+    static constexpr uint64_t kSignificandMask = 0x000fffffffffffffULL;
+    static constexpr uint64_t kExponentMask = 0x7ff0000000000000ULL;
+    static constexpr uint64_t kOneBits = 0x3ff0000000000000ULL;
+};
+
+/*
+ * A fast KeyMapping that approximates the memory-optimal one
+ * (LogarithmicMapping) by extracting the floor value of the logarithm to the
+ * base 2 from the binary representations of floating-point values and
+ * linearly interpolating the logarithm in-between.
+ */
+class LinearlyInterpolatedMapping
+    : public KeyMapping<LinearlyInterpolatedMapping> {
+ public:
+    static constexpr Interpolation kInterpolation = Interpolation::kLinear;
+
+    explicit LinearlyInterpolatedMapping(RealValue relative_accuracy,
+                                         RealValue offset = 0.0) :
+        KeyMapping(relative_accuracy, offset) {
+    }
+
+ private:
+    friend class KeyMapping<LinearlyInterpolatedMapping>;
+
+    /*
+     * Approximates log2 by s + f
+     * where v = (s+1) * 2 ** f  for s in [0, 1)
+     * Both s and f are read from the binary representation of v, which gives
+     * the same result as adjusting the output of frexp(v)
+     */
+    static RealValue log2_approx(RealValue value) {
+        auto exponent = DoubleBitOperationHelper::get_exponent(value);
+        auto significand =
+            DoubleBitOperationHelper::get_significand_plus_one(value) - 1;
+        return significand + exponent;
+    }
+
+    /*
+     * Inverse of log2_approx. The mantissa is computed as in
+     * ldexp((value - exponent + 2) / 2, exponent), so that the result is
+     * the same; it is then rebuilt directly, with no library call
+     */
+    static RealValue exp2_approx(RealValue value) {
+        auto exponent = std::floor(value) + 1;
+        auto mantissa = (value - exponent + 2) / 2.0;
+        return DoubleBitOperationHelper::build_double(
+            static_cast<int64_t>(exponent) - 1, 2.0 * mantissa);
+    }
+
+    RealValue log_gamma(RealValue value) const {
+        return log2_approx(value) * multiplier();
+    }
+
+    RealValue pow_gamma(RealValue value) const {
+        return exp2_approx(value / multiplier());
+    }
+};
+
+/*
+ * A fast KeyMapping that approximates the memory-optimal LogarithmicMapping by
+ * extracting the floor value of the logarithm to the base 2 from the binary
+ * representations of floating-point values and cubically interpolating the
+ * logarithm in-between.
+ *
+ * More detailed documentation of this method can be found in:
+ *     https://github.com/DataDog/sketches-java/
+ */
+class CubicallyInterpolatedMapping
+    : public KeyMapping<CubicallyInterpolatedMapping> {
+ public:
+    static constexpr Interpolation kInterpolation = Interpolation::kCubic;
+
+    explicit CubicallyInterpolatedMapping(RealValue relative_accuracy,
+                                          RealValue offset = 0.0) :
+        KeyMapping(relative_accuracy, offset) {
+        multiplier() /= C_;
+    }
+
+ private:
+    friend class KeyMapping<CubicallyInterpolatedMapping>;
+
+    /* Approximates log2 using a cubic polynomial */
+    static RealValue cubic_log2_approx(RealValue value) {
+        auto exponent = DoubleBitOperationHelper::get_exponent(value);
+        auto significand =
+            DoubleBitOperationHelper::get_significand_plus_one(value) - 1;
+
+        return
+            ((A_ * significand + B_) * significand + C_) * significand +
+            exponent;
+    }
+
+    /* Derived from Cardano's formula */
+    static RealValue cubic_exp2_approx(RealValue value) {
+        auto floor_value = std::floor(value);
+        auto exponent = static_cast<int>(floor_value);
+        auto delta_0 = B_ * B_ - 3 * A_ * C_;
+        auto delta_1 = (
+              2  * B_ * B_ * B_
+            - 9  * A_ * B_ * C_
+            - 27 * A_ * A_ * (value - exponent));
+
+        auto cardano = std::cbrt(
+            (delta_1 -
+                std::sqrt(delta_1 * delta_1 -
+                              4 * delta_0 * delta_0 * delta_0)) / 2.0);
+
+        auto significand_plus_one =
+            -(B_ + cardano + delta_0 / cardano) / (3 * A_) + 1;
+
+        return DoubleBitOperationHelper::build_double(
+            exponent, significand_plus_one);
+    }
+
+    RealValue log_gamma(RealValue value) const {
+        return cubic_log2_approx(value) * multiplier();
+    }
+
+    RealValue pow_gamma(RealValue value) const {
+        return cubic_exp2_approx(value / multiplier());
+    }
+
+    static constexpr RealValue A_ = 6.0 / 35;
+    static constexpr RealValue B_ = -3.0 / 5;
+    static constexpr RealValue C_ = 10.0 / 7;
+};
+
+/*
+ * A KeyMapping whose keys are exactly the ones of LogarithmicMapping, so that
+ * the sketches remain mergeable with the ones of the other implementations,
+ * but which computes them without evaluating the logarithm.
+ *
+ * The key of a value is first bounded from below, using its exponent and a
+ * table of the logarithms at the top bits of its significand, which are fine
+ * enough for the bound to be off by at most one key. A single comparison with
+ * the smallest value of the next key, from a table of the bounds of the keys,
+ * then gives the exact key. The bounds are found by searching around the
+ * value of each key with the logarithm that LogarithmicMapping uses.
+ *
+ * The tables are built by the constructor, and shared by the copies of the
+ * mapping, as well as by the next mappings that the thread builds with the
+ * same accuracy. As they grow with 1 / relative_accuracy, they only cover the
+ * exponents around 0 for which they hold at most kMaxTableKeys keys; the keys
+ * of the other values are computed as LogarithmicMapping does.
+ */
+class TableLogarithmicMapping : public KeyMapping<TableLogarithmicMapping> {
+ public:
+    static constexpr Interpolation kInterpolation = Interpolation::kNone;
+
+    explicit TableLogarithmicMapping(RealValue relative_accuracy,
+                                     RealValue offset = 0.0) :
+        KeyMapping(relative_accuracy, offset) {
+        multiplier() *= std::log(2.0);
+
+        /* The sketches of a thread are usually built with the same accuracy */
+        static thread_local std::shared_ptr<const Table> last_table;
+
+        if (!last_table || last_table->multiplier != multiplier()) {
+            auto table = std::make_shared<Table>();
+            build_table(*table);
+
+            last_table = std::move(table);
+        }
+
+        table_ = last_table;
+    }
+
+    Index key(RealValue value) {
+        const auto& table = *table_;
+
+        auto exponent = DoubleBitOperationHelper::get_exponent(value);
+
+        if (exponent < table.min_exponent || exponent >= table.max_exponent) {
+            return KeyMapping::key(value);
+        }
+
+        auto significand_idx =
+            DoubleBitOperationHelper::get_significand_bits(value) >>
+                table.significand_shift;
+
+        /*
+         * The logs are negated and shifted, so that their sum is positive and
+         * truncates to max_key + 1 less the lower bound of the key, without
+         * calling std::ceil
+         */
+        auto bound_idx = static_cast<size_t>(
+            table.exponent_logs[exponent - table.min_exponent] +
+            table.significand_logs[significand_idx]);
+
+        /* Without a branch, as the comparison is not predictable */
+        auto unshifted_key =
+            table.max_key + 1 - static_cast<Index>(bound_idx) +
+            static_cast<Index>(value >= table.lower_bounds[bound_idx]);
+
+        return static_cast<Index>(
+            static_cast<RealValue>(unshifted_key) + offset());
+    }
+
+ private:
+    friend class KeyMapping<TableLogarithmicMapping>;
+
+    /*
+     * The tables, for the values with an exponent in
+     * [min_exponent, max_exponent)
+     */
+    struct Table {
+        /* The multiplier of the mapping which the tables were built for */
+        RealValue multiplier = 0.0;
+
+        int64_t min_exponent = 0;
+        int64_t max_exponent = 0;
+        int significand_shift = 0;
+
+        /* max_key + 1 - exponent * multiplier, plus the slack */
+        std::vector<RealValue> exponent_logs;
+
+        /* -log_gamma(1 + idx / 2 ** significand_bits) */
+        std::vector<RealValue> significand_logs;
+
+        /*
+         * The smallest value of the unshifted key max_key + 2 - idx, i.e.,
+         * the one after the lower bound, for each idx which the sum of the
+         * logs truncates to
+         */
+        std::vector<RealValue> lower_bounds;
+
+        /* The greatest unshifted key of the values in the tables */
+        Index max_key = 0;
+    };
+
+    /* The unshifted key, as LogarithmicMapping computes it */
+    RealValue log_key(RealValue value) const {
+        return std::ceil(log_gamma(value));
+    }
+
+    /* The smallest positive value whose unshifted key is at least key */
+    RealValue first_value(Index key) const {
+        auto value = pow_gamma(static_cast<RealValue>(key - 1));
+
+        while (log_key(value) >= key) {
+            value = std::nextafter(value, 0.0);
+        }
+
+        while (log_key(value) < key) {
+            value = std::nextafter(
+                value, std::numeric_limits<RealValue>::max());
+        }
+
+        return value;
+    }
+
+    void build_table(Table& table) {
+        table.multiplier = multiplier();
+
+        auto keys_per_exponent = static_cast<int64_t>(multiplier()) + 1;
+        auto num_exponents = std::min(
+            int64_t{kMaxTableExponents},
+            kMaxTableKeys / keys_per_exponent / 2 * 2);
+
+        /* Too fine an accuracy to fit in the tables */
+        if (num_exponents == 0) {
+            return;
+        }
+
+        /*
+         * A bin of the significands spans at most half a key, so that, with
+         * the slack, the lower bound is at most one key below the key
+         */
+        auto significand_bits = static_cast<int>(
+            std::ceil(std::log2(2.0 * multiplier() / std::log(2.0))));
+
+        significand_bits = std::max(1, significand_bits);
+
+        auto num_significands = size_t(1) << significand_bits;
+
+        /* Much larger than the rounding errors of both computations */
+        auto slack = kSlack * static_cast<RealValue>(
+            (num_exponents / 2 + 1) * keys_per_exponent);
+
+        table.min_exponent = -num_exponents / 2;
+        table.max_exponent = num_exponents / 2;
+        table.significand_shift =
+            DoubleBitOperationHelper::kSignificandWidth - significand_bits;
+
+        auto min_key = static_cast<Index>(
+            log_key(std::ldexp(1.0, static_cast<int>(table.min_exponent))));
+
+        table.max_key = static_cast<Index>(log_key(std::nextafter(
+            std::ldexp(1.0, static_cast<int>(table.max_exponent)), 0.0)));
+
+        for (auto exponent = table.min_exponent;
+             exponent < table.max_exponent;
+             ++exponent) {
+            table.exponent_logs.push_back(
+                static_cast<RealValue>(table.max_key + 1) -
+                static_cast<RealValue>(exponent) * multiplier() + slack);
+        }
+
+        for (size_t idx = 0; idx < num_significands; ++idx) {
+            table.significand_logs.push_back(-log_gamma(
+                1.0 + static_cast<RealValue>(idx) /
+                      static_cast<RealValue>(num_significands)));
+        }
+
+        for (auto key = table.max_key + 1; key >= min_key - 1; --key) {
+            table.lower_bounds.push_back(first_value(key + 1));
+        }
+    }
+
+    RealValue log_gamma(RealValue value) const {
+        return std::log2(value) * multiplier();
+    }
+
+    RealValue pow_gamma(RealValue value) const {
+        return std::exp2(value / multiplier());
+    }
+
+    /* At most 8 bytes per key, for up to 128 exponents around 0 */
+    static constexpr int64_t kMaxTableKeys = 1 << 17;
+    static constexpr int64_t kMaxTableExponents = 128;
+    static constexpr RealValue kSlack = 1e-10;
+
+    std::shared_ptr<const Table> table_;
+};
+
+/*
+ * A Mapping which memoizes the bounds of its buckets, for the mappings whose
+ * pow_gamma is costly, e.g., CubicallyInterpolatedMapping, as the quantile
+ * queries and the exports of the bins keep computing the values of the same
+ * keys. The keys and the values are the same as the ones of Mapping.
+ *
+ * The upper bounds are kept for a contiguous range of up to kMaxCachedKeys
+ * keys, which grows to cover the keys that are queried, and may also be
+ * filled in advance, e.g., for the range of a store, with cache_bounds.
+ * The cache is not copied along with the mapping, and, as it is filled by
+ * the const queries, a mapping must not be queried from several threads at
+ * once.
+ */
+template <class Mapping>
+class CachedMapping : public Mapping {
+ public:
+    explicit CachedMapping(RealValue relative_accuracy,
+                           RealValue offset = 0.0) :
+        Mapping(relative_accuracy, offset), cache_min_key_(0) {
+    }
+
+    explicit CachedMapping(const Mapping& mapping) :
+        Mapping(mapping), cache_min_key_(0) {
+    }
+
+    CachedMapping(const CachedMapping& mapping) :
+        Mapping(mapping), cache_min_key_(0) {
+    }
+
+    CachedMapping(CachedMapping&& mapping) = default;
+
+    CachedMapping& operator=(const CachedMapping& mapping) {
+        Mapping::operator=(mapping);
+
+        upper_bounds_.clear();
+        cache_min_key_ = 0;
+
+        return *this;
+    }
+
+    CachedMapping& operator=(CachedMapping&& mapping) = default;
+
+    /* Same as Mapping::value, from the cached upper bound of the bucket */
+    RealValue value(Index key) const {
+        return upper_bound(key) * (2.0 / (1 + this->gamma()));
+    }
+
+    RealValue lower_bound(Index key) const {
+        return upper_bound(key - 1);
+    }
+
+    RealValue upper_bound(Index key) const {
+        if (!extend_cache(key, key)) {
+            return Mapping::upper_bound(key);
+        }
+
+        auto& bound = upper_bounds_[key - cache_min_key_];
+
+        /* A bound is never 0, which marks the ones not computed yet */
+        if (bound == 0.0) {
+            bound = Mapping::upper_bound(key);
+        }
+
+        return bound;
+    }
+
+    /*
+     * Compute the bounds of the keys in [min_key - 1, max_key], i.e., the
+     * lower and upper bounds of the buckets in [min_key, max_key], unless
+     * there are more than kMaxCachedKeys of them
+     */
+    void cache_bounds(Index min_key, Index max_key) const {
+        if (min_key > max_key || !extend_cache(min_key - 1, max_key)) {
+            return;
+        }
+
+        for (auto key = min_key - 1; key <= max_key; ++key) {
+            upper_bound(key);
+        }
+    }
+
+    /* The number of keys that the cache covers */
+    size_t cached_keys() const {
+        return upper_bounds_.size();
+    }
+
+    static constexpr size_t kMaxCachedKeys = 1 << 14;
+
+ private:
+    /*
+     * Make the cache cover [min_key, max_key], unless it would then cover
+     * more than kMaxCachedKeys keys. The cache grows by at least its size
+     * on the side that it is extended to, so that the successive queries of
+     * increasing or decreasing keys extend it a logarithmic number of times
+     */
+    bool extend_cache(Index min_key, Index max_key) const {
+        auto size = static_cast<Index>(upper_bounds_.size());
+
+        if (size > 0 &&
+                min_key >= cache_min_key_ &&
+                max_key < cache_min_key_ + size) {
+            return true;
+        }
+
+        auto new_min_key = min_key;
+        auto new_max_key = max_key;
+
+        if (size > 0) {
+            new_min_key = std::min(min_key, cache_min_key_);
+            new_max_key = std::max(max_key, cache_min_key_ + size - 1);
+        }
+        auto max_size = static_cast<Index>(kMaxCachedKeys);
+
+        if (new_max_key - new_min_key + 1 > max_size) {
+            return false;
+        }
+
+        auto spare = std::min(size, max_size - (new_max_key - new_min_key + 1));
+
+        if (size > 0 && new_min_key < cache_min_key_) {
+            new_min_key -= spare;
+        } else if (size > 0) {
+            new_max_key += spare;
+        }
+
+        std::vector<RealValue> upper_bounds(
+            static_cast<size_t>(new_max_key - new_min_key + 1), 0.0);
+
+        std::copy(upper_bounds_.begin(), upper_bounds_.end(),
+                  upper_bounds.begin() + (cache_min_key_ - new_min_key));
+
+        upper_bounds_ = std::move(upper_bounds);
+        cache_min_key_ = new_min_key;
+
+        return true;
+    }
+
+    /* The upper bounds of the keys from cache_min_key_, 0 if not computed */
+    mutable std::vector<RealValue> upper_bounds_;
+    mutable Index cache_min_key_;
+};
+
+template <class Mapping>
+constexpr size_t CachedMapping<Mapping>::kMaxCachedKeys;
+
+/*
+ * Base implementation of DDSketch.
+ * Concrete implementations, derive from this class
+ */
+template <typename Store, class Mapping>
+class BaseDDSketch {
+ public:
+    /*
+     * The stores are taken by value, and moved, so that they keep their
+     * allocator, cf. BaseDenseStore
+     */
+    BaseDDSketch(const Mapping& mapping,
+                 Store store,
+                 Store negative_store) :
+        mapping_(mapping),
+        store_(std::move(store)),
+        negative_store_(std::move(negative_store)),
+        zero_count_(0.0),
+        count_(0.0),
+        min_(std::numeric_limits<RealValue>::max()),
+        max_(std::numeric_limits<RealValue>::min()),
+        sum_(0.0) {
+    }
+
+    static std::string name() {
+        return "DDSketch";
+    }
+
+    RealValue num_values() const {
+        return count_;
+    }
+
+    RealValue sum() const {
+        return sum_;
+    }
+
+    RealValue avg() const {
+        return sum_ / count_;
+    }
+
+    RealValue zero_count() const {
+        return zero_count_;
+    }
+
+    /* The minimum value of the sketch, or NaN if it is empty */
+    RealValue min() const {
+        return count_ == 0 ? std::nan("") : min_;
+    }
+
+    /* The maximum value of the sketch, or NaN if it is empty */
+    RealValue max() const {
+        return count_ == 0 ? std::nan("") : max_;
+    }
+
+    const Mapping& mapping() const {
+        return mapping_;
+    }
+
+    /* The store for positive values */
+    const Store& store() const {
+        return store_;
+    }
+
+    /* The store for negative values */
+    const Store& negative_store() const {
+        return negative_store_;
+    }
+
+    /* Add a value to the sketch, with a unit weight */
+    void add(RealValue val) {
+        if (val > mapping_.min_possible()) {
+            store_.add(mapping_.key(val));
+        } else if (val < -mapping_.min_possible()) {
+            negative_store_.add(mapping_.key(-val));
+        } else {
+            zero_count_ += 1.0;
+        }
+
+        count_ += 1.0;
+        sum_ += val;
+        update_extremes(val);
+    }
+
+    /* Same as above, with a weight, which must be positive */
+    void add(RealValue val, RealValue weight) {
+        if (weight <= 0.0) {
+            throw IllegalArgumentException("Weight must be positive");
+        }
+
+        add_unchecked(val, weight);
+    }
+
+    /* Same as above, without checking the weight, which must be positive */
+    void add_unchecked(RealValue val, RealValue weight) {
+        if (val > mapping_.min_possible()) {
+            store_.add(mapping_.key(val), weight);
+        } else if (val < -mapping_.min_possible()) {
+            negative_store_.add(mapping_.key(-val), weight);
+        } else {
+            zero_count_ += weight;
+        }
+
+        /* Keep track of summary stats */
+        count_ += weight;
+        sum_ += val * weight;
+        update_extremes(val);
+    }
+
+    /*
+     * Add a value known to be greater than mapping().min_possible(), e.g., a
+     * latency, with a unit weight. The value goes to the positive store
+     * without branching on its sign; passing any other value corrupts the
+     * sketch
+     */
+    void add_positive(RealValue val) {
+        store_.add(mapping_.key(val));
+
+        count_ += 1.0;
+        sum_ += val;
+        update_extremes(val);
+    }
+
+    /* Same as above, with a weight, which must be positive, unchecked */
+    void add_positive(RealValue val, RealValue weight) {
+        store_.add(mapping_.key(val), weight);
+
+        count_ += weight;
+        sum_ += val * weight;
+        update_extremes(val);
+    }
+
+    /*
+     * Add a batch of values, all known to be greater than
+     * mapping().min_possible(), with unit weights, cf. add_positive. The
+     * keys are computed straight from the values, without splitting them
+     * by sign
+     */
+    void add_positive_batch(const RealValue* values, size_t count) {
+        Index keys[kBatchChunkSize];
+
+        for (size_t start = 0; start < count; start += kBatchChunkSize) {
+            auto chunk_size = std::min(kBatchChunkSize, count - start);
+            auto chunk = values + start;
+
+            auto sum = 0.0;
+            auto min = min_;
+            auto max = max_;
+
+            for (size_t idx = 0; idx < chunk_size; ++idx) {
+                sum += chunk[idx];
+                min = std::min(min, chunk[idx]);
+                max = std::max(max, chunk[idx]);
+            }
+
+            mapping_.key_batch(chunk, chunk_size, keys);
+            store_.add_batch(keys, chunk_size);
+
+            count_ += chunk_size;
+            sum_ += sum;
+            min_ = min;
+            max_ = max;
+        }
+    }
+
+    /*
+     * Add a batch of values to the sketch, with unit weights.
+     *
+     * Equivalent to calling add() for each value. The values are split by
+     * sign, their keys computed in a single pass and each store's range is
+     * extended at most once per chunk of kBatchChunkSize values.
+     */
+    void add_batch(const RealValue* values, size_t count) {
+        for (size_t start = 0; start < count; start += kBatchChunkSize) {
+            add_chunk(values + start,
+                      nullptr,
+                      std::min(kBatchChunkSize, count - start));
+        }
+    }
+
+    /* Same as above, with a weight for each value */
+    void add_batch(const RealValue* values,
+                   const RealValue* weights,
+                   size_t count) {
+        /* Validate everything first, so that a bad batch adds nothing */
+        for (size_t idx = 0; idx < count; ++idx) {
+            if (weights[idx] <= 0.0) {
+                throw IllegalArgumentException("Weight must be positive");
+            }
+        }
+
+        for (size_t start = 0; start < count; start += kBatchChunkSize) {
+            add_chunk(values + start,
+                      weights + start,
+                      std::min(kBatchChunkSize, count - start));
+        }
+    }
+
+    /*
+     * The approximate value at the specified quantile
+     *   Args:
+     *       quantile 0 <= q <=1
+     *   Returns:
+     *       The value at the specified quantile or NaN if the sketch is empty
+     */
+    RealValue get_quantile_value(RealValue quantile) {
+        auto quantile_value = 0.0;
+
+        if (quantile < 0 || quantile > 1 || count_ == 0) {
+            return std::nan("");
+        }
+
+        auto rank = quantile * (count_ - 1);
+
+        if (rank < negative_store_.count()) {
+            auto reversed_rank = negative_store_.count() - rank - 1;
+            auto key = negative_store_.key_at_rank(reversed_rank, false);
+            quantile_value = -mapping_.value(key);
+        } else if (rank < zero_count_ + negative_store_.count()) {
+            return 0.0;
+        } else {
+            auto key = store_.key_at_rank(
+                            rank - zero_count_ - negative_store_.count());
+            quantile_value = mapping_.value(key);
+        }
+
+        return quantile_value;
+    }
+
+    /*
+     * The approximate values at several quantiles, resolved in a single pass
+     * over each store instead of one pass per quantile.
+     *   Args:
+     *       quantiles  count quantile values, in any order
+     *       values     output, receives the value at each quantile, or NaN
+     *                  if the quantile is not in [0, 1] or the sketch is empty
+     */
+    void get_quantile_values(const RealValue* quantiles,
+                             size_t count,
+                             RealValue* values) {
+        std::vector<size_t> order;
+        order.reserve(count);
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            if (quantiles[idx] >= 0 && quantiles[idx] <= 1 && count_ != 0) {
+                order.push_back(idx);
+            } else {
+                values[idx] = std::nan("");
+            }
+        }
+
+        std::sort(
+            order.begin(),
+            order.end(),
+            [quantiles](size_t left, size_t right) {
+                return quantiles[left] < quantiles[right];
+            });
+
+        auto rank_of = [this, quantiles](size_t idx) {
+            return quantiles[idx] * (count_ - 1);
+        };
+
+        auto num_negative = static_cast<size_t>(
+            std::partition_point(
+                order.begin(),
+                order.end(),
+                [this, &rank_of](size_t idx) {
+                    return rank_of(idx) < negative_store_.count();
+                }) - order.begin());
+
+        auto num_non_positive = static_cast<size_t>(
+            std::partition_point(
+                order.begin() + num_negative,
+                order.end(),
+                [this, &rank_of](size_t idx) {
+                    return rank_of(idx) <
+                           zero_count_ + negative_store_.count();
+                }) - order.begin());
+
+        std::vector<RealValue> ranks(order.size());
+        std::vector<Index> keys(order.size());
+
+        /* The reversed ranks increase as the ranks decrease */
+        for (size_t pos = 0; pos < num_negative; ++pos) {
+            auto idx = order[num_negative - pos - 1];
+            ranks[pos] = negative_store_.count() - rank_of(idx) - 1;
+        }
+
+        negative_store_.key_at_ranks(
+            ranks.data(), num_negative, keys.data(), false);
+
+        for (size_t pos = 0; pos < num_negative; ++pos) {
+            values[order[num_negative - pos - 1]] = -mapping_.value(keys[pos]);
+        }
+
+        for (size_t pos = num_negative; pos < num_non_positive; ++pos) {
+            values[order[pos]] = 0.0;
+        }
+
+        auto num_positive = order.size() - num_non_positive;
+
+        for (size_t pos = 0; pos < num_positive; ++pos) {
+            auto idx = order[num_non_positive + pos];
+            ranks[pos] =
+                rank_of(idx) - zero_count_ - negative_store_.count();
+        }
+
+        store_.key_at_ranks(ranks.data(), num_positive, keys.data());
+
+        for (size_t pos = 0; pos < num_positive; ++pos) {
+            values[order[num_non_positive + pos]] = mapping_.value(keys[pos]);
+        }
+    }
+
+    /*
+     * The approximate rank of the specified value, i.e., the total weight of
+     * the values lower than or equal to it, which is the inverse of
+     * get_quantile_value. The values sharing the bin of the value count as
+     * lower or equal; the values below the minimum or at the maximum of the
+     * sketch are ranked exactly.
+     *   Returns:
+     *       The rank of the value, 0 if the sketch is empty or NaN if the
+     *       value is NaN
+     */
+    RealValue get_rank(RealValue value) {
+        if (std::isnan(value)) {
+            return std::nan("");
+        }
+
+        if (count_ == 0 || value < min_) {
+            return 0.0;
+        }
+
+        if (value >= max_) {
+            return count_;
+        }
+
+        if (value > mapping_.min_possible()) {
+            return negative_store_.count() + zero_count_ +
+                   store_.count_up_to(mapping_.key(value));
+        }
+
+        if (value < -mapping_.min_possible()) {
+            return negative_store_.count() -
+                   negative_store_.count_up_to(mapping_.key(-value) - 1);
+        }
+
+        return negative_store_.count() + zero_count_;
+    }
+
+    /*
+     * The approximate fraction of the values lower than or equal to the
+     * specified value, cf. get_rank, or NaN if the sketch is empty
+     */
+    RealValue get_cdf(RealValue value) {
+        if (count_ == 0) {
+            return std::nan("");
+        }
+
+        return get_rank(value) / count_;
+    }
+
+    /*
+     * The approximate ranks of several values, cf. get_rank, resolved in a
+     * single pass over each store instead of one pass per value.
+     *   Args:
+     *       values  count values, in any order
+     *       ranks   output, receives the rank of each value
+     */
+    void get_ranks(const RealValue* values, size_t count, RealValue* ranks) {
+        std::vector<size_t> order;
+        order.reserve(count);
+
+        /* Only the values within the range of the sketch need the stores */
+        for (size_t idx = 0; idx < count; ++idx) {
+            if (std::isnan(values[idx])) {
+                ranks[idx] = std::nan("");
+            } else if (count_ == 0 || values[idx] < min_) {
+                ranks[idx] = 0.0;
+            } else if (values[idx] >= max_) {
+                ranks[idx] = count_;
+            } else {
+                order.push_back(idx);
+            }
+        }
+
+        std::sort(
+            order.begin(),
+            order.end(),
+            [values](size_t left, size_t right) {
+                return values[left] < values[right];
+            });
+
+        auto num_negative = static_cast<size_t>(
+            std::partition_point(
+                order.begin(),
+                order.end(),
+                [this, values](size_t idx) {
+                    return values[idx] < -mapping_.min_possible();
+                }) - order.begin());
+
+        auto num_non_positive = static_cast<size_t>(
+            std::partition_point(
+                order.begin() + num_negative,
+                order.end(),
+                [this, values](size_t idx) {
+                    return values[idx] <= mapping_.min_possible();
+                }) - order.begin());
+
+        auto negative_count = negative_store_.count();
+
+        std::vector<Index> keys(order.size());
+        std::vector<RealValue> counts(order.size());
+
+        /* The keys of the negative values increase as the values decrease */
+        for (size_t pos = 0; pos < num_negative; ++pos) {
+            auto idx = order[num_negative - pos - 1];
+            keys[pos] = mapping_.key(-values[idx]) - 1;
+        }
+
+        negative_store_.counts_up_to(keys.data(), num_negative, counts.data());
+
+        for (size_t pos = 0; pos < num_negative; ++pos) {
+            ranks[order[num_negative - pos - 1]] =
+                negative_count - counts[pos];
+        }
+
+        for (size_t pos = num_negative; pos < num_non_positive; ++pos) {
+            ranks[order[pos]] = negative_count + zero_count_;
+        }
+
+        auto num_positive = order.size() - num_non_positive;
+
+        for (size_t pos = 0; pos < num_positive; ++pos) {
+            keys[pos] = mapping_.key(values[order[num_non_positive + pos]]);
+        }
+
+        store_.counts_up_to(keys.data(), num_positive, counts.data());
+
+        for (size_t pos = 0; pos < num_positive; ++pos) {
+            ranks[order[num_non_positive + pos]] =
+                negative_count + zero_count_ + counts[pos];
+        }
+    }
+
+    /*
+     * The approximate fractions of the values lower than or equal to several
+     * values, cf. get_ranks, or NaN if the sketch is empty
+     */
+    void get_cdfs(const RealValue* values, size_t count, RealValue* cdfs) {
+        get_ranks(values, count, cdfs);
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            cdfs[idx] = count_ == 0 ? std::nan("") : cdfs[idx] / count_;
+        }
+    }
+
+    /*
+     *  Merges the other sketch into this one.
+     *
+     *  After this operation, this sketch encodes the values that were
+     *  added to both this and the input sketch.
+     */
+    void merge(const BaseDDSketch& sketch) {
+        if (!mergeable(sketch)) {
+            throw UnequalSketchParametersException();
+        }
+
+        if (sketch.count_ == 0) {
+            return;
+        }
+
+        if (count_ == 0) {
+            copy(sketch);
+            return;
+        }
+
+        /* Merge the stores */
+        store_.merge(sketch.store_);
+        negative_store_.merge(sketch.negative_store_);
+
+        merge_summary(sketch);
+    }
+
+    /*
+     * Same as above, but the bins of the other sketch are taken rather than
+     * copied whenever its stores allow it, e.g., when this sketch is empty.
+     * The other sketch is left empty, unless it is this sketch
+     */
+    void merge(BaseDDSketch&& sketch) {
+        if (&sketch == this) {
+            merge(static_cast<const BaseDDSketch&>(sketch));
+            return;
+        }
+
+        if (!mergeable(sketch)) {
+            throw UnequalSketchParametersException();
+        }
+
+        if (sketch.count_ == 0) {
+            return;
+        }
+
+        store_.merge(std::move(sketch.store_));
+        negative_store_.merge(std::move(sketch.negative_store_));
+
+        merge_summary(sketch);
+        sketch.clear();
+    }
+
+    /*
+     * Merge a sketch with other stores or another implementation of the
+     * mapping, whose keys are the keys of this mapping, e.g., a
+     * StaticDDSketch into a DDSketch. The bins are added one by one.
+     * Throws UnequalSketchParametersException if the mappings do not give
+     * the same keys: their interpolations, gammas or offsets differ
+     */
+    template <class OtherStore, class OtherMapping>
+    void merge(const BaseDDSketch<OtherStore, OtherMapping>& sketch) {
+        if (Mapping::kInterpolation != OtherMapping::kInterpolation ||
+            mapping_.gamma() != sketch.mapping().gamma() ||
+            mapping_.offset() != sketch.mapping().offset()) {
+            throw UnequalSketchParametersException();
+        }
+
+        if (sketch.num_values() == 0) {
+            return;
+        }
+
+        sketch.store().for_each_bin(
+            [this](Index key, RealValue bin_ct) {
+                store_.add(key, bin_ct);
+            });
+
+        sketch.negative_store().for_each_bin(
+            [this](Index key, RealValue bin_ct) {
+                negative_store_.add(key, bin_ct);
+            });
+
+        if (count_ == 0) {
+            min_ = sketch.min();
+            max_ = sketch.max();
+        } else {
+            min_ = std::min(min_, sketch.min());
+            max_ = std::max(max_, sketch.max());
+        }
+
+        zero_count_ += sketch.zero_count();
+        count_ += sketch.num_values();
+        sum_ += sketch.sum();
+    }
+
+    /*
+     *  Merges the sketches in [first, last) into this one, at once: each
+     *  store extends its range a single time, to cover the keys of all the
+     *  sketches, before their bins are added.
+     *
+     *  Throws UnequalSketchParametersException, without merging any sketch,
+     *  if one of them cannot be merged.
+     */
+    template <class Iterator>
+    void merge_all(Iterator first, Iterator last) {
+        std::vector<const Store*> stores;
+        std::vector<const Store*> negative_stores;
+
+        for (auto it = first; it != last; ++it) {
+            const BaseDDSketch& sketch = *it;
+
+            if (!mergeable(sketch)) {
+                throw UnequalSketchParametersException();
+            }
+
+            if (sketch.count_ != 0) {
+                stores.push_back(&sketch.store_);
+                negative_stores.push_back(&sketch.negative_store_);
+            }
+        }
+
+        store_.merge_all(stores.data(), stores.size());
+        negative_store_.merge_all(
+            negative_stores.data(), negative_stores.size());
+
+        for (auto it = first; it != last; ++it) {
+            const BaseDDSketch& sketch = *it;
+
+            if (sketch.count_ != 0) {
+                merge_summary(sketch);
+            }
+        }
+    }
+
+    /*
+     *  Subtracts the other sketch from this one, bin by bin.
+     *
+     *  The values of the other sketch must all have been added to, or merged
+     *  into, this one. The bins hold plain sums of weights, so that this
+     *  sketch then encodes the values which were only added to it, exactly
+     *  so for integer weights, and the stores trim their range to the bins
+     *  which remain non-empty. The count, the zero count and the sum are
+     *  subtracted. The min remains exact if the other sketch did not hold
+     *  it; otherwise, it is set to the value at quantile 0, as when
+     *  deserializing; the same goes for the max. Once the count drops to
+     *  zero, the sketch is cleared.
+     *
+     *  Throws UnequalSketchParametersException if the sketches cannot be
+     *  merged, and std::invalid_argument, leaving the sketch unchanged, if
+     *  the other sketch does not hold a subset of the values of this one,
+     *  cf. holds.
+     */
+    void subtract(const BaseDDSketch& sketch) {
+        if (!mergeable(sketch)) {
+            throw UnequalSketchParametersException();
+        }
+
+        if (sketch.count_ == 0) {
+            return;
+        }
+
+        if (!holds(sketch)) {
+            throw std::invalid_argument(
+                "The sketch does not hold the values to subtract");
+        }
+
+        negative_store_.subtract(sketch.negative_store_);
+        store_.subtract(sketch.store_);
+
+        zero_count_ = subtract_count(zero_count_, sketch.zero_count_);
+        count_ = subtract_count(count_, sketch.count_);
+        sum_ -= sketch.sum_;
+
+        if (count_ <= 0) {
+            clear();
+            return;
+        }
+
+        if (sketch.min_ <= min_) {
+            min_ = get_quantile_value(0);
+        }
+
+        if (sketch.max_ >= max_) {
+            max_ = get_quantile_value(1);
+        }
+    }
+
+    /*
+     * Whether the other sketch can be subtracted from this one: its count
+     * and zero count are at most the ones of this sketch, and each of its
+     * stores can be subtracted from the store of this sketch, up to the
+     * rounding of the counts
+     */
+    bool holds(const BaseDDSketch& sketch) const {
+        return !exceeds_count(sketch.count_, count_) &&
+               !exceeds_count(sketch.zero_count_, zero_count_) &&
+               store_.holds(sketch.store_) &&
+               negative_store_.holds(sketch.negative_store_);
+    }
+
+    /*
+     * Encode the difference between this sketch and a baseline, which this
+     * sketch has been built from by adding values or merging sketches, as
+     * a DDSketch message. Only the bins which changed since the baseline
+     * are written, as binCounts entries, so that exporting a cumulative
+     * sketch at regular intervals does not send the unchanged bins again.
+     * apply_delta, on a copy of the baseline, then rebuilds this sketch.
+     *
+     * Throws UnequalSketchParametersException if the baseline cannot be
+     * merged, and std::invalid_argument if this sketch does not hold all
+     * the values of the baseline
+     */
+    std::string serialize_delta(const BaseDDSketch& baseline) const {
+        if (!mergeable(baseline)) {
+            throw UnequalSketchParametersException();
+        }
+
+        if (!holds(baseline)) {
+            throw std::invalid_argument(
+                "The sketch does not hold the values of the baseline");
+        }
+
+        auto store = store_;
+        auto negative_store = negative_store_;
+        auto zero_count = subtract_count(zero_count_, baseline.zero_count_);
+
+        store.subtract(baseline.store_);
+        negative_store.subtract(baseline.negative_store_);
+
+        auto delta = std::string(
+            delta_size(store, negative_store, zero_count), '\0');
+        auto writer =
+            ProtoWriter(reinterpret_cast<uint8_t*>(&delta[0]), delta.size());
+
+        writer.write_tag(kMappingField, WireType::kLengthDelimited);
+        writer.write_varint(mapping_.serialized_size());
+        mapping_.encode(writer);
+
+        encode_changed_bins(writer, kPositiveValuesField, store);
+        encode_changed_bins(writer, kNegativeValuesField, negative_store);
+
+        if (zero_count != 0) {
+            writer.write_tag(kZeroCountField, WireType::kFixed64);
+            writer.write_double(zero_count);
+        }
+
+        return delta;
+    }
+
+    /*
+     * Add the bins of a message written by serialize_delta, whose baseline
+     * is this sketch. As with deserialize, the message does not carry the
+     * summary stats: the sum is estimated from the added bins, and the
+     * minimum and the maximum extended to their values. Throws
+     * SerializationException, leaving the sketch unchanged, if the message
+     * is malformed or written with another mapping
+     */
+    void apply_delta(const uint8_t* buffer, size_t size) {
+        std::vector<Index> keys;
+        std::vector<RealValue> counts;
+        std::vector<Index> negative_keys;
+        std::vector<RealValue> negative_counts;
+        auto zero_count = 0.0;
+        auto has_mapping = false;
+
+        auto reader = ProtoReader(buffer, size);
+
+        while (!reader.at_end()) {
+            int field;
+            WireType wire_type;
+
+            reader.read_tag(field, wire_type);
+
+            if (field == kMappingField) {
+                ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+                mapping_.check_encoded(reader.read_message());
+                has_mapping = true;
+            } else if (field == kPositiveValuesField) {
+                ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+                read_bins(reader.read_message(), keys, counts);
+            } else if (field == kNegativeValuesField) {
+                ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+                read_bins(
+                    reader.read_message(), negative_keys, negative_counts);
+            } else if (field == kZeroCountField) {
+                ProtoReader::expect(wire_type, WireType::kFixed64);
+                zero_count = reader.read_double();
+
+                if (!(zero_count >= 0) || std::isinf(zero_count)) {
+                    throw SerializationException("Invalid zero count");
+                }
+            } else {
+                reader.skip(wire_type);
+            }
+        }
+
+        if (!has_mapping) {
+            throw SerializationException("The index mapping is missing");
+        }
+
+        apply_bins(keys, counts, 1.0);
+        apply_bins(negative_keys, negative_counts, -1.0);
+
+        if (zero_count != 0) {
+            update_min_max(0.0);
+        }
+
+        zero_count_ += zero_count;
+        count_ += zero_count;
     }
-};
 
-/*
- * A fast KeyMapping that approximates the memory-optimal one
- * (LogarithmicMapping) by extracting the floor value of the logarithm to the
- * base 2 from the binary representations of floating-point values and
- * linearly interpolating the logarithm in-between.
- */
-class LinearlyInterpolatedMapping : public KeyMapping {
- public:
-    explicit LinearlyInterpolatedMapping(RealValue relative_accuracy,
-                                         RealValue offset = 0.0) :
-        KeyMapping(relative_accuracy, offset) {
+    void apply_delta(const std::string& delta) {
+        apply_delta(reinterpret_cast<const uint8_t*>(delta.data()),
+                    delta.size());
     }
 
- private:
     /*
-     * Approximates log2 by s + f
-     * where v = (s+1) * 2 ** f  for s in [0, 1)
-     * frexp(v) returns m and e s.t.
-     * v = m * 2 ** e ; (m in [0.5, 1) or 0.0)
-     * so we adjust m and e accordingly
+     * Two sketches can be merged only if their mappings give the same keys,
+     * i.e., their gammas and offsets are equal
      */
-    static RealValue log2_approx(RealValue value) {
-        auto exponent = 0;
-        auto mantissa = std::frexp(value, &exponent);
-        auto significand = 2.0 * mantissa - 1;
-        return significand + (exponent - 1);
+    bool mergeable(const BaseDDSketch<Store, Mapping>& other) const {
+        return mapping_.gamma() == other.mapping_.gamma() &&
+               mapping_.offset() == other.mapping_.offset();
     }
 
-    /* Inverse of log2_approx */
-    static RealValue exp2_approx(RealValue value) {
-        auto exponent = std::floor(value) + 1;
-        auto mantissa = (value - exponent + 2) / 2.0;
-        return std::ldexp(mantissa, exponent);
+    /* Copy the input sketch into this one */
+    void copy(const BaseDDSketch& sketch) {
+        store_.copy(sketch.store_);
+        negative_store_.copy(sketch.negative_store_);
+        zero_count_ = sketch.zero_count_;
+        min_ = sketch.min_;
+        max_ = sketch.max_;
+        count_ = sketch.count_;
+        sum_ = sketch.sum_;
     }
 
-    RealValue log_gamma(RealValue value) override {
-        return log2_approx(value) * multiplier();
+    /* Remove all the values from the sketch */
+    void clear() {
+        store_.clear();
+        negative_store_.clear();
+        zero_count_ = 0.0;
+        count_ = 0.0;
+        min_ = std::numeric_limits<RealValue>::max();
+        max_ = std::numeric_limits<RealValue>::min();
+        sum_ = 0.0;
     }
 
-    RealValue pow_gamma(RealValue value) override {
-        return exp2_approx(value / multiplier());
-    }
-};
+    /*
+     * Allocate the bins of both stores for the values in
+     * [min_value, max_value], e.g., for a short-lived sketch whose range of
+     * values is known, so that adding them does not grow the stores.
+     * Throws IllegalArgumentException if min_value > max_value
+     */
+    void reserve(RealValue min_value, RealValue max_value) {
+        if (!(min_value <= max_value)) {
+            throw IllegalArgumentException(
+                "The minimum value must not exceed the maximum value");
+        }
 
-/*
- * A fast KeyMapping that approximates the memory-optimal LogarithmicMapping by
- * extracting the floor value of the logarithm to the base 2 from the binary
- * representations of floating-point values and cubically interpolating the
- * logarithm in-between.
- *
- * More detailed documentation of this method can be found in:
- *     https://github.com/DataDog/sketches-java/
- */
-class CubicallyInterpolatedMapping : public KeyMapping {
- public:
-    explicit CubicallyInterpolatedMapping(RealValue relative_accuracy,
-                                          RealValue offset = 0.0) :
-        KeyMapping(relative_accuracy, offset) {
-        multiplier() /= C_;
-    }
+        const auto min_possible = mapping_.min_possible();
+        const auto max_possible = mapping_.max_possible();
 
- private:
-    /* Approximates log2 using a cubic polynomial */
-    static RealValue cubic_log2_approx(RealValue value) {
-        auto exponent = 0;
-        auto mantissa = std::frexp(value, &exponent);
-        auto significand = 2.0 * mantissa - 1;
+        if (max_value > min_possible) {
+            store_.reserve(
+                mapping_.key(std::max(min_value, min_possible)),
+                mapping_.key(std::min(max_value, max_possible)));
+        }
 
-        return
-            ((A_ * significand + B_) * significand + C_) * significand +
-            (exponent - 1);
+        if (min_value < -min_possible) {
+            negative_store_.reserve(
+                mapping_.key(std::max(-max_value, min_possible)),
+                mapping_.key(std::min(-min_value, max_possible)));
+        }
     }
 
-    /* Derived from Cardano's formula */
-    static RealValue cubic_exp2_approx(RealValue value) {
-        auto floor_value = std::floor(value);
-        auto exponent = static_cast<int>(floor_value);
-        auto delta_0 = B_ * B_ - 3 * A_ * C_;
-        auto delta_1 = (
-              2  * B_ * B_ * B_
-            - 9  * A_ * B_ * C_
-            - 27 * A_ * A_ * (value - exponent));
+    /* Release the memory that the bins of the stores do not use */
+    void shrink_to_fit() {
+        store_.shrink_to_fit();
+        negative_store_.shrink_to_fit();
+    }
 
-        auto cardano = std::cbrt(
-            (delta_1 -
-                std::sqrt(delta_1 * delta_1 -
-                              4 * delta_0 * delta_0 * delta_0)) / 2.0);
+    /*
+     * The size of the DDSketch message of the DDSketch protobuf format
+     * (cf. DDSketch.proto in sketches-go, sketches-java or sketches-py)
+     * that serialize writes
+     */
+    size_t serialized_size() const {
+        auto size = message_size(mapping_.serialized_size());
 
-        auto significand_plus_one =
-            -(B_ + cardano + delta_0 / cardano) / (3 * A_) + 1;
+        if (store_.count() != 0) {
+            size += message_size(store_.serialized_size());
+        }
 
-        auto mantissa = significand_plus_one / 2.0;
+        if (negative_store_.count() != 0) {
+            size += message_size(negative_store_.serialized_size());
+        }
 
-        return std::ldexp(mantissa, exponent + 1);
-    }
+        if (zero_count_ != 0) {
+            size += ProtoWriter::kTagSize + sizeof(RealValue);
+        }
 
-    RealValue log_gamma(RealValue value) override {
-        return cubic_log2_approx(value) * multiplier();
+        return size;
     }
 
-    RealValue pow_gamma(RealValue value) override {
-        return cubic_exp2_approx(value / multiplier());
-    }
+    /*
+     * Encode the sketch as a DDSketch message, into a buffer of at least
+     * serialized_size() bytes, without allocating memory.
+     * Returns the number of bytes written
+     */
+    size_t serialize(uint8_t* buffer, size_t size) const {
+        auto writer = ProtoWriter(buffer, size);
 
-    static constexpr RealValue A_ = 6.0 / 35;
-    static constexpr RealValue B_ = -3.0 / 5;
-    static constexpr RealValue C_ = 10.0 / 7;
-};
+        writer.write_tag(kMappingField, WireType::kLengthDelimited);
+        writer.write_varint(mapping_.serialized_size());
+        mapping_.encode(writer);
 
-/*
- * Base implementation of DDSketch.
- * Concrete implementations, derive from this class
- */
-template <typename Store, class Mapping>
-class BaseDDSketch {
- public:
-    BaseDDSketch(const Mapping& mapping,
-                 const Store& store,
-                 const Store& negative_store) :
-        mapping_(mapping),
-        store_(store),
-        negative_store_(negative_store),
-        zero_count_(0.0),
-        count_(0.0),
-        min_(std::numeric_limits<RealValue>::max()),
-        max_(std::numeric_limits<RealValue>::min()),
-        sum_(0.0) {
-    }
+        if (store_.count() != 0) {
+            writer.write_tag(kPositiveValuesField, WireType::kLengthDelimited);
+            writer.write_varint(store_.serialized_size());
+            store_.encode(writer);
+        }
 
-    static std::string name() {
-        return "DDSketch";
+        if (negative_store_.count() != 0) {
+            writer.write_tag(kNegativeValuesField, WireType::kLengthDelimited);
+            writer.write_varint(negative_store_.serialized_size());
+            negative_store_.encode(writer);
+        }
+
+        if (zero_count_ != 0) {
+            writer.write_tag(kZeroCountField, WireType::kFixed64);
+            writer.write_double(zero_count_);
+        }
+
+        return writer.size();
     }
 
-    RealValue num_values() const {
-        return count_;
+    /* Same as above, into a newly allocated string */
+    std::string serialize() const {
+        auto serialized = std::string(serialized_size(), '\0');
+        serialize(reinterpret_cast<uint8_t*>(&serialized[0]),
+                  serialized.size());
+
+        return serialized;
     }
 
-    RealValue sum() const {
-        return sum_;
+    /*
+     * Replace the content of the sketch with a DDSketch message, whose index
+     * mapping must match the one of this sketch. The format does not carry
+     * the summary stats, so the minimum and the maximum are set to the
+     * values at quantiles 0 and 1, and the sum is estimated from the bins.
+     * Throws SerializationException, and leaves the sketch empty, if the
+     * message is malformed or written with another mapping
+     */
+    void deserialize(const uint8_t* buffer, size_t size) {
+        clear();
+
+        try {
+            decode(ProtoReader(buffer, size));
+        } catch (...) {
+            clear();
+            throw;
+        }
     }
 
-    RealValue avg() const {
-        return sum_ / count_;
+    void deserialize(const std::string& serialized) {
+        deserialize(reinterpret_cast<const uint8_t*>(serialized.data()),
+                    serialized.size());
     }
 
-    /* Add a value to the sketch */
-    void add(RealValue val, RealValue weight = 1.0) {
-        if (weight <= 0.0) {
-            throw IllegalArgumentException("Weight must be positive");
+ protected:
+     static Index adjust_bin_limit(Index bin_limit) {
+        if (bin_limit <= 0) {
+            return kDefaultBinLimit;
         }
 
-        if (val > mapping_.min_possible()) {
-            store_.add(mapping_.key(val), weight);
-        } else if (val < -mapping_.min_possible()) {
-            negative_store_.add(mapping_.key(-val), weight);
+        return bin_limit;
+    }
+
+ private:
+    /* Merge the zero count and the summary stats of another sketch */
+    void merge_summary(const BaseDDSketch& sketch) {
+        if (count_ == 0) {
+            min_ = sketch.min_;
+            max_ = sketch.max_;
         } else {
-            zero_count_ += weight;
+            min_ = std::min(min_, sketch.min_);
+            max_ = std::max(max_, sketch.max_);
         }
 
-        /* Keep track of summary stats */
-        count_ += weight;
-        sum_ += val * weight;
+        zero_count_ += sketch.zero_count_;
+        count_ += sketch.count_;
+        sum_ += sketch.sum_;
+    }
+
+    /*
+     * Add at most kBatchChunkSize values, using stack buffers to hold
+     * the values of each sign and their keys. weights may be null,
+     * in which case every value has a unit weight
+     */
+    void add_chunk(const RealValue* values,
+                   const RealValue* weights,
+                   size_t count) {
+        RealValue positive_values[kBatchChunkSize];
+        RealValue positive_weights[kBatchChunkSize];
+        RealValue negative_values[kBatchChunkSize];
+        RealValue negative_weights[kBatchChunkSize];
+        Index keys[kBatchChunkSize];
+
+        size_t num_positive = 0;
+        size_t num_negative = 0;
+
+        auto zero_count = 0.0;
+        auto total_weight = 0.0;
+        auto sum = 0.0;
+        auto min = min_;
+        auto max = max_;
+
+        const auto min_possible = mapping_.min_possible();
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            auto val = values[idx];
+            auto weight = weights ? weights[idx] : 1.0;
+
+            if (val > min_possible) {
+                positive_values[num_positive] = val;
+                positive_weights[num_positive++] = weight;
+            } else if (val < -min_possible) {
+                negative_values[num_negative] = -val;
+                negative_weights[num_negative++] = weight;
+            } else {
+                zero_count += weight;
+            }
+
+            total_weight += weight;
+            sum += val * weight;
+            min = std::min(min, val);
+            max = std::max(max, val);
+        }
 
-        if (val < min_) {
-            min_ = val;
+        if (num_positive != 0) {
+            mapping_.key_batch(positive_values, num_positive, keys);
+            if (weights) {
+                store_.add_batch(keys, positive_weights, num_positive);
+            } else {
+                store_.add_batch(keys, num_positive);
+            }
         }
 
-        if (val > max_) {
-            max_ = val;
+        if (num_negative != 0) {
+            mapping_.key_batch(negative_values, num_negative, keys);
+            if (weights) {
+                negative_store_.add_batch(
+                    keys, negative_weights, num_negative);
+            } else {
+                negative_store_.add_batch(keys, num_negative);
+            }
         }
+
+        /* Keep track of summary stats */
+        zero_count_ += zero_count;
+        count_ += total_weight;
+        sum_ += sum;
+        min_ = min;
+        max_ = max;
     }
 
-    /*
-     * The approximate value at the specified quantile
-     *   Args:
-     *       quantile 0 <= q <=1
-     *   Returns:
-     *       The value at the specified quantile or NaN if the sketch is empty
-     */
-    RealValue get_quantile_value(RealValue quantile) {
-        auto quantile_value = 0.0;
+    /* The size of a nested message, including its tag and length */
+    static size_t message_size(size_t size) {
+        return ProtoWriter::kTagSize + ProtoWriter::varint_size(size) + size;
+    }
 
-        if (quantile < 0 || quantile > 1 || count_ == 0) {
-            return std::nan("");
+    void decode(ProtoReader reader) {
+        auto has_mapping = false;
+
+        while (!reader.at_end()) {
+            int field;
+            WireType wire_type;
+
+            reader.read_tag(field, wire_type);
+
+            if (field == kMappingField) {
+                ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+                mapping_.check_encoded(reader.read_message());
+                has_mapping = true;
+            } else if (field == kPositiveValuesField) {
+                ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+                store_.decode(reader.read_message());
+            } else if (field == kNegativeValuesField) {
+                ProtoReader::expect(wire_type, WireType::kLengthDelimited);
+                negative_store_.decode(reader.read_message());
+            } else if (field == kZeroCountField) {
+                ProtoReader::expect(wire_type, WireType::kFixed64);
+                zero_count_ = reader.read_double();
+
+                if (!(zero_count_ >= 0) || std::isinf(zero_count_)) {
+                    throw SerializationException("Invalid zero count");
+                }
+            } else {
+                reader.skip(wire_type);
+            }
         }
 
-        auto rank = quantile * (count_ - 1);
+        if (!has_mapping) {
+            throw SerializationException("The index mapping is missing");
+        }
 
-        if (rank < negative_store_.count()) {
-            auto reversed_rank = negative_store_.count() - rank - 1;
-            auto key = negative_store_.key_at_rank(reversed_rank, false);
-            quantile_value = -mapping_.value(key);
-        } else if (rank < zero_count_ + negative_store_.count()) {
-            return 0.0;
-        } else {
-            auto key = store_.key_at_rank(
-                            rank - zero_count_ - negative_store_.count());
-            quantile_value = mapping_.value(key);
+        count_ = negative_store_.count() + zero_count_ + store_.count();
+
+        if (count_ != 0) {
+            min_ = get_quantile_value(0);
+            max_ = get_quantile_value(1);
+            sum_ = approximate_sum(store_) - approximate_sum(negative_store_);
         }
+    }
 
-        return quantile_value;
+    /* The size of the Store message with the bins of a store, as binCounts */
+    static size_t changed_bins_size(const Store& store) {
+        size_t size = 0;
+
+        store.for_each_bin(
+            [&size](Index key, RealValue) {
+                size += StoreProto::bin_count_size(key);
+            });
+
+        return size;
     }
 
-    /*
-     *  Merges the other sketch into this one.
-     *
-     *  After this operation, this sketch encodes the values that were
-     *  added to both this and the input sketch.
-     */
-    void merge(const BaseDDSketch& sketch) {
-        if (!mergeable(sketch)) {
-            throw UnequalSketchParametersException();
+    size_t delta_size(const Store& store,
+                      const Store& negative_store,
+                      RealValue zero_count) const {
+        auto size = message_size(mapping_.serialized_size());
+
+        if (store.count() != 0) {
+            size += message_size(changed_bins_size(store));
         }
 
-        if (sketch.count_ == 0) {
-            return;
+        if (negative_store.count() != 0) {
+            size += message_size(changed_bins_size(negative_store));
         }
 
-        if (count_ == 0) {
-            copy(sketch);
+        if (zero_count != 0) {
+            size += ProtoWriter::kTagSize + sizeof(RealValue);
+        }
+
+        return size;
+    }
+
+    static void encode_changed_bins(ProtoWriter& writer,
+                                    int field,
+                                    const Store& store) {
+        if (store.count() == 0) {
             return;
         }
 
-        /* Merge the stores */
-        store_.merge(sketch.store_);
-        negative_store_.merge(sketch.negative_store_);
-        zero_count_ += sketch.zero_count_;
+        writer.write_tag(field, WireType::kLengthDelimited);
+        writer.write_varint(changed_bins_size(store));
 
-        /* Merge summary stats */
-        count_ += sketch.count_;
-        sum_ += sketch.sum_;
+        store.for_each_bin(
+            [&writer](Index key, RealValue bin_ct) {
+                StoreProto::write_bin_count(writer, key, bin_ct);
+            });
+    }
 
-        if (sketch.min_ < min_) {
-            min_ = sketch.min_;
+    static void read_bins(const ProtoReader& reader,
+                          std::vector<Index>& keys,
+                          std::vector<RealValue>& counts) {
+        StoreProto::for_each_bin(
+            reader,
+            [&keys, &counts](Index key, RealValue bin_ct) {
+                keys.push_back(key);
+                counts.push_back(bin_ct);
+            });
+    }
+
+    /*
+     * Add decoded bins to the store of their sign, updating the summary
+     * stats with the values of the bins
+     */
+    void apply_bins(const std::vector<Index>& keys,
+                    const std::vector<RealValue>& counts,
+                    RealValue sign) {
+        if (keys.empty()) {
+            return;
         }
 
-        if (sketch.max_ > max_) {
-            max_ = sketch.max_;
+        auto& store = sign > 0 ? store_ : negative_store_;
+        store.add_batch(keys.data(), counts.data(), keys.size());
+
+        for (size_t idx = 0; idx < keys.size(); ++idx) {
+            auto value = sign * mapping_.value(keys[idx]);
+
+            update_min_max(value);
+            count_ += counts[idx];
+            sum_ += counts[idx] * value;
         }
     }
 
-    /* Two sketches can be merged only if their gammas are equal */
-    bool mergeable(const BaseDDSketch<Store, Mapping>& other) const {
-        return mapping_.gamma() == other.mapping_.gamma();
+    /* Keep track of the extremes, without branching */
+    void update_extremes(RealValue value) {
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
     }
 
-    /* Copy the input sketch into this one */
-    void copy(const BaseDDSketch& sketch) {
-        store_.copy(sketch.store_);
-        negative_store_.copy(sketch.negative_store_);
-        zero_count_ = sketch.zero_count_;
-        min_ = sketch.min_;
-        max_ = sketch.max_;
-        count_ = sketch.count_;
-        sum_ = sketch.sum_;
+    void update_min_max(RealValue value) {
+        if (count_ == 0) {
+            min_ = value;
+            max_ = value;
+        } else {
+            min_ = std::min(min_, value);
+            max_ = std::max(max_, value);
+        }
     }
 
- protected:
-     static Index adjust_bin_limit(Index bin_limit) {
-        if (bin_limit <= 0) {
-            return kDefaultBinLimit;
-        }
+    /* The sum of the values of a store, each one estimated by its bin */
+    RealValue approximate_sum(const Store& store) {
+        auto sum = 0.0;
 
-        return bin_limit;
+        store.for_each_bin(
+            [this, &sum](Index key, RealValue bin_ct) {
+                sum += bin_ct * mapping_.value(key);
+            });
+
+        return sum;
     }
 
- private:
     Mapping mapping_;       /* Map btw values and store bins */
     Store store_;           /* Storage for positive values */
     Store negative_store_;  /* Storage for negative values */
@@ -1267,8 +6747,18 @@ class BaseDDSketch {
     RealValue sum_;         /* The sum of the values seen by the sketch */
 
     static constexpr Index kDefaultBinLimit = 2048;
+    static constexpr size_t kBatchChunkSize = 256;
+
+    /* The field numbers of the DDSketch message */
+    static constexpr int kMappingField = 1;
+    static constexpr int kPositiveValuesField = 2;
+    static constexpr int kNegativeValuesField = 3;
+    static constexpr int kZeroCountField = 4;
 };
 
+template <typename Store, class Mapping>
+constexpr size_t BaseDDSketch<Store, Mapping>::kBatchChunkSize;
+
 /*
  * The default implementation of BaseDDSketch, with optimized memory usage at
  * the cost of lower ingestion speed, using an unlimited number of bins.
@@ -1286,6 +6776,23 @@ class DDSketch : public BaseDDSketch<DenseStore, LogarithmicMapping> {
     }
 };
 
+/*
+ * Implementation of BaseDDSketch that only keeps the non-empty bins, so that
+ * its size depends on the number of distinct keys rather than on the range
+ * of the values. It suits data with a few outliers far apart from the bulk
+ * of the values, and the many mostly idle sketches of an aggregator, at the
+ * cost of a slower ingestion than that of DDSketch.
+ */
+class SparseDDSketch : public BaseDDSketch<SparseStore, LogarithmicMapping> {
+ public:
+    explicit SparseDDSketch(RealValue relative_accuracy)
+        : BaseDDSketch<SparseStore, LogarithmicMapping>(
+            LogarithmicMapping(relative_accuracy),
+            SparseStore(),
+            SparseStore()) {
+    }
+};
+
 /*
  * Implementation of BaseDDSketch with optimized memory usage at the cost of
  * lower ingestion speed, using a limited number of bins. When the maximum
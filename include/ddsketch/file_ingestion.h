@@ -0,0 +1,279 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#ifndef INCLUDES_DDSKETCH_FILE_INGESTION_H_
+#define INCLUDES_DDSKETCH_FILE_INGESTION_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ddsketch.h"
+
+namespace ddsketch {
+
+/*
+ * Thrown when a file of values cannot be mapped, or does not hold a whole
+ * number of values
+ */
+class IngestionException : public std::exception {
+ public:
+    const char* what() const noexcept override {
+        return message_.c_str();
+    }
+
+    explicit IngestionException(const std::string& message)
+        : message_(message) {
+    }
+
+ private:
+    std::string message_;
+};
+
+/* The number of values added to a sketch at once, 512 KiB of doubles */
+constexpr size_t kIngestionPageSize = 1 << 16;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool kIsLittleEndian = false;
+#else
+constexpr bool kIsLittleEndian = true;
+#endif
+
+/*
+ * A read-only mapping of a file of little-endian doubles, read ahead
+ * sequentially by the kernel
+ */
+class MappedValues {
+ public:
+    explicit MappedValues(const std::string& path)
+        : data_(nullptr), size_(0) {
+        auto fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            throw IngestionException(error_message("Cannot open", path));
+        }
+
+        struct stat status;
+
+        if (::fstat(fd, &status) != 0) {
+            auto message = error_message("Cannot stat", path);
+            ::close(fd);
+
+            throw IngestionException(message);
+        }
+
+        auto num_bytes = static_cast<size_t>(status.st_size);
+
+        if (num_bytes % sizeof(RealValue) != 0) {
+            ::close(fd);
+
+            throw IngestionException(
+                path + " does not hold a whole number of values");
+        }
+
+        /* An empty file cannot be mapped */
+        if (num_bytes > 0) {
+            auto* data = ::mmap(nullptr,
+                                num_bytes,
+                                PROT_READ,
+                                MAP_PRIVATE,
+                                fd,
+                                0);
+
+            if (data == MAP_FAILED) {
+                auto message = error_message("Cannot map", path);
+                ::close(fd);
+
+                throw IngestionException(message);
+            }
+
+            ::madvise(data, num_bytes, MADV_SEQUENTIAL);
+
+            data_ = static_cast<const RealValue*>(data);
+            size_ = num_bytes / sizeof(RealValue);
+        }
+
+        /* The mapping outlives the descriptor */
+        ::close(fd);
+    }
+
+    MappedValues(const MappedValues& values) = delete;
+    MappedValues& operator=(const MappedValues& values) = delete;
+
+    ~MappedValues() {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<RealValue*>(data_), size_ * sizeof(RealValue));
+        }
+    }
+
+    /* The values, as stored in the file */
+    const RealValue* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    /* Ask the kernel to start reading the values in [first, last) */
+    void will_need(size_t first, size_t last) const {
+        if (first >= last) {
+            return;
+        }
+
+        static const auto kPageSize =
+            static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+
+        auto start = reinterpret_cast<uintptr_t>(data_ + first);
+        auto end = reinterpret_cast<uintptr_t>(data_ + last);
+
+        start -= start % kPageSize;
+
+        ::madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+    }
+
+ private:
+    static std::string error_message(const std::string& action,
+                                     const std::string& path) {
+        return action + " " + path + ": " + std::strerror(errno);
+    }
+
+    const RealValue* data_;
+    size_t size_;
+};
+
+/*
+ * Add the values in [first, last) to the sketch, one page at a time. The
+ * next page is read ahead while the current one is added
+ */
+template <class Store, class Mapping>
+void ingest_values(BaseDDSketch<Store, Mapping>& sketch,
+                   const MappedValues& values,
+                   size_t first,
+                   size_t last) {
+    std::vector<RealValue> decoded;
+
+    if (!kIsLittleEndian) {
+        decoded.resize(kIngestionPageSize);
+    }
+
+    for (auto start = first; start < last; start += kIngestionPageSize) {
+        auto count = std::min(kIngestionPageSize, last - start);
+
+        values.will_need(start + count,
+                         std::min(start + count + kIngestionPageSize, last));
+
+        if (kIsLittleEndian) {
+            sketch.add_batch(values.data() + start, count);
+            continue;
+        }
+
+        const auto* bytes =
+            reinterpret_cast<const uint8_t*>(values.data() + start);
+
+        for (size_t idx = 0; idx < count; ++idx) {
+            uint64_t bits = 0;
+
+            for (size_t byte = 0; byte < sizeof(bits); ++byte) {
+                bits |= static_cast<uint64_t>(*bytes++) << (8 * byte);
+            }
+
+            std::memcpy(&decoded[idx], &bits, sizeof(bits));
+        }
+
+        sketch.add_batch(decoded.data(), count);
+    }
+}
+
+/* Add all the values of a file of little-endian doubles to the sketch */
+template <class Store, class Mapping>
+void ingest_file(BaseDDSketch<Store, Mapping>& sketch,
+                 const std::string& path) {
+    MappedValues values(path);
+
+    ingest_values(sketch, values, 0, values.size());
+}
+
+/*
+ * Same as above, splitting the file into num_threads ranges of whole pages.
+ * Each range is added by a thread of its own to an empty copy of the
+ * sketch, and the copies are then merged into the sketch, in order.
+ *
+ * Throws IllegalArgumentException if num_threads is zero. If a thread fails,
+ * its exception is rethrown once all the threads are done, and the sketch
+ * is left unchanged.
+ */
+template <class Store, class Mapping>
+void ingest_file(BaseDDSketch<Store, Mapping>& sketch,
+                 const std::string& path,
+                 size_t num_threads) {
+    using Sketch = BaseDDSketch<Store, Mapping>;
+
+    if (num_threads == 0) {
+        throw IllegalArgumentException(
+            "The number of threads must be positive");
+    }
+
+    MappedValues values(path);
+
+    auto num_pages =
+        (values.size() + kIngestionPageSize - 1) / kIngestionPageSize;
+
+    num_threads = std::max<size_t>(1, std::min(num_threads, num_pages));
+
+    auto prototype = sketch;
+    prototype.clear();
+
+    std::vector<Sketch> partials(num_threads, prototype);
+    std::vector<std::exception_ptr> errors(num_threads);
+    std::vector<std::thread> threads;
+
+    for (size_t idx = 0; idx < num_threads; ++idx) {
+        auto first = std::min(
+            idx * num_pages / num_threads * kIngestionPageSize,
+            values.size());
+        auto last = std::min(
+            (idx + 1) * num_pages / num_threads * kIngestionPageSize,
+            values.size());
+
+        threads.emplace_back(
+            [&partials, &errors, &values, idx, first, last]() {
+                try {
+                    ingest_values(partials[idx], values, first, last);
+                } catch (...) {
+                    errors[idx] = std::current_exception();
+                }
+            });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    for (auto& partial : partials) {
+        sketch.merge(std::move(partial));
+    }
+}
+
+}  // namespace ddsketch
+
+#endif  // INCLUDES_DDSKETCH_FILE_INGESTION_H_
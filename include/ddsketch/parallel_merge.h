@@ -0,0 +1,201 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#ifndef INCLUDES_DDSKETCH_PARALLEL_MERGE_H_
+#define INCLUDES_DDSKETCH_PARALLEL_MERGE_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ddsketch.h"
+
+namespace ddsketch {
+
+/* An executor which runs each task on a thread of its own */
+class ThreadExecutor {
+ public:
+    ThreadExecutor() = default;
+
+    ThreadExecutor(const ThreadExecutor& executor) = delete;
+    ThreadExecutor& operator=(const ThreadExecutor& executor) = delete;
+
+    ~ThreadExecutor() {
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void operator()(std::function<void()> task) {
+        threads_.emplace_back(std::move(task));
+    }
+
+ private:
+    std::vector<std::thread> threads_;
+};
+
+namespace detail {
+
+/*
+ * Tracks the tasks handed to an executor, so that they can be waited for.
+ * The first exception thrown by a task is rethrown by wait()
+ */
+class TaskGroup {
+ public:
+    TaskGroup() : num_pending_(0) {
+    }
+
+    template <class Executor, class Task>
+    void run(Executor& executor, Task task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++num_pending_;
+        }
+
+        executor(std::function<void()>(
+            [this, task]() {
+                std::exception_ptr error;
+
+                try {
+                    task();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+
+                /* Notified under the lock, as wait() may return right after */
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (error && !error_) {
+                    error_ = error;
+                }
+
+                if (--num_pending_ == 0) {
+                    done_.notify_all();
+                }
+            }));
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        done_.wait(lock, [this]() { return num_pending_ == 0; });
+
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+ private:
+    std::mutex mutex_;
+    std::condition_variable done_;
+    size_t num_pending_;
+    std::exception_ptr error_;
+};
+
+}  // namespace detail
+
+/* One task per hardware thread */
+inline size_t default_num_merge_tasks() {
+    auto num_threads = std::thread::hardware_concurrency();
+
+    return num_threads == 0 ? 1 : num_threads;
+}
+
+/*
+ * Merge the sketches in [first, last), which are left unchanged, using up
+ * to num_tasks tasks run by the executor.
+ *
+ * The executor is called with a std::function<void()> for each task, which
+ * it may run on any thread, including the calling one. The range is split
+ * into num_tasks contiguous slices, each one merged by a task with
+ * merge_all, and the merged slices are then reduced pairwise, in the order
+ * of the range, through a tree of log2(num_tasks) rounds.
+ *
+ * Since the sketches are merged in order, the bins are the same as the ones
+ * of a sequential merge, for the collapsing stores as well, as long as the
+ * weights are integers; the sum may only differ in its rounding.
+ *
+ * Throws IllegalArgumentException if the range is empty, and
+ * UnequalSketchParametersException, before merging anything, if the
+ * sketches are not all mergeable with the first one.
+ */
+template <class Iterator, class Executor>
+typename std::iterator_traits<Iterator>::value_type parallel_merge(
+        Iterator first,
+        Iterator last,
+        Executor&& executor,
+        size_t num_tasks = default_num_merge_tasks()) {
+    using Sketch = typename std::iterator_traits<Iterator>::value_type;
+
+    if (first == last) {
+        throw IllegalArgumentException("There are no sketches to merge");
+    }
+
+    for (auto it = std::next(first); it != last; ++it) {
+        if (!first->mergeable(*it)) {
+            throw UnequalSketchParametersException();
+        }
+    }
+
+    auto num_sketches = static_cast<size_t>(std::distance(first, last));
+
+    num_tasks = std::max<size_t>(1, std::min(num_tasks, num_sketches));
+
+    /* The slices, and then the merged slices, of the range */
+    std::vector<Iterator> bounds;
+
+    for (size_t idx = 0; idx <= num_tasks; ++idx) {
+        bounds.push_back(std::next(first, idx * num_sketches / num_tasks));
+    }
+
+    std::vector<Sketch> merged(num_tasks, *first);
+
+    detail::TaskGroup slice_tasks;
+
+    for (size_t idx = 0; idx < num_tasks; ++idx) {
+        slice_tasks.run(
+            executor,
+            [&merged, &bounds, idx]() {
+                merged[idx] = *bounds[idx];
+                merged[idx].merge_all(std::next(bounds[idx]), bounds[idx + 1]);
+            });
+    }
+
+    slice_tasks.wait();
+
+    for (size_t stride = 1; stride < num_tasks; stride *= 2) {
+        detail::TaskGroup round_tasks;
+
+        for (size_t idx = 0; idx + stride < num_tasks; idx += 2 * stride) {
+            round_tasks.run(
+                executor,
+                [&merged, idx, stride]() {
+                    merged[idx].merge(std::move(merged[idx + stride]));
+                });
+        }
+
+        round_tasks.wait();
+    }
+
+    return std::move(merged.front());
+}
+
+/* Same as above, running one task per hardware thread on its own thread */
+template <class Iterator>
+typename std::iterator_traits<Iterator>::value_type parallel_merge(
+        Iterator first,
+        Iterator last) {
+    return parallel_merge(first, last, ThreadExecutor());
+}
+
+}  // namespace ddsketch
+
+#endif  // INCLUDES_DDSKETCH_PARALLEL_MERGE_H_
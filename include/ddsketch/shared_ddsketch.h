@@ -0,0 +1,418 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#ifndef INCLUDES_DDSKETCH_SHARED_DDSKETCH_H_
+#define INCLUDES_DDSKETCH_SHARED_DDSKETCH_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+#include "ddsketch.h"
+
+namespace ddsketch {
+
+/*
+ * The fixed layout of a SharedDDSketch in its memory region: this header,
+ * followed by the bins of the positive values, then by the bins of the
+ * negative values, both over the keys from min_key to max_key.
+ *
+ * The layout only holds plain values and lock-free atomics, so that it can
+ * live in memory shared by several processes, e.g., a shm_open segment or a
+ * file mapped with MAP_SHARED, and be read in place by each of them.
+ */
+struct SharedDDSketchHeader {
+    static constexpr uint64_t kMagic = 0x314D485344444B53;  /* "SKDDSHM1" */
+    static constexpr uint32_t kVersion = 1;
+
+    /* Set last, once the rest of the region has been initialized */
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t interpolation;   /* The Interpolation of the mapping */
+
+    RealValue relative_accuracy;
+    RealValue offset;         /* The offset of the keys of the mapping */
+    Index min_key;
+    Index max_key;
+
+    std::atomic<RealValue> zero_count;
+    std::atomic<RealValue> count;
+    std::atomic<RealValue> min;
+    std::atomic<RealValue> max;
+    std::atomic<RealValue> sum;
+};
+
+static_assert(std::is_standard_layout<SharedDDSketchHeader>::value,
+              "The shared header must have a fixed layout");
+static_assert(std::is_trivially_destructible<SharedDDSketchHeader>::value,
+              "The shared header must not need to be destroyed");
+static_assert(sizeof(SharedDDSketchHeader) % alignof(std::atomic<RealValue>) ==
+                  0,
+              "The bins must be aligned after the shared header");
+
+/*
+ * A view of a sketch whose bins live in a memory region provided by the
+ * caller, such as memory shared by several processes. The region holds
+ * everything the sketch needs, cf. SharedDDSketchHeader, so that any process
+ * can attach to it and update or query it in place, without serializing nor
+ * merging.
+ *
+ * As with FixedRangeAtomicStore, the range of keys is fixed when the region
+ * is created: the keys below it are collapsed into its first bin, and the
+ * keys above it into its last bin. The bins and the summary statistics are
+ * atomic counters, so that add and the queries can run concurrently, from
+ * any thread of any process. The queries load each counter once, with
+ * relaxed ordering, and do not see a snapshot taken at a single point in
+ * time.
+ *
+ * The view does not own the region, which must outlive it. The mapping is
+ * rebuilt from the parameters held by the region, in each process.
+ */
+template <class Mapping = LogarithmicMapping>
+class SharedDDSketch {
+    using Bin = std::atomic<RealValue>;
+
+ public:
+    /* The keys of the values in [min_value, max_value], for create */
+    static KeyRange keys_for_values(Mapping mapping,
+                                    RealValue min_value,
+                                    RealValue max_value) {
+        if (!(min_value > mapping.min_possible() && min_value <= max_value)) {
+            throw IllegalArgumentException(
+                "The range of values must be positive and non-empty");
+        }
+
+        return KeyRange{mapping.key(min_value),
+                        mapping.key(std::min(max_value,
+                                             mapping.max_possible()))};
+    }
+
+    /* The size of the region of a sketch over the keys */
+    static size_t required_size(const KeyRange& keys) {
+        return sizeof(SharedDDSketchHeader) +
+               2 * num_bins(keys) * sizeof(Bin);
+    }
+
+    /*
+     * Initialize an empty sketch over the keys in the region, which must be
+     * aligned for doubles and hold at least required_size(keys) bytes.
+     * Throws IllegalArgumentException otherwise, or if the atomic counters
+     * would not be lock-free, and thus could not be shared by processes
+     */
+    static SharedDDSketch create(void* region,
+                                 size_t size,
+                                 const Mapping& mapping,
+                                 const KeyRange& keys) {
+        check_region(region);
+
+        if (keys.max_key < keys.min_key) {
+            throw IllegalArgumentException("The range of keys is empty");
+        }
+
+        if (size < required_size(keys)) {
+            throw IllegalArgumentException(
+                "The region is too small for the range of keys");
+        }
+
+        auto header = new (region) SharedDDSketchHeader;
+
+        header->version = SharedDDSketchHeader::kVersion;
+        header->interpolation =
+            static_cast<uint32_t>(Mapping::kInterpolation);
+        header->relative_accuracy = mapping.relative_accuracy();
+        header->offset = mapping.offset();
+        header->min_key = keys.min_key;
+        header->max_key = keys.max_key;
+
+        header->zero_count.store(0.0, std::memory_order_relaxed);
+        header->count.store(0.0, std::memory_order_relaxed);
+        header->min.store(std::numeric_limits<RealValue>::max(),
+                          std::memory_order_relaxed);
+        header->max.store(std::numeric_limits<RealValue>::lowest(),
+                          std::memory_order_relaxed);
+        header->sum.store(0.0, std::memory_order_relaxed);
+
+        auto bins = reinterpret_cast<Bin*>(header + 1);
+
+        for (size_t idx = 0; idx < 2 * num_bins(keys); ++idx) {
+            new (bins + idx) Bin(0.0);
+        }
+
+        header->magic.store(SharedDDSketchHeader::kMagic,
+                            std::memory_order_release);
+
+        return SharedDDSketch(header, mapping);
+    }
+
+    /*
+     * Attach to a sketch created in the region, possibly by another process.
+     * Throws IllegalArgumentException if the region does not hold a sketch,
+     * is too small for its bins, or was created with a different kind of
+     * mapping
+     */
+    static SharedDDSketch attach(void* region, size_t size) {
+        check_region(region);
+
+        if (size < sizeof(SharedDDSketchHeader)) {
+            throw IllegalArgumentException("The region is too small");
+        }
+
+        auto header = static_cast<SharedDDSketchHeader*>(region);
+
+        if (header->magic.load(std::memory_order_acquire) !=
+                SharedDDSketchHeader::kMagic ||
+            header->version != SharedDDSketchHeader::kVersion) {
+            throw IllegalArgumentException(
+                "The region does not hold a shared sketch");
+        }
+
+        if (header->interpolation !=
+                static_cast<uint32_t>(Mapping::kInterpolation)) {
+            throw IllegalArgumentException(
+                "The shared sketch was created with another mapping");
+        }
+
+        auto keys = KeyRange{header->min_key, header->max_key};
+
+        if (keys.max_key < keys.min_key || size < required_size(keys)) {
+            throw IllegalArgumentException(
+                "The region is too small for the range of keys");
+        }
+
+        return SharedDDSketch(
+            header, Mapping(header->relative_accuracy, header->offset));
+    }
+
+    const Mapping& mapping() const {
+        return mapping_;
+    }
+
+    Index min_key() const {
+        return header_->min_key;
+    }
+
+    Index max_key() const {
+        return header_->max_key;
+    }
+
+    RealValue num_values() const {
+        return header_->count.load(std::memory_order_relaxed);
+    }
+
+    RealValue sum() const {
+        return header_->sum.load(std::memory_order_relaxed);
+    }
+
+    RealValue zero_count() const {
+        return header_->zero_count.load(std::memory_order_relaxed);
+    }
+
+    /* The minimum value of the sketch, or NaN if it is empty */
+    RealValue min() const {
+        return num_values() == 0 ?
+                   std::nan("") :
+                   header_->min.load(std::memory_order_relaxed);
+    }
+
+    /* The maximum value of the sketch, or NaN if it is empty */
+    RealValue max() const {
+        return num_values() == 0 ?
+                   std::nan("") :
+                   header_->max.load(std::memory_order_relaxed);
+    }
+
+    void add(RealValue val, RealValue weight = 1.0) {
+        if (weight <= 0.0) {
+            throw IllegalArgumentException("Weight must be positive");
+        }
+
+        if (val > mapping_.min_possible()) {
+            atomic_add(bins_[get_index(mapping_.key(val))], weight);
+        } else if (val < -mapping_.min_possible()) {
+            atomic_add(negative_bins_[get_index(mapping_.key(-val))], weight);
+        } else {
+            atomic_add(header_->zero_count, weight);
+        }
+
+        atomic_add(header_->count, weight);
+        atomic_add(header_->sum, val * weight);
+
+        atomic_update(header_->min, val,
+                      [](RealValue value, RealValue min_value) {
+                          return value < min_value;
+                      });
+        atomic_update(header_->max, val,
+                      [](RealValue value, RealValue max_value) {
+                          return value > max_value;
+                      });
+    }
+
+    /* Add a batch of values to the sketch, with unit weights */
+    void add_batch(const RealValue* values, size_t count) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            add(values[idx]);
+        }
+    }
+
+    /*
+     * The approximate value at the specified quantile, cf. BaseDDSketch.
+     * The counts are taken from the bins, rather than from num_values, so
+     * that the ranks fall within the bins which are scanned
+     */
+    RealValue get_quantile_value(RealValue quantile) const {
+        auto negative_count = bins_count(negative_bins_);
+        auto zero_count = this->zero_count();
+        auto count = negative_count + zero_count + bins_count(bins_);
+
+        if (quantile < 0 || quantile > 1 || count == 0) {
+            return std::nan("");
+        }
+
+        auto rank = quantile * (count - 1);
+
+        if (rank < negative_count) {
+            auto reversed_rank = negative_count - rank - 1;
+            auto key = key_at_rank(negative_bins_, reversed_rank, false);
+
+            return -mapping_.value(key);
+        } else if (rank < zero_count + negative_count) {
+            return 0.0;
+        }
+
+        auto key = key_at_rank(bins_, rank - zero_count - negative_count);
+
+        return mapping_.value(key);
+    }
+
+    /* Call visit(key, count) for each non-empty bin of the positive values */
+    template <class Visit>
+    void for_each_bin(Visit visit) const {
+        visit_bins(bins_, visit);
+    }
+
+    /* Same as above, for the bins of the negative values */
+    template <class Visit>
+    void for_each_negative_bin(Visit visit) const {
+        visit_bins(negative_bins_, visit);
+    }
+
+ private:
+    SharedDDSketch(SharedDDSketchHeader* header, const Mapping& mapping)
+        : mapping_(mapping),
+          header_(header),
+          bins_(reinterpret_cast<Bin*>(header + 1)),
+          negative_bins_(bins_ + length()) {
+    }
+
+    static size_t num_bins(const KeyRange& keys) {
+        return static_cast<size_t>(keys.max_key - keys.min_key + 1);
+    }
+
+    static void check_region(void* region) {
+        if (region == nullptr ||
+                reinterpret_cast<uintptr_t>(region) %
+                    alignof(SharedDDSketchHeader) != 0) {
+            throw IllegalArgumentException("The region must be aligned");
+        }
+
+        if (!Bin().is_lock_free() ||
+                !std::atomic<uint64_t>().is_lock_free()) {
+            throw IllegalArgumentException(
+                "The atomic counters are not lock-free");
+        }
+    }
+
+    /* std::atomic<double>::fetch_add is only available from C++20 on */
+    static void atomic_add(Bin& bin, RealValue weight) {
+        auto bin_ct = bin.load(std::memory_order_relaxed);
+
+        while (!bin.compare_exchange_weak(
+                    bin_ct, bin_ct + weight, std::memory_order_relaxed)) {
+        }
+    }
+
+    /* Replace the counter with the value while replaces(value, counter) */
+    template <class Replaces>
+    static void atomic_update(Bin& counter,
+                              RealValue value,
+                              Replaces replaces) {
+        auto current = counter.load(std::memory_order_relaxed);
+
+        while (replaces(value, current) &&
+               !counter.compare_exchange_weak(
+                   current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    Index length() const {
+        return header_->max_key - header_->min_key + 1;
+    }
+
+    /* Calculate the bin index for the key, collapsing it into the range */
+    Index get_index(Index key) const {
+        return std::min(std::max(key, header_->min_key), header_->max_key) -
+               header_->min_key;
+    }
+
+    RealValue bins_count(const Bin* bins) const {
+        auto total_count = 0.0;
+
+        for (Index idx = 0; idx < length(); ++idx) {
+            total_count += bins[idx].load(std::memory_order_relaxed);
+        }
+
+        return total_count;
+    }
+
+    /* cf. FixedRangeAtomicStore::key_at_rank */
+    Index key_at_rank(const Bin* bins,
+                      RealValue rank,
+                      bool lower = true) const {
+        auto running_ct = 0.0;
+        auto max_key = header_->max_key;
+
+        for (Index idx = 0; idx < length(); ++idx) {
+            auto bin_ct = bins[idx].load(std::memory_order_relaxed);
+
+            if (bin_ct == 0) {
+                continue;
+            }
+
+            running_ct += bin_ct;
+            max_key = idx + header_->min_key;
+
+            if ((lower && running_ct > rank) ||
+                    (!lower && running_ct >= rank + 1)) {
+                return max_key;
+            }
+        }
+
+        return max_key;
+    }
+
+    template <class Visit>
+    void visit_bins(const Bin* bins, Visit visit) const {
+        for (Index idx = 0; idx < length(); ++idx) {
+            auto bin_ct = bins[idx].load(std::memory_order_relaxed);
+
+            if (bin_ct != 0) {
+                visit(idx + header_->min_key, bin_ct);
+            }
+        }
+    }
+
+    Mapping mapping_;
+    SharedDDSketchHeader* header_;
+    Bin* bins_;            /* The bins of the positive values */
+    Bin* negative_bins_;   /* The bins of the negative values */
+};
+
+}  // namespace ddsketch
+
+#endif  // INCLUDES_DDSKETCH_SHARED_DDSKETCH_H_
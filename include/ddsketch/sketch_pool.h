@@ -0,0 +1,183 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#ifndef INCLUDES_DDSKETCH_SKETCH_POOL_H_
+#define INCLUDES_DDSKETCH_SKETCH_POOL_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ddsketch.h"
+
+namespace ddsketch {
+
+/*
+ * A pool of empty sketches, built from the same prototype, e.g., for the
+ * sketches of many series which are flushed and replaced every interval.
+ *
+ * A released sketch is cleared, which keeps its bins, and pooled until it is
+ * acquired again, so that the bins are allocated once for the range of values
+ * the sketch usually holds, rather than at every interval.
+ *
+ * The pooled sketches are spread over several shards. Every thread is
+ * assigned a shard once, on its first call, which it acquires from and
+ * releases to, so that threads do not contend with one another as long as
+ * there are at least as many shards as threads. A thread whose shard is empty
+ * takes a sketch from the other shards, before building a new one.
+ */
+template <class Sketch>
+class SketchPool {
+ public:
+    static constexpr size_t kDefaultMaxPooledSketches = 1024;
+
+    /*
+     * prototype is an empty sketch, which gives the parameters of the
+     * sketches. Each shard pools up to max_pooled_sketches sketches; the
+     * sketches released beyond are destroyed
+     */
+    explicit SketchPool(
+            const Sketch& prototype,
+            size_t max_pooled_sketches = kDefaultMaxPooledSketches,
+            size_t num_shards = default_num_shards())
+        : prototype_(prototype),
+          max_pooled_sketches_(max_pooled_sketches) {
+        if (prototype.num_values() != 0) {
+            throw IllegalArgumentException("The prototype must be empty");
+        }
+
+        if (num_shards == 0) {
+            throw IllegalArgumentException(
+                "The number of shards must be positive");
+        }
+
+        shards_.reserve(num_shards);
+
+        for (size_t idx = 0; idx < num_shards; ++idx) {
+            shards_.emplace_back(std::make_unique<Shard>());
+        }
+    }
+
+    SketchPool(const SketchPool& pool) = delete;
+    SketchPool& operator=(const SketchPool& pool) = delete;
+
+    /* One shard per hardware thread */
+    static size_t default_num_shards() {
+        auto num_threads = std::thread::hardware_concurrency();
+
+        return num_threads == 0 ? 1 : num_threads;
+    }
+
+    size_t num_shards() const {
+        return shards_.size();
+    }
+
+    /* An empty sketch, pooled if possible */
+    std::unique_ptr<Sketch> acquire() {
+        auto local_idx = thread_slot() % shards_.size();
+
+        for (size_t idx = 0; idx < shards_.size(); ++idx) {
+            auto& shard = *shards_[(local_idx + idx) % shards_.size()];
+
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            if (!shard.sketches.empty()) {
+                auto sketch = std::move(shard.sketches.back());
+
+                shard.sketches.pop_back();
+
+                return sketch;
+            }
+        }
+
+        return std::make_unique<Sketch>(prototype_);
+    }
+
+    /*
+     * Clear a sketch and pool it. Throws UnequalSketchParametersException if
+     * the sketch was not built with the parameters of the prototype
+     */
+    void release(std::unique_ptr<Sketch> sketch) {
+        if (sketch == nullptr) {
+            return;
+        }
+
+        if (!prototype_.mergeable(*sketch)) {
+            throw UnequalSketchParametersException();
+        }
+
+        sketch->clear();
+
+        auto& shard = *shards_[thread_slot() % shards_.size()];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.sketches.size() < max_pooled_sketches_) {
+            shard.sketches.emplace_back(std::move(sketch));
+        }
+    }
+
+    /* The number of pooled sketches, over all the shards */
+    size_t size() const {
+        size_t num_sketches = 0;
+
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+
+            num_sketches += shard->sketches.size();
+        }
+
+        return num_sketches;
+    }
+
+    /* Destroy all the pooled sketches */
+    void clear() {
+        for (auto& shard : shards_) {
+            std::vector<std::unique_ptr<Sketch>> sketches;
+
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+
+                sketches.swap(shard->sketches);
+            }
+        }
+    }
+
+ private:
+    static constexpr size_t kCacheLineSize = 64;
+
+    /*
+     * The shards are allocated one by one; the trailing padding keeps two
+     * shards from sharing a cache line, cf. ConcurrentDDSketch
+     */
+    struct Shard {
+        mutable std::mutex mutex;
+        std::vector<std::unique_ptr<Sketch>> sketches;
+
+        char padding[kCacheLineSize];
+    };
+
+    /* The slot of the calling thread, assigned on its first call */
+    static size_t thread_slot() {
+        static std::atomic<size_t> next_slot(0);
+        thread_local size_t slot = next_slot.fetch_add(1);
+
+        return slot;
+    }
+
+    const Sketch prototype_;
+    const size_t max_pooled_sketches_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+template <class Sketch>
+constexpr size_t SketchPool<Sketch>::kDefaultMaxPooledSketches;
+
+}  // namespace ddsketch
+
+#endif  // INCLUDES_DDSKETCH_SKETCH_POOL_H_
@@ -0,0 +1,384 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#ifndef INCLUDES_DDSKETCH_STATIC_DDSKETCH_H_
+#define INCLUDES_DDSKETCH_STATIC_DDSKETCH_H_
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "ddsketch.h"
+
+namespace ddsketch {
+
+/*
+ * A dense store over the keys from MinKey to MaxKey, whose bins are held
+ * inline, in a std::array, rather than on the heap. The store never grows or
+ * shifts; the keys below MinKey are counted in the first bin, and the keys
+ * above MaxKey in the last one. It is trivially copyable, so that a copy is
+ * a memcpy.
+ */
+template <Index MinKey, Index MaxKey>
+class StaticDenseStore : public BaseStore<StaticDenseStore<MinKey, MaxKey>> {
+    static_assert(MinKey <= MaxKey, "The key range must not be empty");
+
+ public:
+    static constexpr size_t kNumBins = MaxKey - MinKey + 1;
+
+    using Bins = std::array<RealValue, kNumBins>;
+
+    StaticDenseStore() : bins_{}, count_(0) {
+    }
+
+    void copy(const StaticDenseStore& store) {
+        *this = store;
+    }
+
+    Index length() const {
+        return kNumBins;
+    }
+
+    Index min_key() const {
+        return MinKey;
+    }
+
+    Index max_key() const {
+        return MaxKey;
+    }
+
+    bool is_empty() const {
+        return count_ == 0;
+    }
+
+    /* The sum of the counts for the bins */
+    RealValue count() const {
+        return count_;
+    }
+
+    /* The count of each bin, from MinKey to MaxKey */
+    const Bins& bins() const {
+        return bins_;
+    }
+
+    void add(Index key, RealValue weight = 1.0) {
+        bins_[get_index(key)] += weight;
+        count_ += weight;
+    }
+
+    /* Updates the counters for a batch of keys, with unit weights */
+    void add_batch(const Index* keys, size_t count) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            bins_[get_index(keys[idx])] += 1.0;
+        }
+
+        count_ += count;
+    }
+
+    /* Same as above, with a weight for each key */
+    void add_batch(const Index* keys, const RealValue* weights, size_t count) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            bins_[get_index(keys[idx])] += weights[idx];
+            count_ += weights[idx];
+        }
+    }
+
+    Index key_at_rank(RealValue rank, bool lower = true) const {
+        Index key;
+        key_at_ranks(&rank, 1, &key, lower);
+
+        return key;
+    }
+
+    /*
+     * Same as key_at_rank, for several ranks sorted in increasing order,
+     * which are all resolved during a single pass over the bins
+     */
+    void key_at_ranks(const RealValue* ranks,
+                      size_t count,
+                      Index* keys,
+                      bool lower = true) const {
+        auto running_ct = 0.0;
+        size_t rank_idx = 0;
+
+        /* The highest key seen, for the ranks beyond the total count */
+        auto max_key = MaxKey;
+
+        for (size_t idx = 0; idx < kNumBins && rank_idx < count; ++idx) {
+            auto bin_ct = bins_[idx];
+
+            if (bin_ct == 0) {
+                continue;
+            }
+
+            running_ct += bin_ct;
+            max_key = idx + MinKey;
+
+            while (rank_idx < count &&
+                   ((lower && running_ct > ranks[rank_idx]) ||
+                    (!lower && running_ct >= ranks[rank_idx] + 1))) {
+                keys[rank_idx++] = max_key;
+            }
+        }
+
+        std::fill(keys + rank_idx, keys + count, max_key);
+    }
+
+    /* The sum of the counts of the bins up to the key, included */
+    RealValue count_up_to(Index key) const {
+        RealValue count;
+        counts_up_to(&key, 1, &count);
+
+        return count;
+    }
+
+    /*
+     * Same as count_up_to, for several keys sorted in increasing order, which
+     * are all resolved during a single pass over the bins
+     */
+    void counts_up_to(const Index* keys,
+                      size_t count,
+                      RealValue* counts) const {
+        auto running_ct = 0.0;
+        size_t key_idx = 0;
+
+        for (size_t idx = 0; idx < kNumBins; ++idx) {
+            while (key_idx < count &&
+                   keys[key_idx] < static_cast<Index>(idx) + MinKey) {
+                counts[key_idx++] = running_ct;
+            }
+
+            if (key_idx == count) {
+                return;
+            }
+
+            running_ct += bins_[idx];
+        }
+
+        std::fill(counts + key_idx, counts + count, running_ct);
+    }
+
+    /* The stores have the same keys, so that the bins are added in a row */
+    void merge(const StaticDenseStore& store) {
+        if (&store == this) {
+            merge(StaticDenseStore(store));
+            return;
+        }
+
+        add_bin_range(bins_.data(), store.bins_.data(), kNumBins);
+        count_ += store.count_;
+    }
+
+    void merge_all(const StaticDenseStore* const* stores, size_t num_stores) {
+        for (size_t idx = 0; idx < num_stores; ++idx) {
+            merge(*stores[idx]);
+        }
+    }
+
+    /*
+     * Subtract the bins of a store whose values have all been added to, or
+     * merged into, this one. Throws std::invalid_argument, leaving the store
+     * unchanged, if the other store holds higher counts for a bin
+     */
+    void subtract(const StaticDenseStore& store) {
+        if (!holds(store)) {
+            throw std::invalid_argument(
+                "The counts to subtract are higher than the ones of the store");
+        }
+
+        for (size_t idx = 0; idx < kNumBins; ++idx) {
+            bins_[idx] = subtract_count(bins_[idx], store.bins_[idx]);
+        }
+
+        count_ = subtract_count(count_, store.count_);
+
+        if (count_ <= 0) {
+            clear();
+        }
+    }
+
+    /*
+     * Whether each bin is at least the one of the other store, up to the
+     * rounding of the counts, i.e., whether the other store can be subtracted
+     */
+    bool holds(const StaticDenseStore& store) const {
+        for (size_t idx = 0; idx < kNumBins; ++idx) {
+            if (exceeds_count(store.bins_[idx], bins_[idx])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /* The bins are always allocated, for the whole range of keys */
+    void reserve(Index /* min_key */, Index /* max_key */) {
+    }
+
+    void shrink_to_fit() {
+    }
+
+    /* Call visit(key, count) for each non-empty bin, by increasing key */
+    template <class Visit>
+    void for_each_bin(Visit visit) const {
+        if (count_ == 0) {
+            return;
+        }
+
+        for (size_t idx = 0; idx < kNumBins; ++idx) {
+            if (bins_[idx] != 0) {
+                visit(static_cast<Index>(idx) + MinKey, bins_[idx]);
+            }
+        }
+    }
+
+    void clear() {
+        bins_.fill(0);
+        count_ = 0;
+    }
+
+ private:
+    /* The keys outside of the range are clamped to the first or last bin */
+    static size_t get_index(Index key) {
+        return std::min(std::max(key, MinKey), MaxKey) - MinKey;
+    }
+
+    Bins bins_;
+    RealValue count_;
+};
+
+template <Index MinKey, Index MaxKey>
+constexpr size_t StaticDenseStore<MinKey, MaxKey>::kNumBins;
+
+/* The natural logarithm of a positive value, in constant expressions */
+constexpr RealValue static_log(RealValue value) {
+    constexpr RealValue kLn2 = 0.693147180559945309417232121458;
+
+    int exponent = 0;
+
+    while (value >= 2) {
+        value /= 2;
+        ++exponent;
+    }
+
+    while (value < 1) {
+        value *= 2;
+        --exponent;
+    }
+
+    /* log(m) = 2 atanh(z), with z = (m - 1) / (m + 1) <= 1 / 3 */
+    auto z = (value - 1) / (value + 1);
+    auto term = z;
+    auto sum = 0.0;
+
+    for (int power = 1; power < 64; power += 2) {
+        sum += term / power;
+        term *= z * z;
+    }
+
+    return exponent * kLn2 + 2 * sum;
+}
+
+/* The key of a positive value for the gamma, in constant expressions */
+constexpr Index static_key(RealValue gamma, RealValue value) {
+    auto log_gamma = static_log(value) / static_log(gamma);
+    auto key = static_cast<Index>(log_gamma);
+
+    return key < log_gamma ? key + 1 : key;
+}
+
+/*
+ * The constants of a StaticDDSketch, computed from its Config at compile
+ * time: the gamma and the bounds of the LogarithmicMapping for the relative
+ * accuracy, and the keys of the values from kMinValue to kMaxValue. The
+ * keys are widened by one on each side, to absorb the rounding of the
+ * logarithm computed here
+ */
+template <class Config>
+struct StaticSketchKeys {
+    static_assert(Config::kRelativeAccuracy > 0 &&
+                      Config::kRelativeAccuracy < 1,
+                  "The relative accuracy must be between 0 and 1");
+
+    static constexpr RealValue kGamma =
+        1.0 + 2 * Config::kRelativeAccuracy / (1 - Config::kRelativeAccuracy);
+
+    static constexpr RealValue kMinPossible =
+        std::numeric_limits<RealValue>::min() * kGamma;
+    static constexpr RealValue kMaxPossible =
+        std::numeric_limits<RealValue>::max() / kGamma;
+
+    static_assert(Config::kMinValue > kMinPossible &&
+                      Config::kMinValue < Config::kMaxValue &&
+                      Config::kMaxValue < kMaxPossible,
+                  "The range of values must be positive and not empty");
+
+    static constexpr Index kMinKey = static_key(kGamma, Config::kMinValue) - 1;
+    static constexpr Index kMaxKey = static_key(kGamma, Config::kMaxValue) + 1;
+};
+
+template <class Config>
+constexpr RealValue StaticSketchKeys<Config>::kGamma;
+
+template <class Config>
+constexpr RealValue StaticSketchKeys<Config>::kMinPossible;
+
+template <class Config>
+constexpr RealValue StaticSketchKeys<Config>::kMaxPossible;
+
+template <class Config>
+constexpr Index StaticSketchKeys<Config>::kMinKey;
+
+template <class Config>
+constexpr Index StaticSketchKeys<Config>::kMaxKey;
+
+/*
+ * A DDSketch whose relative accuracy and range of values are fixed at
+ * compile time by Config, e.g.,
+ *
+ *     struct LatencyConfig {
+ *         static constexpr RealValue kRelativeAccuracy = 0.01;
+ *         static constexpr RealValue kMinValue = 1e-6;
+ *         static constexpr RealValue kMaxValue = 3600;
+ *     };
+ *
+ * The bins of both stores are inline arrays over the keys of the range, so
+ * that the sketch needs no heap memory, can live on the stack or by value in
+ * a struct, and is trivially copyable. The values whose magnitude is outside
+ * of [kMinValue, kMaxValue] are counted in the lowest, or highest, bin.
+ *
+ * The keys are the ones of a LogarithmicMapping with the same relative
+ * accuracy: the sketch merges with a DDSketch of the same accuracy, in
+ * either direction. The multiplier of the mapping is computed at run time,
+ * once for all the sketches with the same Config, to keep the exact keys
+ * of LogarithmicMapping, as the logarithm is not a constant expression.
+ */
+template <class Config>
+class StaticDDSketch
+    : public BaseDDSketch<
+          StaticDenseStore<StaticSketchKeys<Config>::kMinKey,
+                           StaticSketchKeys<Config>::kMaxKey>,
+          LogarithmicMapping> {
+ public:
+    using Keys = StaticSketchKeys<Config>;
+    using Store = StaticDenseStore<Keys::kMinKey, Keys::kMaxKey>;
+    using Base = BaseDDSketch<Store, LogarithmicMapping>;
+
+    StaticDDSketch() : Base(prototype_mapping(), Store(), Store()) {
+    }
+
+ private:
+    static const LogarithmicMapping& prototype_mapping() {
+        static const LogarithmicMapping mapping(Config::kRelativeAccuracy);
+
+        return mapping;
+    }
+};
+
+}  // namespace ddsketch
+
+#endif  // INCLUDES_DDSKETCH_STATIC_DDSKETCH_H_
@@ -0,0 +1,153 @@
+/*
+ * Unless explicitly stated otherwise all files in this repository are licensed
+ * under the Apache License 2.0.
+ */
+
+#ifndef INCLUDES_DDSKETCH_WINDOWED_DDSKETCH_H_
+#define INCLUDES_DDSKETCH_WINDOWED_DDSKETCH_H_
+
+#include <vector>
+
+#include "ddsketch.h"
+
+namespace ddsketch {
+
+/*
+ * A BaseDDSketch over a sliding window of time, e.g., the last 5 minutes
+ * with a resolution of 10 seconds.
+ *
+ * The window is a ring of slots, each one a BaseDDSketch built from the same
+ * prototype. The values are added to the current slot, and to an aggregate
+ * of the whole window, which answers the queries: their cost does not
+ * depend on the number of slots. Advancing the window expires the oldest
+ * slot, whose counts are subtracted from the aggregate bin by bin, and
+ * which is then cleared in place, keeping its bins for the next values.
+ *
+ * The bins hold plain sums of weights, so that the aggregate holds the same
+ * counts as a merge of the slots, exactly so for integer weights. With the
+ * collapsing stores, the aggregate may however remain collapsed by values
+ * which have since expired.
+ */
+template <typename Store, class Mapping>
+class WindowedDDSketch {
+ public:
+    using Sketch = BaseDDSketch<Store, Mapping>;
+
+    /* prototype is an empty sketch, which gives the parameters of the slots */
+    WindowedDDSketch(const Sketch& prototype, size_t num_slots)
+        : slots_(num_slots, prototype),
+          window_(prototype),
+          current_(0) {
+        if (prototype.num_values() != 0) {
+            throw IllegalArgumentException("The prototype must be empty");
+        }
+
+        if (num_slots == 0) {
+            throw IllegalArgumentException(
+                "The number of slots must be positive");
+        }
+    }
+
+    size_t num_slots() const {
+        return slots_.size();
+    }
+
+    /* The slot that the values are added to */
+    const Sketch& current_slot() const {
+        return slots_[current_];
+    }
+
+    /* The aggregate of all the slots */
+    const Sketch& window() const {
+        return window_;
+    }
+
+    RealValue num_values() const {
+        return window_.num_values();
+    }
+
+    RealValue sum() const {
+        return window_.sum();
+    }
+
+    RealValue zero_count() const {
+        return window_.zero_count();
+    }
+
+    void add(RealValue value, RealValue weight = 1.0) {
+        slots_[current_].add(value, weight);
+        window_.add(value, weight);
+    }
+
+    void add_batch(const RealValue* values, size_t count) {
+        slots_[current_].add_batch(values, count);
+        window_.add_batch(values, count);
+    }
+
+    void add_batch(const RealValue* values,
+                   const RealValue* weights,
+                   size_t count) {
+        slots_[current_].add_batch(values, weights, count);
+        window_.add_batch(values, weights, count);
+    }
+
+    /* Merge a sketch into the current slot */
+    void merge(const Sketch& sketch) {
+        slots_[current_].merge(sketch);
+        window_.merge(sketch);
+    }
+
+    /*
+     * Move the window forward by num_slots slots, expiring as many of the
+     * oldest slots. The next values are added to the slot that expired last
+     */
+    void advance(size_t num_slots = 1) {
+        if (num_slots >= slots_.size()) {
+            for (auto& slot : slots_) {
+                slot.clear();
+            }
+
+            window_.clear();
+            current_ = (current_ + num_slots) % slots_.size();
+
+            return;
+        }
+
+        for (size_t idx = 0; idx < num_slots; ++idx) {
+            current_ = (current_ + 1) % slots_.size();
+
+            window_.subtract(slots_[current_]);
+            slots_[current_].clear();
+        }
+    }
+
+    /* Expire all the slots */
+    void clear() {
+        advance(slots_.size());
+    }
+
+    /* The approximate value at the specified quantile, over the window */
+    RealValue get_quantile_value(RealValue quantile) {
+        return window_.get_quantile_value(quantile);
+    }
+
+    /* Same as above, for several quantiles */
+    void get_quantile_values(const RealValue* quantiles,
+                             size_t count,
+                             RealValue* values) {
+        window_.get_quantile_values(quantiles, count, values);
+    }
+
+    bool mergeable(const Sketch& other) const {
+        return window_.mergeable(other);
+    }
+
+ private:
+    std::vector<Sketch> slots_;
+    Sketch window_;   /* The counts of all the slots */
+    size_t current_;  /* The slot that the values are added to */
+};
+
+}  // namespace ddsketch
+
+#endif  // INCLUDES_DDSKETCH_WINDOWED_DDSKETCH_H_
@@ -27,11 +27,14 @@ class DataSet {
     using iterator = typename DataSetValueContainer::iterator;
     using const_iterator = typename DataSetValueContainer::const_iterator;
 
+    /* The values may be modified through the iterators */
     iterator begin() {
+        invalidate_sorted();
         return data_.begin();
     }
 
     iterator end() {
+        invalidate_sorted();
         return data_.end();
     }
 
@@ -67,29 +70,25 @@ class DataSet {
     }
 
     Index rank(Value value) const {
-        auto tmp_data = data_;
-        auto index = 0;
+        const auto& sorted_data = sorted();
+        Index index = 0;
 
-        sort(tmp_data.begin(), tmp_data.end(), std::less<Value>());
+        auto it = std::lower_bound(
+                      sorted_data.begin(), sorted_data.end(), value);
 
-        auto it = std::lower_bound(tmp_data.begin(), tmp_data.end(), value);
-
-        if (it == tmp_data.end()) {
-            index = tmp_data.size() - 1;
+        if (it == sorted_data.end()) {
+            index = sorted_data.size() - 1;
         } else {
-            index = std::distance(tmp_data.begin(), it);
+            index = std::distance(sorted_data.begin(), it);
         }
 
         return index;
     }
 
     Value quantile(Value quantile) const {
-        auto tmp_data = data_;
-
-        sort(tmp_data.begin(), tmp_data.end(), std::less<Value>());
         Index item_rank = quantile * (data_.size() - 1);
 
-        return tmp_data[item_rank];
+        return sorted()[item_rank];
     }
 
     Value sum() const {
@@ -127,11 +126,34 @@ class DataSet {
     DataSet& operator=(DataSet&& dataset) noexcept = default;
 
     DataSetValueContainer& data() {
+        invalidate_sorted();
         return data_;
     }
 
  private:
+    /*
+     * The values in increasing order, sorted on the first query after the
+     * values change, so that the queries on large datasets do not sort them
+     * every time. Not thread-safe
+     */
+    const DataSetValueContainer& sorted() const {
+        if (!is_sorted_) {
+            sorted_data_ = data_;
+            std::sort(sorted_data_.begin(), sorted_data_.end());
+            is_sorted_ = true;
+        }
+
+        return sorted_data_;
+    }
+
+    void invalidate_sorted() {
+        is_sorted_ = false;
+        sorted_data_.clear();
+    }
+
     DataSetValueContainer data_;
+    mutable DataSetValueContainer sorted_data_;
+    mutable bool is_sorted_ = false;
 };
 
 class EmptyDataSet : public DataSet<DataValue> {
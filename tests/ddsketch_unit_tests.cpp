@@ -3,11 +3,28 @@
  * under the Apache License 2.0.
  */
 
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "../include/ddsketch/concurrent_ddsketch.h"
 #include "../include/ddsketch/ddsketch.h"
+#include "../include/ddsketch/file_ingestion.h"
+#include "../include/ddsketch/parallel_merge.h"
+#include "../include/ddsketch/shared_ddsketch.h"
+#include "../include/ddsketch/sketch_pool.h"
+#include "../include/ddsketch/static_ddsketch.h"
+#include "../include/ddsketch/windowed_ddsketch.h"
 #include "../include/test/datasets.h"
 
 #include "gtest/gtest.h"
@@ -123,6 +140,141 @@ class CubicallyInterpolatedMappingTest
     : public MappingTest<CubicallyInterpolatedMapping> {
 };
 
+class TableLogarithmicMappingTest
+    : public MappingTest<TableLogarithmicMapping> {
+ protected:
+    /*
+     * Test that the keys are the ones of LogarithmicMapping, around the
+     * bounds of the keys and over the whole range of values
+     */
+    static void test_matches_logarithmic_mapping() {
+        for (const auto relative_accuracy : {0.5, 0.05, 0.01, 1e-3, 1e-5}) {
+            for (const auto offset : {0.0, -12.23, 7768.3}) {
+                auto mapping = create_mapping(relative_accuracy, offset);
+                auto reference = LogarithmicMapping(relative_accuracy, offset);
+
+                std::vector<RealValue> values;
+
+                for (auto key = -20000; key <= 20000; ++key) {
+                    auto value = reference.value(key + offset) * 2.0 /
+                                 (1.0 + reference.gamma()) * reference.gamma();
+                    auto lower_value = value;
+
+                    for (auto step = 0; step < 3; ++step) {
+                        values.push_back(value);
+                        values.push_back(lower_value);
+
+                        value = std::nextafter(value, 2 * value);
+                        lower_value = std::nextafter(lower_value, 0.0);
+                    }
+                }
+
+                for (auto value = mapping.min_possible();
+                     value < mapping.max_possible() / 1.01;
+                     value *= 1.01) {
+                    values.push_back(value);
+                }
+
+                values.push_back(mapping.max_possible());
+
+                for (const auto value : values) {
+                    if (value <= mapping.min_possible() ||
+                            value > mapping.max_possible()) {
+                        continue;
+                    }
+
+                    ASSERT_EQ(mapping.key(value), reference.key(value))
+                        << "value " << value
+                        << ", relative accuracy " << relative_accuracy;
+                }
+            }
+        }
+    }
+};
+
+class CachedMappingTest
+    : public MappingTest<CachedMapping<CubicallyInterpolatedMapping>> {
+ protected:
+    using Mapping = CachedMapping<CubicallyInterpolatedMapping>;
+
+    static constexpr RealValue kRelativeAccuracy = 0.01;
+
+    /* Test that the cached bounds are the ones of the mapping */
+    static void test_matches_mapping() {
+        for (const auto offset : {0.0, -12.23, 7768.3}) {
+            auto mapping = create_mapping(kRelativeAccuracy, offset);
+            auto reference = CubicallyInterpolatedMapping(
+                kRelativeAccuracy, offset);
+
+            /* Twice, to read the bounds cached by the first pass */
+            for (auto pass = 0; pass < 2; ++pass) {
+                for (Index key = -3000; key <= 3000; ++key) {
+                    ASSERT_EQ(mapping.value(key), reference.value(key));
+                    ASSERT_EQ(mapping.lower_bound(key),
+                              reference.lower_bound(key));
+                    ASSERT_EQ(mapping.upper_bound(key),
+                              reference.upper_bound(key));
+                }
+            }
+
+            EXPECT_LE(mapping.cached_keys(), Mapping::kMaxCachedKeys);
+            EXPECT_GE(mapping.cached_keys(), 6002u);
+
+            /* Keys out of the range of the cache are computed directly */
+            EXPECT_EQ(mapping.value(100000), reference.value(100000));
+            EXPECT_LE(mapping.cached_keys(), Mapping::kMaxCachedKeys);
+        }
+    }
+
+    static void test_cache_bounds() {
+        auto mapping = create_mapping(kRelativeAccuracy, 0.0);
+
+        mapping.cache_bounds(-10, 10);
+        EXPECT_EQ(mapping.cached_keys(), 22u);
+
+        /* Already covered */
+        mapping.cache_bounds(0, 5);
+        EXPECT_EQ(mapping.cached_keys(), 22u);
+
+        /* Too many keys */
+        mapping.cache_bounds(0, Mapping::kMaxCachedKeys);
+        EXPECT_EQ(mapping.cached_keys(), 22u);
+
+        /* The copies do not share the cache */
+        auto copied_mapping = mapping;
+        EXPECT_EQ(copied_mapping.cached_keys(), 0u);
+        EXPECT_EQ(copied_mapping.value(3), mapping.value(3));
+    }
+
+    /* Test that the quantiles are the ones of the uncached mapping */
+    static void test_quantiles() {
+        auto sketch = BaseDDSketch<DenseStore, Mapping>(
+            Mapping(kRelativeAccuracy), DenseStore(), DenseStore());
+        auto reference_sketch =
+            BaseDDSketch<DenseStore, CubicallyInterpolatedMapping>(
+                CubicallyInterpolatedMapping(kRelativeAccuracy),
+                DenseStore(),
+                DenseStore());
+
+        auto dataset = Mixed();
+        dataset.populate(1000);
+
+        for (const auto value : dataset) {
+            sketch.add(value);
+            reference_sketch.add(-value);
+            reference_sketch.add(value);
+            sketch.add(-value);
+        }
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      reference_sketch.get_quantile_value(quantile));
+        }
+    }
+};
+
+constexpr RealValue CachedMappingTest::kRelativeAccuracy;
+
 TEST_F(LogarithmicMappingTest, TestRelativeAccuracy) {
     test_relative_accuracy();
 }
@@ -147,6 +299,554 @@ TEST_F(CubicallyInterpolatedMappingTest, TestOffsets) {
     test_offsets();
 }
 
+TEST_F(TableLogarithmicMappingTest, TestRelativeAccuracy) {
+    test_relative_accuracy();
+}
+
+TEST_F(TableLogarithmicMappingTest, TestOffsets) {
+    test_offsets();
+}
+
+TEST_F(TableLogarithmicMappingTest, TestMatchesLogarithmicMapping) {
+    test_matches_logarithmic_mapping();
+}
+
+TEST_F(CachedMappingTest, TestRelativeAccuracy) {
+    test_relative_accuracy();
+}
+
+TEST_F(CachedMappingTest, TestOffsets) {
+    test_offsets();
+}
+
+TEST_F(CachedMappingTest, TestMatchesMapping) {
+    test_matches_mapping();
+}
+
+TEST_F(CachedMappingTest, TestCacheBounds) {
+    test_cache_bounds();
+}
+
+TEST_F(CachedMappingTest, TestQuantiles) {
+    test_quantiles();
+}
+
+class DoubleBitOperationHelperTest : public ::testing::Test {
+ protected:
+    /* Positive normal values, spread over the whole range of exponents */
+    static std::vector<RealValue> test_values() {
+        std::vector<RealValue> values;
+
+        auto value_mult = 1.0 + std::sqrt(2) * 1.0e-2;
+        auto min_value = std::numeric_limits<RealValue>::min();
+
+        for (auto value = min_value * value_mult;
+             value < std::numeric_limits<RealValue>::max() / value_mult;
+             value *= value_mult) {
+            values.push_back(value);
+            values.push_back(std::nextafter(value, min_value));
+            values.push_back(std::nextafter(value, 2 * value));
+        }
+
+        for (auto exponent = -1022; exponent <= 1023; ++exponent) {
+            values.push_back(std::ldexp(1.0, exponent));
+        }
+
+        values.push_back(std::numeric_limits<RealValue>::max());
+
+        return values;
+    }
+};
+
+TEST_F(DoubleBitOperationHelperTest, TestMatchesFrexp) {
+    for (const auto value : test_values()) {
+        auto exponent = 0;
+        auto mantissa = std::frexp(value, &exponent);
+
+        EXPECT_EQ(DoubleBitOperationHelper::get_exponent(value), exponent - 1);
+        EXPECT_EQ(DoubleBitOperationHelper::get_significand_plus_one(value),
+                  2.0 * mantissa);
+    }
+}
+
+TEST_F(DoubleBitOperationHelperTest, TestMatchesLdexp) {
+    for (const auto value : test_values()) {
+        auto exponent = DoubleBitOperationHelper::get_exponent(value);
+        auto significand_plus_one =
+            DoubleBitOperationHelper::get_significand_plus_one(value);
+
+        EXPECT_EQ(DoubleBitOperationHelper::build_double(
+                      exponent, significand_plus_one),
+                  value);
+        EXPECT_EQ(DoubleBitOperationHelper::build_double(exponent, 1.5),
+                  std::ldexp(1.5, exponent));
+    }
+}
+
+template <typename Bins>
+class BinListTest : public ::testing::Test {
+ protected:
+    using Reference = std::deque<RealValue>;
+
+    static void expect_equal(const Bins& bins, const Reference& reference) {
+        ASSERT_EQ(bins.size(), reference.size());
+
+        EXPECT_TRUE(std::equal(bins.begin(), bins.end(), reference.begin()));
+    }
+
+    /* Fill the bins with distinct values, so that moves are detectable */
+    static void fill(Bins& bins, Reference& reference) {
+        for (size_t idx = 0; idx < reference.size(); ++idx) {
+            bins[idx] = idx + 1;
+            reference[idx] = idx + 1;
+        }
+    }
+
+    /* Test growing the bins in both directions */
+    static void test_extend() {
+        auto bins = Bins(10);
+        auto reference = Reference(10, 0);
+
+        fill(bins, reference);
+
+        for (auto count : {1, 5, 100, 3, 1000}) {
+            bins.extend_front_with_zeros(count);
+            reference.insert(reference.begin(), count, 0);
+            expect_equal(bins, reference);
+
+            bins.extend_back_with_zeros(count);
+            reference.insert(reference.end(), count, 0);
+            expect_equal(bins, reference);
+
+            fill(bins, reference);
+        }
+
+        bins.insert(42);
+        reference.push_back(42);
+        expect_equal(bins, reference);
+
+        EXPECT_EQ(bins.first(), reference.front());
+        EXPECT_EQ(bins.last(), reference.back());
+    }
+
+    /* Test shifting the bins repeatedly, as done by the dense stores */
+    static void test_shift() {
+        constexpr auto kNumBins = 128;
+
+        auto bins = Bins(kNumBins);
+        auto reference = Reference(kNumBins, 0);
+
+        fill(bins, reference);
+
+        for (auto shift : {3, 3, 50, -7, -100, 127, -127, 1, 1, 1}) {
+            size_t abs_shift = std::abs(shift);
+
+            if (shift > 0) {
+                bins.remove_trailing_elements(abs_shift);
+                bins.extend_front_with_zeros(abs_shift);
+
+                reference.erase(reference.end() - abs_shift, reference.end());
+                reference.insert(reference.begin(), abs_shift, 0);
+            } else {
+                bins.remove_leading_elements(abs_shift);
+                bins.extend_back_with_zeros(abs_shift);
+
+                reference.erase(
+                    reference.begin(), reference.begin() + abs_shift);
+                reference.insert(reference.end(), abs_shift, 0);
+            }
+
+            expect_equal(bins, reference);
+            fill(bins, reference);
+        }
+    }
+
+    /* Test replacing a range with a different number of zeros */
+    static void test_replace_range_with_zeros() {
+        constexpr auto kNumBins = 20;
+
+        for (auto num_zeros : {0, 2, 5, 9}) {
+            auto bins = Bins(kNumBins);
+            auto reference = Reference(kNumBins, 0);
+
+            fill(bins, reference);
+
+            bins.replace_range_with_zeros(3, 8, num_zeros);
+
+            reference.erase(reference.begin() + 3, reference.begin() + 8);
+            reference.insert(reference.begin() + 3, num_zeros, 0);
+
+            expect_equal(bins, reference);
+        }
+    }
+
+    /* Test the aggregate queries */
+    static void test_counts() {
+        auto bins = Bins(10);
+
+        EXPECT_TRUE(bins.has_only_zeros());
+
+        bins[2] = 3;
+        bins[7] = 4;
+
+        EXPECT_FALSE(bins.has_only_zeros());
+        EXPECT_EQ(bins.sum(), 7);
+        EXPECT_EQ(bins.collapsed_count(0, 3), 3);
+        EXPECT_EQ(bins.collapsed_count(3, 7), 0);
+        EXPECT_THROW(bins.collapsed_count(0, 11), std::invalid_argument);
+
+        auto copy = bins;
+        bins.initialize_with_zeros(5);
+
+        EXPECT_TRUE(bins.has_only_zeros());
+        EXPECT_EQ(bins.size(), 5);
+        EXPECT_EQ(copy.sum(), 7);
+    }
+
+    /*
+     * Test the aggregate queries and the addition of bins over ranges longer
+     * than the blocks of the kernels, with a shorter tail
+     */
+    static void test_long_ranges() {
+        constexpr size_t kNumBins = 203;
+
+        auto bins = Bins(kNumBins);
+        const auto& const_bins = bins;
+        auto other = Bins(kNumBins);
+
+        RealValue expected_sum = 0;
+        RealValue expected_count = 0;
+
+        for (size_t idx = 0; idx < kNumBins; ++idx) {
+            other[idx] = idx % 7;
+            expected_sum += idx % 7;
+
+            if (idx >= 5 && idx < 150) {
+                expected_count += idx % 7;
+            }
+        }
+
+        EXPECT_EQ(other.sum(), expected_sum);
+        EXPECT_EQ(other.collapsed_count(5, 150), expected_count);
+
+        for (const auto idx : {0, 63, 64, 130, 202}) {
+            auto zeros = Bins(kNumBins);
+
+            EXPECT_TRUE(zeros.has_only_zeros());
+
+            zeros[idx] = 1;
+            EXPECT_FALSE(zeros.has_only_zeros());
+        }
+
+        bins.add_bins(3, other, 1, 190);
+
+        for (size_t idx = 0; idx < kNumBins; ++idx) {
+            RealValue expected_bin = idx >= 3 && idx < 193 ? (idx - 2) % 7 : 0;
+
+            EXPECT_EQ(const_bins[idx], expected_bin);
+        }
+
+        /* Adding the bins of a list to themselves doubles them */
+        other.add_bins(0, other, 0, kNumBins);
+        EXPECT_EQ(other.sum(), 2 * expected_sum);
+    }
+
+    /* Test that a store using the bins matches one using the default bins */
+    template <class BinsStore, class Store>
+    static void test_store(BinsStore bins_store, Store store) {
+        auto expect_same_bins = [&bins_store, &store]() {
+            ASSERT_EQ(bins_store.length(), store.length());
+            EXPECT_EQ(bins_store.offset(), store.offset());
+            EXPECT_EQ(bins_store.count(), store.count());
+            EXPECT_TRUE(std::equal(bins_store.bins().begin(),
+                                   bins_store.bins().end(),
+                                   store.bins().begin()));
+        };
+
+        for (auto key : {0, 500, -300, 2000, -5000, 7, 9000, -12000, 3}) {
+            bins_store.add(key);
+            store.add(key);
+            expect_same_bins();
+        }
+
+        const std::vector<Index> batch = {-20000, 15, 15, 25000, -1};
+        bins_store.add_batch(batch.data(), batch.size());
+        store.add_batch(batch.data(), batch.size());
+        expect_same_bins();
+
+        auto other_bins_store = bins_store;
+        auto other_store = store;
+        other_bins_store.add(-40000, 2.5);
+        other_store.add(-40000, 2.5);
+
+        bins_store.merge(other_bins_store);
+        store.merge(other_store);
+        expect_same_bins();
+
+        for (auto rank = 0.0; rank < store.count(); rank += 0.5) {
+            EXPECT_EQ(bins_store.key_at_rank(rank), store.key_at_rank(rank));
+        }
+    }
+};
+
+class ContiguousBinListTest : public BinListTest<BinList<RealValue>> {
+};
+
+class DequeBinListTest : public BinListTest<DequeBinList<RealValue>> {
+};
+
+TEST_F(ContiguousBinListTest, TestExtend) {
+    test_extend();
+}
+
+TEST_F(ContiguousBinListTest, TestShift) {
+    test_shift();
+}
+
+TEST_F(ContiguousBinListTest, TestReplaceRangeWithZeros) {
+    test_replace_range_with_zeros();
+}
+
+TEST_F(ContiguousBinListTest, TestCounts) {
+    test_counts();
+}
+
+TEST_F(ContiguousBinListTest, TestLongRanges) {
+    test_long_ranges();
+}
+
+TEST_F(DequeBinListTest, TestExtend) {
+    test_extend();
+}
+
+TEST_F(DequeBinListTest, TestShift) {
+    test_shift();
+}
+
+TEST_F(DequeBinListTest, TestReplaceRangeWithZeros) {
+    test_replace_range_with_zeros();
+}
+
+TEST_F(DequeBinListTest, TestCounts) {
+    test_counts();
+}
+
+TEST_F(DequeBinListTest, TestLongRanges) {
+    test_long_ranges();
+}
+
+/* Small pages, so that the generic tests cross many page boundaries */
+class PagedBinListTest : public BinListTest<PagedBinList<RealValue, 8>> {
+ protected:
+    using Bins = PagedBinList<RealValue, 8>;
+
+    /* Test that the pages are only allocated for non-zero bins */
+    static void test_pages() {
+        auto bins = Bins(64);
+
+        EXPECT_EQ(bins.num_allocated_pages(), 0);
+        EXPECT_TRUE(bins.has_only_zeros());
+
+        bins[3] = 1;
+        bins[60] = 2;
+        EXPECT_EQ(bins.num_allocated_pages(), 2);
+
+        /* Shifting drops the pages moved out of the list */
+        auto pooled_pages = Bins::Pool::size();
+
+        bins.remove_trailing_elements(8);
+        bins.extend_front_with_zeros(8);
+        EXPECT_EQ(bins.num_allocated_pages(), 1);
+        EXPECT_EQ(Bins::Pool::size(), pooled_pages + 1);
+        EXPECT_EQ(bins[11], 1);
+        EXPECT_EQ(bins.sum(), 1);
+
+        /* A page emptied by a collapse goes back to the pool */
+        bins.replace_range_with_zeros(8, 16, 8);
+        EXPECT_EQ(bins.num_allocated_pages(), 0);
+        EXPECT_EQ(Bins::Pool::size(), pooled_pages + 2);
+
+        bins[20] = 3;
+        EXPECT_EQ(Bins::Pool::size(), pooled_pages + 1);
+
+        auto copy = bins;
+        EXPECT_EQ(copy.num_allocated_pages(), 1);
+        EXPECT_EQ(copy[20], 3);
+
+        bins[20] = 0;
+        bins.release_zero_pages();
+        EXPECT_EQ(bins.num_allocated_pages(), 0);
+        EXPECT_EQ(copy.sum(), 3);
+    }
+};
+
+TEST_F(PagedBinListTest, TestExtend) {
+    test_extend();
+}
+
+TEST_F(PagedBinListTest, TestShift) {
+    test_shift();
+}
+
+TEST_F(PagedBinListTest, TestReplaceRangeWithZeros) {
+    test_replace_range_with_zeros();
+}
+
+TEST_F(PagedBinListTest, TestCounts) {
+    test_counts();
+}
+
+TEST_F(PagedBinListTest, TestLongRanges) {
+    test_long_ranges();
+}
+
+TEST_F(PagedBinListTest, TestPages) {
+    test_pages();
+}
+
+TEST_F(PagedBinListTest, TestStores) {
+    test_store(PagedDenseStore(), DenseStore());
+    test_store(PagedDenseStore(16), DenseStore(16));
+    test_store(PagedCollapsingLowestDenseStore(64, 16),
+               CollapsingLowestDenseStore(64, 16));
+    test_store(PagedCollapsingHighestDenseStore(64, 16),
+               CollapsingHighestDenseStore(64, 16));
+    test_store(PagedCollapsingLowestDenseStore(2048),
+               CollapsingLowestDenseStore(2048));
+}
+
+class CompactBinListTest : public BinListTest<CompactBinList> {
+ protected:
+    using Width = CompactBinList::Width;
+
+    /* Test that the counters are widened, exactly, as the counts grow */
+    static void test_widening() {
+        auto bins = CompactBinList(10);
+
+        EXPECT_EQ(bins.width(), Width::kUInt16);
+        EXPECT_EQ(bins.counter_size(), sizeof(uint16_t));
+
+        bins[1] = 7;
+        bins[2] = std::numeric_limits<uint16_t>::max();
+        EXPECT_EQ(bins.width(), Width::kUInt16);
+
+        bins[2] += 1;
+        EXPECT_EQ(bins.width(), Width::kUInt32);
+        EXPECT_EQ(bins[2], 65536);
+
+        bins.extend_front_with_zeros(3);
+        bins[0] = std::numeric_limits<uint32_t>::max();
+        bins[0] += 1;
+        EXPECT_EQ(bins.width(), Width::kReal);
+        EXPECT_EQ(bins[0], 4294967296.0);
+        EXPECT_EQ(bins[4], 7);
+        EXPECT_EQ(bins[5], 65536);
+
+        /* Non-integer counts widen straight to doubles */
+        auto other_bins = CompactBinList(3);
+
+        other_bins[1] += 0.5;
+        EXPECT_EQ(other_bins.width(), Width::kReal);
+        EXPECT_EQ(other_bins.sum(), 0.5);
+
+        /* The sum does not overflow the counters */
+        auto full_bins = CompactBinList(4);
+
+        for (size_t idx = 0; idx < full_bins.size(); ++idx) {
+            full_bins[idx] = std::numeric_limits<uint16_t>::max();
+        }
+
+        EXPECT_EQ(full_bins.width(), Width::kUInt16);
+        EXPECT_EQ(full_bins.sum(), 4.0 * std::numeric_limits<uint16_t>::max());
+
+        full_bins.initialize_with_zeros(4);
+        EXPECT_EQ(full_bins.width(), Width::kUInt16);
+    }
+
+    /*
+     * Test that adding the bins of another list gives the exact sums, whether
+     * the widths of the lists match and the sums fit in them, or not
+     */
+    static void test_add_bins() {
+        constexpr auto kMaxUInt16 = std::numeric_limits<uint16_t>::max();
+
+        auto bins = CompactBinList(4);
+        auto other_bins = CompactBinList(4);
+
+        bins[0] = 1;
+        other_bins[1] = 2;
+        other_bins[3] = 3;
+
+        bins.add_bins(0, other_bins, 0, 4);
+        EXPECT_EQ(bins.width(), Width::kUInt16);
+        EXPECT_EQ(bins[0], 1);
+        EXPECT_EQ(bins[1], 2);
+        EXPECT_EQ(bins[3], 3);
+
+        /* The sum overflows the counters, which are widened */
+        other_bins[1] = kMaxUInt16;
+        bins.add_bins(0, other_bins, 0, 4);
+        EXPECT_EQ(bins.width(), Width::kUInt32);
+        EXPECT_EQ(bins[1], 2.0 + kMaxUInt16);
+        EXPECT_EQ(bins[3], 6);
+
+        /* The lists have different widths */
+        bins.add_bins(1, other_bins, 0, 3);
+        EXPECT_EQ(bins[1], 2.0 + kMaxUInt16);
+        EXPECT_EQ(bins[2], kMaxUInt16);
+        EXPECT_EQ(bins.sum(), 1.0 + (2.0 + kMaxUInt16) + kMaxUInt16 + 6);
+
+        other_bins[0] = 0.5;
+        bins[0] = std::numeric_limits<uint32_t>::max();
+        bins[0] += 1;
+        EXPECT_EQ(bins.width(), Width::kReal);
+
+        bins.add_bins(0, other_bins, 0, 1);
+        EXPECT_EQ(bins[0], 4294967296.5);
+
+        /* Adding the bins of a list to themselves doubles them */
+        bins.add_bins(0, bins, 0, 4);
+        EXPECT_EQ(bins[0], 2 * 4294967296.5);
+        EXPECT_EQ(bins[3], 12);
+    }
+};
+
+TEST_F(CompactBinListTest, TestExtend) {
+    test_extend();
+}
+
+TEST_F(CompactBinListTest, TestShift) {
+    test_shift();
+}
+
+TEST_F(CompactBinListTest, TestReplaceRangeWithZeros) {
+    test_replace_range_with_zeros();
+}
+
+TEST_F(CompactBinListTest, TestCounts) {
+    test_counts();
+}
+
+TEST_F(CompactBinListTest, TestLongRanges) {
+    test_long_ranges();
+}
+
+TEST_F(CompactBinListTest, TestWidening) {
+    test_widening();
+}
+
+TEST_F(CompactBinListTest, TestAddBins) {
+    test_add_bins();
+}
+
+TEST_F(CompactBinListTest, TestStores) {
+    test_store(CompactDenseStore(), DenseStore());
+    test_store(CompactCollapsingLowestDenseStore(64, 16),
+               CollapsingLowestDenseStore(64, 16));
+    test_store(CompactCollapsingHighestDenseStore(64, 16),
+               CollapsingHighestDenseStore(64, 16));
+}
+
 class Counter {
  public:
     using KeyValueContainer = std::map<StoreValue, StoreValue>;
@@ -245,6 +945,7 @@ class StoreTest : public ::testing::Test {
                              const StoreValues& values) = 0;
 
     virtual void test_store(const StoreValues& values) = 0;
+    virtual void test_store_batch(const StoreValues& values) = 0;
     virtual void test_merging(const StoreValueList& values_list) = 0;
 
     /* Test no values */
@@ -356,6 +1057,27 @@ class StoreTest : public ::testing::Test {
         test_store({kExtremeMax, kExtremeMin});
     }
 
+    /* Test adding batches of keys, with a single range extension */
+    void test_add_batch() {
+        constexpr auto kNumValues = 1000;
+
+        StoreValues values(kNumValues);
+
+        std::generate(
+            values.begin(),
+            values.end(),
+            [n = 0] () mutable {
+                /* Spread the keys in both directions from the first one */
+                auto sign = n % 2 ? 1 : -1;
+                return sign * (n++ % 97);
+            });
+
+        test_store_batch({});
+        test_store_batch({5});
+        test_store_batch({-3, -3, 8});
+        test_store_batch(values);
+    }
+
     /* Test merging empty stores */
     void test_merging_empty() {
         test_merging({{}, {}});
@@ -399,19 +1121,129 @@ class StoreTest : public ::testing::Test {
     void test_copying_non_empty() {
     }
 
-    virtual ~StoreTest() = default;
+    /* The non-empty bins of a store, by key */
+    template <class Store>
+    static std::map<Index, RealValue> non_empty_bins(const Store& store) {
+        std::map<Index, RealValue> bins;
 
-    StoreValues flatten(const StoreValueList& values_list) {
-        StoreValues result;
+        store.for_each_bin(
+            [&bins](Index key, RealValue bin_ct) {
+                bins[key] = bin_ct;
+            });
 
-        /* Reserve the total size in advance */
-        auto total_size =
-            std::accumulate(
-                std::begin(values_list),
-                std::end(values_list),
-                0,
-                [] (auto partial_sum, const auto& store_values) {
-                    return partial_sum + store_values.size();
+        return bins;
+    }
+
+    /*
+     * Test that subtracting a store, whose keys were also added to another
+     * one, gives the bins of the keys that were only added to the other
+     * store, including when the subtracted keys from extra_key on have been
+     * collapsed
+     */
+    template <class Store>
+    void test_subtract(Store store, Index extra_key) {
+        auto subtracted_store = store;
+        auto expected_store = store;
+
+        for (Index key = 100; key < 150; ++key) {
+            store.add(key, 2);
+            expected_store.add(key, 2);
+        }
+
+        for (Index key = 0; key < 10; ++key) {
+            store.add(key + extra_key, key + 1);
+            store.add(key * 5 + 100);
+            subtracted_store.add(key + extra_key, key + 1);
+            subtracted_store.add(key * 5 + 100);
+        }
+
+        store.subtract(subtracted_store);
+        EXPECT_EQ(store.count(), expected_store.count());
+        EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+
+        /* A store with keys out of the range is not subtracted */
+        auto other_store = store;
+        other_store.add(10000);
+        other_store.add(-10000);
+
+        EXPECT_THROW(expected_store.subtract(other_store),
+                     std::invalid_argument);
+        EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+
+        /* Nor is a store with a higher count for a key */
+        auto higher_store = expected_store;
+        higher_store.clear();
+        higher_store.add(100, 3);
+
+        EXPECT_THROW(expected_store.subtract(higher_store),
+                     std::invalid_argument);
+        EXPECT_EQ(expected_store.count(), store.count());
+        EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+
+        /* Subtracting everything leaves the store empty */
+        store.subtract(expected_store);
+        EXPECT_EQ(store.count(), 0);
+        EXPECT_TRUE(store.is_empty());
+
+        store.add(42);
+        EXPECT_EQ(store.count(), 1);
+        EXPECT_EQ(store.key_at_rank(0), 42);
+    }
+
+    /*
+     * Test that count_up_to sums the bins up to each key, and that the keys
+     * queried at once give the same counts
+     */
+    template <class Store>
+    void test_count_up_to(Store store) {
+        const std::vector<Index> added_keys = {-7, 3, 3, 5, 12, 40};
+        const std::vector<Index> keys =
+            {-100, -8, -7, -6, 2, 3, 4, 5, 11, 12, 39, 40, 41, 300};
+        std::vector<RealValue> counts(keys.size());
+
+        for (const auto key : keys) {
+            EXPECT_EQ(store.count_up_to(key), 0);
+        }
+
+        for (const auto key : added_keys) {
+            store.add(key);
+        }
+
+        store.add(5, 0.5);
+
+        store.counts_up_to(keys.data(), keys.size(), counts.data());
+
+        for (size_t idx = 0; idx < keys.size(); ++idx) {
+            RealValue expected_count =
+                std::count_if(
+                    added_keys.begin(),
+                    added_keys.end(),
+                    [&keys, idx](Index key) {
+                        return key <= keys[idx];
+                    });
+
+            if (keys[idx] >= 5) {
+                expected_count += 0.5;
+            }
+
+            EXPECT_EQ(store.count_up_to(keys[idx]), expected_count);
+            EXPECT_EQ(counts[idx], expected_count);
+        }
+    }
+
+    virtual ~StoreTest() = default;
+
+    StoreValues flatten(const StoreValueList& values_list) {
+        StoreValues result;
+
+        /* Reserve the total size in advance */
+        auto total_size =
+            std::accumulate(
+                std::begin(values_list),
+                std::end(values_list),
+                0,
+                [] (auto partial_sum, const auto& store_values) {
+                    return partial_sum + store_values.size();
                 });
         result.reserve(total_size);
 
@@ -449,6 +1281,194 @@ class DenseStoreTest : public StoreTest<DenseStore> {
         EXPECT_EQ(store.key_at_rank(-0.5, false), 4);
         EXPECT_EQ(store.key_at_rank(0.5, false), 10);
         EXPECT_EQ(store.key_at_rank(1.5, false), 100);
+
+        const std::vector<RealValue> ranks = {-0.5, 0, 0.5, 1, 1.5, 2, 2.5, 7};
+        std::vector<Index> keys(ranks.size());
+
+        for (const auto lower : {true, false}) {
+            store.key_at_ranks(ranks.data(), ranks.size(), keys.data(), lower);
+
+            for (size_t idx = 0; idx < ranks.size(); ++idx) {
+                EXPECT_EQ(keys[idx], store.key_at_rank(ranks[idx], lower));
+            }
+        }
+    }
+
+    /*
+     * Test that the rank index gives the same keys as the linear scan, and
+     * that it follows the updates made in between queries
+     */
+    template <class Store>
+    void test_rank_index(Store store) {
+        auto indexed_store = store;
+        indexed_store.enable_rank_index();
+
+        auto expect_same_keys = [&store, &indexed_store]() {
+            const auto count = store.count();
+            std::vector<RealValue> ranks;
+
+            for (auto rank = -0.5; rank <= count + 0.5; rank += 0.25) {
+                ranks.push_back(rank);
+            }
+
+            std::vector<Index> keys(ranks.size());
+
+            for (const auto lower : {true, false}) {
+                for (const auto rank : ranks) {
+                    EXPECT_EQ(indexed_store.key_at_rank(rank, lower),
+                              store.key_at_rank(rank, lower));
+                }
+
+                indexed_store.key_at_ranks(
+                    ranks.data(), ranks.size(), keys.data(), lower);
+
+                for (size_t idx = 0; idx < ranks.size(); ++idx) {
+                    EXPECT_EQ(keys[idx], store.key_at_rank(ranks[idx], lower));
+                }
+            }
+
+            for (Index key = -400; key <= 600; key += 7) {
+                EXPECT_EQ(indexed_store.count_up_to(key),
+                          store.count_up_to(key));
+            }
+        };
+
+        expect_same_keys();
+
+        for (Index key = -20; key < 40; key += 3) {
+            store.add(key);
+            indexed_store.add(key);
+            expect_same_keys();
+        }
+
+        const std::vector<Index> batch = {-100, 7, 7, 250, 12};
+        store.add_batch(batch.data(), batch.size());
+        indexed_store.add_batch(batch.data(), batch.size());
+        expect_same_keys();
+
+        auto other_store = store;
+        other_store.add(-300);
+        other_store.add(500, 2.5);
+
+        store.merge(other_store);
+        indexed_store.merge(other_store);
+        expect_same_keys();
+
+        store.copy(other_store);
+        indexed_store.copy(other_store);
+        expect_same_keys();
+
+        indexed_store.enable_rank_index(false);
+        expect_same_keys();
+    }
+
+    template <class Store>
+    static void expect_same_bins(const Store& store, const Store& other) {
+        ASSERT_EQ(store.length(), other.length());
+        EXPECT_EQ(store.offset(), other.offset());
+        EXPECT_EQ(store.count(), other.count());
+        EXPECT_TRUE(std::equal(store.bins().begin(),
+                               store.bins().end(),
+                               other.bins().begin()));
+    }
+
+    /*
+     * Test that merging a store whose keys are collapsed gives the same bins
+     * as adding its values
+     */
+    template <class Store>
+    void test_merging_collapsed(Store store) {
+        auto lower_store = store;
+        auto upper_store = store;
+        auto expected_store = store;
+
+        for (Index key = 100; key < 150; ++key) {
+            store.add(key);
+            expected_store.add(key);
+        }
+
+        for (Index key = 0; key < 10; ++key) {
+            lower_store.add(key, key + 1);
+            upper_store.add(key + 250, key + 1);
+        }
+
+        for (Index key = 0; key < 10; ++key) {
+            expected_store.add(key, key + 1);
+        }
+
+        store.merge(lower_store);
+        expect_same_bins(store, expected_store);
+
+        for (Index key = 0; key < 10; ++key) {
+            expected_store.add(key + 250, key + 1);
+        }
+
+        store.merge(upper_store);
+        expect_same_bins(store, expected_store);
+    }
+
+    /*
+     * Test that merge_all, and merging rvalues, give the same bins as merging
+     * the stores one by one
+     */
+    template <class Store>
+    void test_merge_all(Store store) {
+        std::vector<Store> stores(5, store);
+
+        for (Index key = 0; key < 20; ++key) {
+            stores[0].add(key);
+            stores[2].add(10 * key - 100, 0.5);
+            stores[3].add(key * key);
+        }
+
+        stores[4].add(-1000);
+
+        auto expected_store = store;
+        expected_store.add(7);
+
+        for (const auto& other_store : stores) {
+            expected_store.merge(other_store);
+        }
+
+        std::vector<const Store*> store_pointers;
+
+        for (const auto& other_store : stores) {
+            store_pointers.push_back(&other_store);
+        }
+
+        auto merged_store = store;
+        merged_store.add(7);
+        merged_store.merge_all(store_pointers.data(), store_pointers.size());
+        expect_same_bins(merged_store, expected_store);
+
+        /* The other stores become empty */
+        auto moved_store = store;
+        moved_store.add(7);
+
+        for (auto& other_store : stores) {
+            moved_store.merge(std::move(other_store));
+            EXPECT_EQ(other_store.count(), 0);
+            EXPECT_TRUE(other_store.is_empty());
+        }
+
+        expect_same_bins(moved_store, expected_store);
+
+        /* An empty store takes the bins of the first store */
+        auto taken_store = store;
+        auto expected_taken_store = store;
+        auto other_store = expected_store;
+
+        expected_taken_store.merge(other_store);
+        taken_store.merge(std::move(other_store));
+        expect_same_bins(taken_store, expected_taken_store);
+
+        /* A store moved into itself is merged, rather than emptied */
+        auto doubled_store = expected_store;
+        auto self_store = expected_store;
+
+        doubled_store.merge(expected_store);
+        self_store.merge(std::move(self_store));
+        expect_same_bins(self_store, doubled_store);
     }
 
     void test_values(const DenseStore& store,
@@ -483,6 +1503,20 @@ class DenseStoreTest : public StoreTest<DenseStore> {
         test_values(store, store_values);
     }
 
+    void test_store_batch(const StoreValues& store_values) override {
+        auto store = DenseStore();
+
+        store.add_batch(store_values.data(), store_values.size());
+        test_values(store, store_values);
+
+        /* A weighted batch on top of a non-empty store */
+        auto weights = std::vector<RealValue>(store_values.size(), 2.0);
+        store.add_batch(store_values.data(), weights.data(), weights.size());
+
+        EXPECT_EQ(store.count(), 3 * store_values.size());
+        EXPECT_EQ(store.bins().sum(), store.count());
+    }
+
     void test_merging(const StoreValueList& store_values_list) override {
         auto store = DenseStore();
 
@@ -512,8 +1546,146 @@ class DenseStoreTest : public StoreTest<DenseStore> {
          * far from one another as it would allocate an excessively large array
          */
     }
+
+    /*
+     * Test that the keys added within the reserved bins neither grow nor
+     * shift them, and that shrinking the bins keeps their counts
+     */
+    template <class Store>
+    void test_reserve(Store store, Index bin_limit) {
+        store.reserve(-100, 100);
+
+        const auto length = store.length();
+        const auto offset = store.offset();
+
+        EXPECT_EQ(store.count(), 0);
+        EXPECT_GE(length, std::min<Index>(201, bin_limit));
+        EXPECT_LE(length, std::max<Index>(bin_limit, 256));
+
+        auto expected_store = store;
+        expected_store.clear();
+
+        for (Index key = 0; key >= -100 && key <= 100;
+             key = key > 0 ? -key : -key + 1) {
+            store.add(key);
+            expected_store.add(key);
+
+            /* Unless the bin limit keeps the bins from covering the keys */
+            if (length >= 201) {
+                ASSERT_EQ(store.length(), length);
+                ASSERT_EQ(store.offset(), offset);
+            }
+        }
+
+        EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+
+        /* Reserving more keeps the counts */
+        store.reserve(-1000, -500);
+        EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+
+        store.shrink_to_fit();
+        EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+        EXPECT_LE(store.length(), std::max<Index>(bin_limit, 256));
+
+        store.add(50, 2.0);
+        expected_store.add(50, 2.0);
+        EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+
+        /* An empty store releases its bins */
+        store.clear();
+        store.shrink_to_fit();
+        EXPECT_EQ(store.length(), 0);
+    }
+
+    /* Test that adding the expected keys never grows nor shifts the bins */
+    void test_expected_keys() {
+        auto store = InstrumentedDenseStore(KeyRange{-1000, 1000});
+        const auto& stats = store.stats();
+
+        auto num_bytes_allocated = stats.num_bytes_allocated();
+
+        for (Index key = 1000; key >= -1000; key -= 7) {
+            store.add(key);
+            store.add(-key);
+        }
+
+        EXPECT_EQ(stats.num_shifts(), 0u);
+        EXPECT_EQ(stats.num_bytes_allocated(), num_bytes_allocated);
+        EXPECT_EQ(store.count(), 2 * 286);
+
+        auto collapsing_store =
+            InstrumentedCollapsingHighestDenseStore(64, KeyRange{0, 1000});
+        EXPECT_EQ(collapsing_store.length(), 64);
+    }
+
+    /*
+     * Test that a cleared store holds the same bins as a new one once the
+     * keys are added again, and that it reuses its bins for them
+     */
+    template <class Store>
+    void test_clear(Store store) {
+        auto add_keys = [](Store& target, Index first_key) {
+            for (Index key = first_key; key < first_key + 300; key += 3) {
+                target.add(key, 1.0 + key % 5);
+            }
+        };
+
+        add_keys(store, -100);
+        add_keys(store, 2000);
+
+        store.clear();
+        EXPECT_TRUE(store.is_empty());
+        EXPECT_EQ(store.count(), 0);
+        EXPECT_TRUE(non_empty_bins(store).empty());
+
+        const auto length = store.length();
+        const auto num_shifts = store.stats().num_shifts();
+        const auto num_bytes_allocated = store.stats().num_bytes_allocated();
+
+        auto expected_store = Store(store);
+        expected_store.shrink_to_fit();
+
+        for (auto first_key : {2000, -100}) {
+            add_keys(store, first_key);
+            add_keys(expected_store, first_key);
+
+            EXPECT_EQ(non_empty_bins(store), non_empty_bins(expected_store));
+            EXPECT_EQ(store.count(), expected_store.count());
+        }
+
+        EXPECT_EQ(store.length(), length);
+
+        /* The collapsing stores move their bins as they collapse again */
+        if (std::is_same<Store, InstrumentedDenseStore>::value) {
+            EXPECT_EQ(store.stats().num_shifts(), num_shifts);
+            EXPECT_EQ(store.stats().num_bytes_allocated(),
+                      num_bytes_allocated);
+        }
+    }
 };
 
+TEST_F(DenseStoreTest, TestClear) {
+    test_clear(InstrumentedDenseStore());
+    test_clear(InstrumentedCollapsingLowestDenseStore(256));
+    test_clear(InstrumentedCollapsingHighestDenseStore(256));
+}
+
+TEST_F(DenseStoreTest, TestReserve) {
+    test_reserve(DenseStore(), 256);
+    test_reserve(DenseStore(16), 208);
+    test_reserve(CollapsingLowestDenseStore(64), 64);
+    test_reserve(CollapsingHighestDenseStore(64), 64);
+    test_reserve(CollapsingLowestDenseStore(2048), 256);
+    test_reserve(PagedDenseStore(), 256);
+    test_reserve(PagedCollapsingLowestDenseStore(64, 16), 64);
+    test_reserve(CompactDenseStore(), 256);
+    test_reserve(CompactCollapsingHighestDenseStore(64, 16), 64);
+}
+
+TEST_F(DenseStoreTest, TestExpectedKeys) {
+    test_expected_keys();
+}
+
 TEST_F(DenseStoreTest, TestEmpty) {
     test_empty();
 }
@@ -542,6 +1714,10 @@ TEST_F(DenseStoreTest, TestBinCounts) {
     test_bin_counts();
 }
 
+TEST_F(DenseStoreTest, TestAddBatch) {
+    test_add_batch();
+}
+
 TEST_F(DenseStoreTest, TestExtremeValues) {
     test_extreme_values();
 }
@@ -570,6 +1746,334 @@ TEST_F(DenseStoreTest, TestKeyAtRank) {
     test_key_at_rank();
 }
 
+TEST_F(DenseStoreTest, TestCountUpTo) {
+    test_count_up_to(DenseStore());
+    test_count_up_to(CollapsingHighestDenseStore(2048));
+    test_count_up_to(PagedDenseStore());
+    test_count_up_to(CompactDenseStore());
+}
+
+TEST_F(DenseStoreTest, TestRankIndex) {
+    test_rank_index(DenseStore());
+    test_rank_index(CollapsingLowestDenseStore(64));
+    test_rank_index(CollapsingHighestDenseStore(64));
+    test_rank_index(PagedDenseStore());
+    test_rank_index(PagedCollapsingLowestDenseStore(64));
+}
+
+TEST_F(DenseStoreTest, TestMergingCollapsed) {
+    test_merging_collapsed(CollapsingLowestDenseStore(64));
+    test_merging_collapsed(CollapsingHighestDenseStore(64));
+    test_merging_collapsed(PagedCollapsingLowestDenseStore(64, 16));
+    test_merging_collapsed(CompactCollapsingHighestDenseStore(64, 16));
+}
+
+TEST_F(DenseStoreTest, TestSubtract) {
+    test_subtract(DenseStore(), 0);
+    test_subtract(DenseStore(16), 1000);
+    test_subtract(CollapsingLowestDenseStore(64), 0);
+    test_subtract(CollapsingHighestDenseStore(64), 250);
+    test_subtract(PagedDenseStore(), -500);
+    test_subtract(PagedCollapsingLowestDenseStore(64, 16), -500);
+    test_subtract(CompactDenseStore(), 0);
+    test_subtract(CompactCollapsingHighestDenseStore(64, 16), 250);
+}
+
+TEST_F(DenseStoreTest, TestMergeAll) {
+    test_merge_all(DenseStore());
+    test_merge_all(DenseStore(16));
+    test_merge_all(CollapsingLowestDenseStore(64));
+    test_merge_all(CollapsingHighestDenseStore(64));
+    test_merge_all(CollapsingLowestDenseStore(2048));
+    test_merge_all(PagedDenseStore());
+    test_merge_all(PagedCollapsingLowestDenseStore(64, 16));
+    test_merge_all(CompactDenseStore());
+    test_merge_all(CompactCollapsingHighestDenseStore(64, 16));
+}
+
+class StoreStatsTest : public ::testing::Test {
+ protected:
+    static void test_dense_store() {
+        auto store = InstrumentedDenseStore(16);
+
+        for (Index key = 0; key < 40; ++key) {
+            store.add(key);
+        }
+
+        const auto& stats = store.stats();
+
+        EXPECT_EQ(stats.num_adds(), 40u);
+        EXPECT_EQ(stats.num_range_extensions(), 40u);
+        EXPECT_EQ(stats.num_bytes_allocated(),
+                  store.length() * sizeof(RealValue));
+        EXPECT_EQ(stats.num_collapses(), 0u);
+        EXPECT_EQ(stats.collapsed_weight(), 0);
+
+        /* Within the range */
+        const Index keys[] = {3, 5, 7};
+        store.add_batch(keys, 3);
+
+        EXPECT_EQ(stats.num_adds(), 43u);
+        EXPECT_EQ(stats.num_range_extensions(), 40u);
+
+        /* The bins are shifted to make room for the lower keys */
+        auto num_bins_shifted = stats.num_bins_shifted();
+        store.add(-10);
+
+        EXPECT_GT(stats.num_shifts(), 0u);
+        EXPECT_GT(stats.num_bins_shifted(), num_bins_shifted);
+        EXPECT_EQ(stats.collapsed_weight(), 0);
+    }
+
+    /*
+     * Adding the keys 0 to 19 to a store of 8 bins collapses its range 12
+     * times, each collapse moving the 1 to 12 values of the first bin
+     */
+    static void test_collapsing_lowest_store() {
+        auto store = InstrumentedCollapsingLowestDenseStore(8, 8);
+
+        for (Index key = 0; key < 20; ++key) {
+            store.add(key);
+        }
+
+        const auto& stats = store.stats();
+
+        EXPECT_EQ(stats.num_adds(), 20u);
+        EXPECT_EQ(stats.num_collapses(), 12u);
+        EXPECT_EQ(stats.collapsed_weight(), 78);
+        EXPECT_EQ(stats.num_bytes_allocated(), 8 * sizeof(RealValue));
+
+        /* Collapsed into the first bin */
+        store.add(0, 2.0);
+
+        EXPECT_EQ(stats.num_collapses(), 12u);
+        EXPECT_EQ(stats.collapsed_weight(), 80);
+
+        /*
+         * A merged store, whose lowest keys are collapsed, once the range
+         * extended to them has been collapsed as well
+         */
+        auto other_store = InstrumentedCollapsingLowestDenseStore(8, 8);
+
+        for (Index key = 10; key < 14; ++key) {
+            other_store.add(key);
+        }
+
+        store.merge(other_store);
+
+        EXPECT_EQ(stats.num_collapses(), 14u);
+        EXPECT_EQ(stats.collapsed_weight(), 82);
+    }
+
+    static void test_collapsing_highest_store() {
+        auto store = InstrumentedCollapsingHighestDenseStore(8, 8);
+
+        for (Index key = 19; key >= 0; --key) {
+            store.add(key);
+        }
+
+        const auto& stats = store.stats();
+
+        EXPECT_EQ(stats.num_adds(), 20u);
+        EXPECT_EQ(stats.num_collapses(), 12u);
+        EXPECT_EQ(stats.collapsed_weight(), 78);
+
+        const Index keys[] = {19, 0};
+        store.add_batch(keys, 2);
+
+        EXPECT_EQ(stats.num_adds(), 22u);
+        EXPECT_EQ(stats.collapsed_weight(), 79);
+    }
+
+    static void test_sketch() {
+        using Sketch =
+            BaseDDSketch<InstrumentedCollapsingLowestDenseStore,
+                         LogarithmicMapping>;
+
+        auto sketch = Sketch(LogarithmicMapping(0.01),
+                             InstrumentedCollapsingLowestDenseStore(64),
+                             InstrumentedCollapsingLowestDenseStore(64));
+
+        for (auto value = 1.0; value < 1e6; value *= 1.01) {
+            sketch.add(value);
+        }
+
+        const auto& stats = sketch.store().stats();
+
+        EXPECT_EQ(stats.num_adds(), sketch.num_values());
+        EXPECT_GT(stats.num_collapses(), 0u);
+        EXPECT_GT(stats.collapsed_weight(), 0);
+        EXPECT_EQ(sketch.negative_store().stats().num_adds(), 0u);
+    }
+};
+
+TEST_F(StoreStatsTest, TestDenseStore) {
+    test_dense_store();
+}
+
+TEST_F(StoreStatsTest, TestCollapsingLowestStore) {
+    test_collapsing_lowest_store();
+}
+
+TEST_F(StoreStatsTest, TestCollapsingHighestStore) {
+    test_collapsing_highest_store();
+}
+
+TEST_F(StoreStatsTest, TestSketch) {
+    test_sketch();
+}
+
+class AllocatorTest : public ::testing::Test {
+ protected:
+    /* The bytes obtained from the allocators of an arena */
+    struct Arena {
+        size_t num_live_bytes = 0;
+        size_t num_allocations = 0;
+    };
+
+    /* A stateful allocator, which accounts for its bytes in an arena */
+    template <typename T>
+    class ArenaAllocator {
+     public:
+        using value_type = T;
+
+        explicit ArenaAllocator(std::shared_ptr<Arena> arena)
+            : arena_(std::move(arena)) {
+        }
+
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U>& allocator)  // NOLINT
+            : arena_(allocator.arena()) {
+        }
+
+        T* allocate(size_t num_items) {
+            arena_->num_live_bytes += num_items * sizeof(T);
+            ++arena_->num_allocations;
+
+            return std::allocator<T>().allocate(num_items);
+        }
+
+        void deallocate(T* items, size_t num_items) {
+            arena_->num_live_bytes -= num_items * sizeof(T);
+            std::allocator<T>().deallocate(items, num_items);
+        }
+
+        const std::shared_ptr<Arena>& arena() const {
+            return arena_;
+        }
+
+        template <typename U>
+        bool operator==(const ArenaAllocator<U>& allocator) const {
+            return arena_ == allocator.arena();
+        }
+
+        template <typename U>
+        bool operator!=(const ArenaAllocator<U>& allocator) const {
+            return arena_ != allocator.arena();
+        }
+
+     private:
+        std::shared_ptr<Arena> arena_;
+    };
+
+    /*
+     * Test that the bins of a store, and of its copies, are obtained from
+     * its allocator, whatever the operations on the store
+     */
+    template <class Store>
+    static void test_store(const Store& prototype) {
+        const auto arena = prototype.get_allocator().arena();
+
+        /* An empty std::deque may already hold a block */
+        const auto num_prototype_bytes = arena->num_live_bytes;
+
+        {
+            auto store = prototype;
+
+            for (Index key = -500; key <= 500; key += 7) {
+                store.add(key, key % 3 == 0 ? 0.5 : 70000.0);
+            }
+
+            EXPECT_GT(arena->num_live_bytes, 0u);
+
+            auto num_live_bytes = arena->num_live_bytes;
+            auto other_store = store;
+
+            EXPECT_TRUE(other_store.get_allocator() == store.get_allocator());
+            EXPECT_GT(arena->num_live_bytes, num_live_bytes);
+
+            other_store.merge(std::move(store));
+            other_store.add(-5000);
+            other_store.shrink_to_fit();
+            EXPECT_TRUE(other_store.get_allocator() ==
+                        prototype.get_allocator());
+
+            other_store.clear();
+            other_store.shrink_to_fit();
+            store.shrink_to_fit();
+        }
+
+        EXPECT_EQ(arena->num_live_bytes, num_prototype_bytes);
+    }
+
+    /* Test that the stores of a sketch keep their allocator */
+    static void test_sketch() {
+        using Bins = BinList<RealValue, ArenaAllocator<RealValue>>;
+        using Store = BaseCollapsingLowestDenseStore<Bins>;
+        using Sketch = BaseDDSketch<Store, LogarithmicMapping>;
+
+        const auto arena = std::make_shared<Arena>();
+        const ArenaAllocator<RealValue> allocator(arena);
+
+        {
+            Sketch sketch(LogarithmicMapping(kTestRelativeAccuracy),
+                          Store(256, allocator),
+                          Store(256, allocator));
+
+            EXPECT_EQ(arena->num_allocations, 0u);
+
+            for (auto value = -100.0; value <= 100.0; value += 0.25) {
+                sketch.add(value);
+            }
+
+            EXPECT_GT(arena->num_allocations, 0u);
+            EXPECT_TRUE(sketch.store().get_allocator() == allocator);
+            EXPECT_TRUE(sketch.negative_store().get_allocator() == allocator);
+
+            auto other_sketch = sketch;
+            other_sketch.merge(sketch);
+            EXPECT_EQ(other_sketch.num_values(), 2 * sketch.num_values());
+        }
+
+        EXPECT_EQ(arena->num_live_bytes, 0u);
+    }
+
+    static constexpr RealValue kTestRelativeAccuracy = 0.02;
+};
+
+constexpr RealValue AllocatorTest::kTestRelativeAccuracy;
+
+TEST_F(AllocatorTest, TestStores) {
+    const ArenaAllocator<RealValue> allocator(std::make_shared<Arena>());
+
+    using Bins = BinList<RealValue, ArenaAllocator<RealValue>>;
+    using DequeBins = DequeBinList<RealValue, ArenaAllocator<RealValue>>;
+    using CompactBins = BaseCompactBinList<ArenaAllocator<RealValue>>;
+
+    test_store(BaseDenseStore<void, Bins>(allocator));
+    test_store(BaseDenseStore<void, Bins>(allocator, 16));
+    test_store(BaseDenseStore<void, DequeBins>(allocator));
+    test_store(BaseDenseStore<void, CompactBins>(allocator));
+    test_store(BaseCollapsingLowestDenseStore<Bins>(64, allocator));
+    test_store(BaseCollapsingHighestDenseStore<Bins>(64, allocator));
+    test_store(BaseCollapsingLowestDenseStore<CompactBins>(64, allocator));
+    test_store(BaseCollapsingHighestDenseStore<CompactBins>(64, allocator));
+}
+
+TEST_F(AllocatorTest, TestSketch) {
+    test_sketch();
+}
+
 class CollapsingLowestDenseStoreTest
     : public StoreTest<CollapsingLowestDenseStore> {
  protected:
@@ -619,6 +2123,23 @@ class CollapsingLowestDenseStoreTest
         }
     }
 
+    void test_store_batch(const StoreValues& values) override {
+        auto test_bin_limits = {1, 20, 1000};
+
+        for (const auto bin_limit : test_bin_limits) {
+            auto store = CollapsingLowestDenseStore(bin_limit);
+
+            /* Start from a non-empty store, so that it may collapse */
+            store.add(0);
+            store.add_batch(values.data(), values.size());
+
+            auto expected_values = values;
+            expected_values.insert(expected_values.begin(), 0);
+
+            test_values(store, expected_values);
+        }
+    }
+
     void test_merging(const StoreValueList& store_values_list) override {
         auto test_bin_limits = {1, 20, 1000};
 
@@ -683,6 +2204,10 @@ TEST_F(CollapsingLowestDenseStoreTest, TestBinCounts) {
     test_bin_counts();
 }
 
+TEST_F(CollapsingLowestDenseStoreTest, TestAddBatch) {
+    test_add_batch();
+}
+
 TEST_F(CollapsingLowestDenseStoreTest, TestMergingEmpty) {
     test_merging_empty();
 }
@@ -749,6 +2274,23 @@ class CollapsingHighestDenseStoreTest
         }
     }
 
+    void test_store_batch(const StoreValues& values) override {
+        auto test_bin_limits = {1, 20, 1000};
+
+        for (const auto bin_limit : test_bin_limits) {
+            auto store = CollapsingHighestDenseStore(bin_limit);
+
+            /* Start from a non-empty store, so that it may collapse */
+            store.add(0);
+            store.add_batch(values.data(), values.size());
+
+            auto expected_values = values;
+            expected_values.insert(expected_values.begin(), 0);
+
+            test_values(store, expected_values);
+        }
+    }
+
     void test_merging(const StoreValueList& store_values_list) override {
         auto test_bin_limits = {1, 20, 1000};
 
@@ -810,6 +2352,10 @@ TEST_F(CollapsingHighestDenseStoreTest, TestBinCounts) {
     test_bin_counts();
 }
 
+TEST_F(CollapsingHighestDenseStoreTest, TestAddBatch) {
+    test_add_batch();
+}
+
 TEST_F(CollapsingHighestDenseStoreTest, TestMergingEmpty) {
     test_merging_empty();
 }
@@ -826,427 +2372,3064 @@ TEST_F(CollapsingHighestDenseStoreTest, TestCopyingNonEmpty) {
     test_copying_non_empty();
 }
 
-template <typename ConcreteDDSketch>
-class SketchSummary {
- public:
-    using SketchContainer = std::vector<RealValue>;
-    using iterator = typename SketchContainer::iterator;
-    using const_iterator = typename SketchContainer::const_iterator;
-
-    SketchSummary(ConcreteDDSketch& sketch,
-                  const std::vector<RealValue>& quantiles) {
-        for (const auto& quantile : quantiles) {
-            auto computed_quantile = sketch.get_quantile_value(quantile);
-            summary_.push_back(computed_quantile);
+class FixedRangeAtomicStoreTest : public StoreTest<FixedRangeAtomicStore> {
+ protected:
+    void test_values(const FixedRangeAtomicStore& store,
+                     const StoreValues& values) override {
+        auto normalized_counter = Counter(normalize_values(values));
+        auto bins = store.bins();
+
+        auto expected_total_count = normalized_counter.sum_values();
+        EXPECT_EQ(expected_total_count, store.count());
+        EXPECT_EQ(expected_total_count == 0, store.is_empty());
+        EXPECT_EQ(static_cast<Index>(bins.size()), store.length());
+
+        auto idx = 0;
+        for (const auto& item : bins) {
+            EXPECT_EQ(normalized_counter[idx + store.min_key()], item);
+            ++idx;
         }
-
-        summary_.push_back(sketch.sum());
-        summary_.push_back(sketch.avg());
-        summary_.push_back(sketch.num_values());
     }
 
-    void assert_almost_equal(const SketchSummary<ConcreteDDSketch>& other) {
-        std::equal(summary_.begin(),
-                   summary_.end(),
-                   other.summary_.begin(),
-                   [](const RealValue& left, const RealValue& right) {
-                       EXPECT_ALMOST_EQ(left, right);
-                       return left == right;
-                   });
-    }
+    void test_store(const StoreValues& store_values) override {
+        auto store = FixedRangeAtomicStore(kMinKey, kMaxKey);
 
- private:
-    SketchContainer summary_;
-};
+        for (const auto& value : store_values) {
+            store.add(value);
+        }
 
-template <typename ConcreteDDSketch>
-class BaseDDSketchTest : public ::testing::Test, CRTP<ConcreteDDSketch> {
- public:
-    BaseDDSketchTest(const BaseDDSketchTest& test) = delete;
-    BaseDDSketchTest(BaseDDSketchTest&& test) = delete;
+        test_values(store, store_values);
 
-    BaseDDSketchTest& operator=(const BaseDDSketchTest& test) = delete;
-    BaseDDSketchTest& operator=(BaseDDSketchTest&& test) = delete;
+        /* Copies are deep */
+        auto copy = store;
+        auto other_store = FixedRangeAtomicStore(0, 0);
+        other_store.copy(store);
 
- protected:
-    BaseDDSketchTest() = default;
-    virtual ~BaseDDSketchTest() = default;
+        store.add(0);
+        test_values(copy, store_values);
+        test_values(other_store, store_values);
+    }
 
-    /* Create a new DDSketch of the appropriate type */
-    virtual ConcreteDDSketch create_ddsketch() = 0;
+    void test_store_batch(const StoreValues& store_values) override {
+        auto store = FixedRangeAtomicStore(kMinKey, kMaxKey);
 
-    void evaluate_sketch_accuracy(ConcreteDDSketch& sketch,
-                                  const DataSet<RealValue>& dataset,
-                                  RealValue eps,
-                                  bool summary_stats = true) {
-    auto test_quantiles =
-        {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+        store.add_batch(store_values.data(), store_values.size());
+        test_values(store, store_values);
 
-         for (const auto quantile : test_quantiles) {
-             auto sketch_q = sketch.get_quantile_value(quantile);
-             auto data_q = dataset.quantile(quantile);
-             auto err = std::abs(sketch_q - data_q);
+        auto weights = std::vector<RealValue>(store_values.size(), 2.0);
+        store.add_batch(store_values.data(), weights.data(), weights.size());
 
-             EXPECT_TRUE(err - eps * std::abs(data_q) <= 1.0e-15);
-         }
+        EXPECT_EQ(store.count(), 3 * store_values.size());
+    }
 
-         EXPECT_EQ(sketch.num_values(), dataset.len());
+    void test_merging(const StoreValueList& store_values_list) override {
+        auto store = FixedRangeAtomicStore(kMinKey, kMaxKey);
 
-         if (summary_stats) {
-             EXPECT_ALMOST_EQ(sketch.sum(), dataset.sum());
-             EXPECT_ALMOST_EQ(sketch.avg(), dataset.avg());
-         }
-    }
+        for (const auto& store_values : store_values_list) {
+            /* A wider range, which gets collapsed by the merge */
+            auto intermediate_store =
+                FixedRangeAtomicStore(2 * kMinKey, 2 * kMaxKey);
 
-    /* Test DDSketch on values from various distributions */
-    void test_distributions() {
-        const auto& test_datasets = get_datasets();
+            for (const auto& value : store_values) {
+                intermediate_store.add(value);
+            }
 
-        for (auto& dataset : test_datasets) {
-            for (const auto size : {3, 5, 10, 100, 1000}) {
-                dataset->populate(size);
+            store.merge(intermediate_store);
+        }
 
-                auto sketch = create_ddsketch();
+        test_values(store, flatten(store_values_list));
+    }
 
-                for (const auto& value : *dataset) {
-                    sketch.add(value);
-                }
+    /* Test that key_at_rank matches the one of an uncollapsed DenseStore */
+    void test_key_at_rank() {
+        auto store = FixedRangeAtomicStore(kMinKey, kMaxKey);
+        auto dense_store = DenseStore();
 
-                evaluate_sketch_accuracy(
-                    sketch, *dataset, kTestRelativeAccuracy);
+        for (const auto key : {-400, -3, -3, 0, 7, 7, 7, 12, 500}) {
+            store.add(key);
+            dense_store.add(key);
+        }
+
+        for (const auto lower : {true, false}) {
+            for (auto rank = 0.0; rank <= 10; rank += 0.5) {
+                EXPECT_EQ(store.key_at_rank(rank, lower),
+                          dense_store.key_at_rank(rank, lower));
             }
         }
     }
 
-    /* Test DDSketch on adding integer weighted values */
-    void test_add_multiple() {
-        auto dataset = Integers();
-        dataset.populate(1000);
+    /* Test adding keys from several threads at once */
+    void test_concurrent_add() {
+        constexpr auto kNumThreads = 4;
+        constexpr auto kNumValues = 10000;
 
-        StoreValues dataset_values;
-        for (const auto& value : dataset) {
-            dataset_values.push_back(value);
+        auto store = FixedRangeAtomicStore(kMinKey, kMaxKey);
+        std::vector<std::thread> threads;
+
+        for (auto thread_idx = 0; thread_idx < kNumThreads; ++thread_idx) {
+            threads.emplace_back(
+                [&store]() {
+                    for (auto n = 0; n < kNumValues; ++n) {
+                        store.add(n % 2000 - 1000);
+                    }
+                });
         }
 
-        auto sketch = create_ddsketch();
-        for (const auto& pair : Counter(dataset_values)) {
-            auto value = pair.first;
-            auto count = pair.second;
+        for (auto& thread : threads) {
+            thread.join();
+        }
 
-            sketch.add(value, count);
+        StoreValues values;
+
+        for (auto thread_idx = 0; thread_idx < kNumThreads; ++thread_idx) {
+            for (auto n = 0; n < kNumValues; ++n) {
+                values.push_back(n % 2000 - 1000);
+            }
         }
 
-        evaluate_sketch_accuracy(sketch, dataset, kTestRelativeAccuracy);
+        test_values(store, values);
     }
 
-    /* Test DDSketch on adding decimal weighted values */
-    void test_add_decimal() {
-        auto sketch = create_ddsketch();
+    /* Test a sketch built on top of fixed range stores */
+    void test_sketch() {
+        constexpr auto kRelativeAccuracy = 0.01;
 
-        for (auto value = 0; value < 100; ++value) {
-            sketch.add(value, 1.1);
+        auto mapping = LogarithmicMapping(kRelativeAccuracy);
+        auto sketch = BaseDDSketch<FixedRangeAtomicStore, LogarithmicMapping>(
+            mapping,
+            FixedRangeAtomicStore::for_values(mapping, 1.0, 1000.0),
+            FixedRangeAtomicStore(0, 0));
+        auto dense_sketch = DDSketch(kRelativeAccuracy);
+
+        for (auto value = 1.0; value <= 1000.0; value += 1.5) {
+            sketch.add(value);
+            dense_sketch.add(value);
         }
 
-        sketch.add(100, 110.0);
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.05) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      dense_sketch.get_quantile_value(quantile));
+        }
+    }
 
-        auto data_median = 99;
-        auto sketch_median = sketch.get_quantile_value(0.5);
-        auto err = std::abs(sketch_median - data_median);
+    static StoreValues normalize_values(const StoreValues& store_values) {
+        auto result = StoreValues();
 
-        EXPECT_TRUE(
-            err - kTestRelativeAccuracy * std::abs(data_median) <= 1.0e-15);
-        EXPECT_ALMOST_EQ(sketch.num_values(), 110 * 2);
-        EXPECT_ALMOST_EQ(sketch.sum(), 5445 + 11000);
-        EXPECT_ALMOST_EQ(sketch.avg(), 74.75);
+        std::transform(
+            store_values.begin(),
+            store_values.end(),
+            std::back_inserter(result),
+            [](StoreValue value) -> StoreValue {
+                return std::min(std::max(value, kMinKey), kMaxKey);
+            });
+
+        return result;
     }
 
-    /* Test merging equal-sized DDSketches */
-    void test_merge_equal() {
-        std::vector<std::pair<RealValue, RealValue>> normal_parameters =
-             {{35, 1}, {1, 3}, {15, 2}, {40, 0.5}};
+    /*
+     * Test that holds sums the keys of the other store clamped to the same
+     * bin, and that the stores it holds are subtracted
+     */
+    void test_holds() {
+        auto store = FixedRangeAtomicStore(kMinKey, kMaxKey);
+        auto other_store = FixedRangeAtomicStore(2 * kMinKey, 2 * kMaxKey);
 
-        for (const auto size : {3, 5, 10, 100, 1000}) {
-            auto dataset = EmptyDataSet();
-            auto target_sketch = create_ddsketch();
+        store.add(kMaxKey, 3);
+        store.add(0, 0.8);
+        other_store.add(kMaxKey);
+        other_store.add(2 * kMaxKey);
 
-            for (const auto& params : normal_parameters) {
-                auto generator = Normal(params.first, params.second);
-                generator.populate(size);
+        EXPECT_TRUE(store.holds(other_store));
 
-                auto sketch = create_ddsketch();
-                for (const auto& value : generator) {
-                    sketch.add(value);
-                    dataset.add(value);
-                }
-                target_sketch.merge(sketch);
+        other_store.add(kMaxKey + 1, 2);
+        EXPECT_FALSE(store.holds(other_store));
 
-                evaluate_sketch_accuracy(
-                    target_sketch, dataset, kTestRelativeAccuracy);
-            }
+        auto weighted_store = FixedRangeAtomicStore(kMinKey, kMaxKey);
+        weighted_store.add(0, 0.7);
+        weighted_store.add(0, 0.1);
+        EXPECT_TRUE(store.holds(weighted_store));
 
-            evaluate_sketch_accuracy(
-                target_sketch, dataset, kTestRelativeAccuracy);
-        }
+        store.subtract(weighted_store);
+        EXPECT_EQ(store.count(), 3);
     }
 
-    /* Test merging variable-sized DDSketches */
-    void test_merge_unequal() {
-        constexpr auto num_tests = 20;
+    /* Test that a moved-from store is empty, and can be assigned to again */
+    void test_moved_from() {
+        auto store = FixedRangeAtomicStore(kMinKey, kMaxKey);
+        auto other_store = FixedRangeAtomicStore(kMinKey, kMaxKey);
 
-         std::random_device random_device;
-         std::mt19937_64 generator(random_device());
-         std::uniform_real_distribution<DataValue> random(0, 1);
+        store.add(3, 2);
+        other_store.add(7);
 
-        for (auto test_id = 0; test_id < num_tests; ++test_id) {
-            for (const auto size : {3, 5, 10, 100, 1000}) {
-                auto dataset = Lognormal();
-                dataset.populate(size);
+        auto moved_store = std::move(store);
+        EXPECT_EQ(moved_store.count(), 2);
+        EXPECT_EQ(moved_store.key_at_rank(0), 3);
 
-                auto sketch1 = create_ddsketch();
-                auto sketch2 = create_ddsketch();
+        EXPECT_EQ(store.length(), 0);
+        EXPECT_EQ(store.count(), 0);
+        EXPECT_TRUE(store.is_empty());
+        EXPECT_TRUE(store.bins().empty());
 
-                for (const auto& value : dataset) {
-                    if (random(generator) > 0.7) {
-                        sketch1.add(value);
-                    } else {
-                        sketch2.add(value);
-                    }
-                }
+        /* A copy of the moved-from store is empty as well */
+        auto empty_store = store;
+        EXPECT_EQ(empty_store.length(), 0);
 
-                sketch1.merge(sketch2);
+        store = other_store;
+        EXPECT_EQ(store.length(), other_store.length());
+        EXPECT_EQ(store.count(), 1);
 
-                evaluate_sketch_accuracy(
-                    sketch1, dataset, kTestRelativeAccuracy);
-            }
-        }
-    }
+        store.add(7);
+        EXPECT_EQ(store.count(), 2);
+        EXPECT_EQ(other_store.count(), 1);
 
-    /* Test merging DDSketches of different distributions */
-    void test_merge_mixed() {
-       constexpr auto num_tests = 20;
+        moved_store = std::move(store);
+        EXPECT_EQ(moved_store.count(), 2);
+        EXPECT_EQ(store.length(), 0);
 
-        std::vector<std::unique_ptr<GenericDataSet>> test_datasets;
-        test_datasets.emplace_back(std::make_unique<Normal>());
-        test_datasets.emplace_back(std::make_unique<Exponential>());
-        test_datasets.emplace_back(std::make_unique<Laplace>());
-        test_datasets.emplace_back(std::make_unique<Bimodal>());
+        store = std::move(moved_store);
+        EXPECT_EQ(store.key_at_rank(0), 7);
 
-        std::random_device random_device;
-        std::mt19937_64 generator(random_device());
-        std::uniform_real_distribution<RealValue> random(0, 500);
+        moved_store = empty_store;
+        EXPECT_EQ(moved_store.length(), 0);
+    }
 
-        for (auto test_id = 0; test_id < num_tests; ++test_id) {
-            auto merged_dataset = EmptyDataSet();
-            auto merged_sketch = create_ddsketch();
+    static constexpr StoreValue kMinKey = -512;
+    static constexpr StoreValue kMaxKey = 511;
+};
 
-            for (auto& dataset : test_datasets) {
-                Index dataset_size = static_cast<Index>(random(generator));
-                dataset->populate(dataset_size);
-                auto sketch = create_ddsketch();
+constexpr StoreValue FixedRangeAtomicStoreTest::kMinKey;
+constexpr StoreValue FixedRangeAtomicStoreTest::kMaxKey;
 
-                for (const auto& value : *dataset) {
-                    sketch.add(value);
-                    merged_dataset.add(value);
-                }
+TEST_F(FixedRangeAtomicStoreTest, TestEmpty) {
+    test_empty();
+}
 
-                merged_sketch.merge(sketch);
-                evaluate_sketch_accuracy(
-                    merged_sketch, merged_dataset, kTestRelativeAccuracy);
-            }
-        }
-    }
+TEST_F(FixedRangeAtomicStoreTest, TestConstant) {
+    test_constant();
+}
 
-    /* Test that merge() calls do not modify the argument sketch */
-    void test_consistent_merge() {
-        std::vector<RealValue> kTestQuantiles =
-            {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+TEST_F(FixedRangeAtomicStoreTest, TestIncreasingLinearly) {
+    test_increasing_linearly();
+}
 
-        auto sketch1 = create_ddsketch();
-        auto sketch2 = create_ddsketch();
+TEST_F(FixedRangeAtomicStoreTest, TestDecreasingLinearly) {
+    test_decreasing_linearly();
+}
 
-        auto dataset1 = Normal();
-        dataset1.populate(100);
+TEST_F(FixedRangeAtomicStoreTest, TestIncreasingExponentially) {
+    test_increasing_exponentially();
+}
 
-        for (const auto& value : dataset1) {
-            sketch1.add(value);
-        }
+TEST_F(FixedRangeAtomicStoreTest, TestDecreasingExponentially) {
+    test_decreasing_exponentially();
+}
 
-        sketch1.merge(sketch2);
+TEST_F(FixedRangeAtomicStoreTest, TestBinCounts) {
+    test_bin_counts();
+}
 
-        /* Sketch2 is still empty */
-        EXPECT_EQ(sketch2.num_values(), 0);
+TEST_F(FixedRangeAtomicStoreTest, TestAddBatch) {
+    test_add_batch();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestExtremeValues) {
+    test_extreme_values();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestMergingEmpty) {
+    test_merging_empty();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestMergingFarApart) {
+    test_merging_far_apart();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestMergingConstant) {
+    test_merging_constant();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestMergingExtremeValues) {
+    test_merging_extreme_values();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestKeyAtRank) {
+    test_key_at_rank();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestCountUpTo) {
+    test_count_up_to(FixedRangeAtomicStore(kMinKey, kMaxKey));
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestMovedFrom) {
+    test_moved_from();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestHolds) {
+    test_holds();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestConcurrentAdd) {
+    test_concurrent_add();
+}
+
+TEST_F(FixedRangeAtomicStoreTest, TestSketch) {
+    test_sketch();
+}
+
+class SparseStoreTest : public StoreTest<SparseStore> {
+ protected:
+    void test_values(const SparseStore& store,
+                     const StoreValues& values) override {
+        auto counter = Counter(values);
+
+        EXPECT_EQ(counter.sum_values(), store.count());
+        EXPECT_EQ(counter.sum_values() == 0, store.is_empty());
+
+        /* Only the non-empty bins are kept, in increasing key order */
+        auto num_bins = 0;
+        for (const auto& item : counter) {
+            if (item.second != 0) {
+                ++num_bins;
+            }
+        }
+        EXPECT_EQ(store.length(), num_bins);
+
+        EXPECT_TRUE(
+            std::is_sorted(
+                store.bins().begin(),
+                store.bins().end(),
+                [](const SparseStore::Bin& bin,
+                   const SparseStore::Bin& other_bin) {
+                    return bin.first <= other_bin.first;
+                }));
+
+        for (const auto& bin : store.bins()) {
+            EXPECT_EQ(counter[bin.first], bin.second);
+        }
+    }
+
+    void test_store(const StoreValues& store_values) override {
+        auto store = SparseStore();
+
+        for (const auto& value : store_values) {
+            store.add(value);
+        }
+
+        test_values(store, store_values);
+    }
+
+    void test_store_batch(const StoreValues& store_values) override {
+        auto store = SparseStore();
+
+        store.add_batch(store_values.data(), store_values.size());
+        test_values(store, store_values);
+
+        /* A weighted batch on top of a non-empty store */
+        auto weights = std::vector<RealValue>(store_values.size(), 2.0);
+        store.add_batch(store_values.data(), weights.data(), weights.size());
+
+        EXPECT_EQ(store.count(), 3 * store_values.size());
+
+        auto tripled_values = flatten({store_values, store_values, store_values});
+        test_values(store, tripled_values);
+    }
+
+    void test_merging(const StoreValueList& store_values_list) override {
+        auto store = SparseStore();
+
+        for (const auto& store_values : store_values_list) {
+            auto intermediate_store = SparseStore();
+
+            for (const auto& value : store_values) {
+                intermediate_store.add(value);
+            }
+
+            store.merge(intermediate_store);
+        }
+
+        test_values(store, flatten(store_values_list));
+    }
+
+    /* Test that key_at_rank matches the one of a DenseStore */
+    void test_key_at_rank() {
+        auto store = SparseStore();
+        auto dense_store = DenseStore();
+
+        for (const auto key : {-400, -3, -3, 0, 7, 7, 7, 12, 500}) {
+            store.add(key);
+            dense_store.add(key);
+        }
+
+        for (const auto lower : {true, false}) {
+            for (auto rank = 0.0; rank <= 10; rank += 0.5) {
+                EXPECT_EQ(store.key_at_rank(rank, lower),
+                          dense_store.key_at_rank(rank, lower));
+            }
+        }
+    }
+
+    /*
+     * Test that a store with a higher count for a key is not subtracted, so
+     * that the count stays the sum of the bins
+     */
+    void test_subtract_higher_count() {
+        auto store = SparseStore();
+        auto subtracted_store = SparseStore();
+
+        store.add(5);
+        store.add(7);
+        subtracted_store.add(5, 2);
+
+        EXPECT_THROW(store.subtract(subtracted_store), std::invalid_argument);
+        EXPECT_EQ(store.count(), 2);
+        EXPECT_EQ(non_empty_bins(store),
+                  (std::map<Index, RealValue> {{5, 1}, {7, 1}}));
+
+        /* The bins which drop to zero are removed */
+        subtracted_store.clear();
+        subtracted_store.add(5);
+        store.subtract(subtracted_store);
+
+        EXPECT_EQ(store.count(), 1);
+        EXPECT_FALSE(store.is_empty());
+        EXPECT_EQ(non_empty_bins(store),
+                  (std::map<Index, RealValue> {{7, 1}}));
+    }
+};
+
+TEST_F(SparseStoreTest, TestEmpty) {
+    test_empty();
+}
+
+TEST_F(SparseStoreTest, TestConstant) {
+    test_constant();
+}
+
+TEST_F(SparseStoreTest, TestIncreasingLinearly) {
+    test_increasing_linearly();
+}
+
+TEST_F(SparseStoreTest, TestDecreasingLinearly) {
+    test_decreasing_linearly();
+}
+
+TEST_F(SparseStoreTest, TestIncreasingExponentially) {
+    test_increasing_exponentially();
+}
+
+TEST_F(SparseStoreTest, TestDecreasingExponentially) {
+    test_decreasing_exponentially();
+}
+
+TEST_F(SparseStoreTest, TestBinCounts) {
+    test_bin_counts();
+}
+
+TEST_F(SparseStoreTest, TestAddBatch) {
+    test_add_batch();
+}
+
+TEST_F(SparseStoreTest, TestExtremeValues) {
+    test_extreme_values();
+}
+
+TEST_F(SparseStoreTest, TestMergingEmpty) {
+    test_merging_empty();
+}
+
+TEST_F(SparseStoreTest, TestMergingFarApart) {
+    test_merging_far_apart();
+}
+
+TEST_F(SparseStoreTest, TestMergingConstant) {
+    test_merging_constant();
+}
+
+TEST_F(SparseStoreTest, TestMergingExtremeValues) {
+    test_merging_extreme_values();
+}
+
+TEST_F(SparseStoreTest, TestKeyAtRank) {
+    test_key_at_rank();
+}
+
+TEST_F(SparseStoreTest, TestCountUpTo) {
+    test_count_up_to(SparseStore());
+}
+
+TEST_F(SparseStoreTest, TestSubtract) {
+    test_subtract(SparseStore(), 0);
+    test_subtract(SparseStore(), 1000);
+    test_subtract_higher_count();
+}
+
+template <typename ConcreteDDSketch>
+class SketchSummary {
+ public:
+    using SketchContainer = std::vector<RealValue>;
+    using iterator = typename SketchContainer::iterator;
+    using const_iterator = typename SketchContainer::const_iterator;
+
+    SketchSummary(ConcreteDDSketch& sketch,
+                  const std::vector<RealValue>& quantiles) {
+        for (const auto& quantile : quantiles) {
+            auto computed_quantile = sketch.get_quantile_value(quantile);
+            summary_.push_back(computed_quantile);
+        }
+
+        summary_.push_back(sketch.sum());
+        summary_.push_back(sketch.avg());
+        summary_.push_back(sketch.num_values());
+    }
+
+    void assert_almost_equal(const SketchSummary<ConcreteDDSketch>& other) {
+        std::equal(summary_.begin(),
+                   summary_.end(),
+                   other.summary_.begin(),
+                   [](const RealValue& left, const RealValue& right) {
+                       EXPECT_ALMOST_EQ(left, right);
+                       return left == right;
+                   });
+    }
+
+ private:
+    SketchContainer summary_;
+};
+
+template <typename ConcreteDDSketch>
+class BaseDDSketchTest : public ::testing::Test, CRTP<ConcreteDDSketch> {
+ public:
+    BaseDDSketchTest(const BaseDDSketchTest& test) = delete;
+    BaseDDSketchTest(BaseDDSketchTest&& test) = delete;
+
+    BaseDDSketchTest& operator=(const BaseDDSketchTest& test) = delete;
+    BaseDDSketchTest& operator=(BaseDDSketchTest&& test) = delete;
+
+ protected:
+    BaseDDSketchTest() = default;
+    virtual ~BaseDDSketchTest() = default;
+
+    /* Create a new DDSketch of the appropriate type */
+    virtual ConcreteDDSketch create_ddsketch() = 0;
+
+    void evaluate_sketch_accuracy(ConcreteDDSketch& sketch,
+                                  const DataSet<RealValue>& dataset,
+                                  RealValue eps,
+                                  bool summary_stats = true) {
+    auto test_quantiles =
+        {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+
+         for (const auto quantile : test_quantiles) {
+             auto sketch_q = sketch.get_quantile_value(quantile);
+             auto data_q = dataset.quantile(quantile);
+             auto err = std::abs(sketch_q - data_q);
+
+             EXPECT_TRUE(err - eps * std::abs(data_q) <= 1.0e-15);
+         }
+
+         EXPECT_EQ(sketch.num_values(), dataset.len());
+
+         if (summary_stats) {
+             EXPECT_ALMOST_EQ(sketch.sum(), dataset.sum());
+             EXPECT_ALMOST_EQ(sketch.avg(), dataset.avg());
+         }
+    }
+
+    /* Test DDSketch on values from various distributions */
+    void test_distributions() {
+        const auto& test_datasets = get_datasets();
+
+        for (auto& dataset : test_datasets) {
+            for (const auto size : {3, 5, 10, 100, 1000}) {
+                dataset->populate(size);
+
+                auto sketch = create_ddsketch();
+
+                for (const auto& value : *dataset) {
+                    sketch.add(value);
+                }
+
+                evaluate_sketch_accuracy(
+                    sketch, *dataset, kTestRelativeAccuracy);
+            }
+        }
+    }
+
+    /* Test DDSketch on adding integer weighted values */
+    void test_add_multiple() {
+        auto dataset = Integers();
+        dataset.populate(1000);
+
+        StoreValues dataset_values;
+        for (const auto& value : dataset) {
+            dataset_values.push_back(value);
+        }
+
+        auto sketch = create_ddsketch();
+        for (const auto& pair : Counter(dataset_values)) {
+            auto value = pair.first;
+            auto count = pair.second;
+
+            sketch.add(value, count);
+        }
+
+        evaluate_sketch_accuracy(sketch, dataset, kTestRelativeAccuracy);
+    }
+
+    /* Test DDSketch on adding decimal weighted values */
+    void test_add_decimal() {
+        auto sketch = create_ddsketch();
+
+        for (auto value = 0; value < 100; ++value) {
+            sketch.add(value, 1.1);
+        }
+
+        sketch.add(100, 110.0);
+
+        auto data_median = 99;
+        auto sketch_median = sketch.get_quantile_value(0.5);
+        auto err = std::abs(sketch_median - data_median);
+
+        EXPECT_TRUE(
+            err - kTestRelativeAccuracy * std::abs(data_median) <= 1.0e-15);
+        EXPECT_ALMOST_EQ(sketch.num_values(), 110 * 2);
+        EXPECT_ALMOST_EQ(sketch.sum(), 5445 + 11000);
+        EXPECT_ALMOST_EQ(sketch.avg(), 74.75);
+    }
+
+    /* Test that adding batches is equivalent to adding values one by one */
+    void test_add_batch() {
+        std::vector<RealValue> test_quantiles =
+            {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+
+        const auto& test_datasets = get_datasets();
+
+        for (auto& dataset : test_datasets) {
+            for (const auto size : {3, 100, 1000}) {
+                dataset->populate(size);
+
+                std::vector<RealValue> values(dataset->begin(), dataset->end());
+                std::vector<RealValue> weights(values.size());
+
+                std::iota(weights.begin(), weights.end(), 1.0);
+
+                auto sketch = create_ddsketch();
+                auto batch_sketch = create_ddsketch();
+                auto weighted_sketch = create_ddsketch();
+                auto weighted_batch_sketch = create_ddsketch();
+
+                for (size_t idx = 0; idx < values.size(); ++idx) {
+                    sketch.add(values[idx]);
+                    weighted_sketch.add(values[idx], weights[idx]);
+                }
+
+                batch_sketch.add_batch(values.data(), values.size());
+                weighted_batch_sketch.add_batch(
+                    values.data(), weights.data(), values.size());
+
+                EXPECT_EQ(sketch.num_values(), batch_sketch.num_values());
+                EXPECT_EQ(weighted_sketch.num_values(),
+                          weighted_batch_sketch.num_values());
+                EXPECT_ALMOST_EQ(sketch.sum(), batch_sketch.sum());
+
+                for (const auto quantile : test_quantiles) {
+                    EXPECT_EQ(sketch.get_quantile_value(quantile),
+                              batch_sketch.get_quantile_value(quantile));
+                    EXPECT_EQ(
+                        weighted_sketch.get_quantile_value(quantile),
+                        weighted_batch_sketch.get_quantile_value(quantile));
+                }
+            }
+        }
+
+        /* A batch with a non-positive weight is rejected as a whole */
+        auto sketch = create_ddsketch();
+        std::vector<RealValue> values = {1.0, 2.0, 3.0};
+        std::vector<RealValue> weights = {1.0, 0.0, 1.0};
+
+        EXPECT_THROW(
+            sketch.add_batch(values.data(), weights.data(), values.size()),
+            IllegalArgumentException);
+        EXPECT_EQ(sketch.num_values(), 0);
+    }
+
+    /* Test that querying several quantiles at once matches single queries */
+    void test_get_quantile_values() {
+        std::vector<RealValue> quantiles =
+            {0.99, 0.0, 0.5, 1.0, 0.25, -0.1, 0.999, 0.5, 1.1, 0.1, 0.75};
+        std::vector<RealValue> values(quantiles.size());
+
+        auto sketch = create_ddsketch();
+
+        /* An empty sketch has no quantiles */
+        sketch.get_quantile_values(
+            quantiles.data(), quantiles.size(), values.data());
+
+        for (const auto value : values) {
+            EXPECT_TRUE(std::isnan(value));
+        }
+
+        const auto& test_datasets = get_datasets();
+
+        for (auto& dataset : test_datasets) {
+            for (const auto size : {3, 10, 1000}) {
+                dataset->populate(size);
+
+                sketch = create_ddsketch();
+
+                for (const auto& value : *dataset) {
+                    sketch.add(value);
+                }
+
+                sketch.add(0.0);
+
+                sketch.get_quantile_values(
+                    quantiles.data(), quantiles.size(), values.data());
+
+                for (size_t idx = 0; idx < quantiles.size(); ++idx) {
+                    auto expected = sketch.get_quantile_value(quantiles[idx]);
+
+                    if (std::isnan(expected)) {
+                        EXPECT_TRUE(std::isnan(values[idx]));
+                    } else {
+                        EXPECT_EQ(values[idx], expected);
+                    }
+                }
+            }
+        }
+    }
+
+    /* Test that a deserialized sketch holds the same bins as the original */
+    void test_serialization() {
+        std::vector<RealValue> test_quantiles =
+            {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+
+        auto sketch = create_ddsketch();
+        auto deserialized_sketch = create_ddsketch();
+
+        deserialized_sketch.deserialize(sketch.serialize());
+        EXPECT_EQ(deserialized_sketch.num_values(), 0);
+
+        const auto& test_datasets = get_datasets();
+
+        for (auto& dataset : test_datasets) {
+            for (const auto size : {3, 100, 1000}) {
+                dataset->populate(size);
+
+                sketch = create_ddsketch();
+
+                for (const auto value : *dataset) {
+                    sketch.add(value);
+                }
+
+                auto serialized = sketch.serialize();
+                EXPECT_EQ(serialized.size(), sketch.serialized_size());
+
+                deserialized_sketch.deserialize(serialized);
+
+                EXPECT_EQ(deserialized_sketch.serialize(), serialized);
+                EXPECT_EQ(deserialized_sketch.num_values(),
+                          sketch.num_values());
+                EXPECT_EQ(deserialized_sketch.zero_count(),
+                          sketch.zero_count());
+
+                for (const auto quantile : test_quantiles) {
+                    EXPECT_EQ(deserialized_sketch.get_quantile_value(quantile),
+                              sketch.get_quantile_value(quantile));
+                }
+            }
+        }
+
+        /* The buffer must be large enough */
+        std::vector<uint8_t> buffer(sketch.serialized_size() - 1);
+        EXPECT_THROW(sketch.serialize(buffer.data(), buffer.size()),
+                     SerializationException);
+
+        /* A truncated message leaves the sketch empty */
+        auto serialized = sketch.serialize();
+        EXPECT_THROW(
+            deserialized_sketch.deserialize(
+                serialized.substr(0, serialized.size() / 2)),
+            SerializationException);
+        EXPECT_EQ(deserialized_sketch.num_values(), 0);
+        EXPECT_EQ(deserialized_sketch.store().count(), 0);
+        EXPECT_EQ(deserialized_sketch.negative_store().count(), 0);
+    }
+
+    /* Test merging equal-sized DDSketches */
+    void test_merge_equal() {
+        std::vector<std::pair<RealValue, RealValue>> normal_parameters =
+             {{35, 1}, {1, 3}, {15, 2}, {40, 0.5}};
+
+        for (const auto size : {3, 5, 10, 100, 1000}) {
+            auto dataset = EmptyDataSet();
+            auto target_sketch = create_ddsketch();
+
+            for (const auto& params : normal_parameters) {
+                auto generator = Normal(params.first, params.second);
+                generator.populate(size);
+
+                auto sketch = create_ddsketch();
+                for (const auto& value : generator) {
+                    sketch.add(value);
+                    dataset.add(value);
+                }
+                target_sketch.merge(sketch);
+
+                evaluate_sketch_accuracy(
+                    target_sketch, dataset, kTestRelativeAccuracy);
+            }
+
+            evaluate_sketch_accuracy(
+                target_sketch, dataset, kTestRelativeAccuracy);
+        }
+    }
+
+    /* Test merging variable-sized DDSketches */
+    void test_merge_unequal() {
+        constexpr auto num_tests = 20;
+
+         std::random_device random_device;
+         std::mt19937_64 generator(random_device());
+         std::uniform_real_distribution<DataValue> random(0, 1);
+
+        for (auto test_id = 0; test_id < num_tests; ++test_id) {
+            for (const auto size : {3, 5, 10, 100, 1000}) {
+                auto dataset = Lognormal();
+                dataset.populate(size);
+
+                auto sketch1 = create_ddsketch();
+                auto sketch2 = create_ddsketch();
+
+                for (const auto& value : dataset) {
+                    if (random(generator) > 0.7) {
+                        sketch1.add(value);
+                    } else {
+                        sketch2.add(value);
+                    }
+                }
+
+                sketch1.merge(sketch2);
+
+                evaluate_sketch_accuracy(
+                    sketch1, dataset, kTestRelativeAccuracy);
+            }
+        }
+    }
+
+    /* Test merging DDSketches of different distributions */
+    void test_merge_mixed() {
+       constexpr auto num_tests = 20;
+
+        std::vector<std::unique_ptr<GenericDataSet>> test_datasets;
+        test_datasets.emplace_back(std::make_unique<Normal>());
+        test_datasets.emplace_back(std::make_unique<Exponential>());
+        test_datasets.emplace_back(std::make_unique<Laplace>());
+        test_datasets.emplace_back(std::make_unique<Bimodal>());
+
+        std::random_device random_device;
+        std::mt19937_64 generator(random_device());
+        std::uniform_real_distribution<RealValue> random(0, 500);
+
+        for (auto test_id = 0; test_id < num_tests; ++test_id) {
+            auto merged_dataset = EmptyDataSet();
+            auto merged_sketch = create_ddsketch();
+
+            for (auto& dataset : test_datasets) {
+                Index dataset_size = static_cast<Index>(random(generator));
+                dataset->populate(dataset_size);
+                auto sketch = create_ddsketch();
+
+                for (const auto& value : *dataset) {
+                    sketch.add(value);
+                    merged_dataset.add(value);
+                }
+
+                merged_sketch.merge(sketch);
+                evaluate_sketch_accuracy(
+                    merged_sketch, merged_dataset, kTestRelativeAccuracy);
+            }
+        }
+    }
+
+    /* Test that merge() calls do not modify the argument sketch */
+    void test_consistent_merge() {
+        std::vector<RealValue> kTestQuantiles =
+            {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+
+        auto sketch1 = create_ddsketch();
+        auto sketch2 = create_ddsketch();
+
+        auto dataset1 = Normal();
+        dataset1.populate(100);
+
+        for (const auto& value : dataset1) {
+            sketch1.add(value);
+        }
+
+        sketch1.merge(sketch2);
+
+        /* Sketch2 is still empty */
+        EXPECT_EQ(sketch2.num_values(), 0);
 
         auto dataset2 = Normal();
         dataset2.populate(50);
 
-        for (const auto& value : dataset2) {
-            sketch2.add(value);
+        for (const auto& value : dataset2) {
+            sketch2.add(value);
+        }
+
+        auto sketch2_summary =
+            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
+        sketch1.merge(sketch2);
+
+        auto dataset3 = Normal();
+        dataset3.populate(10);
+
+        for (const auto& value : dataset3) {
+            sketch1.add(value);
+        }
+
+        /* Changes to sketch1 does not affect sketch2 after merge */
+        sketch2_summary =
+            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
+
+        auto sketch2_summary_tmp =
+            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
+        sketch2_summary.assert_almost_equal(sketch2_summary_tmp);
+
+        auto sketch3 = create_ddsketch();
+        sketch3.merge(sketch2);
+
+        /* Merging to an empty sketch does not change sketch2 */
+        sketch2_summary_tmp =
+            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
+        sketch2_summary.assert_almost_equal(sketch2_summary_tmp);
+    }
+
+    /*
+     * Test that merge_all, and merging rvalues, give the same sketch as
+     * merging the sketches one by one
+     */
+    void test_merge_all() {
+        const std::vector<RealValue> test_quantiles =
+            {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+
+        std::vector<std::unique_ptr<GenericDataSet>> test_datasets;
+        test_datasets.emplace_back(std::make_unique<Normal>(35, 1));
+        test_datasets.emplace_back(std::make_unique<EmptyDataSet>());
+        test_datasets.emplace_back(std::make_unique<Lognormal>());
+        test_datasets.emplace_back(std::make_unique<Mixed>());
+        test_datasets.emplace_back(std::make_unique<NegativeUniformForward>());
+
+        std::vector<ConcreteDDSketch> sketches;
+
+        for (auto& dataset : test_datasets) {
+            dataset->populate(200);
+            sketches.push_back(create_ddsketch());
+
+            for (const auto& value : *dataset) {
+                sketches.back().add(value);
+            }
+        }
+
+        for (const auto initial_value : {0.0, 1.0}) {
+            auto expected_sketch = create_ddsketch();
+            auto merged_sketch = create_ddsketch();
+            auto moved_sketch = create_ddsketch();
+
+            if (initial_value != 0) {
+                expected_sketch.add(initial_value);
+                merged_sketch.add(initial_value);
+                moved_sketch.add(initial_value);
+            }
+
+            for (const auto& sketch : sketches) {
+                expected_sketch.merge(sketch);
+            }
+
+            merged_sketch.merge_all(sketches.begin(), sketches.end());
+
+            for (auto sketch : sketches) {
+                moved_sketch.merge(std::move(sketch));
+                EXPECT_EQ(sketch.num_values(), 0);
+            }
+
+            auto expected_summary =
+                SketchSummary<ConcreteDDSketch>(
+                    expected_sketch, test_quantiles);
+
+            for (auto* sketch : {&merged_sketch, &moved_sketch}) {
+                EXPECT_EQ(sketch->num_values(), expected_sketch.num_values());
+                EXPECT_EQ(sketch->zero_count(), expected_sketch.zero_count());
+
+                SketchSummary<ConcreteDDSketch>(*sketch, test_quantiles)
+                    .assert_almost_equal(expected_summary);
+            }
+
+            /* A sketch moved into itself is merged, rather than emptied */
+            expected_sketch.merge(expected_sketch);
+            moved_sketch.merge(std::move(moved_sketch));
+
+            EXPECT_EQ(moved_sketch.num_values(), expected_sketch.num_values());
+            SketchSummary<ConcreteDDSketch>(moved_sketch, test_quantiles)
+                .assert_almost_equal(
+                    SketchSummary<ConcreteDDSketch>(
+                        expected_sketch, test_quantiles));
+        }
+    }
+
+    /*
+     * Test that subtracting a sketch gives the same bins as adding only the
+     * values of the other sketch, and the semantics of the summary stats
+     */
+    void test_subtract() {
+        const std::vector<RealValue> test_quantiles =
+            {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+
+        auto dataset = Mixed();
+        dataset.populate(500);
+
+        const auto values =
+            std::vector<RealValue>(dataset.begin(), dataset.end());
+
+        /* The first half is kept, along with the extreme values */
+        const auto extreme_values =
+            std::minmax_element(values.begin(), values.end());
+
+        auto sketch = create_ddsketch();
+        auto subtracted_sketch = create_ddsketch();
+        auto expected_sketch = create_ddsketch();
+
+        for (size_t idx = 0; idx < values.size(); ++idx) {
+            sketch.add(values[idx]);
+
+            if (idx < values.size() / 2 ||
+                    values.begin() + idx == extreme_values.first ||
+                    values.begin() + idx == extreme_values.second) {
+                expected_sketch.add(values[idx]);
+            } else {
+                subtracted_sketch.add(values[idx]);
+            }
+        }
+
+        sketch.add(0.0, 3);
+        subtracted_sketch.add(0.0, 2);
+        expected_sketch.add(0.0);
+
+        auto summary_sketch = sketch;
+
+        sketch.subtract(subtracted_sketch);
+
+        EXPECT_EQ(sketch.num_values(), expected_sketch.num_values());
+        EXPECT_EQ(sketch.zero_count(), expected_sketch.zero_count());
+        EXPECT_EQ(sketch.min(), expected_sketch.min());
+        EXPECT_EQ(sketch.max(), expected_sketch.max());
+
+        SketchSummary<ConcreteDDSketch>(sketch, test_quantiles)
+            .assert_almost_equal(
+                SketchSummary<ConcreteDDSketch>(
+                    expected_sketch, test_quantiles));
+
+        /* Once the extreme values are subtracted, they are estimated */
+        summary_sketch.subtract(expected_sketch);
+
+        EXPECT_EQ(summary_sketch.min(),
+                  summary_sketch.get_quantile_value(0));
+        EXPECT_EQ(summary_sketch.max(),
+                  summary_sketch.get_quantile_value(1));
+
+        /* A sketch which was not added is not subtracted */
+        auto other_sketch = create_ddsketch();
+        other_sketch.add(-1e100);
+        other_sketch.add(1e100);
+
+        EXPECT_THROW(sketch.subtract(other_sketch), std::invalid_argument);
+        EXPECT_EQ(sketch.num_values(), expected_sketch.num_values());
+        EXPECT_EQ(sketch.get_quantile_value(0.1),
+                  expected_sketch.get_quantile_value(0.1));
+
+        /* Nor is a sketch with more zeros, nor more values */
+        auto zero_sketch = create_ddsketch();
+        auto more_zeros_sketch = create_ddsketch();
+
+        zero_sketch.add(0.0);
+        zero_sketch.add(5.0, 3);
+        more_zeros_sketch.add(0.0, 2);
+        more_zeros_sketch.add(5.0);
+
+        EXPECT_THROW(zero_sketch.subtract(more_zeros_sketch),
+                     std::invalid_argument);
+        EXPECT_THROW(zero_sketch.serialize_delta(more_zeros_sketch),
+                     std::invalid_argument);
+        EXPECT_EQ(zero_sketch.num_values(), 4);
+        EXPECT_EQ(zero_sketch.zero_count(), 1);
+        EXPECT_EQ(zero_sketch.store().count(), 3);
+
+        more_zeros_sketch.clear();
+        more_zeros_sketch.add(5.0, 4);
+
+        EXPECT_THROW(zero_sketch.subtract(more_zeros_sketch),
+                     std::invalid_argument);
+        EXPECT_EQ(zero_sketch.num_values(), 4);
+        EXPECT_EQ(zero_sketch.store().count(), 3);
+
+        /* Subtracting all the values leaves the sketch empty */
+        sketch.subtract(expected_sketch);
+
+        EXPECT_EQ(sketch.num_values(), 0);
+        EXPECT_TRUE(std::isnan(sketch.min()));
+        EXPECT_TRUE(std::isnan(sketch.get_quantile_value(0.5)));
+    }
+
+    /*
+     * Test that applying the delta of a sketch to its baseline gives the
+     * same bins as the sketch, including when the new values collapse bins
+     */
+    void test_delta() {
+        auto dataset = Mixed();
+        dataset.populate(500);
+
+        auto baseline = create_ddsketch();
+
+        for (const auto value : dataset) {
+            baseline.add(value);
+        }
+
+        auto sketch = baseline;
+        auto receiver = baseline;
+
+        /* No change */
+        receiver.apply_delta(sketch.serialize_delta(baseline));
+        EXPECT_EQ(receiver.num_values(), sketch.num_values());
+
+        for (const auto value : {1.0, 2.5, -3.0, 0.0}) {
+            sketch.add(value);
+        }
+
+        /* Only the changed bins are encoded */
+        EXPECT_LT(sketch.serialize_delta(baseline).size(),
+                  sketch.serialize().size());
+
+        /* Values which collapse the bins of the collapsing stores */
+        sketch.add(1e100);
+        sketch.add(-1e100);
+
+        const auto delta = sketch.serialize_delta(baseline);
+
+        receiver.apply_delta(delta);
+
+        EXPECT_EQ(receiver.num_values(), sketch.num_values());
+        EXPECT_EQ(receiver.zero_count(), sketch.zero_count());
+        EXPECT_EQ(receiver.min(), receiver.get_quantile_value(0));
+        EXPECT_EQ(receiver.max(), receiver.get_quantile_value(1));
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(receiver.get_quantile_value(quantile),
+                      sketch.get_quantile_value(quantile));
+        }
+
+        /* The baseline holds values which the sketch does not */
+        EXPECT_THROW(baseline.serialize_delta(sketch), std::invalid_argument);
+
+        auto single = create_ddsketch();
+        auto pair = create_ddsketch();
+
+        single.add(5.0);
+        pair.add(5.0, 2);
+        EXPECT_THROW(single.serialize_delta(pair), std::invalid_argument);
+
+        /* Even if the sketch holds as many values */
+        single.add(7.0);
+        EXPECT_THROW(single.serialize_delta(pair), std::invalid_argument);
+
+        auto truncated_delta = delta.substr(0, delta.size() - 3);
+        auto num_values = receiver.num_values();
+
+        EXPECT_THROW(receiver.apply_delta(truncated_delta),
+                     SerializationException);
+        EXPECT_EQ(receiver.num_values(), num_values);
+    }
+
+    /* Test that reserving and shrinking the bins keeps the quantiles */
+    void test_reserve() {
+        auto sketch = create_ddsketch();
+        auto expected_sketch = create_ddsketch();
+
+        EXPECT_THROW(sketch.reserve(1.0, -1.0), IllegalArgumentException);
+
+        sketch.reserve(-1000.0, 1000.0);
+
+        auto dataset = Mixed();
+        dataset.populate(1000);
+
+        for (const auto value : dataset) {
+            sketch.add(value);
+            sketch.add(-value / 2);
+            expected_sketch.add(value);
+            expected_sketch.add(-value / 2);
+        }
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.05) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      expected_sketch.get_quantile_value(quantile));
+        }
+
+        sketch.shrink_to_fit();
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.05) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      expected_sketch.get_quantile_value(quantile));
+        }
+
+        EXPECT_EQ(sketch.num_values(), expected_sketch.num_values());
+    }
+
+    /* Expect the two sketches to hold the same values */
+    static void expect_same_sketch(ConcreteDDSketch& sketch,
+                                   ConcreteDDSketch& expected_sketch) {
+        EXPECT_EQ(sketch.num_values(), expected_sketch.num_values());
+        EXPECT_EQ(sketch.zero_count(), expected_sketch.zero_count());
+        EXPECT_NEAR(sketch.sum(), expected_sketch.sum(),
+                    1e-12 * std::abs(expected_sketch.sum()));
+        EXPECT_EQ(sketch.min(), expected_sketch.min());
+        EXPECT_EQ(sketch.max(), expected_sketch.max());
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      expected_sketch.get_quantile_value(quantile));
+        }
+    }
+
+    /*
+     * Test that get_rank counts the values up to the bin of each value, i.e.,
+     * at least the values lower or equal, and at most those within one bin
+     */
+    void test_get_rank() {
+        auto sketch = create_ddsketch();
+
+        EXPECT_EQ(sketch.get_rank(1.0), 0);
+        EXPECT_TRUE(std::isnan(sketch.get_cdf(1.0)));
+
+        const auto gamma =
+            (1 + kTestRelativeAccuracy) / (1 - kTestRelativeAccuracy);
+        const auto kInfinity = std::numeric_limits<RealValue>::infinity();
+        const auto& test_datasets = get_datasets();
+
+        for (auto& dataset : test_datasets) {
+            for (const auto size : {3, 10, 1000}) {
+                dataset->populate(size);
+
+                sketch = create_ddsketch();
+
+                for (const auto& value : *dataset) {
+                    sketch.add(value);
+                }
+
+                sketch.add(0.0);
+
+                std::vector<RealValue> sorted_values(
+                    dataset->begin(), dataset->end());
+                sorted_values.push_back(0.0);
+                std::sort(sorted_values.begin(), sorted_values.end());
+
+                auto exact_rank = [&sorted_values](RealValue value) {
+                    return static_cast<RealValue>(
+                        std::upper_bound(sorted_values.begin(),
+                                         sorted_values.end(),
+                                         value) - sorted_values.begin());
+                };
+
+                std::vector<RealValue> values = {
+                    0.0, kInfinity, -kInfinity,
+                    sorted_values.front() - 1, sorted_values.back() + 1};
+
+                for (const auto quantile : {0.99, 0.0, 0.5, 1.0, 0.1, 0.75}) {
+                    auto value = sorted_values[
+                        static_cast<size_t>(
+                            quantile * (sorted_values.size() - 1))];
+
+                    values.push_back(value);
+                    values.push_back(value * 1.01);
+                    values.push_back(value * 0.99);
+                }
+
+                std::vector<RealValue> ranks(values.size());
+                std::vector<RealValue> cdfs(values.size());
+
+                sketch.get_ranks(values.data(), values.size(), ranks.data());
+                sketch.get_cdfs(values.data(), values.size(), cdfs.data());
+
+                for (size_t idx = 0; idx < values.size(); ++idx) {
+                    auto value = values[idx];
+                    auto rank = sketch.get_rank(value);
+
+                    EXPECT_EQ(ranks[idx], rank);
+                    EXPECT_DOUBLE_EQ(cdfs[idx], rank / sketch.num_values());
+                    EXPECT_DOUBLE_EQ(sketch.get_cdf(value), cdfs[idx]);
+
+                    if (std::isinf(value)) {
+                        EXPECT_EQ(rank, value > 0 ? sketch.num_values() : 0);
+                        continue;
+                    }
+
+                    auto upper_value =
+                        value + std::abs(value) * (gamma - 1) * 1.01;
+
+                    EXPECT_GE(rank, exact_rank(value));
+                    EXPECT_LE(rank, exact_rank(upper_value));
+                }
+            }
+        }
+
+        EXPECT_TRUE(std::isnan(sketch.get_rank(std::nan(""))));
+    }
+
+    /* Test that the fast paths of add hold the same values as add */
+    void test_add_fast_paths() {
+        auto dataset = Lognormal();
+        dataset.populate(1000);
+
+        auto values = std::vector<RealValue>(dataset.begin(), dataset.end());
+
+        auto positive_sketch = create_ddsketch();
+        auto positive_batch_sketch = create_ddsketch();
+        auto expected_sketch = create_ddsketch();
+
+        for (const auto value : values) {
+            positive_sketch.add_positive(value);
+            expected_sketch.add(value);
+        }
+
+        /* Over several chunks, and a partial one */
+        values.insert(values.end(), values.begin(), values.end());
+        values.resize(values.size() - 7);
+
+        positive_batch_sketch.add_positive_batch(values.data(), 0);
+        positive_batch_sketch.add_positive_batch(
+            values.data(), values.size() - 1000);
+        positive_batch_sketch.add_positive_batch(
+            values.data() + values.size() - 1000, 1000);
+        expect_same_sketch(positive_sketch, expected_sketch);
+
+        for (size_t idx = 1000; idx < values.size(); ++idx) {
+            expected_sketch.add(values[idx]);
+        }
+
+        expect_same_sketch(positive_batch_sketch, expected_sketch);
+
+        auto weighted_sketch = create_ddsketch();
+        auto unchecked_sketch = create_ddsketch();
+        auto expected_weighted_sketch = create_ddsketch();
+
+        auto mixed_dataset = Mixed();
+        mixed_dataset.populate(1000);
+
+        size_t idx = 0;
+
+        for (const auto value : mixed_dataset) {
+            auto weight = 0.5 + idx++ % 4;
+
+            unchecked_sketch.add_unchecked(-value, weight);
+            unchecked_sketch.add_unchecked(0.0, weight);
+            expected_weighted_sketch.add(-value, weight);
+            expected_weighted_sketch.add(0.0, weight);
+
+            if (value > 0) {
+                weighted_sketch.add_positive(value, weight);
+                expected_sketch.add(value, weight);
+            }
+        }
+
+        expect_same_sketch(unchecked_sketch, expected_weighted_sketch);
+
+        for (const auto value : values) {
+            weighted_sketch.add(value);
+        }
+
+        expect_same_sketch(weighted_sketch, expected_sketch);
+    }
+
+    auto get_datasets() {
+        std::vector<std::unique_ptr<GenericDataSet>> test_datasets;
+
+        test_datasets.emplace_back(std::make_unique<UniformForward>());
+        test_datasets.emplace_back(std::make_unique<UniformBackward>());
+        test_datasets.emplace_back(std::make_unique<UniformZoomIn>());
+        test_datasets.emplace_back(std::make_unique<UniformZoomOut>());
+        test_datasets.emplace_back(std::make_unique<UniformSqrt>());
+        test_datasets.emplace_back(std::make_unique<Constant>());
+        test_datasets.emplace_back(std::make_unique<NegativeUniformBackward>());
+        test_datasets.emplace_back(std::make_unique<NegativeUniformForward>());
+        test_datasets.emplace_back(std::make_unique<NumberLineBackward>());
+        test_datasets.emplace_back(std::make_unique<NumberLineForward>());
+        test_datasets.emplace_back(std::make_unique<Exponential>());
+        test_datasets.emplace_back(std::make_unique<Lognormal>());
+        test_datasets.emplace_back(std::make_unique<Normal>());
+        test_datasets.emplace_back(std::make_unique<Laplace>());
+        test_datasets.emplace_back(std::make_unique<Bimodal>());
+        test_datasets.emplace_back(std::make_unique<Trimodal>());
+        test_datasets.emplace_back(std::make_unique<Mixed>());
+        test_datasets.emplace_back(std::make_unique<Integers>());
+
+        return test_datasets;
+    }
+
+    static constexpr RealValue kTestRelativeAccuracy = 0.05;
+    static constexpr Index kTestBinLimit = 1024;
+};
+
+class DDSketchTest : public BaseDDSketchTest<DDSketch> {
+ protected:
+    DDSketch create_ddsketch() override {
+        return DDSketch(kTestRelativeAccuracy);
+    }
+};
+
+TEST_F(DDSketchTest, TestDistributions) {
+    test_distributions();
+}
+
+TEST_F(DDSketchTest, TestAddMultiple) {
+    test_add_multiple();
+}
+
+TEST_F(DDSketchTest, TestAddDecimal) {
+    test_add_decimal();
+}
+
+TEST_F(DDSketchTest, TestAddBatch) {
+    test_add_batch();
+}
+
+TEST_F(DDSketchTest, TestGetQuantileValues) {
+    test_get_quantile_values();
+}
+
+TEST_F(DDSketchTest, TestGetRank) {
+    test_get_rank();
+}
+
+TEST_F(DDSketchTest, TestSerialization) {
+    test_serialization();
+}
+
+TEST_F(DDSketchTest, TestMergeEqual) {
+     test_merge_equal();
+}
+
+TEST_F(DDSketchTest, TestMergeUnequal) {
+    test_merge_unequal();
+}
+
+TEST_F(DDSketchTest, TestMergeMixed) {
+     test_merge_mixed();
+}
+
+TEST_F(DDSketchTest, TestConsistentMerge) {
+    test_consistent_merge();
+}
+
+TEST_F(DDSketchTest, TestMergeAll) {
+    test_merge_all();
+}
+
+TEST_F(DDSketchTest, TestSubtract) {
+    test_subtract();
+}
+
+TEST_F(DDSketchTest, TestDelta) {
+    test_delta();
+}
+
+TEST_F(DDSketchTest, TestReserve) {
+    test_reserve();
+}
+
+TEST_F(DDSketchTest, TestAddFastPaths) {
+    test_add_fast_paths();
+}
+
+class TestLogCollapsingLowestDenseDDSketch
+    : public BaseDDSketchTest<LogCollapsingLowestDenseDDSketch> {
+ protected:
+    LogCollapsingLowestDenseDDSketch create_ddsketch() override {
+        return LogCollapsingLowestDenseDDSketch(
+                                kTestRelativeAccuracy, kTestBinLimit);
+    }
+};
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestDistributions) {
+    test_distributions();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestAddMultiple) {
+    test_add_multiple();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestAddDecimal) {
+    test_add_decimal();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestAddBatch) {
+    test_add_batch();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestGetQuantileValues) {
+    test_get_quantile_values();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestGetRank) {
+    test_get_rank();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestSerialization) {
+    test_serialization();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestMergeEqual) {
+    test_merge_equal();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestMergeUnequal) {
+    test_merge_unequal();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestMergeMixed) {
+    test_merge_mixed();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestConsistentMerge) {
+    test_consistent_merge();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestMergeAll) {
+    test_merge_all();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestSubtract) {
+    test_subtract();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestDelta) {
+    test_delta();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestReserve) {
+    test_reserve();
+}
+
+TEST_F(TestLogCollapsingLowestDenseDDSketch, TestAddFastPaths) {
+    test_add_fast_paths();
+}
+
+class TestLogCollapsingHighestDenseDDSketch
+    : public BaseDDSketchTest<LogCollapsingHighestDenseDDSketch> {
+ protected:
+    LogCollapsingHighestDenseDDSketch create_ddsketch() override {
+        return LogCollapsingHighestDenseDDSketch(
+                                kTestRelativeAccuracy, kTestBinLimit);
+    }
+};
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestDistributions) {
+    test_distributions();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestAddMultiple) {
+    test_add_multiple();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestAddDecimal) {
+    test_add_decimal();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestAddBatch) {
+    test_add_batch();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestGetQuantileValues) {
+    test_get_quantile_values();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestGetRank) {
+    test_get_rank();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestSerialization) {
+    test_serialization();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestMergeEqual) {
+    test_merge_equal();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestMergeUnequal) {
+    test_merge_unequal();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestMergeMixed) {
+    test_merge_mixed();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestConsistentMerge) {
+    test_consistent_merge();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestMergeAll) {
+    test_merge_all();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestSubtract) {
+    test_subtract();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestDelta) {
+    test_delta();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestReserve) {
+    test_reserve();
+}
+
+TEST_F(TestLogCollapsingHighestDenseDDSketch, TestAddFastPaths) {
+    test_add_fast_paths();
+}
+
+class TestSparseDDSketch : public BaseDDSketchTest<SparseDDSketch> {
+ protected:
+    SparseDDSketch create_ddsketch() override {
+        return SparseDDSketch(kTestRelativeAccuracy);
+    }
+};
+
+TEST_F(TestSparseDDSketch, TestDistributions) {
+    test_distributions();
+}
+
+TEST_F(TestSparseDDSketch, TestAddMultiple) {
+    test_add_multiple();
+}
+
+TEST_F(TestSparseDDSketch, TestAddDecimal) {
+    test_add_decimal();
+}
+
+TEST_F(TestSparseDDSketch, TestAddBatch) {
+    test_add_batch();
+}
+
+TEST_F(TestSparseDDSketch, TestGetQuantileValues) {
+    test_get_quantile_values();
+}
+
+TEST_F(TestSparseDDSketch, TestGetRank) {
+    test_get_rank();
+}
+
+TEST_F(TestSparseDDSketch, TestSerialization) {
+    test_serialization();
+}
+
+TEST_F(TestSparseDDSketch, TestMergeEqual) {
+    test_merge_equal();
+}
+
+TEST_F(TestSparseDDSketch, TestMergeUnequal) {
+    test_merge_unequal();
+}
+
+TEST_F(TestSparseDDSketch, TestMergeMixed) {
+    test_merge_mixed();
+}
+
+TEST_F(TestSparseDDSketch, TestConsistentMerge) {
+    test_consistent_merge();
+}
+
+TEST_F(TestSparseDDSketch, TestMergeAll) {
+    test_merge_all();
+}
+
+TEST_F(TestSparseDDSketch, TestSubtract) {
+    test_subtract();
+}
+
+TEST_F(TestSparseDDSketch, TestDelta) {
+    test_delta();
+}
+
+TEST_F(TestSparseDDSketch, TestReserve) {
+    test_reserve();
+}
+
+TEST_F(TestSparseDDSketch, TestAddFastPaths) {
+    test_add_fast_paths();
+}
+
+class SerializationTest : public ::testing::Test {
+ protected:
+    using Bytes = std::vector<uint8_t>;
+
+    static std::string to_string(const Bytes& bytes) {
+        return std::string(bytes.begin(), bytes.end());
+    }
+
+    /* A mapping with gamma = 2, so that the keys are easy to work out */
+    static DDSketch create_ddsketch() {
+        return DDSketch(1.0 / 3);
+    }
+
+    /* Test the encoding against the output of protoc for DDSketch.proto */
+    void test_encoding() {
+        auto sketch = create_ddsketch();
+
+        EXPECT_EQ(sketch.mapping().gamma(), 2.0);
+
+        sketch.add(0.5);
+        sketch.add(2.0, 2.0);
+        sketch.add(0.0);
+
+        const auto expected = Bytes({
+            0x0a, 0x09, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40,
+            0x12, 0x1c, 0x12, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0,
+            0x3f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x18, 0x01, 0x21, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0xf0, 0x3f});
+
+        EXPECT_EQ(sketch.serialize(), to_string(expected));
+    }
+
+    /*
+     * Test decoding a message written by another encoder, with sparse and
+     * non-packed contiguous bin counts, the offset after the counts and
+     * an unknown field
+     */
+    void test_decoding() {
+        const auto serialized = Bytes({
+            0x0a, 0x09, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40,
+            0x12, 0x3a, 0x0a, 0x0b, 0x08, 0x0d, 0x11, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x40, 0x0a, 0x0b, 0x08, 0x14, 0x11, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0xf0, 0x3f, 0x11, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0xf0, 0x3f, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x40,
+            0x18, 0x0a, 0x4a, 0x01, 0x78, 0x1a, 0x0d, 0x0a, 0x0b, 0x08, 0x06,
+            0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe0, 0x3f, 0x21, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x40});
+
+        /* Positive bins {-7: 2, 5: 1, 7: 4, 10: 1}, negative bins {3: 0.5} */
+        auto sketch = create_ddsketch();
+        sketch.deserialize(to_string(serialized));
+
+        EXPECT_EQ(sketch.num_values(), 11.5);
+        EXPECT_EQ(sketch.zero_count(), 3);
+        EXPECT_EQ(sketch.store().count(), 8);
+        EXPECT_EQ(sketch.negative_store().count(), 0.5);
+
+        const auto& store = sketch.store();
+        EXPECT_EQ(store.bins()[-7 - store.offset()], 2);
+        EXPECT_EQ(store.bins()[5 - store.offset()], 1);
+        EXPECT_EQ(store.bins()[7 - store.offset()], 4);
+        EXPECT_EQ(store.bins()[10 - store.offset()], 1);
+
+        /* The summary stats are estimated from the bins */
+        auto mapping = sketch.mapping();
+        EXPECT_EQ(sketch.get_quantile_value(1), mapping.value(10));
+
+        /* As well as into a sparse one */
+        auto sparse_sketch = SparseDDSketch(1.0 / 3);
+        sparse_sketch.deserialize(to_string(serialized));
+
+        EXPECT_EQ(sparse_sketch.store().bins(),
+                  SparseStore::Bins({{-7, 2}, {5, 1}, {7, 4}, {10, 1}}));
+        EXPECT_EQ(sparse_sketch.negative_store().bins(),
+                  SparseStore::Bins({{3, 0.5}}));
+        EXPECT_EQ(sparse_sketch.zero_count(), 3);
+
+        /* Decoding into a collapsing store collapses the lowest bins */
+        auto collapsing_sketch = LogCollapsingLowestDenseDDSketch(1.0 / 3, 8);
+        collapsing_sketch.deserialize(to_string(serialized));
+
+        EXPECT_EQ(collapsing_sketch.num_values(), 11.5);
+        EXPECT_EQ(collapsing_sketch.store().length(), 8);
+        EXPECT_EQ(collapsing_sketch.get_quantile_value(1),
+                  sketch.get_quantile_value(1));
+    }
+
+    /* Test that a message is only decoded with the mapping it was written by */
+    void test_mismatched_mapping() {
+        auto sketch = DDSketch(0.01);
+        sketch.add(1.0);
+
+        auto other_sketch = DDSketch(0.02);
+        EXPECT_THROW(other_sketch.deserialize(sketch.serialize()),
+                     SerializationException);
+
+        auto interpolated_sketch =
+            BaseDDSketch<DenseStore, LinearlyInterpolatedMapping>(
+                LinearlyInterpolatedMapping(0.01), DenseStore(), DenseStore());
+        EXPECT_THROW(interpolated_sketch.deserialize(sketch.serialize()),
+                     SerializationException);
+
+        interpolated_sketch.add(1.0);
+        EXPECT_THROW(sketch.deserialize(interpolated_sketch.serialize()),
+                     SerializationException);
+        EXPECT_EQ(sketch.num_values(), 0);
+    }
+};
+
+TEST_F(SerializationTest, TestEncoding) {
+    test_encoding();
+}
+
+TEST_F(SerializationTest, TestDecoding) {
+    test_decoding();
+}
+
+TEST_F(SerializationTest, TestMismatchedMapping) {
+    test_mismatched_mapping();
+}
+
+class ConcurrentDDSketchTest : public ::testing::Test {
+ protected:
+    using Sketch = BaseDDSketch<DenseStore, LogarithmicMapping>;
+    using ConcurrentSketch = ConcurrentDDSketch<DenseStore, LogarithmicMapping>;
+
+    static Sketch create_ddsketch(RealValue relative_accuracy) {
+        return DDSketch(relative_accuracy);
+    }
+
+    /* Expect the two sketches to hold the same bins */
+    static void expect_same_sketch(Sketch& sketch, Sketch& other) {
+        EXPECT_EQ(sketch.num_values(), other.num_values());
+        EXPECT_EQ(sketch.zero_count(), other.zero_count());
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      other.get_quantile_value(quantile));
         }
+    }
 
-        auto sketch2_summary =
-            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
-        sketch1.merge(sketch2);
+    /*
+     * Test that the values added from several threads, one by one or in
+     * batches, end up in the snapshot
+     */
+    void test_concurrent_add() {
+        constexpr auto kNumThreads = 4;
+        constexpr auto kNumValues = 20000;
+
+        auto dataset = Mixed();
+        dataset.populate(kNumValues);
+
+        const auto values =
+            std::vector<RealValue>(dataset.begin(), dataset.end());
+        auto sketch = create_ddsketch(kTestRelativeAccuracy);
+
+        for (const auto value : values) {
+            sketch.add(value);
+        }
+
+        ConcurrentSketch concurrent_sketch(
+            create_ddsketch(kTestRelativeAccuracy), kNumThreads - 1);
+        std::vector<std::thread> threads;
+
+        for (auto thread_idx = 0; thread_idx < kNumThreads; ++thread_idx) {
+            threads.emplace_back(
+                [&concurrent_sketch, &values, thread_idx]() {
+                    const auto len = values.size() / kNumThreads;
+                    const auto* first = values.data() + thread_idx * len;
+
+                    if (thread_idx % 2 == 0) {
+                        concurrent_sketch.add_batch(first, len);
+                        return;
+                    }
+
+                    for (size_t idx = 0; idx < len; ++idx) {
+                        concurrent_sketch.add(first[idx]);
+                    }
+                });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        auto snapshot = concurrent_sketch.snapshot();
+        expect_same_sketch(snapshot, sketch);
+    }
+
+    /* Test that the cached snapshot follows the updates */
+    void test_snapshot() {
+        ConcurrentSketch concurrent_sketch(
+            create_ddsketch(kTestRelativeAccuracy), 2);
+        auto sketch = create_ddsketch(kTestRelativeAccuracy);
+
+        EXPECT_EQ(concurrent_sketch.num_values(), 0);
+        EXPECT_TRUE(std::isnan(concurrent_sketch.get_quantile_value(0.5)));
+
+        for (auto value = -10.0; value <= 100.0; value += 0.5) {
+            concurrent_sketch.add(value);
+            sketch.add(value);
+
+            EXPECT_EQ(concurrent_sketch.num_values(), sketch.num_values());
+            EXPECT_EQ(concurrent_sketch.get_quantile_value(0.9),
+                      sketch.get_quantile_value(0.9));
+        }
+
+        auto other_sketch = create_ddsketch(kTestRelativeAccuracy);
+        other_sketch.add(1000.0, 25.0);
+
+        concurrent_sketch.merge(other_sketch);
+        sketch.merge(other_sketch);
+
+        auto snapshot = concurrent_sketch.snapshot();
+        expect_same_sketch(snapshot, sketch);
+
+        const std::vector<RealValue> quantiles = {0.99, 0.1, 0.5};
+        std::vector<RealValue> values(quantiles.size());
+
+        concurrent_sketch.get_quantile_values(
+            quantiles.data(), quantiles.size(), values.data());
+
+        for (size_t idx = 0; idx < quantiles.size(); ++idx) {
+            EXPECT_EQ(values[idx], sketch.get_quantile_value(quantiles[idx]));
+        }
+    }
+
+    /* Test the checks on the parameters */
+    void test_parameters() {
+        ConcurrentSketch concurrent_sketch(
+            create_ddsketch(kTestRelativeAccuracy));
+
+        EXPECT_GE(concurrent_sketch.num_shards(), 1);
+
+        auto other_sketch = create_ddsketch(2 * kTestRelativeAccuracy);
+        other_sketch.add(1.0);
+
+        EXPECT_FALSE(concurrent_sketch.mergeable(other_sketch));
+        EXPECT_THROW(concurrent_sketch.merge(other_sketch),
+                     UnequalSketchParametersException);
+
+        EXPECT_THROW(ConcurrentSketch(other_sketch, 1),
+                     IllegalArgumentException);
+        EXPECT_THROW(ConcurrentSketch(create_ddsketch(kTestRelativeAccuracy), 0),
+                     IllegalArgumentException);
+    }
+
+    static constexpr RealValue kTestRelativeAccuracy = 0.02;
+};
+
+TEST_F(ConcurrentDDSketchTest, TestConcurrentAdd) {
+    test_concurrent_add();
+}
+
+TEST_F(ConcurrentDDSketchTest, TestSnapshot) {
+    test_snapshot();
+}
+
+TEST_F(ConcurrentDDSketchTest, TestParameters) {
+    test_parameters();
+}
+
+class ParallelMergeTest : public ::testing::Test {
+ protected:
+    /* Runs the tasks on the calling thread */
+    static void inline_executor(std::function<void()> task) {
+        task();
+    }
+
+    /*
+     * Fill the sketches with values spread over many orders of magnitude,
+     * so that the collapsing stores collapse while merging
+     */
+    template <class Sketch>
+    static std::vector<Sketch> create_sketches(const Sketch& prototype,
+                                               size_t num_sketches) {
+        auto dataset = Lognormal();
+        dataset.populate(kNumValues);
+
+        std::vector<Sketch> sketches(num_sketches, prototype);
+
+        for (size_t idx = 0; idx < num_sketches; ++idx) {
+            const auto scale = std::pow(10.0, static_cast<int>(idx % 9) - 4);
+            const auto sign = idx % 4 == 3 ? -1.0 : 1.0;
+
+            for (auto value : dataset) {
+                sketches[idx].add(sign * scale * value, 1 + idx % 3);
+            }
+
+            if (idx % 5 == 0) {
+                sketches[idx].add(0.0, 2);
+            }
+        }
+
+        return sketches;
+    }
+
+    /* Expect the two sketches to hold the same bins */
+    template <class Sketch>
+    static void expect_same_sketch(Sketch sketch, Sketch& other) {
+        EXPECT_EQ(sketch.num_values(), other.num_values());
+        EXPECT_EQ(sketch.zero_count(), other.zero_count());
+        EXPECT_NEAR(sketch.sum(), other.sum(), 1e-9 * std::abs(other.sum()));
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      other.get_quantile_value(quantile));
+        }
+    }
+
+    /*
+     * Test that the parallel merge matches a sequential merge, whatever the
+     * number of tasks and the executor, and leaves the sketches unchanged
+     */
+    template <class Sketch>
+    void test_parallel_merge(const Sketch& prototype) {
+        for (auto num_sketches : {1, 2, 7, 64}) {
+            const auto sketches = create_sketches(prototype, num_sketches);
+
+            auto sequential = sketches.front();
+
+            for (size_t idx = 1; idx < sketches.size(); ++idx) {
+                sequential.merge(sketches[idx]);
+            }
+
+            for (auto num_tasks : {1, 2, 3, 5, 8, 100}) {
+                expect_same_sketch(
+                    parallel_merge(sketches.begin(), sketches.end(),
+                                   inline_executor, num_tasks),
+                    sequential);
+
+                expect_same_sketch(
+                    parallel_merge(sketches.begin(), sketches.end(),
+                                   ThreadExecutor(), num_tasks),
+                    sequential);
+            }
+
+            expect_same_sketch(
+                parallel_merge(sketches.begin(), sketches.end()), sequential);
+
+            EXPECT_EQ(sketches.back().num_values(),
+                      create_sketches(prototype, num_sketches)
+                          .back().num_values());
+        }
+    }
+
+    /* Test the checks on the range of sketches */
+    void test_parameters() {
+        std::vector<DDSketch> sketches;
+
+        EXPECT_THROW(parallel_merge(sketches.begin(), sketches.end()),
+                     IllegalArgumentException);
+
+        sketches.emplace_back(kTestRelativeAccuracy);
+        sketches.emplace_back(kTestRelativeAccuracy);
+        sketches.emplace_back(2 * kTestRelativeAccuracy);
+
+        for (auto& sketch : sketches) {
+            sketch.add(1.0);
+        }
+
+        EXPECT_THROW(parallel_merge(sketches.begin(), sketches.end()),
+                     UnequalSketchParametersException);
+
+        for (const auto& sketch : sketches) {
+            EXPECT_EQ(sketch.num_values(), 1);
+        }
+    }
+
+    static constexpr RealValue kTestRelativeAccuracy = 0.02;
+    static constexpr size_t kNumValues = 200;
+};
+
+constexpr RealValue ParallelMergeTest::kTestRelativeAccuracy;
+constexpr size_t ParallelMergeTest::kNumValues;
+
+TEST_F(ParallelMergeTest, TestDDSketch) {
+    test_parallel_merge(DDSketch(kTestRelativeAccuracy));
+}
+
+TEST_F(ParallelMergeTest, TestCollapsingLowest) {
+    test_parallel_merge(
+        LogCollapsingLowestDenseDDSketch(kTestRelativeAccuracy, 64));
+}
+
+TEST_F(ParallelMergeTest, TestCollapsingHighest) {
+    test_parallel_merge(
+        LogCollapsingHighestDenseDDSketch(kTestRelativeAccuracy, 64));
+}
+
+TEST_F(ParallelMergeTest, TestSparseDDSketch) {
+    test_parallel_merge(SparseDDSketch(kTestRelativeAccuracy));
+}
+
+TEST_F(ParallelMergeTest, TestParameters) {
+    test_parameters();
+}
+
+class WindowedDDSketchTest : public ::testing::Test {
+ protected:
+    /* Expect the two sketches to hold the same bins */
+    template <class Sketch, class OtherSketch>
+    static void expect_same_sketch(Sketch& sketch, OtherSketch& other) {
+        EXPECT_EQ(sketch.num_values(), other.num_values());
+        EXPECT_EQ(sketch.zero_count(), other.zero_count());
+        EXPECT_NEAR(sketch.sum(), other.sum(), 1e-9 * std::abs(other.sum()));
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      other.get_quantile_value(quantile));
+        }
+    }
+
+    /*
+     * Test that, as the window advances, it holds the same bins as a sketch
+     * of the values added to the slots which have not expired yet
+     */
+    template <class Sketch>
+    void test_window(const Sketch& prototype) {
+        using Window =
+            WindowedDDSketch<typename std::decay_t<decltype(
+                                 prototype.store())>,
+                             typename std::decay_t<decltype(
+                                 prototype.mapping())>>;
+
+        constexpr size_t kNumSlots = 5;
+        constexpr size_t kNumSteps = 17;
+
+        Window window(prototype, kNumSlots);
+        std::deque<std::vector<RealValue>> slot_values;
+
+        for (size_t step = 0; step < kNumSteps; ++step) {
+            auto dataset = step % 3 == 0 ? Normal(10.0 * step, 2.0) :
+                                           Normal(-5.0, 100.0);
+            dataset.populate(100 + 13 * step);
+
+            auto values =
+                std::vector<RealValue>(dataset.begin(), dataset.end());
+
+            if (step % 2 == 0) {
+                window.add_batch(values.data(), values.size());
+            } else {
+                for (const auto value : values) {
+                    window.add(value);
+                }
+            }
+
+            window.add(0.0, 2);
+            values.push_back(0.0);
+            values.push_back(0.0);
+
+            slot_values.push_back(values);
+
+            auto expected = prototype;
+
+            for (const auto& slot : slot_values) {
+                for (const auto value : slot) {
+                    expected.add(value);
+                }
+            }
+
+            EXPECT_EQ(window.current_slot().num_values(), values.size());
+            expect_same_sketch(window, expected);
+
+            if (slot_values.size() == kNumSlots) {
+                slot_values.pop_front();
+            }
+
+            /* Sometimes skip a slot, without any values */
+            if (step % 4 == 3) {
+                window.advance(2);
+                slot_values.push_back({});
+
+                if (slot_values.size() == kNumSlots) {
+                    slot_values.pop_front();
+                }
+            } else {
+                window.advance();
+            }
+        }
+
+        window.advance(kNumSlots - 1);
+        EXPECT_EQ(window.num_values(), 0);
+        EXPECT_TRUE(std::isnan(window.get_quantile_value(0.5)));
+
+        window.add(1.0);
+        window.clear();
+        EXPECT_EQ(window.num_values(), 0);
+    }
+
+    /*
+     * Test that the slots of non-integer weights expire, although the
+     * rounding of the counts of the window differs from the one of the slots
+     */
+    template <class Sketch>
+    void test_weighted_window(const Sketch& prototype) {
+        using Window =
+            WindowedDDSketch<typename std::decay_t<decltype(
+                                 prototype.store())>,
+                             typename std::decay_t<decltype(
+                                 prototype.mapping())>>;
+
+        constexpr size_t kNumSlots = 3;
+
+        Window window(prototype, kNumSlots);
+
+        window.add(5.0, 0.7);
+        window.advance();
+        window.add(5.0, 0.1);
+
+        for (size_t step = 0; step < kNumSlots; ++step) {
+            window.advance();
+        }
+
+        EXPECT_EQ(window.num_values(), 0);
+        EXPECT_TRUE(std::isnan(window.get_quantile_value(0.5)));
+
+        for (size_t step = 0; step < 20; ++step) {
+            for (size_t idx = 0; idx < 50; ++idx) {
+                window.add(1.0 + idx % 7, 0.1 * (1 + (idx + step) % 3));
+                window.add(0.0, 0.3);
+            }
+
+            window.advance();
+            EXPECT_GT(window.num_values(), 0);
+        }
+
+        for (size_t step = 0; step < kNumSlots; ++step) {
+            window.advance();
+        }
+
+        EXPECT_EQ(window.num_values(), 0);
+        EXPECT_EQ(window.zero_count(), 0);
+        EXPECT_TRUE(std::isnan(window.get_quantile_value(0.5)));
+    }
+
+    /* Test the checks on the parameters */
+    void test_parameters() {
+        using Window = WindowedDDSketch<DenseStore, LogarithmicMapping>;
+
+        EXPECT_THROW(Window(DDSketch(kTestRelativeAccuracy), 0),
+                     IllegalArgumentException);
+
+        auto sketch = DDSketch(kTestRelativeAccuracy);
+        sketch.add(1.0);
+
+        EXPECT_THROW(Window(sketch, 3), IllegalArgumentException);
+
+        Window window(DDSketch(kTestRelativeAccuracy), 3);
+        auto other_sketch = DDSketch(2 * kTestRelativeAccuracy);
+        other_sketch.add(1.0);
+
+        EXPECT_EQ(window.num_slots(), 3);
+        EXPECT_FALSE(window.mergeable(other_sketch));
+        EXPECT_THROW(window.merge(other_sketch),
+                     UnequalSketchParametersException);
+
+        window.merge(sketch);
+        EXPECT_EQ(window.num_values(), 1);
+    }
+
+    static constexpr RealValue kTestRelativeAccuracy = 0.02;
+};
+
+constexpr RealValue WindowedDDSketchTest::kTestRelativeAccuracy;
+
+TEST_F(WindowedDDSketchTest, TestDDSketch) {
+    test_window(DDSketch(kTestRelativeAccuracy));
+    test_weighted_window(DDSketch(kTestRelativeAccuracy));
+}
+
+TEST_F(WindowedDDSketchTest, TestCollapsingLowest) {
+    test_window(LogCollapsingLowestDenseDDSketch(kTestRelativeAccuracy, 4096));
+    test_weighted_window(
+        LogCollapsingLowestDenseDDSketch(kTestRelativeAccuracy, 4096));
+}
+
+TEST_F(WindowedDDSketchTest, TestSparseDDSketch) {
+    test_window(SparseDDSketch(kTestRelativeAccuracy));
+    test_weighted_window(SparseDDSketch(kTestRelativeAccuracy));
+}
+
+TEST_F(WindowedDDSketchTest, TestCompactStore) {
+    using Sketch = BaseDDSketch<CompactDenseStore, LogarithmicMapping>;
+
+    const auto mapping = LogarithmicMapping(kTestRelativeAccuracy);
+
+    test_window(Sketch(mapping, CompactDenseStore(), CompactDenseStore()));
+    test_weighted_window(
+        Sketch(mapping, CompactDenseStore(), CompactDenseStore()));
+}
+
+TEST_F(WindowedDDSketchTest, TestParameters) {
+    test_parameters();
+}
+
+class SketchPoolTest : public ::testing::Test {
+ protected:
+    /* Test that the released sketches are cleared, and handed out again */
+    template <class Sketch>
+    void test_reuse(const Sketch& prototype) {
+        SketchPool<Sketch> pool(prototype, 2, 1);
+
+        auto sketch = pool.acquire();
+        auto other_sketch = pool.acquire();
+        auto third_sketch = pool.acquire();
+        EXPECT_EQ(pool.size(), 0u);
+
+        for (auto value = -50.0; value <= 500.0; value += 0.5) {
+            sketch->add(value);
+        }
+
+        const auto* released_sketch = sketch.get();
+
+        pool.release(std::move(sketch));
+        pool.release(std::move(other_sketch));
+        pool.release(std::move(third_sketch));
+        pool.release(nullptr);
+        EXPECT_EQ(pool.size(), 2u);
+
+        /* The last released sketch was not pooled */
+        auto reused_sketch = pool.acquire();
+        reused_sketch = pool.acquire();
+        EXPECT_EQ(reused_sketch.get(), released_sketch);
+        EXPECT_EQ(pool.size(), 0u);
+
+        EXPECT_EQ(reused_sketch->num_values(), 0);
+        EXPECT_EQ(reused_sketch->sum(), 0);
+        EXPECT_EQ(reused_sketch->zero_count(), 0);
+        EXPECT_TRUE(std::isnan(reused_sketch->get_quantile_value(0.5)));
+
+        auto expected_sketch = prototype;
+
+        for (auto value = 1.0; value <= 100.0; value += 1.0) {
+            reused_sketch->add(value);
+            expected_sketch.add(value);
+        }
+
+        EXPECT_EQ(reused_sketch->min(), 1.0);
+        EXPECT_EQ(reused_sketch->max(), 100.0);
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(reused_sketch->get_quantile_value(quantile),
+                      expected_sketch.get_quantile_value(quantile));
+        }
+
+        pool.release(std::move(reused_sketch));
+        pool.clear();
+        EXPECT_EQ(pool.size(), 0u);
+    }
 
-        auto dataset3 = Normal();
-        dataset3.populate(10);
+    /* Test acquiring and releasing sketches from several threads at once */
+    void test_concurrent_reuse() {
+        constexpr size_t kNumThreads = 4;
+        constexpr size_t kNumIterations = 200;
+
+        SketchPool<DDSketch> pool(DDSketch(kTestRelativeAccuracy),
+                                  16,
+                                  2);
+        std::vector<std::thread> threads;
+        std::atomic<size_t> num_failures(0);
+
+        for (size_t thread_idx = 0; thread_idx < kNumThreads; ++thread_idx) {
+            threads.emplace_back(
+                [&pool, &num_failures, thread_idx]() {
+                    for (size_t iter = 0; iter < kNumIterations; ++iter) {
+                        auto sketch = pool.acquire();
+
+                        if (sketch->num_values() != 0) {
+                            ++num_failures;
+                        }
+
+                        sketch->add(1.0 + thread_idx + iter);
+                        pool.release(std::move(sketch));
+                    }
+                });
+        }
 
-        for (const auto& value : dataset3) {
-            sketch1.add(value);
+        for (auto& thread : threads) {
+            thread.join();
         }
 
-        /* Changes to sketch1 does not affect sketch2 after merge */
-        sketch2_summary =
-            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
+        EXPECT_EQ(num_failures.load(), 0u);
+        EXPECT_GE(pool.size(), 1u);
+        EXPECT_LE(pool.size(), kNumThreads);
+    }
 
-        auto sketch2_summary_tmp =
-            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
-        sketch2_summary.assert_almost_equal(sketch2_summary_tmp);
+    /* Test the checks on the parameters */
+    void test_parameters() {
+        using Pool = SketchPool<DDSketch>;
 
-        auto sketch3 = create_ddsketch();
-        sketch3.merge(sketch2);
+        EXPECT_THROW(Pool(DDSketch(kTestRelativeAccuracy), 4, 0),
+                     IllegalArgumentException);
 
-        /* Merging to an empty sketch does not change sketch2 */
-        sketch2_summary_tmp =
-            SketchSummary<ConcreteDDSketch>(sketch2, kTestQuantiles);
-        sketch2_summary.assert_almost_equal(sketch2_summary_tmp);
-    }
+        auto sketch = DDSketch(kTestRelativeAccuracy);
+        sketch.add(1.0);
 
-    auto get_datasets() {
-        std::vector<std::unique_ptr<GenericDataSet>> test_datasets;
+        EXPECT_THROW(Pool(sketch, 4), IllegalArgumentException);
 
-        test_datasets.emplace_back(std::make_unique<UniformForward>());
-        test_datasets.emplace_back(std::make_unique<UniformBackward>());
-        test_datasets.emplace_back(std::make_unique<UniformZoomIn>());
-        test_datasets.emplace_back(std::make_unique<UniformZoomOut>());
-        test_datasets.emplace_back(std::make_unique<UniformSqrt>());
-        test_datasets.emplace_back(std::make_unique<Constant>());
-        test_datasets.emplace_back(std::make_unique<NegativeUniformBackward>());
-        test_datasets.emplace_back(std::make_unique<NegativeUniformForward>());
-        test_datasets.emplace_back(std::make_unique<NumberLineBackward>());
-        test_datasets.emplace_back(std::make_unique<NumberLineForward>());
-        test_datasets.emplace_back(std::make_unique<Exponential>());
-        test_datasets.emplace_back(std::make_unique<Lognormal>());
-        test_datasets.emplace_back(std::make_unique<Normal>());
-        test_datasets.emplace_back(std::make_unique<Laplace>());
-        test_datasets.emplace_back(std::make_unique<Bimodal>());
-        test_datasets.emplace_back(std::make_unique<Trimodal>());
-        test_datasets.emplace_back(std::make_unique<Mixed>());
-        test_datasets.emplace_back(std::make_unique<Integers>());
+        Pool pool(DDSketch(kTestRelativeAccuracy), 4, 3);
+        EXPECT_EQ(pool.num_shards(), 3u);
 
-        return test_datasets;
+        EXPECT_THROW(pool.release(
+                         std::make_unique<DDSketch>(2 * kTestRelativeAccuracy)),
+                     UnequalSketchParametersException);
+        EXPECT_EQ(pool.size(), 0u);
     }
 
-    static constexpr RealValue kTestRelativeAccuracy = 0.05;
-    static constexpr Index kTestBinLimit = 1024;
+    static constexpr RealValue kTestRelativeAccuracy = 0.02;
 };
 
-class DDSketchTest : public BaseDDSketchTest<DDSketch> {
- protected:
-    DDSketch create_ddsketch() override {
-        return DDSketch(kTestRelativeAccuracy);
-    }
-};
+constexpr RealValue SketchPoolTest::kTestRelativeAccuracy;
 
-TEST_F(DDSketchTest, TestDistributions) {
-    test_distributions();
+TEST_F(SketchPoolTest, TestDDSketch) {
+    test_reuse(DDSketch(kTestRelativeAccuracy));
 }
 
-TEST_F(DDSketchTest, TestAddMultiple) {
-    test_add_multiple();
+TEST_F(SketchPoolTest, TestCollapsingLowest) {
+    test_reuse(LogCollapsingLowestDenseDDSketch(kTestRelativeAccuracy, 64));
 }
 
-TEST_F(DDSketchTest, TestAddDecimal) {
-    test_add_decimal();
+TEST_F(SketchPoolTest, TestSparseDDSketch) {
+    test_reuse(SparseDDSketch(kTestRelativeAccuracy));
 }
 
-TEST_F(DDSketchTest, TestMergeEqual) {
-     test_merge_equal();
-}
+TEST_F(SketchPoolTest, TestDequeStore) {
+    using Sketch = BaseDDSketch<DequeDenseStore, LogarithmicMapping>;
 
-TEST_F(DDSketchTest, TestMergeUnequal) {
-    test_merge_unequal();
+    const auto mapping = LogarithmicMapping(kTestRelativeAccuracy);
+
+    test_reuse(Sketch(mapping, DequeDenseStore(), DequeDenseStore()));
 }
 
-TEST_F(DDSketchTest, TestMergeMixed) {
-     test_merge_mixed();
+TEST_F(SketchPoolTest, TestConcurrentReuse) {
+    test_concurrent_reuse();
 }
 
-TEST_F(DDSketchTest, TestConsistentMerge) {
-    test_consistent_merge();
+TEST_F(SketchPoolTest, TestParameters) {
+    test_parameters();
 }
 
-class TestLogCollapsingLowestDenseDDSketch
-    : public BaseDDSketchTest<LogCollapsingLowestDenseDDSketch> {
+class SharedDDSketchTest : public ::testing::Test {
  protected:
-    LogCollapsingLowestDenseDDSketch create_ddsketch() override {
-        return LogCollapsingLowestDenseDDSketch(
-                                kTestRelativeAccuracy, kTestBinLimit);
+    /* A region aligned for the sketch, as a mapping of shared memory is */
+    static std::vector<uint64_t> allocate_region(size_t size) {
+        return std::vector<uint64_t>((size + 7) / 8, 0xFF);
+    }
+
+    /* The values of the tests, within the range of the shared sketches */
+    static std::vector<RealValue> test_values() {
+        std::vector<RealValue> values;
+
+        for (auto value = 0.1; value < 1000.0; value *= 1.01) {
+            values.push_back(value);
+            values.push_back(-3 * value);
+        }
+
+        values.push_back(0.0);
+
+        return values;
+    }
+
+    /*
+     * Test that the shared sketch holds the same bins as a sketch of the same
+     * values, and that an attached view reads and updates them in place
+     */
+    template <class Mapping>
+    void test_shared(const Mapping& mapping) {
+        using Sketch = BaseDDSketch<DenseStore, Mapping>;
+        using Shared = SharedDDSketch<Mapping>;
+
+        const auto keys = Shared::keys_for_values(mapping, 0.01, 10000.0);
+        auto region = allocate_region(Shared::required_size(keys));
+        const auto size = region.size() * sizeof(uint64_t);
+
+        auto shared = Shared::create(region.data(), size, mapping, keys);
+        auto sketch = Sketch(mapping, DenseStore(), DenseStore());
+
+        EXPECT_EQ(shared.num_values(), 0);
+        EXPECT_TRUE(std::isnan(shared.min()));
+        EXPECT_TRUE(std::isnan(shared.get_quantile_value(0.5)));
+
+        auto values = test_values();
+
+        for (size_t idx = 0; idx < values.size(); ++idx) {
+            shared.add(values[idx], 1.0 + idx % 3);
+            sketch.add(values[idx], 1.0 + idx % 3);
+        }
+
+        auto attached = Shared::attach(region.data(), size);
+
+        EXPECT_EQ(attached.min_key(), keys.min_key);
+        EXPECT_EQ(attached.max_key(), keys.max_key);
+        EXPECT_EQ(attached.mapping().gamma(), mapping.gamma());
+
+        for (const auto* view : {&shared, &attached}) {
+            EXPECT_EQ(view->num_values(), sketch.num_values());
+            EXPECT_EQ(view->zero_count(), sketch.zero_count());
+            EXPECT_DOUBLE_EQ(view->sum(), sketch.sum());
+            EXPECT_EQ(view->min(), sketch.min());
+            EXPECT_EQ(view->max(), sketch.max());
+
+            for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+                EXPECT_EQ(view->get_quantile_value(quantile),
+                          sketch.get_quantile_value(quantile));
+            }
+        }
+
+        std::map<Index, RealValue> bins;
+        shared.for_each_bin(
+            [&bins](Index key, RealValue count) {
+                bins[key] = count;
+            });
+
+        std::map<Index, RealValue> expected_bins;
+        sketch.store().for_each_bin(
+            [&expected_bins](Index key, RealValue count) {
+                expected_bins[key] = count;
+            });
+
+        EXPECT_EQ(bins, expected_bins);
+
+        /* The values out of the range are collapsed into its ends */
+        attached.add(1e9);
+        attached.add(-1e-9);
+        EXPECT_EQ(shared.num_values(), sketch.num_values() + 2);
+        EXPECT_EQ(shared.max(), 1e9);
+        EXPECT_EQ(shared.get_quantile_value(1.0),
+                  mapping.value(keys.max_key));
+    }
+
+    /* Test adding to a sketch from several processes at once */
+    void test_processes() {
+        constexpr size_t kNumProcesses = 3;
+
+        const auto mapping = LogarithmicMapping(kTestRelativeAccuracy);
+        const auto keys =
+            SharedDDSketch<>::keys_for_values(mapping, 0.01, 10000.0);
+        const auto size = SharedDDSketch<>::required_size(keys);
+
+        auto region = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        ASSERT_NE(region, MAP_FAILED);
+
+        auto shared = SharedDDSketch<>::create(region, size, mapping, keys);
+        auto values = test_values();
+
+        std::vector<pid_t> children;
+
+        for (size_t process = 0; process < kNumProcesses; ++process) {
+            auto pid = ::fork();
+
+            if (pid == 0) {
+                auto child = SharedDDSketch<>::attach(region, size);
+
+                child.add_batch(values.data(), values.size());
+                ::_exit(0);
+            }
+
+            ASSERT_GT(pid, 0);
+            children.push_back(pid);
+        }
+
+        for (auto pid : children) {
+            int status = 0;
+
+            ASSERT_EQ(::waitpid(pid, &status, 0), pid);
+            EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+
+        auto sketch = DDSketch(kTestRelativeAccuracy);
+
+        for (size_t process = 0; process < kNumProcesses; ++process) {
+            sketch.add_batch(values.data(), values.size());
+        }
+
+        EXPECT_EQ(shared.num_values(), sketch.num_values());
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.05) {
+            EXPECT_EQ(shared.get_quantile_value(quantile),
+                      sketch.get_quantile_value(quantile));
+        }
+
+        ::munmap(region, size);
+    }
+
+    /* Test adding to a sketch from several threads at once */
+    void test_threads() {
+        constexpr size_t kNumThreads = 4;
+
+        const auto mapping = LogarithmicMapping(kTestRelativeAccuracy);
+        const auto keys = KeyRange{-100, 100};
+        auto region = allocate_region(SharedDDSketch<>::required_size(keys));
+        auto shared = SharedDDSketch<>::create(
+            region.data(), region.size() * sizeof(uint64_t), mapping, keys);
+
+        std::vector<std::thread> threads;
+
+        for (size_t thread_idx = 0; thread_idx < kNumThreads; ++thread_idx) {
+            threads.emplace_back(
+                [&shared, thread_idx]() {
+                    for (size_t idx = 1; idx <= 1000; ++idx) {
+                        shared.add(thread_idx * 1000.0 + idx);
+                    }
+                });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        EXPECT_EQ(shared.num_values(), kNumThreads * 1000);
+        EXPECT_EQ(shared.min(), 1.0);
+        EXPECT_EQ(shared.max(), kNumThreads * 1000.0);
+        EXPECT_EQ(shared.sum(),
+                  kNumThreads * 1000.0 * (kNumThreads * 1000.0 + 1) / 2);
+    }
+
+    /* Test the checks on the regions */
+    void test_parameters() {
+        using Shared = SharedDDSketch<LogarithmicMapping>;
+
+        const auto mapping = LogarithmicMapping(kTestRelativeAccuracy);
+        const auto keys = KeyRange{0, 10};
+        const auto size = Shared::required_size(keys);
+        auto region = allocate_region(size);
+
+        EXPECT_THROW(Shared::keys_for_values(mapping, 0.0, 1.0),
+                     IllegalArgumentException);
+        EXPECT_THROW(Shared::keys_for_values(mapping, 2.0, 1.0),
+                     IllegalArgumentException);
+
+        EXPECT_THROW(Shared::create(nullptr, size, mapping, keys),
+                     IllegalArgumentException);
+        EXPECT_THROW(Shared::create(reinterpret_cast<char*>(region.data()) + 4,
+                                    size, mapping, keys),
+                     IllegalArgumentException);
+        EXPECT_THROW(Shared::create(region.data(), size - 1, mapping, keys),
+                     IllegalArgumentException);
+        EXPECT_THROW(Shared::create(region.data(), size, mapping,
+                                    KeyRange{1, 0}),
+                     IllegalArgumentException);
+
+        /* Nothing was created yet */
+        EXPECT_THROW(Shared::attach(region.data(), size),
+                     IllegalArgumentException);
+
+        auto shared = Shared::create(region.data(), size, mapping, keys);
+        EXPECT_THROW(shared.add(1.0, 0.0), IllegalArgumentException);
+
+        EXPECT_THROW(Shared::attach(region.data(), size - 1),
+                     IllegalArgumentException);
+        EXPECT_THROW(Shared::attach(region.data(), 8),
+                     IllegalArgumentException);
+        EXPECT_THROW(SharedDDSketch<CubicallyInterpolatedMapping>::attach(
+                         region.data(), size),
+                     IllegalArgumentException);
+
+        /* The logarithmic mappings share their keys */
+        auto table_shared =
+            SharedDDSketch<TableLogarithmicMapping>::attach(region.data(),
+                                                            size);
+        table_shared.add(2.0);
+        EXPECT_EQ(shared.num_values(), 1);
     }
+
+    static constexpr RealValue kTestRelativeAccuracy = 0.02;
 };
 
-TEST_F(TestLogCollapsingLowestDenseDDSketch, TestDistributions) {
-    test_distributions();
-}
+constexpr RealValue SharedDDSketchTest::kTestRelativeAccuracy;
 
-TEST_F(TestLogCollapsingLowestDenseDDSketch, TestAddMultiple) {
-    test_add_multiple();
+TEST_F(SharedDDSketchTest, TestLogarithmic) {
+    test_shared(LogarithmicMapping(kTestRelativeAccuracy));
 }
 
-TEST_F(TestLogCollapsingLowestDenseDDSketch, TestAddDecimal) {
-    test_add_decimal();
+TEST_F(SharedDDSketchTest, TestLinearlyInterpolated) {
+    test_shared(LinearlyInterpolatedMapping(kTestRelativeAccuracy));
 }
 
-TEST_F(TestLogCollapsingLowestDenseDDSketch, TestMergeEqual) {
-    test_merge_equal();
+TEST_F(SharedDDSketchTest, TestOffset) {
+    test_shared(CubicallyInterpolatedMapping(kTestRelativeAccuracy, 12.0));
 }
 
-TEST_F(TestLogCollapsingLowestDenseDDSketch, TestMergeUnequal) {
-    test_merge_unequal();
+TEST_F(SharedDDSketchTest, TestProcesses) {
+    test_processes();
 }
 
-TEST_F(TestLogCollapsingLowestDenseDDSketch, TestMergeMixed) {
-    test_merge_mixed();
+TEST_F(SharedDDSketchTest, TestThreads) {
+    test_threads();
 }
 
-TEST_F(TestLogCollapsingLowestDenseDDSketch, TestConsistentMerge) {
-    test_consistent_merge();
+TEST_F(SharedDDSketchTest, TestParameters) {
+    test_parameters();
 }
 
-class TestLogCollapsingHighestDenseDDSketch
-    : public BaseDDSketchTest<LogCollapsingHighestDenseDDSketch> {
+class FileIngestionTest : public ::testing::Test {
  protected:
-    LogCollapsingHighestDenseDDSketch create_ddsketch() override {
-        return LogCollapsingHighestDenseDDSketch(
-                                kTestRelativeAccuracy, kTestBinLimit);
+    void TearDown() override {
+        std::remove(path().c_str());
+    }
+
+    static std::string path() {
+        return ::testing::TempDir() + "ddsketch_ingestion_values.bin";
+    }
+
+    /* Write the values to the file, as little-endian doubles */
+    static void write_values(const std::vector<RealValue>& values,
+                             size_t num_extra_bytes = 0) {
+        std::ofstream file(path(), std::ios::binary | std::ios::trunc);
+
+        for (const auto value : values) {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+
+            for (size_t byte = 0; byte < sizeof(bits); ++byte) {
+                file.put(static_cast<char>(bits >> (8 * byte)));
+            }
+        }
+
+        for (size_t byte = 0; byte < num_extra_bytes; ++byte) {
+            file.put(0);
+        }
+    }
+
+    /* Expect the two sketches to hold the same bins */
+    template <class Sketch>
+    static void expect_same_sketch(Sketch& sketch, Sketch& other) {
+        EXPECT_EQ(sketch.num_values(), other.num_values());
+        EXPECT_EQ(sketch.zero_count(), other.zero_count());
+        EXPECT_NEAR(sketch.sum(), other.sum(), 1e-9 * std::abs(other.sum()));
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      other.get_quantile_value(quantile));
+        }
+    }
+
+    /*
+     * Test that ingesting a file, over several pages and threads, matches
+     * adding its values one by one
+     */
+    template <class Sketch>
+    void test_ingestion(const Sketch& prototype) {
+        auto dataset = Mixed();
+        dataset.populate(3 * kIngestionPageSize + 1000);
+
+        auto values = std::vector<RealValue>(dataset.begin(), dataset.end());
+        values[42] = 0.0;
+        values[kIngestionPageSize] = -values[kIngestionPageSize];
+
+        write_values(values);
+
+        auto sketch = prototype;
+
+        for (const auto value : values) {
+            sketch.add(value);
+        }
+
+        auto ingested = prototype;
+        ingest_file(ingested, path());
+        expect_same_sketch(ingested, sketch);
+
+        for (auto num_threads : {1, 2, 3, 16}) {
+            auto threaded = prototype;
+            threaded.add(-1.0);
+            ingest_file(threaded, path(), num_threads);
+
+            auto expected = sketch;
+            expected.add(-1.0);
+            expect_same_sketch(threaded, expected);
+        }
+    }
+
+    /* Test the files which cannot be ingested */
+    void test_invalid_files() {
+        DDSketch sketch(kTestRelativeAccuracy);
+
+        write_values({});
+        ingest_file(sketch, path());
+        ingest_file(sketch, path(), 4);
+        EXPECT_EQ(sketch.num_values(), 0);
+
+        write_values({1.0, 2.0}, 3);
+        EXPECT_THROW(ingest_file(sketch, path()), IngestionException);
+        EXPECT_THROW(ingest_file(sketch, path(), 2), IngestionException);
+
+        write_values({1.0, 2.0});
+        EXPECT_THROW(ingest_file(sketch, path(), 0), IllegalArgumentException);
+        EXPECT_EQ(sketch.num_values(), 0);
+
+        std::remove(path().c_str());
+        EXPECT_THROW(ingest_file(sketch, path()), IngestionException);
     }
+
+    static constexpr RealValue kTestRelativeAccuracy = 0.02;
 };
 
-TEST_F(TestLogCollapsingHighestDenseDDSketch, TestDistributions) {
-    test_distributions();
+constexpr RealValue FileIngestionTest::kTestRelativeAccuracy;
+
+TEST_F(FileIngestionTest, TestDDSketch) {
+    test_ingestion(DDSketch(kTestRelativeAccuracy));
 }
 
-TEST_F(TestLogCollapsingHighestDenseDDSketch, TestAddMultiple) {
-    test_add_multiple();
+TEST_F(FileIngestionTest, TestCollapsingLowest) {
+    test_ingestion(
+        LogCollapsingLowestDenseDDSketch(kTestRelativeAccuracy, 64));
 }
 
-TEST_F(TestLogCollapsingHighestDenseDDSketch, TestAddDecimal) {
-    test_add_decimal();
+TEST_F(FileIngestionTest, TestInvalidFiles) {
+    test_invalid_files();
 }
 
-TEST_F(TestLogCollapsingHighestDenseDDSketch, TestMergeEqual) {
-    test_merge_equal();
+class StaticDDSketchTest : public ::testing::Test {
+ protected:
+    struct TestConfig {
+        static constexpr RealValue kRelativeAccuracy = 0.02;
+        static constexpr RealValue kMinValue = 1e-3;
+        static constexpr RealValue kMaxValue = 1e6;
+    };
+
+    /* Another accuracy, for the sketches which cannot be merged */
+    struct CoarseConfig {
+        static constexpr RealValue kRelativeAccuracy = 0.05;
+        static constexpr RealValue kMinValue = 1.0;
+        static constexpr RealValue kMaxValue = 100.0;
+    };
+
+    using Sketch = StaticDDSketch<TestConfig>;
+    using Keys = StaticSketchKeys<TestConfig>;
+
+    static_assert(std::is_trivially_copyable<Sketch>::value,
+                  "A static sketch is copied as bytes");
+
+    /* The values of the tests, within the range of the configuration */
+    static std::vector<RealValue> test_values() {
+        std::vector<RealValue> values;
+
+        for (auto value = 1e-3; value < 1e5; value *= 1.013) {
+            values.push_back(value);
+            values.push_back(-7 * value);
+        }
+
+        values.push_back(0.0);
+
+        return values;
+    }
+
+    /* Test that the range covers the keys the mapping gives to its ends */
+    void test_keys() {
+        auto mapping = LogarithmicMapping(TestConfig::kRelativeAccuracy);
+
+        EXPECT_EQ(Keys::kGamma, mapping.gamma());
+        EXPECT_LT(Keys::kMinKey, mapping.key(TestConfig::kMinValue));
+        EXPECT_GT(Keys::kMaxKey, mapping.key(TestConfig::kMaxValue));
+        EXPECT_LE(mapping.key(TestConfig::kMinValue) - Keys::kMinKey, 2);
+        EXPECT_LE(Keys::kMaxKey - mapping.key(TestConfig::kMaxValue), 2);
+        EXPECT_EQ(Sketch::Store::kNumBins,
+                  static_cast<size_t>(Keys::kMaxKey - Keys::kMinKey + 1));
+
+        for (auto value : {1e-9, 0.5, 1.0, 2.0, 10.0, 1e5}) {
+            EXPECT_NEAR(static_log(value), std::log(value), 1e-13);
+        }
+    }
+
+    /* Test that the sketch gives the quantiles of a DDSketch */
+    void test_quantiles() {
+        Sketch sketch;
+        DDSketch expected(TestConfig::kRelativeAccuracy);
+
+        EXPECT_EQ(sketch.num_values(), 0);
+        EXPECT_TRUE(std::isnan(sketch.get_quantile_value(0.5)));
+
+        auto values = test_values();
+
+        for (size_t idx = 0; idx < values.size(); ++idx) {
+            sketch.add(values[idx], 1.0 + idx % 3);
+            expected.add(values[idx], 1.0 + idx % 3);
+        }
+
+        EXPECT_EQ(sketch.num_values(), expected.num_values());
+        EXPECT_EQ(sketch.zero_count(), expected.zero_count());
+        EXPECT_DOUBLE_EQ(sketch.sum(), expected.sum());
+        EXPECT_EQ(sketch.min(), expected.min());
+        EXPECT_EQ(sketch.max(), expected.max());
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      expected.get_quantile_value(quantile));
+        }
+
+        for (auto value : {-1000.0, -1.0, 0.0, 0.5, 20.0, 1e4}) {
+            EXPECT_EQ(sketch.get_rank(value), expected.get_rank(value));
+        }
+
+        /* The values out of the range are counted in its ends */
+        sketch.add(1e9);
+        sketch.add(1e-9);
+        EXPECT_EQ(sketch.max(), 1e9);
+        EXPECT_EQ(sketch.get_quantile_value(1.0),
+                  sketch.mapping().value(Keys::kMaxKey));
+        EXPECT_EQ(sketch.store().bins().front(), 1.0);
+
+        sketch.clear();
+        EXPECT_EQ(sketch.num_values(), 0);
+        EXPECT_TRUE(sketch.store().is_empty());
+    }
+
+    /* Test merging a static sketch and a DDSketch, in both directions */
+    void test_merge() {
+        Sketch sketch;
+        Sketch other;
+        DDSketch dynamic(TestConfig::kRelativeAccuracy);
+        DDSketch twice(TestConfig::kRelativeAccuracy);
+        DDSketch thrice(TestConfig::kRelativeAccuracy);
+
+        auto values = test_values();
+
+        for (size_t idx = 0; idx < values.size(); ++idx) {
+            auto& target = idx % 2 ? sketch : other;
+
+            target.add(values[idx]);
+            dynamic.add(values[idx]);
+            twice.add(values[idx], 2.0);
+            thrice.add(values[idx], 3.0);
+        }
+
+        sketch.merge(other);
+        dynamic.merge(sketch);
+        sketch.merge(dynamic);
+
+        EXPECT_EQ(sketch.num_values(), 3 * values.size());
+        EXPECT_EQ(dynamic.num_values(), 2 * values.size());
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.01) {
+            EXPECT_EQ(dynamic.get_quantile_value(quantile),
+                      twice.get_quantile_value(quantile));
+            EXPECT_EQ(sketch.get_quantile_value(quantile),
+                      thrice.get_quantile_value(quantile));
+        }
+
+        sketch.merge(Sketch());
+        EXPECT_EQ(sketch.num_values(), 3 * values.size());
+
+        StaticDDSketch<CoarseConfig> coarse;
+        coarse.add(2.0);
+
+        EXPECT_THROW(sketch.merge(coarse), UnequalSketchParametersException);
+        EXPECT_THROW(coarse.merge(dynamic), UnequalSketchParametersException);
+        EXPECT_THROW(dynamic.merge(coarse), UnequalSketchParametersException);
+
+        /* The same gamma, but other keys */
+        BaseDDSketch<DenseStore, LinearlyInterpolatedMapping> linear(
+            LinearlyInterpolatedMapping(TestConfig::kRelativeAccuracy),
+            DenseStore(), DenseStore());
+        BaseDDSketch<DenseStore, CubicallyInterpolatedMapping> cubic(
+            CubicallyInterpolatedMapping(TestConfig::kRelativeAccuracy),
+            DenseStore(), DenseStore());
+        BaseDDSketch<DenseStore, LogarithmicMapping> shifted(
+            LogarithmicMapping(TestConfig::kRelativeAccuracy, 10.0),
+            DenseStore(), DenseStore());
+
+        for (auto value = 1.0; value <= 1000.0; ++value) {
+            linear.add(value);
+            cubic.add(value);
+            shifted.add(value);
+        }
+
+        const auto num_values = dynamic.num_values();
+
+        EXPECT_THROW(dynamic.merge(linear), UnequalSketchParametersException);
+        EXPECT_THROW(dynamic.merge(cubic), UnequalSketchParametersException);
+        EXPECT_THROW(sketch.merge(cubic), UnequalSketchParametersException);
+        EXPECT_THROW(dynamic.merge(shifted), UnequalSketchParametersException);
+        EXPECT_EQ(dynamic.num_values(), num_values);
+
+        /* The logarithmic mappings share their keys */
+        BaseDDSketch<DenseStore, TableLogarithmicMapping> table(
+            TableLogarithmicMapping(TestConfig::kRelativeAccuracy),
+            DenseStore(), DenseStore());
+        table.add(2.0);
+        sketch.merge(table);
+        EXPECT_EQ(sketch.num_values(), 3 * values.size() + 1);
+    }
+
+    /* Test that a copy of the bytes of a sketch is an equal sketch */
+    void test_copy() {
+        Sketch sketch;
+
+        for (auto value : test_values()) {
+            sketch.add(value);
+        }
+
+        Sketch copy;
+        std::memcpy(static_cast<void*>(&copy), &sketch, sizeof(Sketch));
+
+        EXPECT_EQ(copy.num_values(), sketch.num_values());
+
+        for (auto quantile = 0.0; quantile <= 1.0; quantile += 0.05) {
+            EXPECT_EQ(copy.get_quantile_value(quantile),
+                      sketch.get_quantile_value(quantile));
+        }
+
+        copy.merge(copy);
+        EXPECT_EQ(copy.num_values(), 2 * sketch.num_values());
+        EXPECT_EQ(copy.get_quantile_value(0.5),
+                  sketch.get_quantile_value(0.5));
+    }
+
+    /* Test that only the values which were added are subtracted */
+    void test_subtract() {
+        Sketch sketch;
+        Sketch subtracted_sketch;
+
+        sketch.add(5.0);
+        sketch.add(7.0);
+        subtracted_sketch.add(5.0, 2);
+
+        EXPECT_THROW(sketch.subtract(subtracted_sketch),
+                     std::invalid_argument);
+        EXPECT_THROW(sketch.serialize_delta(subtracted_sketch),
+                     std::invalid_argument);
+        EXPECT_EQ(sketch.num_values(), 2);
+
+        subtracted_sketch.clear();
+        subtracted_sketch.add(5.0);
+        sketch.subtract(subtracted_sketch);
+
+        EXPECT_EQ(sketch.num_values(), 1);
+        EXPECT_EQ(sketch.store().count(), 1);
+
+        auto mapping = sketch.mapping();
+        EXPECT_EQ(sketch.get_quantile_value(0.5),
+                  mapping.value(mapping.key(7.0)));
+    }
+};
+
+constexpr RealValue StaticDDSketchTest::TestConfig::kRelativeAccuracy;
+constexpr RealValue StaticDDSketchTest::TestConfig::kMinValue;
+constexpr RealValue StaticDDSketchTest::TestConfig::kMaxValue;
+constexpr RealValue StaticDDSketchTest::CoarseConfig::kRelativeAccuracy;
+constexpr RealValue StaticDDSketchTest::CoarseConfig::kMinValue;
+constexpr RealValue StaticDDSketchTest::CoarseConfig::kMaxValue;
+
+TEST_F(StaticDDSketchTest, TestKeys) {
+    test_keys();
 }
 
-TEST_F(TestLogCollapsingHighestDenseDDSketch, TestMergeUnequal) {
-    test_merge_unequal();
+TEST_F(StaticDDSketchTest, TestQuantiles) {
+    test_quantiles();
 }
 
-TEST_F(TestLogCollapsingHighestDenseDDSketch, TestMergeMixed) {
-    test_merge_mixed();
+TEST_F(StaticDDSketchTest, TestMerge) {
+    test_merge();
 }
 
-TEST_F(TestLogCollapsingHighestDenseDDSketch, TestConsistentMerge) {
-    test_consistent_merge();
+TEST_F(StaticDDSketchTest, TestCopy) {
+    test_copy();
+}
+
+TEST_F(StaticDDSketchTest, TestSubtract) {
+    test_subtract();
 }
 
 }  // namespace test